@@ -0,0 +1,969 @@
+/*
+ *  Compares the tree with a B+ tree, std::multimap and a sorted vector.
+ *
+ *  Usage: bench [max keys] [ops] [structures] [workloads]
+ *
+ *  For each power of ten from 1000 up to max keys, each structure is bulk
+ *  loaded with that many keys, then timed on point lookups, one at a time
+ *  and as a batch, range scans of 100 values, inserts and deletes.
+ *  Structures are named by a comma-separated list of csbpt, csbpt++,
+ *  btree, multimap and vector; workloads by a list of uniform, zipf and
+ *  sequential:
+ *
+ *  - uniform:     keys are loaded in random order and picked uniformly
+ *  - zipf:        keys are loaded in random order and picked with a Zipfian
+ *                 skew of 0.99, the hottest keys scattered through the tree
+ *  - sequential:  keys are loaded in order and picked in order; inserts
+ *                 append past the largest key
+ *
+ *  Each measurement is written to stdout as one JSON object per line:
+ *  nanoseconds per operation, last-level cache misses per operation, read
+ *  through perf_event_open() where the kernel allows it and null otherwise,
+ *  and heap bytes per key held by the structure after the operation.
+ *  Inserts and deletes in the sorted vector move half of it each time, so it
+ *  runs fewer of them on large sizes; the "ops" field gives the count.
+ */
+
+#include <algorithm>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <map>
+#include <string>
+#include <vector>
+
+#include <malloc.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+
+#ifdef __linux__
+#include <linux/perf_event.h>
+#endif
+
+#include "csbpt.hpp"
+
+static const int scan_length = 100;
+
+static volatile long sink;
+
+static double now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/*
+ *  Heap bytes in use, including blocks big enough to be mapped separately
+ */
+static long heap_bytes(void)
+{
+#if defined(__GLIBC__) && (__GLIBC__ > 2 || __GLIBC_MINOR__ >= 33)
+	struct mallinfo2 info = mallinfo2();
+
+	return (long) (info.uordblks + info.hblkhd);
+#else
+	return -1;
+#endif
+}
+
+/*
+ *  Counter of last-level cache misses of this thread
+ */
+struct miss_counter {
+	int fd;
+
+	miss_counter() : fd(-1)
+	{
+#ifdef __linux__
+		struct perf_event_attr attr;
+
+		memset(&attr, 0, sizeof(attr));
+		attr.size = sizeof(attr);
+		attr.type = PERF_TYPE_HARDWARE;
+		attr.config = PERF_COUNT_HW_CACHE_MISSES;
+		attr.disabled = 1;
+		attr.exclude_kernel = 1;
+		attr.exclude_hv = 1;
+
+		fd = (int) syscall(__NR_perf_event_open, &attr, 0, -1, -1, 0);
+#endif
+	}
+
+	~miss_counter()
+	{
+		if(fd >= 0) {
+			close(fd);
+		}
+	}
+
+	void start()
+	{
+#ifdef __linux__
+		if(fd >= 0) {
+			ioctl(fd, PERF_EVENT_IOC_RESET, 0);
+			ioctl(fd, PERF_EVENT_IOC_ENABLE, 0);
+		}
+#endif
+	}
+
+	/* Returns -1 if the counter is not available */
+	long long stop()
+	{
+		long long count = -1;
+
+#ifdef __linux__
+		if(fd >= 0) {
+			ioctl(fd, PERF_EVENT_IOC_DISABLE, 0);
+			if(read(fd, &count, sizeof(count)) != sizeof(count)) {
+				count = -1;
+			}
+		}
+#endif
+
+		return count;
+	}
+};
+
+/*
+ *  splitmix64, so runs are repeatable on any platform
+ */
+struct rng {
+	unsigned long long state;
+
+	explicit rng(unsigned long long seed) : state(seed)
+	{
+	}
+
+	unsigned long long next()
+	{
+		unsigned long long z = (state += 0x9e3779b97f4a7c15ULL);
+
+		z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+		z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+		return z ^ (z >> 31);
+	}
+
+	double uniform()
+	{
+		return (next() >> 11) * (1.0 / 9007199254740992.0);
+	}
+};
+
+/*
+ *  Zipfian ranks from 0 to n - 1, by the method of Gray et al. "Quickly
+ *  generating billion-record synthetic databases"
+ */
+struct zipf {
+	long   n;
+	double theta;
+	double alpha;
+	double zetan;
+	double eta;
+
+	zipf(long n_, double theta_) : n(n_), theta(theta_)
+	{
+		double zeta2 = 1 + std::pow(0.5, theta);
+		long i;
+
+		zetan = 0;
+		for(i = 1; i <= n; i++) {
+			zetan += 1 / std::pow((double) i, theta);
+		}
+		alpha = 1 / (1 - theta);
+		eta = (1 - std::pow(2.0 / n, 1 - theta)) / (1 - zeta2 / zetan);
+	}
+
+	long next(rng &r) const
+	{
+		double u = r.uniform();
+		double uz = u * zetan;
+		long rank;
+
+		if(uz < 1) {
+			return 0;
+		}
+		if(uz < 1 + std::pow(0.5, theta)) {
+			return 1;
+		}
+		rank = (long) (n * std::pow(eta * u - eta + 1, alpha));
+		return rank < n ? rank : n - 1;
+	}
+};
+
+enum workload {
+	WORKLOAD_UNIFORM,
+	WORKLOAD_ZIPF,
+	WORKLOAD_SEQUENTIAL
+};
+
+static const char *workload_names[] = { "uniform", "zipf", "sequential" };
+
+/*
+ *  Keys picked by a workload.  The structures hold the even numbers from 0
+ *  to 2(n - 1); lookups, scans and deletes pick among them, and inserts add
+ *  odd numbers next to them, or numbers past the end for the sequential
+ *  workload.
+ */
+struct key_source {
+	enum workload  type;
+	long           n;
+	rng            r;
+	const zipf    *skew;
+	long           position;
+
+	key_source(enum workload type_, long n_, unsigned long long seed, const zipf *skew_)
+		: type(type_), n(n_), r(seed), skew(skew_), position(0)
+	{
+	}
+
+	/* Index of a stored key */
+	long pick()
+	{
+		switch(type) {
+		case WORKLOAD_UNIFORM:
+			return (long) (r.next() % n);
+		case WORKLOAD_ZIPF:
+			/* Scatter the ranks, so that hot keys are not neighbours */
+			return (long) ((unsigned long long) skew->next(r) * 2654435761ULL % n);
+		default:
+			return position++ % n;
+		}
+	}
+
+	int existing()
+	{
+		return (int) (2 * pick());
+	}
+
+	int fresh()
+	{
+		if(type == WORKLOAD_SEQUENTIAL) {
+			return (int) (2 * (n + position++));
+		}
+		return (int) (2 * pick() + 1);
+	}
+};
+
+static int int_measure(void *val)
+{
+	return *((int *) val);
+}
+
+static int sum_action(void *user_data, void *val)
+{
+	*((long *) user_data) += *((int *) val);
+
+	return 0;
+}
+
+/*
+ *  The tree through its C interface.  Values point at the keys, which the
+ *  benchmark keeps alive.
+ */
+struct csbpt_c {
+	struct csbpt_tree *tree;
+
+	static const char *name() { return "csbpt"; }
+	static const bool slow_updates = false;
+
+	csbpt_c() : tree(NULL)
+	{
+	}
+
+	~csbpt_c()
+	{
+		if(tree) {
+			csbpt_release(tree);
+		}
+	}
+
+	void load(int *keys, long n)
+	{
+		struct csbpt_tune tune;
+
+		memset(&tune, 0, sizeof(tune));
+		tune.order = 8;
+		tree = csbpt_create(&tune, int_measure, keys, n, sizeof(int));
+		if(!tree) {
+			perror("csbpt_create");
+			exit(1);
+		}
+	}
+
+	long lookup(int key)
+	{
+		long sum = 0;
+
+		csbpt_find_value(tree, key, &sum, sum_action);
+		return sum;
+	}
+
+	long scan(int key)
+	{
+		struct csbpt_cursor  cursor;
+		int                  measures[scan_length];
+		long                 sum = 0;
+		size_t               i, read;
+
+		csbpt_cursor_seek(tree, &cursor, key);
+		read = csbpt_cursor_read(&cursor, measures, NULL, scan_length);
+		for(i = 0; i < read; i++) {
+			sum += measures[i];
+		}
+		return sum;
+	}
+
+	void insert(int *key)
+	{
+		csbpt_insert(tree, key);
+	}
+
+	size_t erase(int key)
+	{
+		size_t count = 0;
+
+		csbpt_delete(tree, key, NULL, NULL, &count);
+		return count;
+	}
+};
+
+/*
+ *  The tree through the C++ wrapper, with the values stored inline
+ */
+struct csbpt_cxx {
+	csbpt::tree<int, int> tree;
+
+	static const char *name() { return "csbpt++"; }
+	static const bool slow_updates = false;
+
+	void load(int *keys, long n)
+	{
+		std::vector<std::pair<int, int> > pairs;
+		long i;
+
+		pairs.reserve(n);
+		for(i = 0; i < n; i++) {
+			pairs.push_back(std::make_pair(keys[i], keys[i]));
+		}
+		tree.insert(pairs.begin(), pairs.end());
+	}
+
+	long lookup(int key)
+	{
+		long sum = 0;
+
+		tree.find(key, [&sum](int value) { sum += value; });
+		return sum;
+	}
+
+	long scan(int key)
+	{
+		long sum = 0;
+		int  left = scan_length;
+
+		/* scan() has no limit on the number of values, so bound the range */
+		tree.scan(key, key + 2 * scan_length - 1, [&](int, int value) {
+			if(left-- > 0) {
+				sum += value;
+			}
+		});
+		return sum;
+	}
+
+	void insert(int *key)
+	{
+		tree.insert(*key, *key);
+	}
+
+	size_t erase(int key)
+	{
+		return tree.erase(key);
+	}
+};
+
+/*
+ *  A plain B+ tree of nodes allocated one by one, with the keys and values
+ *  of each leaf side by side and the leaves linked for scans.  Deletes leave
+ *  nodes underfull rather than merging them, as many B-trees in practice do.
+ */
+struct btree_baseline {
+	enum { fanout = 32 };
+
+	struct leaf {
+		int   count;
+		int   keys[fanout];
+		int   values[fanout];
+		leaf *next;
+	};
+
+	struct inner {
+		int   count;
+		int   keys[fanout];
+		void *children[fanout + 1];
+	};
+
+	void *root;
+	int   height;
+
+	static const char *name() { return "btree"; }
+	static const bool slow_updates = false;
+
+	btree_baseline() : root(NULL), height(0)
+	{
+	}
+
+	~btree_baseline()
+	{
+		release(root, height);
+	}
+
+	static void release(void *node, int level)
+	{
+		inner *in = (inner *) node;
+		int    i;
+
+		if(level == 0) {
+			delete (leaf *) node;
+			return;
+		}
+		for(i = 0; i <= in->count; i++) {
+			release(in->children[i], level - 1);
+		}
+		delete in;
+	}
+
+	/*
+	 *  Child i holds keys from separator i - 1 to separator i, both included,
+	 *  so the first copy of a key is in the leftmost leaf reached this way
+	 */
+	leaf *seek(int key) const
+	{
+		void *node = root;
+		int   level;
+
+		for(level = height; level > 0; level--) {
+			inner *in = (inner *) node;
+
+			node = in->children[std::lower_bound(in->keys, in->keys + in->count, key) - in->keys];
+		}
+		return (leaf *) node;
+	}
+
+	void load(int *data, long n)
+	{
+		std::vector<int>     sorted(data, data + n);
+		std::vector<void *>  level;
+		std::vector<void *>  above;
+		std::vector<int>     firsts;
+		std::vector<int>     above_firsts;
+		leaf                *previous = NULL;
+		long                 i, j, last;
+
+		std::sort(sorted.begin(), sorted.end());
+		for(i = 0; i < n || level.empty(); i += fanout) {
+			leaf *l = new leaf();
+
+			l->count = (int) std::min<long>(fanout, n - i);
+			for(j = 0; j < l->count; j++) {
+				l->keys[j] = l->values[j] = sorted[i + j];
+			}
+			if(previous) {
+				previous->next = l;
+			}
+			previous = l;
+			level.push_back(l);
+			firsts.push_back(l->keys[0]);
+		}
+
+		/* Full inner nodes, bottom up; the last of each level may have fewer children */
+		while(level.size() > 1) {
+			above.clear();
+			above_firsts.clear();
+			for(i = 0; i < (long) level.size(); i += fanout + 1) {
+				inner *in = new inner();
+
+				last = std::min<long>(i + fanout + 1, level.size());
+				in->count = (int) (last - i - 1);
+				for(j = i; j < last; j++) {
+					in->children[j - i] = level[j];
+					if(j > i) {
+						in->keys[j - i - 1] = firsts[j];
+					}
+				}
+				above.push_back(in);
+				above_firsts.push_back(firsts[i]);
+			}
+			level.swap(above);
+			firsts.swap(above_firsts);
+			height++;
+		}
+		root = level[0];
+	}
+
+	long lookup(int key)
+	{
+		long  sum = 0;
+		leaf *l;
+		int   i;
+
+		for(l = seek(key); l; l = l->next) {
+			for(i = std::lower_bound(l->keys, l->keys + l->count, key) - l->keys; i < l->count && l->keys[i] == key; i++) {
+				sum += l->values[i];
+			}
+			if(i < l->count) {
+				break;
+			}
+		}
+		return sum;
+	}
+
+	long scan(int key)
+	{
+		long  sum = 0;
+		int   left = scan_length;
+		leaf *l;
+		int   i;
+
+		for(l = seek(key); l && left > 0; l = l->next) {
+			for(i = std::lower_bound(l->keys, l->keys + l->count, key) - l->keys; i < l->count && left > 0; i++, left--) {
+				sum += l->values[i];
+			}
+		}
+		return sum;
+	}
+
+	/*
+	 *  Inserts after any equal keys in the subtree, and returns the new right
+	 *  sibling of the node if it split, with its first key in \c separator
+	 */
+	void *insert_into(void *node, int level, int key, int *separator)
+	{
+		int    keys[fanout + 1];
+		void  *children[fanout + 2];
+		int    i, total, half;
+		void  *split;
+		inner *in = (inner *) node;
+		inner *right;
+
+		if(level == 0) {
+			leaf *l = (leaf *) node;
+			leaf *sibling = NULL;
+
+			if(l->count == fanout) {
+				sibling = new leaf();
+				sibling->count = fanout - fanout / 2;
+				std::copy(l->keys + fanout / 2, l->keys + fanout, sibling->keys);
+				std::copy(l->values + fanout / 2, l->values + fanout, sibling->values);
+				l->count = fanout / 2;
+				sibling->next = l->next;
+				l->next = sibling;
+				*separator = sibling->keys[0];
+				if(key >= sibling->keys[0]) {
+					l = sibling;
+				}
+			}
+			i = std::upper_bound(l->keys, l->keys + l->count, key) - l->keys;
+			std::copy_backward(l->keys + i, l->keys + l->count, l->keys + l->count + 1);
+			std::copy_backward(l->values + i, l->values + l->count, l->values + l->count + 1);
+			l->keys[i] = l->values[i] = key;
+			l->count++;
+			return sibling;
+		}
+
+		i = std::upper_bound(in->keys, in->keys + in->count, key) - in->keys;
+		split = insert_into(in->children[i], level - 1, key, separator);
+		if(!split) {
+			return NULL;
+		}
+
+		std::copy(in->keys, in->keys + i, keys);
+		keys[i] = *separator;
+		std::copy(in->keys + i, in->keys + in->count, keys + i + 1);
+		std::copy(in->children, in->children + i + 1, children);
+		children[i + 1] = split;
+		std::copy(in->children + i + 1, in->children + in->count + 1, children + i + 2);
+		total = in->count + 1;
+		if(total <= fanout) {
+			std::copy(keys, keys + total, in->keys);
+			std::copy(children, children + total + 1, in->children);
+			in->count = total;
+			return NULL;
+		}
+
+		/* The middle separator moves up */
+		half = total / 2;
+		right = new inner();
+		right->count = total - half - 1;
+		std::copy(keys, keys + half, in->keys);
+		std::copy(children, children + half + 1, in->children);
+		in->count = half;
+		*separator = keys[half];
+		std::copy(keys + half + 1, keys + total, right->keys);
+		std::copy(children + half + 1, children + total + 1, right->children);
+		return right;
+	}
+
+	void insert(int *key)
+	{
+		int    separator;
+		void  *split = insert_into(root, height, *key, &separator);
+		inner *in;
+
+		if(split) {
+			in = new inner();
+			in->count = 1;
+			in->keys[0] = separator;
+			in->children[0] = root;
+			in->children[1] = split;
+			root = in;
+			height++;
+		}
+	}
+
+	size_t erase(int key)
+	{
+		size_t  count = 0;
+		leaf   *l;
+		int     i, j;
+
+		for(l = seek(key); l; l = l->next) {
+			i = std::lower_bound(l->keys, l->keys + l->count, key) - l->keys;
+			for(j = i; j < l->count && l->keys[j] == key; j++);
+			std::copy(l->keys + j, l->keys + l->count, l->keys + i);
+			std::copy(l->values + j, l->values + l->count, l->values + i);
+			l->count -= j - i;
+			count += j - i;
+			if(i < l->count) {
+				break;
+			}
+		}
+		return count;
+	}
+};
+
+struct multimap_baseline {
+	std::multimap<int, int> map;
+
+	static const char *name() { return "multimap"; }
+	static const bool slow_updates = false;
+
+	void load(int *keys, long n)
+	{
+		long i;
+
+		for(i = 0; i < n; i++) {
+			map.insert(std::make_pair(keys[i], keys[i]));
+		}
+	}
+
+	long lookup(int key)
+	{
+		long sum = 0;
+		std::pair<std::multimap<int, int>::iterator, std::multimap<int, int>::iterator> range = map.equal_range(key);
+
+		for(; range.first != range.second; ++range.first) {
+			sum += range.first->second;
+		}
+		return sum;
+	}
+
+	long scan(int key)
+	{
+		long sum = 0;
+		int  i;
+		std::multimap<int, int>::iterator it = map.lower_bound(key);
+
+		for(i = 0; i < scan_length && it != map.end(); i++, ++it) {
+			sum += it->second;
+		}
+		return sum;
+	}
+
+	void insert(int *key)
+	{
+		map.insert(std::make_pair(*key, *key));
+	}
+
+	size_t erase(int key)
+	{
+		return map.erase(key);
+	}
+};
+
+struct vector_baseline {
+	std::vector<int> keys;
+
+	static const char *name() { return "vector"; }
+	static const bool slow_updates = true;
+
+	void load(int *data, long n)
+	{
+		keys.assign(data, data + n);
+		std::sort(keys.begin(), keys.end());
+	}
+
+	long lookup(int key)
+	{
+		long sum = 0;
+		std::vector<int>::iterator it = std::lower_bound(keys.begin(), keys.end(), key);
+
+		for(; it != keys.end() && *it == key; ++it) {
+			sum += *it;
+		}
+		return sum;
+	}
+
+	long scan(int key)
+	{
+		long sum = 0;
+		std::vector<int>::iterator it = std::lower_bound(keys.begin(), keys.end(), key);
+		std::vector<int>::iterator end = keys.end() - it > scan_length ? it + scan_length : keys.end();
+
+		for(; it != end; ++it) {
+			sum += *it;
+		}
+		return sum;
+	}
+
+	void insert(int *key)
+	{
+		keys.insert(std::upper_bound(keys.begin(), keys.end(), *key), *key);
+	}
+
+	size_t erase(int key)
+	{
+		std::pair<std::vector<int>::iterator, std::vector<int>::iterator> range =
+			std::equal_range(keys.begin(), keys.end(), key);
+
+		keys.erase(range.first, range.second);
+		return range.second - range.first;
+	}
+};
+
+/*
+ *  Looks up many keys at once.  Structures without a batched lookup look
+ *  them up one at a time.
+ */
+template<typename Structure>
+static long lookup_batch(Structure *s, const int *keys, long count)
+{
+	long i;
+	long sum = 0;
+
+	for(i = 0; i < count; i++) {
+		sum += s->lookup(keys[i]);
+	}
+	return sum;
+}
+
+static long lookup_batch(csbpt_c *s, const int *keys, long count)
+{
+	long    i, j;
+	long    sum = 0;
+	void   *values[256];
+
+	for(i = 0; i < count; i += 256) {
+		csbpt_find_batch(s->tree, keys + i, count - i < 256 ? count - i : 256, values);
+		for(j = 0; j < 256 && i + j < count; j++) {
+			if(values[j]) {
+				sum += *((int *) values[j]);
+			}
+		}
+	}
+	return sum;
+}
+
+/*
+ *  Writes one measurement.  \c held is the number of keys in the structure
+ *  afterwards, and \c bytes the heap it holds, or -1 if unknown.
+ */
+static void report(const char *structure, enum workload type, long n, const char *op,
+                   long ops, double seconds, long long misses, long bytes, long held)
+{
+	printf("{\"structure\":\"%s\",\"workload\":\"%s\",\"keys\":%ld,\"op\":\"%s\",\"ops\":%ld,"
+	       "\"ns_per_op\":%.2f,",
+	       structure, workload_names[type], n, op, ops, seconds * 1e9 / ops);
+	if(misses >= 0) {
+		printf("\"cache_misses_per_op\":%.3f,", (double) misses / ops);
+	} else {
+		printf("\"cache_misses_per_op\":null,");
+	}
+	if(bytes >= 0) {
+		printf("\"bytes_per_key\":%.2f}\n", (double) bytes / (held > 0 ? held : 1));
+	} else {
+		printf("\"bytes_per_key\":null}\n");
+	}
+	fflush(stdout);
+}
+
+/*
+ *  Runs every operation on one structure
+ */
+template<typename Structure>
+static void bench_structure(enum workload type, long n, long ops, const zipf *skew, miss_counter &counter)
+{
+	long                i;
+	long                update_ops = ops;
+	long                sum = 0;
+	long                base;
+	long                held = n;
+	long long           misses;
+	double              start;
+	double              seconds;
+	std::vector<int>    keys(n);
+	std::vector<int>    probes(ops);
+	std::vector<int>    inserted(ops);
+	key_source          source(type, n, 42, skew);
+	rng                 shuffle(7);
+	Structure          *s;
+
+	/* Shifting half the vector each time, a sorted vector would take hours */
+	if(Structure::slow_updates && update_ops > 100000000 / n + 1) {
+		update_ops = 100000000 / n + 1;
+	}
+
+	for(i = 0; i < n; i++) {
+		keys[i] = (int) (2 * i);
+	}
+	if(type != WORKLOAD_SEQUENTIAL) {
+		for(i = n - 1; i > 0; i--) {
+			std::swap(keys[i], keys[shuffle.next() % (i + 1)]);
+		}
+	}
+
+	base = heap_bytes();
+	s = new Structure();
+
+	counter.start();
+	start = now();
+	s->load(keys.data(), n);
+	seconds = now() - start;
+	misses = counter.stop();
+	report(Structure::name(), type, n, "load", n, seconds, misses, base < 0 ? -1 : heap_bytes() - base, held);
+
+	for(i = 0; i < ops; i++) {
+		probes[i] = source.existing();
+	}
+	counter.start();
+	start = now();
+	for(i = 0; i < ops; i++) {
+		sum += s->lookup(probes[i]);
+	}
+	seconds = now() - start;
+	misses = counter.stop();
+	report(Structure::name(), type, n, "lookup", ops, seconds, misses, base < 0 ? -1 : heap_bytes() - base, held);
+
+	counter.start();
+	start = now();
+	sum += lookup_batch(s, probes.data(), ops);
+	seconds = now() - start;
+	misses = counter.stop();
+	report(Structure::name(), type, n, "lookup_batch", ops, seconds, misses, base < 0 ? -1 : heap_bytes() - base, held);
+
+	counter.start();
+	start = now();
+	for(i = 0; i < ops / scan_length + 1; i++) {
+		sum += s->scan(probes[i]);
+	}
+	seconds = now() - start;
+	misses = counter.stop();
+	report(Structure::name(), type, n, "scan", ops / scan_length + 1, seconds, misses, base < 0 ? -1 : heap_bytes() - base, held);
+
+	for(i = 0; i < update_ops; i++) {
+		inserted[i] = source.fresh();
+	}
+	counter.start();
+	start = now();
+	for(i = 0; i < update_ops; i++) {
+		s->insert(&inserted[i]);
+	}
+	held += update_ops;
+	seconds = now() - start;
+	misses = counter.stop();
+	report(Structure::name(), type, n, "insert", update_ops, seconds, misses, base < 0 ? -1 : heap_bytes() - base, held);
+
+	for(i = 0; i < update_ops; i++) {
+		probes[i] = source.existing();
+	}
+	counter.start();
+	start = now();
+	for(i = 0; i < update_ops; i++) {
+		held -= (long) s->erase(probes[i]);
+	}
+	seconds = now() - start;
+	misses = counter.stop();
+	report(Structure::name(), type, n, "delete", update_ops, seconds, misses, base < 0 ? -1 : heap_bytes() - base, held);
+
+	delete s;
+	sink = sum;
+}
+
+static int listed(const char *list, const char *name)
+{
+	size_t      length = strlen(name);
+	const char *p;
+
+	for(p = list; (p = strstr(p, name)); p += length) {
+		if((p == list || p[-1] == ',') && (p[length] == ',' || p[length] == '\0')) {
+			return 1;
+		}
+	}
+
+	return 0;
+}
+
+int main(int argc, char **argv)
+{
+	int           t;
+	long          n;
+	long          max_keys = argc > 1 ? atol(argv[1]) : 1000000;
+	long          ops = argc > 2 ? atol(argv[2]) : 1000000;
+	const char   *structures = argc > 3 ? argv[3] : "csbpt,csbpt++,btree,multimap,vector";
+	const char   *workloads = argc > 4 ? argv[4] : "uniform,zipf,sequential";
+	miss_counter  counter;
+
+	if(max_keys < 1000 || ops < 1) {
+		fprintf(stderr, "Usage: bench [max keys >= 1000] [ops] [structures] [workloads]\n");
+		return 1;
+	}
+
+	if(counter.fd < 0) {
+		fprintf(stderr, "Cache misses are not available; see /proc/sys/kernel/perf_event_paranoid\n");
+	}
+
+	for(n = 1000; n <= max_keys; n *= 10) {
+		zipf skew(n, 0.99);
+
+		for(t = WORKLOAD_UNIFORM; t <= WORKLOAD_SEQUENTIAL; t++) {
+			enum workload type = (enum workload) t;
+
+			if(!listed(workloads, workload_names[t])) {
+				continue;
+			}
+
+			if(listed(structures, csbpt_c::name())) {
+				bench_structure<csbpt_c>(type, n, ops, &skew, counter);
+			}
+			if(listed(structures, csbpt_cxx::name())) {
+				bench_structure<csbpt_cxx>(type, n, ops, &skew, counter);
+			}
+			if(listed(structures, btree_baseline::name())) {
+				bench_structure<btree_baseline>(type, n, ops, &skew, counter);
+			}
+			if(listed(structures, multimap_baseline::name())) {
+				bench_structure<multimap_baseline>(type, n, ops, &skew, counter);
+			}
+			if(listed(structures, vector_baseline::name())) {
+				bench_structure<vector_baseline>(type, n, ops, &skew, counter);
+			}
+		}
+	}
+
+	return 0;
+}
@@ -0,0 +1,148 @@
+/*
+ *  Measures how read throughput of a concurrent tree scales with threads.
+ *
+ *  Usage: bench_concurrent [entries] [max threads] [seconds]
+ *
+ *  For each number of reader threads, the readers look up random keys for
+ *  the given time while a writer keeps inserting new values.
+ */
+
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "csbpt.h"
+
+struct bench {
+	struct csbpt *tree;
+	int *data;
+	int num_entries;
+	int stop;
+};
+
+struct reader_arg {
+	struct bench *bench;
+	unsigned int seed;
+	long lookups;
+};
+
+static int ordered_ints_measure(void *val)
+{
+	return *((int *) val);
+}
+
+static void *reader_thread(void *arg)
+{
+	int i;
+	struct reader_arg *r = (struct reader_arg *) arg;
+	struct csbpt_reader *reader = csbpt_reader_register(r->bench->tree);
+
+	while(!__atomic_load_n(&r->bench->stop, __ATOMIC_ACQUIRE)) {
+		csbpt_read_begin(reader);
+		for(i = 0; i < 1024; i++) {
+			csbpt_find_value(r->bench->tree, r->bench->data[rand_r(&r->seed) % r->bench->num_entries], NULL, NULL);
+		}
+		csbpt_read_end(reader);
+		r->lookups += 1024;
+	}
+
+	csbpt_reader_unregister(reader);
+
+	return NULL;
+}
+
+static void *writer_thread(void *arg)
+{
+	struct bench *bench = (struct bench *) arg;
+	int *values = malloc(bench->num_entries * sizeof(int));
+	int i = 0;
+
+	while(!__atomic_load_n(&bench->stop, __ATOMIC_ACQUIRE) && i < bench->num_entries) {
+		values[i] = bench->data[i] + 1;
+		csbpt_insert(bench->tree, &values[i++]);
+	}
+
+	/* The tree still points at the values; they are freed with it */
+	return values;
+}
+
+int main(int argc, char **argv)
+{
+	int i, t;
+	int num_entries = argc > 1 ? atoi(argv[1]) : 1000000;
+	int max_threads = argc > 2 ? atoi(argv[2]) : (int) sysconf(_SC_NPROCESSORS_ONLN) - 1;
+	int seconds = argc > 3 ? atoi(argv[3]) : 2;
+	long total;
+	void *written;
+	struct bench bench;
+	struct csbpt_tune tune;
+	struct reader_arg *args;
+	pthread_t *readers;
+	pthread_t writer;
+
+	if(max_threads < 1) {
+		max_threads = 1;
+	}
+
+	bench.data = malloc(num_entries * sizeof(int));
+	args = calloc(max_threads, sizeof(struct reader_arg));
+	readers = calloc(max_threads, sizeof(pthread_t));
+
+	if(!bench.data || !args || !readers) {
+		fprintf(stderr, "Out of memory\n");
+		return 1;
+	}
+
+	srand(1);
+	for(i = 0; i < num_entries; i++) {
+		bench.data[i] = 2 * (rand() % num_entries);
+	}
+	bench.num_entries = num_entries;
+
+	memset(&tune, 0, sizeof(tune));
+	tune.order = 8;
+	tune.concurrent = 1;
+
+	/* Powers of two, then max_threads itself */
+	for(t = 1; t <= max_threads; t = (t < max_threads && t * 2 > max_threads) ? max_threads : t * 2) {
+		bench.tree = csbpt_create(&tune, ordered_ints_measure, bench.data, num_entries, sizeof(int));
+		bench.stop = 0;
+
+		if(!bench.tree) {
+			fprintf(stderr, "Error creating tree\n");
+			return 1;
+		}
+
+		pthread_create(&writer, NULL, writer_thread, &bench);
+		for(i = 0; i < t; i++) {
+			args[i].bench = &bench;
+			args[i].seed = i + 1;
+			args[i].lookups = 0;
+			pthread_create(&readers[i], NULL, reader_thread, &args[i]);
+		}
+
+		sleep(seconds);
+		__atomic_store_n(&bench.stop, 1, __ATOMIC_RELEASE);
+
+		total = 0;
+		for(i = 0; i < t; i++) {
+			pthread_join(readers[i], NULL);
+			total += args[i].lookups;
+		}
+		pthread_join(writer, &written);
+
+		printf("%3d readers  %12.0f lookups/s  %12.0f per reader\n",
+		       t, (double) total / seconds, (double) total / seconds / t);
+
+		csbpt_release(bench.tree);
+		free(written);
+	}
+
+	free(bench.data);
+	free(args);
+	free(readers);
+
+	return 0;
+}
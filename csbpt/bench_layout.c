@@ -0,0 +1,105 @@
+/*
+ *  Compares the interleaved and split leaf group layouts.
+ *
+ *  Usage: bench_layout [entries] [probes] [order]
+ *
+ *  Builds a tree of random ints with each layout, then times point lookups
+ *  of keys which are in the tree and keys which are not.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "csbpt.h"
+
+static int ordered_ints_measure(void *val)
+{
+	return *((int *) val);
+}
+
+static double now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void bench_layout(enum csbpt_leaf_layout layout, const char *name, int order,
+                         int *data, int num_entries, int *probes, int num_probes)
+{
+	int i;
+	int found;
+	double start;
+	double load_time, hit_time, miss_time;
+	struct csbpt_tune tune;
+	struct csbpt *tree;
+
+	memset(&tune, 0, sizeof(tune));
+	tune.order = order;
+	tune.leaf_layout = layout;
+
+	start = now();
+	tree = csbpt_create(&tune, ordered_ints_measure, data, num_entries, sizeof(int));
+	load_time = now() - start;
+
+	if(!tree) {
+		fprintf(stderr, "Error creating tree\n");
+		return;
+	}
+
+	/* Even keys are in the tree, odd keys are not */
+	found = 0;
+	start = now();
+	for(i = 0; i < num_probes; i++) {
+		found += csbpt_find_value(tree, probes[i] & ~1, NULL, NULL);
+	}
+	hit_time = now() - start;
+
+	start = now();
+	for(i = 0; i < num_probes; i++) {
+		found += csbpt_find_value(tree, probes[i] | 1, NULL, NULL);
+	}
+	miss_time = now() - start;
+
+	printf("%-12s order %3d  load %8.3f s  hit %8.1f ns  miss %8.1f ns  (%d found)\n",
+	       name, order, load_time, hit_time * 1e9 / num_probes, miss_time * 1e9 / num_probes, found);
+
+	csbpt_release(tree);
+}
+
+int main(int argc, char **argv)
+{
+	int i;
+	int num_entries = argc > 1 ? atoi(argv[1]) : 10000000;
+	int num_probes = argc > 2 ? atoi(argv[2]) : 1000000;
+	int order = argc > 3 ? atoi(argv[3]) : 8;
+	int *data;
+	int *probes;
+
+	data = malloc(num_entries * sizeof(int));
+	probes = malloc(num_probes * sizeof(int));
+
+	if(!data || !probes) {
+		fprintf(stderr, "Out of memory\n");
+		return 1;
+	}
+
+	srand(1);
+	for(i = 0; i < num_entries; i++) {
+		data[i] = 2 * (rand() % num_entries);
+	}
+	for(i = 0; i < num_probes; i++) {
+		probes[i] = data[rand() % num_entries];
+	}
+
+	bench_layout(CSBPT_LEAF_INTERLEAVED, "interleaved", order, data, num_entries, probes, num_probes);
+	bench_layout(CSBPT_LEAF_SPLIT, "split", order, data, num_entries, probes, num_probes);
+
+	free(data);
+	free(probes);
+
+	return 0;
+}
@@ -3,20 +3,182 @@
  *  \brief    CSB+ Tree Implementation in C
  *  \author   Matt Weaver (matt@innerweaver.com)
  *  \date     2009
+ *
+ *  The tree is compiled once for each type of measure.  Compiled on its own,
+ *  this file builds the tree of int measures declared in csbpt.h.  Other types
+ *  are built by defining the \c CSBPT_KEY_ macros below, and \c CSBPT_PREFIX,
+ *  before including it; see csbpt_i64.c.
  */
 
+#ifndef CSBPT_KEY_TYPE
+#define CSBPT_KEY_TYPE    int       /*!< Type of a measure                                   */
+#define CSBPT_KEY_MIN     INT_MIN   /*!< Smallest measure                                    */
+#define CSBPT_KEY_MAX     INT_MAX   /*!< Largest measure                                     */
+#define CSBPT_KEY_BITS    32        /*!< Width of a measure; 32 or 64                        */
+#define CSBPT_KEY_SIGNED  1         /*!< Whether measures are signed                         */
+#define CSBPT_KEY_FORMAT  "d"       /*!< printf() conversion of a measure, without the \c %  */
+#endif
+
+#if CSBPT_KEY_BITS == 32 && !CSBPT_KEY_SIGNED
+#error "The 32-bit search kernels only compare signed measures"
+#endif
+
+/* Keep the names of this instance's functions for the rest of the file */
+#define CSBPT_KEEP_NAMES
 #include "csbpt.h"
 
-#include <math.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stddef.h>
+#include <stdint.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define CSBPT_X86_SIMD
+#include <cpuid.h>
+#include <immintrin.h>
+#endif
+
+#define CSBPT_ELEM_SIZE (sizeof(csbpt_key_t) + sizeof(void *))
+
+#if CSBPT_KEY_BITS == 64
+typedef uint64_t csbpt_key_bits_t;
+#else
+typedef uint32_t csbpt_key_bits_t;
+#endif
+
+/*!
+ *  XORed into a measure's bits to make them sort as an unsigned integer in
+ *  the same order as the measure
+ */
+#if CSBPT_KEY_SIGNED
+#define CSBPT_KEY_SIGN_FLIP ((csbpt_key_bits_t) 1 << (CSBPT_KEY_BITS - 1))
+#else
+#define CSBPT_KEY_SIGN_FLIP ((csbpt_key_bits_t) 0)
+#endif
+
+/*!
+ *  Size and alignment of the slabs node groups are carved from
+ */
+#define CSBPT_SLAB_SIZE (2 * 1024 * 1024)
+
+/*!
+ *  Granularity of allocations within a slab, unless the tree's order was
+ *  picked to fit cache lines
+ */
+#define CSBPT_ARENA_ALIGN 16
+
+/*!
+ *  Number of distinct allocation sizes whose freed chunks are kept for reuse
+ */
+#define CSBPT_ARENA_CLASSES 8
+
+/*!
+ *  Most cache lines the keys of a node may fill when the order is picked
+ *  automatically
+ */
+#define CSBPT_AUTO_MAX_LINES 4
+
+/*!
+ *  Cache line size assumed when the machine doesn't report one
+ */
+#define CSBPT_DEFAULT_LINE_SIZE 64
+
+/*!
+ *  Page size assumed when the machine doesn't report one
+ */
+#define CSBPT_DEFAULT_PAGE_SIZE 4096
+
+/*!
+ *  Most threads a tree will use to bulk load
+ */
+#define CSBPT_MAX_THREADS 64
+
+/*!
+ *  Fewest elements worth handing to a thread of their own
+ */
+#define CSBPT_PARALLEL_MIN 16384
+
+/*!
+ *  Fewest elements sorted with a radix sort rather than a merge sort
+ */
+#define CSBPT_RADIX_MIN 2048
+
+/*!
+ *  Upper bound on the height of a tree.  Insert paths are tracked in arrays of
+ *  this size.
+ */
+#define CSBPT_MAX_HEIGHT 64
+
+/*!
+ *  Number of lookups csbpt_find_batch() walks down the tree together.  Enough
+ *  to keep the CPU's line fill buffers busy, while each lookup's node still
+ *  stays in the L1 cache until it is searched.
+ */
+#define CSBPT_FIND_BATCH 16
+
+/*!
+ *  First bytes of every snapshot
+ */
+#define CSBPT_SNAPSHOT_MAGIC "CSBPTSNP"
+
+/*!
+ *  Version of the snapshot format written by csbpt_save().  Bumped whenever
+ *  the layout of a snapshot changes.
+ */
+#define CSBPT_SNAPSHOT_VERSION 4
+
+/*!
+ *  Alignment of each region of a snapshot
+ */
+#define CSBPT_SNAPSHOT_ALIGN 64
+
+/*!
+ *  Written as a native integer to record the byte order of a snapshot
+ */
+#define CSBPT_SNAPSHOT_BYTE_ORDER 0x01020304
+
+/*!
+ *  First bytes of every log
+ */
+#define CSBPT_LOG_MAGIC "CSBPTLOG"
+
+/*!
+ *  Version of the log format.  Bumped whenever the layout of a record
+ *  changes.
+ */
+#define CSBPT_LOG_VERSION 1
+
+/*!
+ *  Bytes of records a log buffers before the writer flushes them itself,
+ *  without waiting for csbpt_log_sync() or the flusher thread
+ */
+#define CSBPT_LOG_BUFFER (1024 * 1024)
 
-#define CSBPT_ELEM_SIZE (sizeof(int) + sizeof(void *))
+/*!
+ *  Size of the blocks values recovered from a checkpoint or log are copied
+ *  into
+ */
+#define CSBPT_VALUE_BLOCK (64 * 1024)
 
 /*
  *  Internal Structures
  */
 
+/*!
+ *  \brief Function to search the keys of a node
+ *
+ *  \see search_keys_scalar()
+ */
+typedef int (csbpt_search_fn)(const csbpt_key_t *keys, int num_keys, csbpt_key_t key);
+
 /*!
  *  \brief Internal tree node
  *
@@ -24,28 +186,235 @@
  *  child nodes (a node group).
  */
 struct csbpt_internal_node {
-	int    num_keys;   /*!< The number of keys in this node; corresponds to the number of children */
-	int   *keys;       /*!< Keys of the child nodes                                                */
-	void  *children;   /*!< Child nodes; may be csbpt_internal_node or csbpt_leaf_node instances   */
+	int           num_keys;   /*!< The number of keys in this node; corresponds to the number of children */
+	csbpt_key_t  *keys;       /*!< Keys of the child nodes                                                */
+	void         *children;   /*!< Child nodes; may be csbpt_internal_node or csbpt_leaf_node instances   */
 };
 
 /*!
  *  \brief Node group at the base of the tree
  *
  *  This is a "flattened" set of leaf nodes.  Each leaf node consists of
- *  nothing but a set of memory consisting of alternating pairs of int keys
- *  and pointer values.
+ *  nothing but a set of memory consisting of alternating pairs of keys
+ *  and pointer values.  With the #CSBPT_LEAF_SPLIT layout, the group's keys
+ *  are instead stored together, followed by an array of the values.
  *
  *  Leaf nodes are conceptually linked together into a double-linked-list, but
  *  since each node in a node group is contiguous, they can be physically
  *  combined into a single pair of pointers and a flattened chunk of data.
+ *
+ *  The keys of a split group may be compressed: when they all lie within
+ *  256 or 65536 of the first, they are stored as 8 or 16 bit deltas from it,
+ *  at the start of the space for the keys.  See csbpt_tune.compress_keys.
  */
 struct csbpt_leaf_group {
-	struct csbpt_leaf_group   *next;        /*!< Pointer to the next node group */
-	struct csbpt_leaf_group   *prev;        /*!< Pointer to the prev node group */
-	size_t                     num_elems;   /*!< Number of elements             */
+	struct csbpt_leaf_group   *next;        /*!< Pointer to the next node group                 */
+	struct csbpt_leaf_group   *prev;        /*!< Pointer to the prev node group                 */
+	size_t                     num_elems;   /*!< Number of elements                             */
+	csbpt_key_t                base;        /*!< Key the deltas of compressed keys are added to */
+	unsigned int               delta_bits;  /*!< 8 or 16 if the keys are compressed, else 0     */
+};
+
+
+/*!
+ *  \brief Where a slab was obtained from
+ */
+enum csbpt_slab_source {
+	CSBPT_SLAB_ALLOCATOR = 0,   /*!< The arena's allocator                                */
+	CSBPT_SLAB_HUGETLB,         /*!< A mapping of reserved huge pages                      */
+	CSBPT_SLAB_MAPPED           /*!< An anonymous mapping, advised to use huge pages       */
+};
+
+/*!
+ *  \brief Header at the start of every slab
+ */
+struct csbpt_slab {
+	struct csbpt_slab         *next;        /*!< Next slab owned by the arena   */
+	size_t                     size;        /*!< Size of the slab               */
+	enum csbpt_slab_source     source;      /*!< How the slab is given back     */
+};
+
+/*!
+ *  \brief A freed chunk, waiting to be reused
+ */
+struct csbpt_free_chunk {
+	struct csbpt_free_chunk   *next;        /*!< Next chunk of the same size    */
+};
+
+/*!
+ *  \brief Memory arena for a tree
+ *
+ *  Everything a tree is built from (node groups, leaf groups, key arrays and
+ *  whole rows) is carved from large slabs.  Consecutive allocations are
+ *  contiguous, and releasing the tree only needs to free the slabs.
+ *
+ *  A tree only ever allocates a handful of distinct sizes, so freed chunks
+ *  are kept on one free list per size and handed out again before any new
+ *  space is used.
+ */
+struct csbpt_arena {
+	struct csbpt_allocator     allocator;                          /*!< Where slabs come from                       */
+	struct csbpt_slab         *slabs;                              /*!< Every slab owned by the arena               */
+	unsigned char             *cur;                                /*!< Next free byte in the current slab          */
+	unsigned char             *end;                                /*!< End of the current slab                     */
+	size_t                     class_size[CSBPT_ARENA_CLASSES];    /*!< Chunk size of each free list; 0 if unused   */
+	struct csbpt_free_chunk   *free[CSBPT_ARENA_CLASSES];          /*!< Free lists                                  */
+	size_t                     align;                              /*!< Granularity of allocations; a power of 2    */
+	int                        huge_pages;                         /*!< Whether slabs are backed by huge pages      */
+};
+
+/*!
+ *  \brief A published version of a concurrent tree
+ *
+ *  Readers of a concurrent tree start from the current version, which is
+ *  replaced as a whole by every write.  Keeping the height and the log
+ *  sequence next to the root means a reader never mixes the root of one
+ *  version with the height or log position of another.
+ */
+struct csbpt_version {
+	struct csbpt_internal_node   root;          /*!< Root of the tree in this version              */
+	int                          height;        /*!< Height of the tree in this version            */
+	uint64_t                     log_sequence;  /*!< Log records the tree includes in this version */
+};
+
+/*!
+ *  \brief Memory which readers may still be using
+ */
+struct csbpt_retired {
+	void                        *ptr;      /*!< Memory to free                                */
+	size_t                       size;     /*!< Size it was allocated with                    */
+	unsigned long                epoch;    /*!< Epoch in which it was removed from the tree   */
+};
+
+/*!
+ *  \brief Registration of a reader thread with a concurrent tree
+ *
+ *  Each reader announces the epoch it entered while it is reading, and zero
+ *  while it is not.  Records are padded to a cache line so that readers never
+ *  write to a line another thread is using.
+ */
+struct csbpt_reader {
+	unsigned long                epoch;    /*!< Epoch the reader entered; 0 when not reading  */
+	struct csbpt_reader         *next;     /*!< Next record registered with the tree          */
+	struct csbpt                *tree;     /*!< Tree the record is registered with            */
+	int                          in_use;   /*!< Whether a thread owns this record             */
+	unsigned char                pad[64 - sizeof(unsigned long) - 2 * sizeof(void *) - sizeof(int)];
+};
+
+/*!
+ *  \brief Header at the start of a snapshot
+ *
+ *  Offsets are from the start of the file.  The remaining fields must match
+ *  the layout the reading process would compute for the same tree.
+ */
+struct csbpt_snapshot_header {
+	char                         magic[8];          /*!< #CSBPT_SNAPSHOT_MAGIC                           */
+	uint32_t                     version;           /*!< #CSBPT_SNAPSHOT_VERSION                         */
+	uint32_t                     byte_order;        /*!< #CSBPT_SNAPSHOT_BYTE_ORDER, as written          */
+	uint32_t                     word_size;         /*!< Size of a pointer in the writing process        */
+	int32_t                      height;            /*!< Height of the tree                              */
+	int32_t                      leaf_layout;       /*!< How leaf groups are laid out                    */
+	int32_t                      summarized;        /*!< Whether nodes cache counts and summaries        */
+	uint32_t                     key_bits;          /*!< Width of a measure                              */
+	uint32_t                     key_signed;        /*!< Whether measures are signed                     */
+	int32_t                      compress_keys;     /*!< Whether leaf groups may have compressed keys    */
+	uint64_t                     min_children;      /*!< Order of the tree                               */
+	uint64_t                     max_children;      /*!< Twice the order                                 */
+	uint64_t                     leaf_group_size;   /*!< Size of a leaf group                            */
+	uint64_t                     leaf_values;       /*!< Offset of the values in a split leaf group      */
+	uint64_t                     keys_size;         /*!< Size of a key array                             */
+	uint64_t                     counts_offset;     /*!< Offset of the counts in a key array             */
+	uint64_t                     summaries_offset;  /*!< Offset of the summaries in a key array          */
+	int64_t                      identity;          /*!< Summary of no values                            */
+	uint64_t                     value_size;        /*!< Bytes stored for each value                     */
+	uint64_t                     num_values;        /*!< Number of values in the tree                    */
+	uint64_t                     root;              /*!< Offset of the root node                         */
+	uint64_t                     file_size;         /*!< Size of the whole snapshot                      */
+	uint64_t                     log_sequence;      /*!< Log records the tree includes                   */
+};
+
+/*!
+ *  \brief Header at the start of a log
+ *
+ *  Every log starts where a checkpoint left off, so its records are numbered
+ *  on from the ones the checkpoint includes.
+ */
+struct csbpt_log_header {
+	char                         magic[8];          /*!< #CSBPT_LOG_MAGIC                                */
+	uint32_t                     version;           /*!< #CSBPT_LOG_VERSION                              */
+	uint32_t                     byte_order;        /*!< #CSBPT_SNAPSHOT_BYTE_ORDER, as written          */
+	uint32_t                     key_bits;          /*!< Width of a measure                              */
+	uint32_t                     key_signed;        /*!< Whether measures are signed                     */
+	uint64_t                     value_size;        /*!< Bytes stored for each value                     */
+	uint64_t                     start;             /*!< Sequence number of the first record             */
+	uint32_t                     reserved;          /*!< Zero                                            */
+	uint32_t                     checksum;          /*!< CRC-32C of the fields above                     */
+};
+
+/*!
+ *  \brief Operations recorded in a log
+ */
+enum log_op {
+	LOG_INSERT = 1,                                 /*!< csbpt_insert() and friends                      */
+	LOG_PUSH_LEFT,                                  /*!< csbpt_push_left()                               */
+	LOG_PUSH_RIGHT,                                 /*!< csbpt_push_right()                              */
+	LOG_REMOVE,                                     /*!< Removal of a single value                       */
+	LOG_DELETE_RANGE                                /*!< Removal of every value in a range of measures   */
+};
+
+/*!
+ *  \brief Header of a record in a log
+ *
+ *  Inserts and removals are followed by the \c value_size bytes of the value;
+ *  a removal is replayed by removing a value with the same measure and bytes.
+ *  Measures are stored as the bits of a \c csbpt_key_t.
+ */
+struct csbpt_log_record {
+	uint32_t                     checksum;          /*!< CRC-32C of the rest of the record and its value */
+	uint32_t                     op;                /*!< A #log_op                                       */
+	uint64_t                     sequence;          /*!< Number of records before it                     */
+	uint64_t                     lo;                /*!< Measure of the value, or first of the range     */
+	uint64_t                     hi;                /*!< Last measure of a range                         */
+};
+
+/*!
+ *  \brief A write-ahead log attached to a tree
+ *
+ *  The tree's writer formats records into \c buf.  Whichever thread flushes
+ *  it swaps it with \c spare, writes and syncs the spare outside the lock,
+ *  and so carries every record appended up to the swap; threads which want
+ *  later records wait on \c flushed and then flush the next lot together.
+ */
+struct csbpt_log {
+	struct csbpt                *tree;              /*!< Tree whose writes are logged                    */
+	char                        *path;              /*!< Path of the log                                 */
+	int                          fd;                /*!< Descriptor of the log, positioned at its end    */
+	size_t                       value_size;        /*!< Bytes stored for each value                     */
+	pthread_mutex_t              lock;              /*!< Guards everything below                         */
+	pthread_cond_t               flushed;           /*!< Signalled when a flush finishes                 */
+	pthread_cond_t               wake;              /*!< Wakes the flusher thread to leave               */
+	unsigned char               *buf;               /*!< Records not yet handed to a flush               */
+	size_t                       len;               /*!< Bytes used in \c buf                            */
+	size_t                       size;              /*!< Bytes allocated for \c buf                      */
+	unsigned char               *spare;             /*!< Buffer being written, or free to swap in        */
+	size_t                       spare_size;        /*!< Bytes allocated for \c spare                    */
+	uint64_t                     appended;          /*!< Bytes of records appended since opening         */
+	uint64_t                     durable;           /*!< Bytes of those synced to disk                   */
+	int                          flushing;          /*!< Whether a thread is writing \c spare            */
+	int                          error;             /*!< errno of the first failed flush; 0 if none      */
+	unsigned long                sync_usec;         /*!< Flusher thread period; 0 if there is none       */
+	int                          closing;           /*!< Whether the flusher thread should leave         */
+	pthread_t                    flusher;           /*!< Flushes the buffer every \c sync_usec           */
 };
 
+/*!
+ *  \brief Memory holding copies of values read back from a checkpoint or log
+ */
+struct csbpt_value_block {
+	struct csbpt_value_block    *next;              /*!< Next block owned by the tree                    */
+	size_t                       used;              /*!< Bytes handed out                                */
+	size_t                       size;              /*!< Bytes after the header                          */
+};
 
 /*!
  *  \brief The tree structure itself.
@@ -57,373 +426,7018 @@ struct csbpt {
 	size_t                       max_children;     /*!< The maximum number of children under a tree node */
 	int                          height;           /*!< Current height of the tree                       */
 	csbpt_measure_fn            *measure;          /*!< Function used to measure a value                 */
+	csbpt_search_fn             *search;           /*!< Kernel used to search the keys of a node         */
+	enum csbpt_leaf_layout       leaf_layout;      /*!< How leaf groups are laid out                     */
+	size_t                       leaf_group_size;  /*!< Size of a leaf group, including its header       */
+	size_t                       leaf_values;      /*!< Offset of the values in a split leaf group       */
+	size_t                       keys_size;        /*!< Size of the key array of a node                  */
+	int                          summarized;       /*!< Whether nodes cache summaries of their children  */
+	size_t                       counts_offset;    /*!< Offset of the child counts in a key array        */
+	size_t                       summaries_offset; /*!< Offset of the child summaries in a key array     */
+	struct csbpt_combinator      combinator;       /*!< Combines values into summaries                   */
+	int                          threads;          /*!< Threads used to bulk load                        */
 	struct csbpt_internal_node  *root;             /*!< Root of the tree                                 */
+	struct csbpt_arena           arena;            /*!< Memory the tree is built from                    */
+	int                          concurrent;       /*!< Whether writes are copy-on-write                 */
+	int                          compress_keys;    /*!< Whether split leaf groups get compressed keys    */
+	struct csbpt_version        *version;          /*!< Version readers start from                       */
+	unsigned long                epoch;            /*!< Current reclamation epoch                        */
+	struct csbpt_reader         *readers;          /*!< Registered reader records                        */
+	struct csbpt_retired        *retired;          /*!< Memory awaiting reclamation                      */
+	size_t                       num_retired;      /*!< Entries in use in \c retired                     */
+	size_t                       retired_size;     /*!< Entries allocated in \c retired                  */
+	unsigned char               *image;            /*!< Snapshot the tree is read from; NULL if none     */
+	size_t                       image_size;       /*!< Size of \c image                                 */
+	int                          image_mapped;     /*!< Whether \c image is a mapping of the file        */
+	struct csbpt                *origin;           /*!< Tree a version was pinned from; NULL if none     */
+	struct csbpt_reader         *pin;              /*!< Reader record keeping a pinned version alive     */
+	size_t                       num_pinned;       /*!< Versions pinned from this tree and not released  */
+	struct csbpt_log            *log;              /*!< Log writes are recorded in; NULL if none         */
+	uint64_t                     log_sequence;     /*!< Log records the tree includes                    */
+	struct csbpt_value_block    *owned_values;     /*!< Values recovered into memory the tree owns       */
 #ifdef CSBPT_DEBUG
 	size_t                       bytes_used;       /*!< Number of bytes allocated for the tree           */
 #endif
+#ifdef CSBPT_STATS
+	uint64_t                     stats_id;         /*!< Identifies the tree to thread_stats()            */
+	struct csbpt_thread_stats   *thread_stats;     /*!< Counters of each thread which used the tree      */
+#endif
 };
 
 /*
- *  Helper functions
+ *  Statistics
+ *
+ *  Built with CSBPT_STATS, each thread which uses a tree counts into its own
+ *  copy of the counters, so the hot paths never share a cache line or take
+ *  a lock; csbpt_stats_get() adds the copies up.  A thread finds its copy
+ *  through a small thread-local cache, and only walks the tree's list of
+ *  copies on a miss.  Without CSBPT_STATS the macros below compile away.
  */
 
+#ifdef CSBPT_STATS
+
+#define CSBPT_STATS_SLOTS 8     /*!< Trees each thread caches its counters for                */
 
 /*!
- *  Creates a node group of internal nodes.
+ *  \brief Counters kept by one thread for one tree
+ */
+struct csbpt_thread_stats {
+	struct csbpt_thread_stats  *next;     /*!< Next thread's counters                                */
+	const void                 *owner;    /*!< Thread-local address identifying the thread           */
+	struct csbpt_stats          stats;    /*!< The counters, only written by their thread            */
+};
+
+/*!
+ *  \brief Entry in a thread's cache of its counters
+ */
+struct stats_slot {
+	uint64_t             id;        /*!< csbpt.stats_id of the tree; 0 if empty                  */
+	struct csbpt_stats  *stats;     /*!< The thread's counters for that tree                     */
+};
+
+static uint64_t                   stats_ids;
+static __thread struct stats_slot  stats_slots[CSBPT_STATS_SLOTS];
+
+/*!
+ *  Finds the calling thread's counters for a tree, adding them if it has
+ *  none yet.  A pinned version counts into the tree it came from.
  *
- *  \param  tree       Tree to allocate for
+ *  \retval NULL   The counters could not be allocated
+ *  \retval other  The counters
+ */
+static struct csbpt_stats *thread_stats(struct csbpt *tree)
+{
+	struct stats_slot          *slot;
+	struct csbpt_thread_stats  *block;
+
+	if(tree->origin) {
+		tree = tree->origin;
+	}
+
+	slot = &stats_slots[tree->stats_id % CSBPT_STATS_SLOTS];
+	if(slot->id == tree->stats_id) {
+		return slot->stats;
+	}
+
+	/* A thread which has exited may leave its counters to one which
+	 * reuses its thread-local storage, which is harmless */
+	block = __atomic_load_n(&tree->thread_stats, __ATOMIC_ACQUIRE);
+	while(block && block->owner != stats_slots) {
+		block = block->next;
+	}
+
+	if(!block) {
+		block = calloc(1, sizeof(struct csbpt_thread_stats));
+		if(!block) {
+			return NULL;
+		}
+
+		block->owner = stats_slots;
+		block->next = __atomic_load_n(&tree->thread_stats, __ATOMIC_RELAXED);
+		while(!__atomic_compare_exchange_n(&tree->thread_stats, &block->next, block, 1, __ATOMIC_RELEASE, __ATOMIC_RELAXED));
+	}
+
+	slot->id = tree->stats_id;
+	slot->stats = &block->stats;
+
+	return slot->stats;
+}
+
+/*!
+ *  Adds to a counter.  Only the counter's thread writes it, but
+ *  csbpt_stats_get() may read it at any time, so it is stored whole.
+ */
+static void stat_add(uint64_t *counter, uint64_t n)
+{
+	__atomic_store_n(counter, *counter + n, __ATOMIC_RELAXED);
+}
+
+/*!
+ *  Returns a monotonic time in nanoseconds
+ */
+static uint64_t stats_clock(void)
+{
+	struct timespec now;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+
+	return (uint64_t) now.tv_sec * 1000000000 + now.tv_nsec;
+}
+
+/*!
+ *  Counts an operation and its latency
  *
- *  \retval NULL       If an error occurred
- *  \retval other      If allocation succeeded
+ *  \param  tree     Tree operated on
+ *  \param  op       The operation
+ *  \param  started  stats_clock() when it started
+ *  \param  count    Number of values it handled, each counted at the
+ *                   average latency
  */
-static struct csbpt_internal_node *alloc_internal_node_group(struct csbpt *tree)
+static void stats_op(struct csbpt *tree, enum csbpt_op op, uint64_t started, uint64_t count)
 {
-	struct csbpt_internal_node *ret;
+	int                      bucket;
+	int                      exponent;
+	uint64_t                 elapsed = stats_clock() - started;
+	uint64_t                 each;
+	struct csbpt_stats      *stats = thread_stats(tree);
+	struct csbpt_histogram  *histogram;
+
+	if(!stats || !count) {
+		return;
+	}
 
-	ret = calloc(tree->max_children, sizeof(struct csbpt_internal_node));
+	histogram = &stats->latency[op];
+	each = elapsed / count;
 
-#ifdef CSBPT_DEBUG
-	fprintf(stderr, "Allocating an internal node group of %d bytes to hold %d nodes of %d bytes each at address %x\n",
-			tree->max_children * sizeof(struct csbpt_internal_node), tree->max_children, sizeof(struct csbpt_internal_node), ret);
-	tree->bytes_used += tree->max_children * sizeof(struct csbpt_internal_node);
-#endif
+	/* 16 buckets for each power of two; see struct csbpt_histogram */
+	if(each < 16) {
+		bucket = (int) each;
+	} else {
+		exponent = 63 - __builtin_clzll(each);
+		bucket = (exponent - 3) * 16 + (int) ((each >> (exponent - 4)) & 15);
+	}
+
+	stat_add(&stats->ops[op], count);
+	stat_add(&histogram->count, count);
+	stat_add(&histogram->total_ns, elapsed);
+	stat_add(&histogram->buckets[bucket], count);
+	if(each > histogram->max_ns) {
+		__atomic_store_n(&histogram->max_ns, each, __ATOMIC_RELAXED);
+	}
+}
+
+/*!
+ *  Counts descents from the root
+ */
+static void stats_lookups(struct csbpt *tree, uint64_t count, uint64_t nodes)
+{
+	struct csbpt_stats *stats = thread_stats(tree);
+
+	if(stats) {
+		stat_add(&stats->lookups, count);
+		stat_add(&stats->nodes_visited, nodes);
+	}
+}
+
+#define STATS_CLOCK()                           stats_clock()
+#define STATS_OP(tree, op, started, count)      stats_op(tree, op, started, count)
+#define STATS_LOOKUPS(tree, count, nodes)       stats_lookups(tree, count, nodes)
+#define STATS_COUNT(tree, field, n)             do { struct csbpt_stats *s_ = thread_stats(tree); if(s_) stat_add(&s_->field, n); } while(0)
+
+#else
+
+#define STATS_CLOCK()                           0
+#define STATS_OP(tree, op, started, count)      ((void) (started))
+#define STATS_LOOKUPS(tree, count, nodes)       ((void) (nodes))
+#define STATS_COUNT(tree, field, n)             ((void) 0)
+
+#endif /* CSBPT_STATS */
+
+/*
+ *  Memory management
+ */
+
+/*!
+ *  Default slab allocator; see csbpt_allocator.alloc
+ */
+static void *default_slab_alloc(void *user_data, size_t size, size_t alignment)
+{
+	void *ret;
+
+	(void) user_data;
+
+	if(posix_memalign(&ret, alignment, size)) {
+		return NULL;
+	}
 
 	return ret;
 }
 
-static struct csbpt_internal_node *alloc_internal_row(struct csbpt *tree, size_t num_nodes)
+/*!
+ *  Default slab deallocator; see csbpt_allocator.free
+ */
+static void default_slab_free(void *user_data, void *ptr, size_t size)
 {
-	int i;
-	int num_groups;
-	struct csbpt_internal_node *ret;
+	(void) user_data;
+	(void) size;
 
-	num_groups = num_nodes / tree->max_children;
-	ret = calloc(num_nodes, sizeof(struct csbpt_internal_node));
+	free(ptr);
+}
 
-#ifdef CSBPT_DEBUG
-	fprintf(stderr, "Allocating an internal row %d bytes to hold %d nodes of %d bytes each at address %x\n",
-			num_nodes * sizeof(struct csbpt_internal_node), num_nodes, sizeof(struct csbpt_internal_node), ret);
-	tree->bytes_used += num_nodes * sizeof(struct csbpt_internal_node);
-#endif
+/*!
+ *  Sets up an empty arena
+ *
+ *  \param  arena      Arena to set up
+ *  \param  allocator  Where to get slabs from; NULL for the default
+ */
+static void arena_init(struct csbpt_arena *arena, struct csbpt_allocator *allocator)
+{
+	memset(arena, 0, sizeof(struct csbpt_arena));
+
+	if(allocator) {
+		arena->allocator = *allocator;
+	} else {
+		arena->allocator.alloc = default_slab_alloc;
+		arena->allocator.free = default_slab_free;
+	}
+
+	arena->align = CSBPT_ARENA_ALIGN;
+}
+
+/*!
+ *  Maps anonymous memory aligned to a slab boundary, by mapping a slab more
+ *  than needed and trimming both ends
+ *
+ *  \retval NULL   If an error occurred
+ *  \retval other  The memory
+ */
+static void *map_aligned(size_t size)
+{
+	unsigned char *ptr;
+	unsigned char *ret;
+
+	ptr = mmap(NULL, size + CSBPT_SLAB_SIZE, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+
+	if(ptr == MAP_FAILED) {
+		return NULL;
+	}
+
+	ret = (unsigned char *) (((uintptr_t) ptr + CSBPT_SLAB_SIZE - 1) & ~((uintptr_t) CSBPT_SLAB_SIZE - 1));
+	if(ret > ptr) {
+		munmap(ptr, ret - ptr);
+	}
+	munmap(ret + size, ptr + CSBPT_SLAB_SIZE - ret);
 
 	return ret;
 }
 
 /*!
- *  Creates a node group of leaf nodes
+ *  Gets a slab backed by huge pages; see csbpt_tune.huge_pages.  Reserved
+ *  huge pages are tried first, then an ordinary mapping advised to use
+ *  transparent ones.  A custom allocator's slabs are advised as they are.
  *
- *  \param  tree        Tree to allocate for
+ *  \param  arena   Arena to allocate for
+ *  \param  size    Size of the slab
+ *  \param  source  Set to where the slab came from
  *
- *  \retval NULL        If an error occurred
- *  \retval other       If allocation succeeded
+ *  \retval NULL    If an error occurred
+ *  \retval other   The slab
  */
-static struct csbpt_leaf_group *alloc_leaf_node_group(struct csbpt *tree)
+static void *alloc_huge_slab(struct csbpt_arena *arena, size_t size, enum csbpt_slab_source *source)
 {
-	struct csbpt_leaf_group *ret = NULL;
+	void *ret;
+
+	if(arena->allocator.alloc == default_slab_alloc) {
+#ifdef MAP_HUGETLB
+		ret = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+
+		if(ret != MAP_FAILED) {
+			if(((uintptr_t) ret & (CSBPT_SLAB_SIZE - 1)) == 0) {
+				*source = CSBPT_SLAB_HUGETLB;
+				return ret;
+			}
+
+			/* Huge pages smaller than a slab don't keep it aligned */
+			munmap(ret, size);
+		}
+#endif
+
+		ret = map_aligned(size);
+		*source = CSBPT_SLAB_MAPPED;
+	} else {
+		ret = arena->allocator.alloc(arena->allocator.user_data, size, CSBPT_SLAB_SIZE);
+		*source = CSBPT_SLAB_ALLOCATOR;
+	}
+
+#ifdef MADV_HUGEPAGE
+	if(ret) {
+		madvise(ret, size, MADV_HUGEPAGE);
+	}
+#endif
+
+	return ret;
+}
+
+/*!
+ *  Gets a new slab and adds it to the arena
+ *
+ *  \param  arena  Arena to grow
+ *  \param  size   Size of the slab, including its header
+ *
+ *  \retval NULL   If an error occurred
+ *  \retval other  The new slab
+ */
+static struct csbpt_slab *arena_add_slab(struct csbpt_arena *arena, size_t size)
+{
+	struct csbpt_slab        *slab;
+	enum csbpt_slab_source    source = CSBPT_SLAB_ALLOCATOR;
+
+	if(arena->huge_pages) {
+		slab = alloc_huge_slab(arena, size, &source);
+	} else {
+		slab = arena->allocator.alloc(arena->allocator.user_data, size, CSBPT_SLAB_SIZE);
+	}
+
+	if(!slab) {
+		errno = ENOMEM;
+		return NULL;
+	}
+
+	slab->next = arena->slabs;
+	slab->size = size;
+	slab->source = source;
+	arena->slabs = slab;
+
+	return slab;
+}
+
+/*!
+ *  Returns the size an arena hands out for a request of a given size
+ */
+static size_t arena_round(struct csbpt_arena *arena, size_t size)
+{
+	return (size + arena->align - 1) / arena->align * arena->align;
+}
+
+/*!
+ *  Allocates zeroed memory from an arena
+ *
+ *  \param  arena  Arena to allocate from
+ *  \param  size   Number of bytes needed
+ *
+ *  \retval NULL   If an error occurred
+ *  \retval other  If allocation succeeded
+ */
+static void *arena_alloc(struct csbpt_arena *arena, size_t size)
+{
+	int                 i;
+	size_t              header = (sizeof(struct csbpt_slab) + arena->align - 1) / arena->align * arena->align;
+	void               *ret;
+	struct csbpt_slab  *slab;
+
+	size = arena_round(arena, size);
+
+	for(i = 0; i < CSBPT_ARENA_CLASSES && arena->class_size[i]; i++) {
+		if(arena->class_size[i] == size && arena->free[i]) {
+			ret = arena->free[i];
+			arena->free[i] = arena->free[i]->next;
+			memset(ret, 0, size);
+			return ret;
+		}
+	}
+
+	/* Big requests, such as whole rows, get slabs of their own */
+	if(size > (CSBPT_SLAB_SIZE - header) / 4) {
+		slab = arena_add_slab(arena, (header + size + CSBPT_SLAB_SIZE - 1) / CSBPT_SLAB_SIZE * CSBPT_SLAB_SIZE);
+
+		if(!slab) {
+			return NULL;
+		}
+
+		ret = ((unsigned char *) slab) + header;
+		memset(ret, 0, size);
+		return ret;
+	}
+
+	if(arena->cur + size > arena->end || !arena->cur) {
+		slab = arena_add_slab(arena, CSBPT_SLAB_SIZE);
+
+		if(!slab) {
+			return NULL;
+		}
+
+		arena->cur = ((unsigned char *) slab) + header;
+		arena->end = ((unsigned char *) slab) + CSBPT_SLAB_SIZE;
+	}
+
+	ret = arena->cur;
+	arena->cur += size;
+	memset(ret, 0, size);
+
+	return ret;
+}
+
+/*!
+ *  Returns memory to an arena, to be reused by a later allocation of the same
+ *  size
+ *
+ *  \param  arena  Arena the memory came from
+ *  \param  ptr    Memory to free; may be NULL
+ *  \param  size   Size originally requested
+ */
+static void arena_free(struct csbpt_arena *arena, void *ptr, size_t size)
+{
+	int i;
+	struct csbpt_free_chunk *chunk = (struct csbpt_free_chunk *) ptr;
+
+	if(!ptr) {
+		return;
+	}
+
+	size = arena_round(arena, size);
+
+	for(i = 0; i < CSBPT_ARENA_CLASSES; i++) {
+		if(arena->class_size[i] == 0) {
+			arena->class_size[i] = size;
+		}
+
+		if(arena->class_size[i] == size) {
+			chunk->next = arena->free[i];
+			arena->free[i] = chunk;
+			return;
+		}
+	}
+
+	/* No free list left for this size; the chunk is reclaimed with the arena */
+}
+
+/*!
+ *  Frees every slab in an arena
+ */
+static void arena_release(struct csbpt_arena *arena)
+{
+	struct csbpt_slab *slab;
+	struct csbpt_slab *next;
+
+	for(slab = arena->slabs; slab; slab = next) {
+		next = slab->next;
+		if(slab->source == CSBPT_SLAB_ALLOCATOR) {
+			arena->allocator.free(arena->allocator.user_data, slab, slab->size);
+		} else {
+			munmap(slab, slab->size);
+		}
+	}
+
+	arena->slabs = NULL;
+	arena->cur = NULL;
+	arena->end = NULL;
+}
+
+/*
+ *  Parallel loops
+ */
+
+/*!
+ *  \brief Function run on a slice of a parallel loop
+ *
+ *  \param  ctx    Context given to parallel_for()
+ *  \param  begin  First index of the slice
+ *  \param  end    One past the last index of the slice
+ */
+typedef void (csbpt_slice_fn)(void *ctx, size_t begin, size_t end);
+
+/*!
+ *  \brief A slice of a parallel loop
+ */
+struct parallel_slice {
+	csbpt_slice_fn  *fn;      /*!< Function to run         */
+	void            *ctx;     /*!< Context to pass to it   */
+	size_t           begin;   /*!< First index             */
+	size_t           end;     /*!< One past the last index */
+};
+
+/*!
+ *  Thread entry point for a slice of a parallel loop
+ */
+static void *run_slice(void *arg)
+{
+	struct parallel_slice *slice = (struct parallel_slice *) arg;
+
+	slice->fn(slice->ctx, slice->begin, slice->end);
+
+	return NULL;
+}
+
+/*!
+ *  Runs a loop over [0, count) split into contiguous slices, one per thread.
+ *  The calling thread runs the first slice.  If a thread cannot be started,
+ *  its slice is run by the calling thread instead, so the loop always
+ *  completes.
+ *
+ *  \param  tree       Tree whose thread count to use
+ *  \param  count      Number of indexes
+ *  \param  min_slice  Fewest indexes worth a thread of their own
+ *  \param  fn         Function to run on each slice
+ *  \param  ctx        Passed to \c fn
+ */
+static void parallel_for(struct csbpt *tree, size_t count, size_t min_slice, csbpt_slice_fn *fn, void *ctx)
+{
+	size_t                 i;
+	size_t                 num_slices = tree->threads;
+	int                    started[CSBPT_MAX_THREADS];
+	pthread_t              threads[CSBPT_MAX_THREADS];
+	struct parallel_slice  slices[CSBPT_MAX_THREADS];
+
+	if(num_slices > count / min_slice) {
+		num_slices = count / min_slice;
+	}
+
+	if(num_slices <= 1) {
+		fn(ctx, 0, count);
+		return;
+	}
+
+	for(i = 0; i < num_slices; i++) {
+		slices[i].fn = fn;
+		slices[i].ctx = ctx;
+		slices[i].begin = count * i / num_slices;
+		slices[i].end = count * (i + 1) / num_slices;
+	}
+
+	for(i = 1; i < num_slices; i++) {
+		started[i] = !pthread_create(&threads[i], NULL, run_slice, &slices[i]);
+	}
+
+	run_slice(&slices[0]);
+
+	for(i = 1; i < num_slices; i++) {
+		if(started[i]) {
+			pthread_join(threads[i], NULL);
+		} else {
+			run_slice(&slices[i]);
+		}
+	}
+}
+
+/*
+ *  Helper functions
+ */
+
+
+/*!
+ *  Creates a node group of internal nodes.
+ *
+ *  \param  tree       Tree to allocate for
+ *
+ *  \retval NULL       If an error occurred
+ *  \retval other      If allocation succeeded
+ */
+static struct csbpt_internal_node *alloc_internal_node_group(struct csbpt *tree)
+{
+	struct csbpt_internal_node *ret;
+
+	ret = arena_alloc(&tree->arena, tree->max_children * sizeof(struct csbpt_internal_node));
+
+#ifdef CSBPT_DEBUG
+	fprintf(stderr, "Allocating an internal node group of %d bytes to hold %d nodes of %d bytes each at address %x\n",
+			tree->max_children * sizeof(struct csbpt_internal_node), tree->max_children, sizeof(struct csbpt_internal_node), ret);
+	tree->bytes_used += tree->max_children * sizeof(struct csbpt_internal_node);
+#endif
+
+	return ret;
+}
+
+/*!
+ *  Creates a node group of leaf nodes
+ *
+ *  \param  tree        Tree to allocate for
+ *
+ *  \retval NULL        If an error occurred
+ *  \retval other       If allocation succeeded
+ */
+static struct csbpt_leaf_group *alloc_leaf_node_group(struct csbpt *tree)
+{
+	struct csbpt_leaf_group *ret = NULL;
+
+	ret = arena_alloc(&tree->arena, tree->leaf_group_size);
+
+#ifdef CSBPT_DEBUG
+	fprintf(stderr, "Allocating a leaf node group of size %d to hold %d leaves at address %x\n",
+			tree->leaf_group_size, tree->max_children, ret);
+	tree->bytes_used += tree->leaf_group_size;
+#endif
+
+	return ret;
+}
+
+/*!
+ *  Creates the key array for an internal node.  Every key array has room for
+ *  \c max_children keys, so that nodes can grow in place.  In a summarized
+ *  tree, the keys are followed by the count and summary of each child.
+ *
+ *  \param  tree        Tree to allocate for
+ *
+ *  \retval NULL        If an error occurred
+ *  \retval other       If allocation succeeded
+ */
+static csbpt_key_t *alloc_keys(struct csbpt *tree)
+{
+	csbpt_key_t *ret;
+
+	ret = arena_alloc(&tree->arena, tree->keys_size);
+
+#ifdef CSBPT_DEBUG
+	tree->bytes_used += tree->keys_size;
+#endif
+
+	return ret;
+}
+
+/*!
+ *  Frees a node group of internal nodes
+ */
+static void free_internal_node_group(struct csbpt *tree, struct csbpt_internal_node *group)
+{
+	arena_free(&tree->arena, group, tree->max_children * sizeof(struct csbpt_internal_node));
+}
+
+/*!
+ *  Frees a node group of leaf nodes
+ */
+static void free_leaf_node_group(struct csbpt *tree, struct csbpt_leaf_group *group)
+{
+	arena_free(&tree->arena, group, tree->leaf_group_size);
+}
+
+/*!
+ *  Frees the key array of an internal node
+ */
+static void free_keys(struct csbpt *tree, csbpt_key_t *keys)
+{
+	arena_free(&tree->arena, keys, tree->keys_size);
+}
+
+/*!
+ *  Turns a pointer read from the tree into one which can be followed.  In a
+ *  tree read from a snapshot, pointers are offsets from the start of the
+ *  snapshot; see csbpt_save().
+ */
+static void *resolve(struct csbpt *tree, void *ptr)
+{
+	if(!tree->image || !ptr) {
+		return ptr;
+	}
+
+	return tree->image + (uintptr_t) ptr;
+}
+
+/*!
+ *  Returns the key array of a node, in a tree which may be read from a
+ *  snapshot
+ */
+static csbpt_key_t *node_keys(struct csbpt *tree, struct csbpt_internal_node *node)
+{
+	return (csbpt_key_t *) resolve(tree, node->keys);
+}
+
+/*!
+ *  Returns the children of a node, in a tree which may be read from a
+ *  snapshot
+ */
+static void *node_children(struct csbpt *tree, struct csbpt_internal_node *node)
+{
+	return resolve(tree, node->children);
+}
+
+/*!
+ *  Returns the address of an element in an interleaved leaf group, or in an
+ *  array of measure/value pairs
+ *
+ *  \param  group  Leaf group
+ *  \param  i      Index of the element
+ *
+ *  \return Address of the key/value pair
+ */
+static unsigned char *leaf_elem(struct csbpt_leaf_group *group, size_t i)
+{
+	return ((unsigned char *) group) + sizeof(struct csbpt_leaf_group) + i * CSBPT_ELEM_SIZE;
+}
+
+/*!
+ *  Returns the key array of a split leaf group
+ */
+static csbpt_key_t *leaf_keys(struct csbpt_leaf_group *group)
+{
+	return (csbpt_key_t *) (((unsigned char *) group) + sizeof(struct csbpt_leaf_group));
+}
+
+/*!
+ *  Returns the value array of a split leaf group
+ */
+static void **leaf_values(struct csbpt *tree, struct csbpt_leaf_group *group)
+{
+	return (void **) (((unsigned char *) group) + tree->leaf_values);
+}
+
+/*!
+ *  Returns the 8 bit deltas of a compressed leaf group
+ */
+static uint8_t *leaf_deltas8(struct csbpt_leaf_group *group)
+{
+	return (uint8_t *) leaf_keys(group);
+}
+
+/*!
+ *  Returns the 16 bit deltas of a compressed leaf group
+ */
+static uint16_t *leaf_deltas16(struct csbpt_leaf_group *group)
+{
+	return (uint16_t *) leaf_keys(group);
+}
+
+/*!
+ *  Returns the key of an element in a leaf group
+ */
+static csbpt_key_t leaf_key(struct csbpt *tree, struct csbpt_leaf_group *group, size_t i)
+{
+	if(tree->leaf_layout == CSBPT_LEAF_SPLIT) {
+		if(group->delta_bits == 8) {
+			return (csbpt_key_t) ((csbpt_key_bits_t) group->base + leaf_deltas8(group)[i]);
+		} else if(group->delta_bits == 16) {
+			return (csbpt_key_t) ((csbpt_key_bits_t) group->base + leaf_deltas16(group)[i]);
+		}
+
+		return leaf_keys(group)[i];
+	}
+
+	return *((csbpt_key_t *) leaf_elem(group, i));
+}
+
+/*!
+ *  Returns the value of an element in a leaf group.  Values are not aligned
+ *  within an interleaved group, so they are copied out rather than
+ *  dereferenced.
+ */
+static void *leaf_value(struct csbpt *tree, struct csbpt_leaf_group *group, size_t i)
+{
+	void *ret;
+
+	if(tree->leaf_layout == CSBPT_LEAF_SPLIT) {
+		return resolve(tree, leaf_values(tree, group)[i]);
+	}
+
+	memcpy(&ret, leaf_elem(group, i) + sizeof(csbpt_key_t), sizeof(void *));
+
+	return resolve(tree, ret);
+}
+
+/*!
+ *  Packs a key and value into an element
+ */
+static void make_elem(unsigned char *elem, csbpt_key_t key, void *value)
+{
+	*((csbpt_key_t *) elem) = key;
+	memcpy(elem + sizeof(csbpt_key_t), &value, sizeof(void *));
+}
+
+/*!
+ *  Stores the keys of a split leaf group as deltas from its first key, if
+ *  the tree compresses keys and they are close enough together.  Each delta
+ *  is written over the start of a key which has already been read.
+ */
+static void compress_leaf(struct csbpt *tree, struct csbpt_leaf_group *group)
+{
+	size_t              i;
+	size_t              n = group->num_elems;
+	csbpt_key_t        *keys = leaf_keys(group);
+	csbpt_key_t         base;
+	csbpt_key_bits_t    span;
+
+	if(!tree->compress_keys || group->delta_bits || n == 0) {
+		return;
+	}
+
+	base = keys[0];
+	span = (csbpt_key_bits_t) keys[n - 1] - (csbpt_key_bits_t) base;
+
+	if(span <= UINT8_MAX) {
+		for(i = 0; i < n; i++) {
+			leaf_deltas8(group)[i] = (uint8_t) ((csbpt_key_bits_t) keys[i] - (csbpt_key_bits_t) base);
+		}
+		group->delta_bits = 8;
+	} else if(span <= UINT16_MAX) {
+		for(i = 0; i < n; i++) {
+			leaf_deltas16(group)[i] = (uint16_t) ((csbpt_key_bits_t) keys[i] - (csbpt_key_bits_t) base);
+		}
+		group->delta_bits = 16;
+	} else {
+		return;
+	}
+
+	group->base = base;
+}
+
+/*!
+ *  Turns the compressed keys of a leaf group back into whole keys, ahead of
+ *  a change to the group.  Keys are written from the last one back, so no
+ *  delta is overwritten before it is read.
+ */
+static void expand_leaf(struct csbpt *tree, struct csbpt_leaf_group *group)
+{
+	size_t i;
+
+	if(!group->delta_bits) {
+		return;
+	}
+
+	for(i = group->num_elems; i > 0; i--) {
+		leaf_keys(group)[i - 1] = leaf_key(tree, group, i - 1);
+	}
+
+	group->delta_bits = 0;
+	group->base = 0;
+}
+
+/*!
+ *  Copies elements out of a leaf group as measure/value pairs
+ *
+ *  \param  tree   Tree the group belongs to
+ *  \param  group  Leaf group to read
+ *  \param  i      Index of the first element to copy
+ *  \param  elems  Destination for the pairs
+ *  \param  n      Number of elements to copy
+ */
+static void leaf_get_elems(struct csbpt *tree, struct csbpt_leaf_group *group, size_t i, unsigned char *elems, size_t n)
+{
+	size_t j;
+
+	if(tree->leaf_layout == CSBPT_LEAF_SPLIT) {
+		for(j = 0; j < n; j++) {
+			make_elem(elems + j * CSBPT_ELEM_SIZE, leaf_key(tree, group, i + j), leaf_values(tree, group)[i + j]);
+		}
+	} else {
+		memcpy(elems, leaf_elem(group, i), n * CSBPT_ELEM_SIZE);
+	}
+}
+
+/*!
+ *  Copies measure/value pairs into a leaf group, whose keys are expanded
+ *  first if they were compressed
+ *
+ *  \param  tree   Tree the group belongs to
+ *  \param  group  Leaf group to write
+ *  \param  i      Index of the first element to write
+ *  \param  elems  Pairs to copy
+ *  \param  n      Number of elements to copy
+ */
+static void leaf_put_elems(struct csbpt *tree, struct csbpt_leaf_group *group, size_t i, const unsigned char *elems, size_t n)
+{
+	size_t j;
+
+	if(tree->leaf_layout == CSBPT_LEAF_SPLIT) {
+		expand_leaf(tree, group);
+		for(j = 0; j < n; j++) {
+			leaf_keys(group)[i + j] = *((csbpt_key_t *) (elems + j * CSBPT_ELEM_SIZE));
+			memcpy(&leaf_values(tree, group)[i + j], elems + j * CSBPT_ELEM_SIZE + sizeof(csbpt_key_t), sizeof(void *));
+		}
+	} else {
+		memcpy(leaf_elem(group, i), elems, n * CSBPT_ELEM_SIZE);
+	}
+}
+
+/*!
+ *  Whether nodes directly above the leaves need key arrays of their own.
+ *  With split leaf groups they use the group's key array instead.
+ */
+static int bottom_keys_needed(struct csbpt *tree)
+{
+	return tree->leaf_layout != CSBPT_LEAF_SPLIT;
+}
+
+/*!
+ *  Brings the keys of a node directly above the leaves back in sync with its
+ *  leaf group.
+ */
+static void sync_bottom_keys(struct csbpt *tree, struct csbpt_internal_node *node)
+{
+	size_t i;
+	struct csbpt_leaf_group *leaf = (struct csbpt_leaf_group *) node->children;
+
+	node->num_keys = leaf->num_elems;
+
+	if(tree->leaf_layout == CSBPT_LEAF_SPLIT) {
+		node->keys = leaf_keys(leaf);
+		return;
+	}
+
+	for(i = 0; i < leaf->num_elems; i++) {
+		node->keys[i] = leaf_key(tree, leaf, i);
+	}
+}
+
+/*!
+ *  Stores a pointer which readers of a concurrent tree may be following.
+ *  Everything written before the store is visible to a reader which loads
+ *  the new pointer.
+ */
+static void publish_ptr(void **ptr, void *value)
+{
+	__atomic_store_n(ptr, value, __ATOMIC_RELEASE);
+}
+
+/*!
+ *  Returns the largest key under a node.  The node must not be empty.
+ *
+ *  \param  tree    Tree the node belongs to
+ *  \param  node    Node to look at
+ *  \param  bottom  Whether the node is directly above the leaves, whose
+ *                  keys may be compressed
+ */
+static csbpt_key_t node_max(struct csbpt *tree, struct csbpt_internal_node *node, int bottom)
+{
+	if(bottom && tree->leaf_layout == CSBPT_LEAF_SPLIT) {
+		return leaf_key(tree, (struct csbpt_leaf_group *) node->children, node->num_keys - 1);
+	}
+
+	return node->keys[node->num_keys - 1];
+}
+
+/*!
+ *  Returns the number of values under each child of a node.  Only valid in a
+ *  summarized tree, for nodes which are not directly above the leaves.
+ */
+static size_t *node_counts(struct csbpt *tree, struct csbpt_internal_node *node)
+{
+	return (size_t *) (((unsigned char *) node_keys(tree, node)) + tree->counts_offset);
+}
+
+/*!
+ *  Returns the summary of the values under each child of a node.  Only valid
+ *  in a summarized tree, for nodes which are not directly above the leaves.
+ */
+static long long *node_summaries(struct csbpt *tree, struct csbpt_internal_node *node)
+{
+	return (long long *) (((unsigned char *) node_keys(tree, node)) + tree->summaries_offset);
+}
+
+/*!
+ *  Combines two summaries
+ */
+static long long combine(struct csbpt *tree, long long left, long long right)
+{
+	if(!tree->combinator.combine) {
+		return tree->combinator.identity;
+	}
+
+	return tree->combinator.combine(tree->combinator.user_data, left, right);
+}
+
+/*!
+ *  Summarizes the values at the start of a leaf group
+ *
+ *  \param  tree   Tree the group belongs to
+ *  \param  leaf   Group to summarize
+ *  \param  n      Number of values to summarize
+ *
+ *  \return The combined summary of the values
+ */
+static long long summarize_leaf(struct csbpt *tree, struct csbpt_leaf_group *leaf, size_t n)
+{
+	size_t     i;
+	long long  ret = tree->combinator.identity;
+
+	if(!tree->combinator.summarize) {
+		return ret;
+	}
+
+	for(i = 0; i < n; i++) {
+		ret = combine(tree, ret, tree->combinator.summarize(tree->combinator.user_data, leaf_value(tree, leaf, i)));
+	}
+
+	return ret;
+}
+
+/*!
+ *  Computes the number of values under a node, and their summary
+ *
+ *  \param  tree     Summarized tree the node belongs to
+ *  \param  node     Node to summarize
+ *  \param  bottom   Whether the node is directly above the leaves
+ *  \param  count    Set to the number of values
+ *  \param  summary  Set to the summary of the values
+ */
+static void node_summary(struct csbpt *tree, struct csbpt_internal_node *node, int bottom,
+                         size_t *count, long long *summary)
+{
+	int i;
+
+	if(bottom) {
+		*count = ((struct csbpt_leaf_group *) node->children)->num_elems;
+		*summary = summarize_leaf(tree, (struct csbpt_leaf_group *) node->children, *count);
+		return;
+	}
+
+	*count = 0;
+	*summary = tree->combinator.identity;
+	for(i = 0; i < node->num_keys; i++) {
+		*count += node_counts(tree, node)[i];
+		*summary = combine(tree, *summary, node_summaries(tree, node)[i]);
+	}
+}
+
+/*!
+ *  Recomputes the keys of a node whose children are internal nodes.  Each key
+ *  is the largest key found under the corresponding child.  In a summarized
+ *  tree, the counts and summaries of the children are recomputed too.
+ *
+ *  \param  tree          Tree the node belongs to
+ *  \param  node          Node to refresh
+ *  \param  above_bottom  Whether the node's children are directly above the
+ *                        leaves
+ */
+static void refresh_keys(struct csbpt *tree, struct csbpt_internal_node *node, int above_bottom)
+{
+	int i;
+	struct csbpt_internal_node *group = (struct csbpt_internal_node *) node->children;
+
+	for(i = 0; i < node->num_keys; i++) {
+		node->keys[i] = node_max(tree, &group[i], above_bottom);
+
+		if(tree->summarized) {
+			node_summary(tree, &group[i], above_bottom, &node_counts(tree, node)[i], &node_summaries(tree, node)[i]);
+		}
+	}
+}
+
+/*
+ *  Key search kernels
+ *
+ *  Each kernel counts the keys in a sorted array which are less than a given
+ *  key, which is also the index of the first key not less than it.  The
+ *  vector kernels compare a whole register of keys at once and add up the
+ *  matches, so a search through a node costs a handful of instructions and
+ *  no unpredictable branches.  The kernel is picked by select_search() when
+ *  the tree is created, based on what the CPU supports.
+ */
+
+/*!
+ *  Finds the first key in a node which is not less than the given key
+ *
+ *  \param  keys      Sorted keys to search
+ *  \param  num_keys  Number of keys
+ *  \param  key       Key to search for
+ *
+ *  \return Index of the first key >= \c key, or \c num_keys if there is none
+ */
+static int search_keys_scalar(const csbpt_key_t *keys, int num_keys, csbpt_key_t key)
+{
+	int i;
+
+	for(i = 0; i < num_keys && keys[i] < key; i++);
+
+	return i;
+}
+
+#ifdef CSBPT_X86_SIMD
+
+#if CSBPT_KEY_BITS == 32
+
+/*!
+ *  SSE2 version of search_keys_scalar(); compares 4 keys at a time.  Keys past
+ *  the last full register are compared one at a time.
+ */
+__attribute__((target("sse2")))
+static int search_keys_sse2(const csbpt_key_t *keys, int num_keys, csbpt_key_t key)
+{
+	int      i;
+	int      count = 0;
+	__m128i  k = _mm_set1_epi32(key);
+	__m128i  less;
+
+	for(i = 0; i + 4 <= num_keys; i += 4) {
+		less = _mm_cmplt_epi32(_mm_loadu_si128((const __m128i *) (keys + i)), k);
+		count += __builtin_popcount(_mm_movemask_ps(_mm_castsi128_ps(less)));
+	}
+
+	for(; i < num_keys; i++) {
+		count += keys[i] < key;
+	}
+
+	return count;
+}
+
+/*!
+ *  Masks used to load the last, partial register of keys in
+ *  search_keys_avx2().  Loading at offset \c 8-n gives a mask of \c n lanes.
+ */
+static const int avx2_tail_masks[16] = { -1, -1, -1, -1, -1, -1, -1, -1, 0, 0, 0, 0, 0, 0, 0, 0 };
+
+/*!
+ *  AVX2 version of search_keys_scalar(); compares 8 keys at a time.  The last
+ *  partial register is loaded with a mask, so nothing past the end of the
+ *  keys is touched.
+ */
+__attribute__((target("avx2,popcnt")))
+static int search_keys_avx2(const csbpt_key_t *keys, int num_keys, csbpt_key_t key)
+{
+	int      i;
+	int      count = 0;
+	__m256i  k = _mm256_set1_epi32(key);
+	__m256i  mask;
+	__m256i  less;
+
+	for(i = 0; i + 8 <= num_keys; i += 8) {
+		less = _mm256_cmpgt_epi32(k, _mm256_loadu_si256((const __m256i *) (keys + i)));
+		count += __builtin_popcount(_mm256_movemask_ps(_mm256_castsi256_ps(less)));
+	}
+
+	if(i < num_keys) {
+		mask = _mm256_loadu_si256((const __m256i *) (avx2_tail_masks + 8 - (num_keys - i)));
+		less = _mm256_and_si256(mask, _mm256_cmpgt_epi32(k, _mm256_maskload_epi32(keys + i, mask)));
+		count += __builtin_popcount(_mm256_movemask_ps(_mm256_castsi256_ps(less)));
+	}
+
+	return count;
+}
+
+/*!
+ *  AVX-512 version of search_keys_scalar(); compares 16 keys at a time.  Nodes
+ *  of up to 16 keys take a single masked load and compare.
+ */
+__attribute__((target("avx512f,popcnt")))
+static int search_keys_avx512(const csbpt_key_t *keys, int num_keys, csbpt_key_t key)
+{
+	int        i;
+	int        count = 0;
+	__m512i    k = _mm512_set1_epi32(key);
+	__mmask16  mask;
+
+	for(i = 0; i < num_keys; i += 16) {
+		mask = num_keys - i >= 16 ? 0xffff : (__mmask16) ((1 << (num_keys - i)) - 1);
+		count += __builtin_popcount(_mm512_mask_cmplt_epi32_mask(mask, _mm512_maskz_loadu_epi32(mask, keys + i), k));
+	}
+
+	return count;
+}
+
+#else /* CSBPT_KEY_BITS == 64 */
+
+/*
+ *  SSE4.2 and AVX2 only compare signed 64-bit integers, so unsigned measures
+ *  have their top bit flipped on the way into a register, which orders them
+ *  the same way as signed ones.  AVX-512 has an unsigned compare.
+ */
+#if CSBPT_KEY_SIGNED
+#define SEARCH_BIAS_128(v)                  (v)
+#define SEARCH_BIAS_256(v)                  (v)
+#define SEARCH_CMPLT_512(mask, a, b)        _mm512_mask_cmplt_epi64_mask(mask, a, b)
+#else
+#define SEARCH_BIAS_128(v)                  _mm_xor_si128((v), _mm_set1_epi64x(LLONG_MIN))
+#define SEARCH_BIAS_256(v)                  _mm256_xor_si256((v), _mm256_set1_epi64x(LLONG_MIN))
+#define SEARCH_CMPLT_512(mask, a, b)        _mm512_mask_cmplt_epu64_mask(mask, a, b)
+#endif
+
+/*!
+ *  Vector version of search_keys_scalar() for the #CSBPT_SEARCH_SSE2 level;
+ *  compares 2 keys at a time.  SSE2 has no 64-bit compare, so this needs
+ *  SSE4.2.
+ */
+__attribute__((target("sse4.2,popcnt")))
+static int search_keys_sse2(const csbpt_key_t *keys, int num_keys, csbpt_key_t key)
+{
+	int      i;
+	int      count = 0;
+	__m128i  k = SEARCH_BIAS_128(_mm_set1_epi64x((long long) key));
+	__m128i  less;
+
+	for(i = 0; i + 2 <= num_keys; i += 2) {
+		less = _mm_cmpgt_epi64(k, SEARCH_BIAS_128(_mm_loadu_si128((const __m128i *) (keys + i))));
+		count += __builtin_popcount(_mm_movemask_pd(_mm_castsi128_pd(less)));
+	}
+
+	if(i < num_keys) {
+		count += keys[i] < key;
+	}
+
+	return count;
+}
+
+/*!
+ *  Masks used to load the last, partial register of keys in
+ *  search_keys_avx2().  Loading at offset \c 4-n gives a mask of \c n lanes.
+ */
+static const long long avx2_tail_masks[8] = { -1, -1, -1, -1, 0, 0, 0, 0 };
+
+/*!
+ *  AVX2 version of search_keys_scalar(); compares 4 keys at a time.  The last
+ *  partial register is loaded with a mask, so nothing past the end of the
+ *  keys is touched.
+ */
+__attribute__((target("avx2,popcnt")))
+static int search_keys_avx2(const csbpt_key_t *keys, int num_keys, csbpt_key_t key)
+{
+	int      i;
+	int      count = 0;
+	__m256i  k = SEARCH_BIAS_256(_mm256_set1_epi64x((long long) key));
+	__m256i  mask;
+	__m256i  less;
+
+	for(i = 0; i + 4 <= num_keys; i += 4) {
+		less = _mm256_cmpgt_epi64(k, SEARCH_BIAS_256(_mm256_loadu_si256((const __m256i *) (keys + i))));
+		count += __builtin_popcount(_mm256_movemask_pd(_mm256_castsi256_pd(less)));
+	}
+
+	if(i < num_keys) {
+		mask = _mm256_loadu_si256((const __m256i *) (avx2_tail_masks + 4 - (num_keys - i)));
+		less = _mm256_cmpgt_epi64(k, SEARCH_BIAS_256(_mm256_maskload_epi64((const long long *) (keys + i), mask)));
+		less = _mm256_and_si256(mask, less);
+		count += __builtin_popcount(_mm256_movemask_pd(_mm256_castsi256_pd(less)));
+	}
+
+	return count;
+}
+
+/*!
+ *  AVX-512 version of search_keys_scalar(); compares 8 keys at a time.
+ */
+__attribute__((target("avx512f,popcnt")))
+static int search_keys_avx512(const csbpt_key_t *keys, int num_keys, csbpt_key_t key)
+{
+	int        i;
+	int        count = 0;
+	__m512i    k = _mm512_set1_epi64((long long) key);
+	__mmask8   mask;
+
+	for(i = 0; i < num_keys; i += 8) {
+		mask = num_keys - i >= 8 ? 0xff : (__mmask8) ((1 << (num_keys - i)) - 1);
+		count += __builtin_popcount(SEARCH_CMPLT_512(mask, _mm512_maskz_loadu_epi64(mask, keys + i), k));
+	}
+
+	return count;
+}
+
+#endif /* CSBPT_KEY_BITS */
+
+#endif /* CSBPT_X86_SIMD */
+
+/*!
+ *  Picks the key search kernel for a tree.
+ *
+ *  \param  requested  Kernel asked for in the tree's tuning parameters
+ *
+ *  \return The requested kernel, or the fastest one the CPU supports if it
+ *          can't run the one requested
+ */
+static csbpt_search_fn *select_search(enum csbpt_search requested)
+{
+#ifdef CSBPT_X86_SIMD
+	__builtin_cpu_init();
+
+	if((requested == CSBPT_SEARCH_AUTO || requested == CSBPT_SEARCH_AVX512) && __builtin_cpu_supports("avx512f")) {
+		return search_keys_avx512;
+	}
+
+	if((requested == CSBPT_SEARCH_AUTO || requested >= CSBPT_SEARCH_AVX2) && __builtin_cpu_supports("avx2")) {
+		return search_keys_avx2;
+	}
+
+	if(requested != CSBPT_SEARCH_SCALAR && __builtin_cpu_supports(CSBPT_KEY_BITS == 32 ? "sse2" : "sse4.2")) {
+		return search_keys_sse2;
+	}
+#endif
+
+	return search_keys_scalar;
+}
+
+/*!
+ *  Finds the first key in a node which is not less than the given key, using
+ *  the tree's search kernel
+ *
+ *  \return Index of the first key >= \c key, or \c num_keys if there is none
+ */
+static int search_keys(struct csbpt *tree, const csbpt_key_t *keys, int num_keys, csbpt_key_t key)
+{
+	return tree->search(keys, num_keys, key);
+}
+
+/*!
+ *  Finds the first key in a node which is greater than the given key
+ *
+ *  \return Index of the first key > \c key, or \c num_keys if there is none
+ */
+static int search_keys_after(struct csbpt *tree, const csbpt_key_t *keys, int num_keys, csbpt_key_t key)
+{
+	if(key == CSBPT_KEY_MAX) {
+		return num_keys;
+	}
+
+	return tree->search(keys, num_keys, key + 1);
+}
+
+/*
+ *  Compressed key search
+ *
+ *  The deltas of a compressed leaf group are searched without decoding them:
+ *  the key is turned into a delta from the group's base instead.  Deltas are
+ *  unsigned, so the SSE2 kernels flip their top bits to compare them with
+ *  signed instructions.
+ */
+
+/*!
+ *  Counts the 8 bit deltas which are less than a given delta
+ */
+static int search_deltas8_scalar(const uint8_t *deltas, int num_keys, unsigned int delta)
+{
+	int i;
+
+	for(i = 0; i < num_keys && deltas[i] < delta; i++);
+
+	return i;
+}
+
+/*!
+ *  Counts the 16 bit deltas which are less than a given delta
+ */
+static int search_deltas16_scalar(const uint16_t *deltas, int num_keys, unsigned int delta)
+{
+	int i;
+
+	for(i = 0; i < num_keys && deltas[i] < delta; i++);
+
+	return i;
+}
+
+#ifdef CSBPT_X86_SIMD
+
+/*!
+ *  SSE2 version of search_deltas8_scalar(); compares 16 deltas at a time.
+ *  The last register may run past the deltas into the rest of the group,
+ *  which always holds the values after them, and its extra lanes are masked
+ *  off.
+ */
+__attribute__((target("sse2")))
+static int search_deltas8_sse2(const uint8_t *deltas, int num_keys, unsigned int delta)
+{
+	int           i;
+	int           count = 0;
+	unsigned int  mask;
+	__m128i       flip = _mm_set1_epi8((char) 0x80);
+	__m128i       d = _mm_xor_si128(_mm_set1_epi8((char) delta), flip);
+
+	for(i = 0; i < num_keys; i += 16) {
+		mask = _mm_movemask_epi8(_mm_cmplt_epi8(_mm_xor_si128(_mm_loadu_si128((const __m128i *) (deltas + i)), flip), d));
+		if(num_keys - i < 16) {
+			mask &= (1u << (num_keys - i)) - 1;
+		}
+		count += __builtin_popcount(mask);
+	}
+
+	return count;
+}
+
+/*!
+ *  SSE2 version of search_deltas16_scalar(); compares 8 deltas at a time,
+ *  with the last register treated as in search_deltas8_sse2().  Each lane
+ *  sets two bits of the mask.
+ */
+__attribute__((target("sse2")))
+static int search_deltas16_sse2(const uint16_t *deltas, int num_keys, unsigned int delta)
+{
+	int           i;
+	int           count = 0;
+	unsigned int  mask;
+	__m128i       flip = _mm_set1_epi16((short) 0x8000);
+	__m128i       d = _mm_xor_si128(_mm_set1_epi16((short) delta), flip);
+
+	for(i = 0; i < num_keys; i += 8) {
+		mask = _mm_movemask_epi8(_mm_cmplt_epi16(_mm_xor_si128(_mm_loadu_si128((const __m128i *) (deltas + i)), flip), d));
+		if(num_keys - i < 8) {
+			mask &= (1u << (2 * (num_keys - i))) - 1;
+		}
+		count += __builtin_popcount(mask);
+	}
+
+	return count / 2;
+}
+
+#endif /* CSBPT_X86_SIMD */
+
+/*!
+ *  Finds the first key in a compressed leaf group which is not less than the
+ *  given key.  The vector kernels are used unless the tree was asked to
+ *  search one key at a time.
+ *
+ *  \return Index of the first key >= \c key, or \c num_keys if there is none
+ */
+static int search_deltas(struct csbpt *tree, struct csbpt_leaf_group *group, int num_keys, csbpt_key_t key)
+{
+	csbpt_key_bits_t delta;
+
+	if(key <= group->base) {
+		return 0;
+	}
+
+	delta = (csbpt_key_bits_t) key - (csbpt_key_bits_t) group->base;
+	if(delta >= (csbpt_key_bits_t) 1 << group->delta_bits) {
+		return num_keys;
+	}
+
+#ifdef CSBPT_X86_SIMD
+	if(tree->search != search_keys_scalar) {
+		if(group->delta_bits == 8) {
+			return search_deltas8_sse2(leaf_deltas8(group), num_keys, (unsigned int) delta);
+		}
+		return search_deltas16_sse2(leaf_deltas16(group), num_keys, (unsigned int) delta);
+	}
+#endif
+
+	if(group->delta_bits == 8) {
+		return search_deltas8_scalar(leaf_deltas8(group), num_keys, (unsigned int) delta);
+	}
+	return search_deltas16_scalar(leaf_deltas16(group), num_keys, (unsigned int) delta);
+}
+
+/*!
+ *  Finds the first key under a node which is not less than the given key.
+ *  A node directly above a split leaf group shares the group's keys, which
+ *  may be compressed.
+ *
+ *  \param  tree    Tree the node belongs to; may be read from a snapshot
+ *  \param  node    Node to search
+ *  \param  bottom  Whether the node is directly above the leaves
+ *  \param  key     Key to search for
+ *
+ *  \return Index of the first key >= \c key, or \c num_keys if there is none
+ */
+static int search_node(struct csbpt *tree, struct csbpt_internal_node *node, int bottom, csbpt_key_t key)
+{
+	struct csbpt_leaf_group *leaf;
+
+	if(bottom && tree->compress_keys) {
+		leaf = (struct csbpt_leaf_group *) node_children(tree, node);
+		if(leaf->delta_bits) {
+			return search_deltas(tree, leaf, node->num_keys, key);
+		}
+	}
+
+	return search_keys(tree, node_keys(tree, node), node->num_keys, key);
+}
+
+/*!
+ *  Finds the first key under a node which is greater than the given key; see
+ *  search_node()
+ *
+ *  \return Index of the first key > \c key, or \c num_keys if there is none
+ */
+static int search_node_after(struct csbpt *tree, struct csbpt_internal_node *node, int bottom, csbpt_key_t key)
+{
+	if(key == CSBPT_KEY_MAX) {
+		return node->num_keys;
+	}
+
+	return search_node(tree, node, bottom, key + 1);
+}
+
+/*!
+ *  Moves a path to the next or previous node directly above the leaves
+ *
+ *  \param  tree  Tree the path is in
+ *  \param  path  Nodes from the root down to the parent of the current node
+ *  \param  idx   Index of the child taken below each node of \c path
+ *  \param  dir   1 to move right, -1 to move left
+ *
+ *  \return The new node, or NULL if the path was already at that end of the
+ *          tree, in which case the path is unchanged
+ */
+static struct csbpt_internal_node *step_bottom(struct csbpt *tree, struct csbpt_internal_node **path, int *idx, int dir)
+{
+	int                          level;
+	struct csbpt_internal_node  *node;
+
+	/* Climb to the lowest node with a child on that side */
+	for(level = tree->height - 2; level >= 0; level--) {
+		if(idx[level] + dir >= 0 && idx[level] + dir < path[level]->num_keys) {
+			break;
+		}
+	}
+
+	if(level < 0) {
+		return NULL;
+	}
+
+	idx[level] += dir;
+	node = &((struct csbpt_internal_node *) node_children(tree, path[level]))[idx[level]];
+
+	/* Then take the nearest child all the way down */
+	for(level++; level < tree->height - 1; level++) {
+		path[level] = node;
+		idx[level] = dir > 0 ? 0 : node->num_keys - 1;
+		node = &((struct csbpt_internal_node *) node_children(tree, node))[idx[level]];
+	}
+
+	return node;
+}
+
+/*!
+ *  Finds a neighbour of a leaf group in a version pinned by csbpt_snapshot().
+ *  The live tree's writer relinks the groups it shares with the version, so
+ *  the links may lead into later versions; the neighbour is found by
+ *  descending the pinned version instead.  Equal measures can span several
+ *  groups, so the groups after the first one which could hold \c group are
+ *  walked until it turns up.
+ *
+ *  \param  tree     Pinned version
+ *  \param  group    Leaf group of the version
+ *  \param  dir      1 for the group after \c group, -1 for the one before
+ *
+ *  \return The neighbour, or NULL if \c group is at that end of the tree
+ */
+static struct csbpt_leaf_group *pinned_neighbour(struct csbpt *tree, struct csbpt_leaf_group *group, int dir)
+{
+	int                          level;
+	int                          idx[CSBPT_MAX_HEIGHT];
+	struct csbpt_internal_node  *path[CSBPT_MAX_HEIGHT];
+	struct csbpt_internal_node  *node = tree->root;
+	struct csbpt_leaf_group     *before = NULL;
+	csbpt_key_t                  key;
+
+	/* Only the root's group of an empty tree has no elements */
+	if(tree->height < 2 || group->num_elems == 0) {
+		return NULL;
+	}
+
+	key = leaf_key(tree, group, 0);
+	for(level = 0; level < tree->height - 1; level++) {
+		path[level] = node;
+		idx[level] = search_node(tree, node, 0, key);
+		if(idx[level] == node->num_keys) {
+			idx[level]--;
+		}
+		node = &((struct csbpt_internal_node *) node_children(tree, node))[idx[level]];
+	}
+
+	while(node && node_children(tree, node) != group) {
+		before = (struct csbpt_leaf_group *) node_children(tree, node);
+		node = step_bottom(tree, path, idx, 1);
+	}
+
+	if(!node) {
+		return NULL;
+	}
+
+	if(dir < 0 && before) {
+		return before;
+	}
+
+	node = step_bottom(tree, path, idx, dir);
+
+	return node ? (struct csbpt_leaf_group *) node_children(tree, node) : NULL;
+}
+
+/*!
+ *  Returns the leaf group after a group.  Safe while a concurrent writer is
+ *  relinking the list.
+ */
+static struct csbpt_leaf_group *leaf_next(struct csbpt *tree, struct csbpt_leaf_group *group)
+{
+	if(tree->origin) {
+		return pinned_neighbour(tree, group, 1);
+	}
+
+	return resolve(tree, __atomic_load_n(&group->next, __ATOMIC_ACQUIRE));
+}
+
+/*!
+ *  Returns the leaf group before a group.  Safe while a concurrent writer is
+ *  relinking the list.
+ */
+static struct csbpt_leaf_group *leaf_prev(struct csbpt *tree, struct csbpt_leaf_group *group)
+{
+	if(tree->origin) {
+		return pinned_neighbour(tree, group, -1);
+	}
+
+	return resolve(tree, __atomic_load_n(&group->prev, __ATOMIC_ACQUIRE));
+}
+
+/*!
+ *  Inserts an element into an array, splitting the result across two arrays.
+ *
+ *  Conceptually, \c elem is inserted at \c pos in the \c total - 1 elements at
+ *  \c base; the first \c left elements of the result stay in \c base and the
+ *  rest are moved to \c new_base.  If \c left equals \c total, nothing is
+ *  moved.
+ *
+ *  \param  base       Existing elements
+ *  \param  new_base   Destination for the right part of the split
+ *  \param  elem_size  Size of each element
+ *  \param  total      Number of elements after the insertion
+ *  \param  left       Number of elements to keep in \c base
+ *  \param  pos        Insertion position
+ *  \param  elem       Element to insert
+ */
+static void split_insert(unsigned char *base, unsigned char *new_base, size_t elem_size,
+                         size_t total, size_t left, size_t pos, const void *elem)
+{
+	size_t i;
+
+	for(i = left; i < total; i++) {
+		if(i < pos) {
+			memcpy(new_base + (i - left) * elem_size, base + i * elem_size, elem_size);
+		} else if(i == pos) {
+			memcpy(new_base + (i - left) * elem_size, elem, elem_size);
+		} else {
+			memcpy(new_base + (i - left) * elem_size, base + (i - 1) * elem_size, elem_size);
+		}
+	}
+
+	if(pos < left) {
+		memmove(base + (pos + 1) * elem_size, base + pos * elem_size, (left - 1 - pos) * elem_size);
+		memcpy(base + pos * elem_size, elem, elem_size);
+	}
+}
+
+/*!
+ *  Inserts an element into a leaf group, splitting the result across two
+ *  groups.  See split_insert().
+ *
+ *  \param  tree       Tree the groups belong to
+ *  \param  group      Existing group
+ *  \param  new_group  Destination for the right part of the split; may be
+ *                     NULL if nothing is split off
+ *  \param  total      Number of elements after the insertion
+ *  \param  left       Number of elements to keep in \c group
+ *  \param  pos        Insertion position
+ *  \param  elem       Measure/value pair to insert
+ */
+static void leaf_split_insert(struct csbpt *tree, struct csbpt_leaf_group *group, struct csbpt_leaf_group *new_group,
+                              size_t total, size_t left, size_t pos, const unsigned char *elem)
+{
+	void *value;
+
+	if(tree->leaf_layout == CSBPT_LEAF_SPLIT) {
+		expand_leaf(tree, group);
+		memcpy(&value, elem + sizeof(csbpt_key_t), sizeof(void *));
+		split_insert((unsigned char *) leaf_keys(group), new_group ? (unsigned char *) leaf_keys(new_group) : NULL,
+		             sizeof(csbpt_key_t), total, left, pos, elem);
+		split_insert((unsigned char *) leaf_values(tree, group), new_group ? (unsigned char *) leaf_values(tree, new_group) : NULL,
+		             sizeof(void *), total, left, pos, &value);
+	} else {
+		split_insert(leaf_elem(group, 0), new_group ? leaf_elem(new_group, 0) : NULL,
+		             CSBPT_ELEM_SIZE, total, left, pos, elem);
+	}
+}
+
+/*!
+ *  Allocates memory for the given tree.  Calls itself recursively to allocate
+ *  lower levels.
+ *
+ *  \param  tree   Tree to allocate memory for
+ *  \param  root   Root of the current subtree being allocated
+ *  \param  height Height of the current subtree being allocated
+ *
+ *  \retval 0      Allocation succeeded
+ *  \retval other  Allocation failed
+ */
+static int alloc_tree(struct csbpt *tree, struct csbpt_internal_node *root, int height)
+{
+	int i;
+
+	if(height > 0 || (height == 0 && bottom_keys_needed(tree))) {
+		root->keys = alloc_keys(tree);
+
+		if(!root->keys) {
+			return 1;
+		}
+	}
+
+	if(height > 0) {
+		root->children = alloc_internal_node_group(tree);
+
+		if(!root->children) {
+			return 1;
+		}
+
+		for(i = 0; i < tree->max_children; i++) {
+			if(alloc_tree(tree, &((struct csbpt_internal_node *) root->children)[i], height - 1)) {
+				return 1;
+			}
+		}
+
+		return 0;
+	} else if(height == 0) {
+		root->children = alloc_leaf_node_group(tree);
+
+		if(!root->children) {
+			return 1;
+		}
+
+		sync_bottom_keys(tree, root);
+
+		return 0;
+	} else {
+		return 0;
+	}
+}
+
+/*
+ *  Sorting
+ *
+ *  Measured values are sorted stably, so that values with equal measures keep
+ *  the order they were given in.  This also makes the result independent of
+ *  how the sort is split between threads.
+ *
+ *  Most arrays are sorted with an LSD radix sort on the measures, one byte
+ *  per pass, with each thread counting and scattering a slice of the array.
+ *  Flipping the sign bit of each measure makes signed order match unsigned
+ *  byte order, and a pass is skipped when every measure has the same byte in
+ *  its position, which is common for measures from a narrow range.  Small
+ *  arrays, where the passes over 256 counters would dominate, are merge
+ *  sorted instead.
+ */
+
+/*!
+ *  Returns the measure of an element in a measure/value array
+ */
+static csbpt_key_t elem_key(const unsigned char *elems, size_t i)
+{
+	return *((const csbpt_key_t *) (elems + i * CSBPT_ELEM_SIZE));
+}
+
+/*!
+ *  Merges two sorted element arrays.  Elements of \c a go first when
+ *  measures are equal.
+ */
+static void merge_elems(const unsigned char *a, size_t na, const unsigned char *b, size_t nb, unsigned char *out)
+{
+	size_t i = 0;
+	size_t j = 0;
+
+	while(i < na && j < nb) {
+		if(elem_key(a, i) <= elem_key(b, j)) {
+			memcpy(out, a + i++ * CSBPT_ELEM_SIZE, CSBPT_ELEM_SIZE);
+		} else {
+			memcpy(out, b + j++ * CSBPT_ELEM_SIZE, CSBPT_ELEM_SIZE);
+		}
+		out += CSBPT_ELEM_SIZE;
+	}
+
+	memcpy(out, a + i * CSBPT_ELEM_SIZE, (na - i) * CSBPT_ELEM_SIZE);
+	memcpy(out + (na - i) * CSBPT_ELEM_SIZE, b + j * CSBPT_ELEM_SIZE, (nb - j) * CSBPT_ELEM_SIZE);
+}
+
+/*!
+ *  Sorts an element array on a single thread
+ *
+ *  \param  elems  Elements to sort
+ *  \param  tmp    Scratch space for as many elements
+ *  \param  count  Number of elements
+ */
+static void sort_run(unsigned char *elems, unsigned char *tmp, size_t count)
+{
+	size_t          i, j, k, n;
+	size_t          width;
+	unsigned char   elem[CSBPT_ELEM_SIZE];
+	unsigned char  *src = elems;
+	unsigned char  *dst = tmp;
+	unsigned char  *swap;
+
+	/* Insertion sort short runs, then merge them */
+	for(i = 0; i < count; i += 16) {
+		n = count - i < 16 ? count - i : 16;
+
+		for(j = i + 1; j < i + n; j++) {
+			memcpy(elem, elems + j * CSBPT_ELEM_SIZE, CSBPT_ELEM_SIZE);
+			for(k = j; k > i && elem_key(elems, k - 1) > elem_key(elem, 0); k--);
+			memmove(elems + (k + 1) * CSBPT_ELEM_SIZE, elems + k * CSBPT_ELEM_SIZE, (j - k) * CSBPT_ELEM_SIZE);
+			memcpy(elems + k * CSBPT_ELEM_SIZE, elem, CSBPT_ELEM_SIZE);
+		}
+	}
+
+	for(width = 16; width < count; width *= 2) {
+		for(i = 0; i < count; i += 2 * width) {
+			n = count - i < width ? count - i : width;
+			j = count - i - n < width ? count - i - n : width;
+			merge_elems(src + i * CSBPT_ELEM_SIZE, n, src + (i + n) * CSBPT_ELEM_SIZE, j, dst + i * CSBPT_ELEM_SIZE);
+		}
+
+		swap = src;
+		src = dst;
+		dst = swap;
+	}
+
+	if(src != elems) {
+		memcpy(elems, src, count * CSBPT_ELEM_SIZE);
+	}
+}
+
+/*!
+ *  \brief State shared by the threads of a radix sort
+ *
+ *  Each thread counts and scatters its own slice of the source array.  The
+ *  counts of slice \c s are turned into the offsets where that slice's
+ *  elements go, after those of every earlier slice, which keeps the sort
+ *  stable.
+ */
+struct radix_job {
+	unsigned char   *src;          /*!< Elements in their current order               */
+	unsigned char   *dst;          /*!< Where the next pass puts them                 */
+	size_t           count;        /*!< Number of elements                            */
+	size_t           num_slices;   /*!< Number of slices                              */
+	int              shift;        /*!< Position of the byte sorted by the next pass  */
+	size_t         (*counts)[CSBPT_KEY_BITS / 8][256];  /*!< Byte counts, then offsets, of each slice */
+};
+
+/*!
+ *  Returns an element's measure as an unsigned integer which sorts in the
+ *  same order, by flipping the sign bit of signed measures
+ */
+static csbpt_key_bits_t radix_key(const unsigned char *elems, size_t i)
+{
+	return ((csbpt_key_bits_t) elem_key(elems, i)) ^ CSBPT_KEY_SIGN_FLIP;
+}
+
+/*!
+ *  Returns a byte of an element's measure, as ordered by radix_key()
+ */
+static unsigned int radix_byte(const unsigned char *elems, size_t i, int shift)
+{
+	return (radix_key(elems, i) >> shift) & 0xff;
+}
+
+/*!
+ *  Returns the start of a slice of a radix sort
+ */
+static size_t radix_slice_start(struct radix_job *job, size_t slice)
+{
+	return job->count * slice / job->num_slices;
+}
+
+/*!
+ *  Counts every byte of the measures in a slice; see csbpt_slice_fn
+ */
+static void radix_count_all_slice(void *ctx, size_t begin, size_t end)
+{
+	int                byte;
+	size_t             i;
+	size_t             slice;
+	csbpt_key_bits_t   key;
+	struct radix_job  *job = (struct radix_job *) ctx;
+
+	for(slice = begin; slice < end; slice++) {
+		memset(job->counts[slice], 0, sizeof(job->counts[slice]));
+
+		for(i = radix_slice_start(job, slice); i < radix_slice_start(job, slice + 1); i++) {
+			key = radix_key(job->src, i);
+			for(byte = 0; byte < CSBPT_KEY_BITS / 8; byte++) {
+				job->counts[slice][byte][(key >> (8 * byte)) & 0xff]++;
+			}
+		}
+	}
+}
+
+/*!
+ *  Counts the byte sorted by the next pass in a slice; see csbpt_slice_fn
+ */
+static void radix_count_slice(void *ctx, size_t begin, size_t end)
+{
+	size_t             i;
+	size_t             slice;
+	struct radix_job  *job = (struct radix_job *) ctx;
+
+	for(slice = begin; slice < end; slice++) {
+		memset(job->counts[slice][job->shift / 8], 0, sizeof(job->counts[slice][0]));
+
+		for(i = radix_slice_start(job, slice); i < radix_slice_start(job, slice + 1); i++) {
+			job->counts[slice][job->shift / 8][radix_byte(job->src, i, job->shift)]++;
+		}
+	}
+}
+
+/*!
+ *  Moves the elements of a slice to their place in the next order; see
+ *  csbpt_slice_fn
+ */
+static void radix_scatter_slice(void *ctx, size_t begin, size_t end)
+{
+	size_t             i;
+	size_t             slice;
+	size_t            *offsets;
+	struct radix_job  *job = (struct radix_job *) ctx;
+
+	for(slice = begin; slice < end; slice++) {
+		offsets = job->counts[slice][job->shift / 8];
+
+		for(i = radix_slice_start(job, slice); i < radix_slice_start(job, slice + 1); i++) {
+			memcpy(job->dst + offsets[radix_byte(job->src, i, job->shift)]++ * CSBPT_ELEM_SIZE,
+			       job->src + i * CSBPT_ELEM_SIZE, CSBPT_ELEM_SIZE);
+		}
+	}
+}
+
+/*!
+ *  Sorts an element array by measure with an LSD radix sort
+ *
+ *  \param  tree   Tree whose thread count to use
+ *  \param  elems  Elements to sort
+ *  \param  tmp    Scratch space for as many elements
+ *  \param  count  Number of elements
+ *
+ *  \retval 0      Sorting succeeded
+ *  \retval other  Sorting failed
+ */
+static int radix_sort(struct csbpt *tree, unsigned char *elems, unsigned char *tmp, size_t count)
+{
+	int               byte;
+	int               counted = 1;
+	size_t            b;
+	size_t            slice;
+	size_t            total;
+	size_t            offset;
+	unsigned char    *swap;
+	struct radix_job  job;
+
+	job.src = elems;
+	job.dst = tmp;
+	job.count = count;
+	job.num_slices = count / CSBPT_PARALLEL_MIN;
+	if(job.num_slices > tree->threads) {
+		job.num_slices = tree->threads;
+	}
+	if(job.num_slices < 1) {
+		job.num_slices = 1;
+	}
+
+	job.counts = malloc(job.num_slices * sizeof(*job.counts));
+
+	if(!job.counts) {
+		errno = ENOMEM;
+		return 1;
+	}
+
+	parallel_for(tree, job.num_slices, 1, radix_count_all_slice, &job);
+
+	for(byte = 0; byte < CSBPT_KEY_BITS / 8; byte++) {
+		job.shift = 8 * byte;
+
+		/* After the first pass moves elements between slices, each slice's
+		 * counts have to be taken again */
+		if(!counted) {
+			parallel_for(tree, job.num_slices, 1, radix_count_slice, &job);
+		}
+
+		for(b = 0, total = 0; b < 256 && total == 0; b++) {
+			for(slice = 0; slice < job.num_slices; slice++) {
+				total += job.counts[slice][byte][b];
+			}
+		}
+
+		if(total == count) {
+			continue;
+		}
+
+		for(b = 0, offset = 0; b < 256; b++) {
+			for(slice = 0; slice < job.num_slices; slice++) {
+				total = job.counts[slice][byte][b];
+				job.counts[slice][byte][b] = offset;
+				offset += total;
+			}
+		}
+
+		parallel_for(tree, job.num_slices, 1, radix_scatter_slice, &job);
+
+		swap = job.src;
+		job.src = job.dst;
+		job.dst = swap;
+		counted = job.num_slices == 1;
+	}
+
+	if(job.src != elems) {
+		memcpy(elems, job.src, count * CSBPT_ELEM_SIZE);
+	}
+
+	free(job.counts);
+
+	return 0;
+}
+
+/*!
+ *  Sorts an element array by measure, keeping elements with equal measures
+ *  in their original order
+ *
+ *  \param  tree   Tree whose thread count to use
+ *  \param  elems  Elements to sort
+ *  \param  count  Number of elements
+ *
+ *  \retval 0      Sorting succeeded
+ *  \retval other  Sorting failed
+ */
+static int sort_elems(struct csbpt *tree, unsigned char *elems, size_t count)
+{
+	int             failed = 0;
+	unsigned char  *tmp;
+
+	tmp = malloc(count * CSBPT_ELEM_SIZE);
+
+	if(!tmp) {
+		errno = ENOMEM;
+		return 1;
+	}
+
+	if(count >= CSBPT_RADIX_MIN) {
+		failed = radix_sort(tree, elems, tmp, count);
+	} else {
+		sort_run(elems, tmp, count);
+	}
+
+	free(tmp);
+
+	return failed;
+}
+
+/*!
+ *  \brief Values being measured by measure_values()
+ */
+struct measure_job {
+	struct csbpt    *tree;        /*!< Tree the values are destined for  */
+	unsigned char   *values;      /*!< Values to measure                 */
+	size_t           elem_size;   /*!< Size of each value                */
+	unsigned char   *elems;       /*!< Measure/value pairs               */
+};
+
+/*!
+ *  Measures a slice of the values; see csbpt_slice_fn
+ */
+static void measure_slice(void *ctx, size_t begin, size_t end)
+{
+	size_t               i;
+	struct measure_job  *job = (struct measure_job *) ctx;
+
+	for(i = begin; i < end; i++) {
+		make_elem(job->elems + i * CSBPT_ELEM_SIZE, job->tree->measure(job->values + i * job->elem_size), job->values + i * job->elem_size);
+	}
+}
+
+/*!
+ *  Measures a set of values, and sorts them by measure.
+ *
+ *  \param  tree       Tree the values are destined for
+ *  \param  values     Values to measure
+ *  \param  count      Number of values
+ *  \param  elem_size  Size of each value
+ *
+ *  \retval NULL       If an error occurred
+ *  \retval other      An array of \c count measure/value pairs, in the same
+ *                     format as leaf group elements.  The caller must free it.
+ */
+static unsigned char *measure_values(struct csbpt *tree, void *values, size_t count, size_t elem_size)
+{
+	unsigned char       *elems;
+	struct measure_job   job;
+#ifdef CSBPT_DEBUG
+	size_t               i;
+	void                *value;
+#endif
+
+	/* Create list of measure-elem pairs */
+	elems = malloc(count * CSBPT_ELEM_SIZE);
+
+	if(!elems) {
+		errno = ENOMEM;
+		return NULL;
+	}
+
+	job.tree = tree;
+	job.values = (unsigned char *) values;
+	job.elem_size = elem_size;
+	job.elems = elems;
+	parallel_for(tree, count, CSBPT_PARALLEL_MIN, measure_slice, &job);
+
+	if(sort_elems(tree, elems, count)) {
+		free(elems);
+		return NULL;
+	}
+
+#ifdef CSBPT_DEBUG
+	fprintf(stderr, "Sorted measurements: [");
+	for(i = 0; i < count; i++) {
+		memcpy(&value, elems + i * CSBPT_ELEM_SIZE + sizeof(csbpt_key_t), sizeof(void *));
+		fprintf(stderr, "%" CSBPT_KEY_FORMAT ":%p%s", elem_key(elems, i), value, i == count - 1 ? "]\n" : ", ");
+	}
+#endif
+
+	return elems;
+}
+
+/*!
+ *  Pairs up values with measures given by the caller, and sorts them by
+ *  measure.
+ *
+ *  \param  tree      Tree the values are destined for
+ *  \param  measures  Measure of each value
+ *  \param  values    Values
+ *  \param  count     Number of values
+ *
+ *  \retval NULL      If an error occurred
+ *  \retval other     An array of \c count measure/value pairs, as returned by
+ *                    measure_values().  The caller must free it.
+ */
+static unsigned char *pair_values(struct csbpt *tree, const csbpt_key_t *measures, void *const *values, size_t count)
+{
+	size_t          i;
+	unsigned char  *elems;
+
+	elems = malloc(count * CSBPT_ELEM_SIZE);
+
+	if(!elems) {
+		errno = ENOMEM;
+		return NULL;
+	}
+
+	for(i = 0; i < count; i++) {
+		make_elem(elems + i * CSBPT_ELEM_SIZE, measures[i], values[i]);
+	}
+
+	if(sort_elems(tree, elems, count)) {
+		free(elems);
+		return NULL;
+	}
+
+	return elems;
+}
+
+/*!
+ *  Returns how many groups are needed to hold the given number of children
+ */
+static size_t groups_needed(struct csbpt *tree, size_t count)
+{
+	return count <= tree->max_children ? 1 : (count + tree->max_children - 1) / tree->max_children;
+}
+
+/*
+ *  Bulk loading
+ *
+ *  A bulk load builds the tree bottom up from the sorted values.  The size
+ *  of every row is worked out first, from the number of values alone, using
+ *  integer arithmetic only.  Each row's node groups and key arrays, and all
+ *  of the leaf groups, are then taken from the arena in one allocation each,
+ *  and filled in parallel.
+ *
+ *  The entries of each row are spread as evenly as they go over as many
+ *  groups as it takes to fill them to the tree's fill factor, so every group
+ *  except the root's holds between min_children and max_children of them,
+ *  and there are no empty groups to pad the rows out.  A row which fits in
+ *  one group is kept in one, since splitting it would only add a level.
+ *  The groups of a row are laid out one after another at the stride the
+ *  arena rounds their size up to, so each one can later be freed and
+ *  reused on its own.
+ */
+
+/*!
+ *  Returns where a share of \c n items starts, when they are split into
+ *  \c parts shares as evenly as they go, with the larger shares first
+ */
+static size_t share_start(size_t n, size_t parts, size_t part)
+{
+	return part * (n / parts) + (part < n % parts ? part : n % parts);
+}
+
+/*!
+ *  Finds which share of \c n items split as by share_start() holds an item
+ *
+ *  \param  n       Number of items
+ *  \param  parts   Number of shares; at most \c n
+ *  \param  i       Index of the item
+ *  \param  offset  Set to the index of the item within its share
+ *
+ *  \return The index of the share
+ */
+static size_t share_of(size_t n, size_t parts, size_t i, size_t *offset)
+{
+	size_t small = n / parts;
+	size_t large = n % parts;
+	size_t part;
+
+	if(i < large * (small + 1)) {
+		part = i / (small + 1);
+	} else {
+		part = large + (i - large * (small + 1)) / small;
+	}
+
+	*offset = i - share_start(n, parts, part);
+
+	return part;
+}
+
+/*!
+ *  Works out how many groups a bulk load spreads a row's entries over
+ *
+ *  \param  tree       Tree being loaded
+ *  \param  count      Number of entries
+ *  \param  per_group  Entries to aim for in each group; between
+ *                     min_children and max_children
+ *
+ *  \return The number of groups
+ */
+static size_t bulk_groups(struct csbpt *tree, size_t count, size_t per_group)
+{
+	size_t  groups = (count + per_group - 1) / per_group;
+
+	if(count <= tree->max_children) {
+		return 1;
+	}
+
+	/* Rounding up may leave groups short of min_children */
+	return groups < count / tree->min_children ? groups : count / tree->min_children;
+}
+
+/*!
+ *  Works out how many leaf groups a bulk load spreads its values over: as
+ *  few as hold them at \c per_group values each, or, to make the tree at
+ *  least \c min_height tall, as many as that takes while each keeps
+ *  \c min_children values.
+ *
+ *  \param  tree        Tree being loaded
+ *  \param  count       Number of values
+ *  \param  per_group   Values to aim for in each leaf group
+ *  \param  min_height  Height the tree should reach; see
+ *                      csbpt_tune.initial_height
+ *
+ *  \return The number of leaf groups
+ */
+static size_t bulk_leaf_groups(struct csbpt *tree, size_t count, size_t per_group, int min_height)
+{
+	int     height;
+	size_t  needed = bulk_groups(tree, count, per_group);
+	size_t  most = count / tree->min_children;
+	size_t  tall = 1;
+
+	/* A tree of height h > 1 has more than max_children^(h - 2) leaf groups */
+	for(height = 2; height < min_height && tall <= most; height++) {
+		tall *= tree->max_children;
+	}
+	if(min_height > 1) {
+		tall++;
+	}
+
+	if(tall > most) {
+		tall = most;
+	}
+
+	return needed > tall ? needed : (tall > 1 ? tall : 1);
+}
+
+/*!
+ *  \brief A row of a tree being bulk loaded
+ */
+struct bulk_row {
+	size_t                       num_nodes;  /*!< Nodes in the row                                 */
+	unsigned char               *groups;     /*!< The row's node groups, one after another         */
+	unsigned char               *keys;       /*!< The nodes' key arrays, in order; NULL if none    */
+};
+
+/*!
+ *  \brief A tree being bulk loaded
+ */
+struct bulk_load {
+	struct csbpt                *tree;                        /*!< Tree being loaded                             */
+	unsigned char               *elems;                       /*!< Sorted measure/value pairs                    */
+	size_t                       count;                       /*!< Number of pairs                               */
+	unsigned char               *leaves;                      /*!< Leaf groups, in order                         */
+	size_t                       num_leaf_groups;             /*!< Number of leaf groups                         */
+	size_t                       leaf_stride;                 /*!< Distance between leaf groups                  */
+	size_t                       group_stride;                /*!< Distance between node groups                  */
+	size_t                       keys_stride;                 /*!< Distance between key arrays                   */
+	size_t                       per_group;                   /*!< Entries to aim for in each group              */
+	int                          height;                      /*!< Height of the tree                            */
+	int                          level;                       /*!< Row being filled                              */
+	struct bulk_row              rows[CSBPT_MAX_HEIGHT];      /*!< Rows of nodes; row 0 holds the root           */
+};
+
+/*!
+ *  Finds a node of a row being bulk loaded
+ */
+static struct csbpt_internal_node *bulk_node(struct bulk_load *b, int level, size_t i)
+{
+	size_t  group;
+	size_t  offset;
+
+	if(level == 0) {
+		return (struct csbpt_internal_node *) b->rows[0].groups;
+	}
+
+	group = share_of(b->rows[level].num_nodes, b->rows[level - 1].num_nodes, i, &offset);
+
+	return (struct csbpt_internal_node *) (b->rows[level].groups + group * b->group_stride) + offset;
+}
+
+/*!
+ *  Returns a leaf group of a tree being bulk loaded
+ */
+static struct csbpt_leaf_group *bulk_leaf(struct bulk_load *b, size_t i)
+{
+	return (struct csbpt_leaf_group *) (b->leaves + i * b->leaf_stride);
+}
+
+/*!
+ *  Fills in a slice of the row being bulk loaded; see csbpt_slice_fn.  The
+ *  row below must be complete.
+ */
+static void bulk_fill_slice(void *ctx, size_t begin, size_t end)
+{
+	size_t                       i;
+	size_t                       first;
+	struct bulk_load            *b = (struct bulk_load *) ctx;
+	struct csbpt                *tree = b->tree;
+	struct bulk_row             *row = &b->rows[b->level];
+	struct bulk_row             *below = &b->rows[b->level + 1];
+	struct csbpt_internal_node  *node;
+	struct csbpt_leaf_group     *leaf;
+
+	for(i = begin; i < end; i++) {
+		node = bulk_node(b, b->level, i);
+		node->keys = row->keys ? (csbpt_key_t *) (row->keys + i * b->keys_stride) : NULL;
+
+		/* Each node above the leaves has a leaf group of its own */
+		if(b->level == b->height - 1) {
+			leaf = bulk_leaf(b, i);
+			first = share_start(b->count, b->num_leaf_groups, i);
+			leaf->num_elems = share_start(b->count, b->num_leaf_groups, i + 1) - first;
+			leaf->prev = i > 0 ? bulk_leaf(b, i - 1) : NULL;
+			leaf->next = i + 1 < b->num_leaf_groups ? bulk_leaf(b, i + 1) : NULL;
+
+			leaf_put_elems(tree, leaf, 0, b->elems + first * CSBPT_ELEM_SIZE, leaf->num_elems);
+			compress_leaf(tree, leaf);
+
+			node->children = leaf;
+			sync_bottom_keys(tree, node);
+			continue;
+		}
+
+		node->children = below->groups + i * b->group_stride;
+		node->num_keys = share_start(below->num_nodes, row->num_nodes, i + 1) - share_start(below->num_nodes, row->num_nodes, i);
+		refresh_keys(tree, node, b->level + 1 == b->height - 1);
+	}
+}
+
+/*!
+ *  Bulk loads the provided data into a tree
+ *
+ *  \param  tree        Tree to load
+ *  \param  values      Values to load into the tree
+ *  \param  count       Number of values to load
+ *  \param  elem_size   Distance between values
+ *  \param  min_height  Height the tree should reach if it can; see
+ *                      csbpt_tune.initial_height
+ *  \param  fill        Percentage of each group to fill; see
+ *                      csbpt_tune.fill_factor
+ *
+ *  \retval 0      Loading succeeded
+ *  \retval other  Loading failed
+ */
+static int bulk_load_tree(struct csbpt *tree, void *values, size_t count, size_t elem_size, int min_height, int fill)
+{
+	int                          level;
+	size_t                       n;
+	size_t                       sizes[CSBPT_MAX_HEIGHT];
+	size_t                       group_size = tree->max_children * sizeof(struct csbpt_internal_node);
+	struct bulk_load             b;
+
+	memset(&b, 0, sizeof(b));
+	b.tree = tree;
+	b.count = count;
+	b.per_group = fill > 0 ? (tree->max_children * fill + 50) / 100 : tree->max_children;
+	if(b.per_group < tree->min_children) {
+		b.per_group = tree->min_children;
+	}
+	if(b.per_group < 2) {
+		b.per_group = 2;
+	}
+	b.num_leaf_groups = bulk_leaf_groups(tree, count, b.per_group, min_height);
+	b.leaf_stride = arena_round(&tree->arena, tree->leaf_group_size);
+	b.group_stride = arena_round(&tree->arena, group_size);
+	b.keys_stride = arena_round(&tree->arena, tree->keys_size);
+
+	/* Size every row from the bottom up, ending with the root */
+	for(n = b.num_leaf_groups; b.height == 0 || sizes[b.height - 1] > 1; n = bulk_groups(tree, n, b.per_group)) {
+		if(b.height == CSBPT_MAX_HEIGHT) {
+			errno = EOVERFLOW;
+			return 1;
+		}
+		sizes[b.height++] = n;
+	}
+
+#ifdef CSBPT_DEBUG
+	fprintf(stderr, "Bulk loading %d values into %d leaf groups of about %d under a tree of height %d and order %d\n",
+	        (int) count, (int) b.num_leaf_groups, (int) b.per_group, b.height, (int) tree->min_children);
+#endif
+
+	/* The arena is not thread-safe, so memory is allocated up front */
+	b.leaves = arena_alloc(&tree->arena, b.num_leaf_groups * b.leaf_stride);
+	if(!b.leaves) {
+		return 1;
+	}
+
+	for(level = 0; level < b.height; level++) {
+		b.rows[level].num_nodes = sizes[b.height - 1 - level];
+
+		/* The root is a node of its own; each other row is spread over
+		 * the node groups of the row above */
+		if(level == 0) {
+			b.rows[level].groups = arena_alloc(&tree->arena, sizeof(struct csbpt_internal_node));
+		} else {
+			b.rows[level].groups = arena_alloc(&tree->arena, b.rows[level - 1].num_nodes * b.group_stride);
+		}
+
+		if(level < b.height - 1 || bottom_keys_needed(tree)) {
+			b.rows[level].keys = arena_alloc(&tree->arena, b.rows[level].num_nodes * b.keys_stride);
+			if(!b.rows[level].keys) {
+				return 1;
+			}
+		}
+
+		if(!b.rows[level].groups) {
+			return 1;
+		}
+	}
+
+#ifdef CSBPT_DEBUG
+	tree->bytes_used += b.num_leaf_groups * tree->leaf_group_size;
+	for(level = 0; level < b.height; level++) {
+		tree->bytes_used += (level > 0 ? b.rows[level - 1].num_nodes * group_size : sizeof(struct csbpt_internal_node)) +
+		                    (b.rows[level].keys ? b.rows[level].num_nodes * tree->keys_size : 0);
+	}
+#endif
+
+	b.elems = measure_values(tree, values, count, elem_size);
+	if(!b.elems) {
+		return 1;
+	}
+
+	for(b.level = b.height - 1; b.level >= 0; b.level--) {
+		parallel_for(tree, b.rows[b.level].num_nodes, CSBPT_PARALLEL_MIN / tree->max_children + 1, bulk_fill_slice, &b);
+	}
+
+	free(b.elems);
+
+	tree->root = (struct csbpt_internal_node *) b.rows[0].groups;
+	tree->height = b.height;
+
+	return 0;
+}
+
+/*!
+ *  Decides how a full group is split when an element is added to it.
+ *
+ *  The half which receives the new element is given the smaller share, so
+ *  that runs of inserts at one end of the tree (see csbpt_push_left() and
+ *  csbpt_push_right()) leave room behind them instead of splitting all the way
+ *  up to the root each time.
+ *
+ *  \param  tree  Tree being split
+ *  \param  pos   Position of the new element in the full group
+ *
+ *  \return Number of elements to keep in the left half
+ */
+static int split_point(struct csbpt *tree, int pos)
+{
+	int total = tree->max_children + 1;
+	int small = total / 2;
+
+	return pos < total - small ? small : total - small;
+}
+
+/*!
+ *  \brief Where a value is placed by insert_value()
+ */
+enum insert_mode {
+	INSERT_SORTED,   /*!< By measure                            */
+	INSERT_LEFT,     /*!< Before every other value in the tree  */
+	INSERT_RIGHT     /*!< After every other value in the tree   */
+};
+
+/*!
+ *  Picks the child of an internal node a new value is inserted under
+ *
+ *  \param  tree   Tree being inserted into
+ *  \param  node   Node to descend from
+ *  \param  key    Measure of the value
+ *  \param  mode   Where the value is being put
+ *
+ *  \return Index of the child
+ */
+static int insert_child(struct csbpt *tree, struct csbpt_internal_node *node, csbpt_key_t key, enum insert_mode mode)
+{
+	int ret;
+
+	if(mode == INSERT_LEFT) {
+		return 0;
+	} else if(mode == INSERT_RIGHT) {
+		return node->num_keys - 1;
+	}
+
+	ret = search_keys_after(tree, node->keys, node->num_keys, key);
+	if(ret == node->num_keys) {
+		ret--;
+	}
+
+	return ret;
+}
+
+/*!
+ *  Inserts a single value into a tree.
+ *
+ *  The value is added to the leaf group at the end of the search path.  If
+ *  that group is full, it is split in two and a node for the new group is
+ *  inserted next to its sibling in the parent's node group.  A full node group
+ *  is split the same way, all the way up to the root; when the root itself
+ *  splits, a new root is added and the tree grows by a level.
+ *
+ *  Every node group and key array needed by the splits is allocated before
+ *  the tree is touched, so a failed insert leaves the tree unchanged.
+ *
+ *  \param  tree   Tree to insert into
+ *  \param  key    Measure of the value
+ *  \param  value  Value to insert
+ *  \param  mode   Where to put the value
+ *
+ *  \retval 0      Insertion succeeded
+ *  \retval other  Insertion failed
+ */
+static int insert_value(struct csbpt *tree, csbpt_key_t key, void *value, enum insert_mode mode)
+{
+	int                          level;
+	int                          num_splits;
+	int                          failed;
+	int                          pos;
+	int                          left;
+	int                          idx[CSBPT_MAX_HEIGHT];
+	struct csbpt_internal_node  *path[CSBPT_MAX_HEIGHT];
+	struct csbpt_internal_node  *node;
+	struct csbpt_internal_node  *group;
+	struct csbpt_internal_node   sibling;
+	struct csbpt_internal_node   new_sibling;
+	struct csbpt_leaf_group     *leaf;
+	struct csbpt_leaf_group     *new_leaf = NULL;
+	struct csbpt_internal_node  *spare_groups[CSBPT_MAX_HEIGHT + 1];
+	csbpt_key_t                 *spare_keys[CSBPT_MAX_HEIGHT + 1];
+	unsigned char                elem[CSBPT_ELEM_SIZE];
+
+	/* Find the path down to the node above the target leaf group */
+	node = tree->root;
+	for(level = 0; level < tree->height - 1; level++) {
+		path[level] = node;
+		idx[level] = insert_child(tree, node, key, mode);
+		node = &((struct csbpt_internal_node *) node->children)[idx[level]];
+	}
+	path[level] = node;
+	leaf = (struct csbpt_leaf_group *) node->children;
+
+	/* The group is about to change, so its keys are searched whole */
+	expand_leaf(tree, leaf);
+
+	if(mode == INSERT_LEFT) {
+		if(node->num_keys > 0 && key > node->keys[0]) {
+			errno = EINVAL;
+			return 1;
+		}
+		pos = 0;
+	} else if(mode == INSERT_RIGHT) {
+		if(node->num_keys > 0 && key < node_max(tree, node, 1)) {
+			errno = EINVAL;
+			return 1;
+		}
+		pos = node->num_keys;
+	} else {
+		pos = search_keys_after(tree, node->keys, node->num_keys, key);
+	}
+
+	/* Count the splits, and allocate everything they need up front */
+	num_splits = 0;
+	if(leaf->num_elems == tree->max_children) {
+		num_splits = 1;
+		for(level = tree->height - 2; level >= 0 && path[level]->num_keys == tree->max_children; level--) {
+			num_splits++;
+		}
+	}
+
+	if(num_splits == tree->height && tree->height == CSBPT_MAX_HEIGHT) {
+		errno = EOVERFLOW;
+		return 1;
+	}
+
+	failed = 0;
+	for(level = 0; level < num_splits; level++) {
+		spare_groups[level] = NULL;
+		spare_keys[level] = NULL;
+		if(level > 0 || bottom_keys_needed(tree)) {
+			spare_keys[level] = alloc_keys(tree);
+		}
+		if(level > 0) {
+			spare_groups[level] = alloc_internal_node_group(tree);
+		}
+
+		if((!spare_keys[level] && (level > 0 || bottom_keys_needed(tree))) || (level > 0 && !spare_groups[level])) {
+			failed = 1;
+		}
+	}
+
+	spare_groups[num_splits] = NULL;
+	spare_keys[num_splits] = NULL;
+	if(num_splits == tree->height) {
+		spare_groups[num_splits] = alloc_internal_node_group(tree);
+		spare_keys[num_splits] = alloc_keys(tree);
+
+		if(!spare_groups[num_splits] || !spare_keys[num_splits]) {
+			failed = 1;
+		}
+	}
+
+	if(num_splits > 0) {
+		new_leaf = alloc_leaf_node_group(tree);
+
+		if(!new_leaf) {
+			failed = 1;
+		}
+	}
+
+	if(failed) {
+		for(level = 0; level <= num_splits; level++) {
+			free_internal_node_group(tree, spare_groups[level]);
+			free_keys(tree, spare_keys[level]);
+		}
+		free_leaf_node_group(tree, new_leaf);
+		errno = ENOMEM;
+		return 1;
+	}
+
+	STATS_COUNT(tree, splits, num_splits);
+
+	/* Put the value in its leaf group */
+	make_elem(elem, key, value);
+	node = path[tree->height - 1];
+
+	if(num_splits == 0) {
+		leaf_split_insert(tree, leaf, NULL, leaf->num_elems + 1, leaf->num_elems + 1, pos, elem);
+		leaf->num_elems++;
+		sync_bottom_keys(tree, node);
+	} else {
+#ifdef CSBPT_DEBUG
+		fprintf(stderr, "Splitting leaf group %p\n", (void *) leaf);
+#endif
+		left = split_point(tree, pos);
+		leaf_split_insert(tree, leaf, new_leaf, tree->max_children + 1, left, pos, elem);
+		leaf->num_elems = left;
+		new_leaf->num_elems = tree->max_children + 1 - left;
+
+		new_leaf->prev = leaf;
+		new_leaf->next = leaf->next;
+		if(leaf->next) {
+			publish_ptr((void **) &leaf->next->prev, new_leaf);
+		}
+		leaf->next = new_leaf;
+
+		sibling.children = new_leaf;
+		sibling.keys = spare_keys[0];
+		sync_bottom_keys(tree, node);
+		sync_bottom_keys(tree, &sibling);
+	}
+
+	/* Walk back up, adding the new siblings created by each split */
+	for(level = tree->height - 2; level >= 0; level--) {
+		node = path[level];
+		group = (struct csbpt_internal_node *) node->children;
+		pos = idx[level] + 1;
+
+		if(tree->height - 1 - level < num_splits) {
+#ifdef CSBPT_DEBUG
+			fprintf(stderr, "Splitting internal node group %p\n", (void *) group);
+#endif
+			new_sibling.children = spare_groups[tree->height - 1 - level];
+			new_sibling.keys = spare_keys[tree->height - 1 - level];
+			left = split_point(tree, pos);
+			split_insert((unsigned char *) group, (unsigned char *) new_sibling.children, sizeof(struct csbpt_internal_node),
+			             tree->max_children + 1, left, pos, &sibling);
+			node->num_keys = left;
+			new_sibling.num_keys = tree->max_children + 1 - left;
+			refresh_keys(tree, &new_sibling, level == tree->height - 2);
+			sibling = new_sibling;
+		} else if(tree->height - 1 - level == num_splits && num_splits > 0) {
+			split_insert((unsigned char *) group, NULL, sizeof(struct csbpt_internal_node),
+			             node->num_keys + 1, node->num_keys + 1, pos, &sibling);
+			node->num_keys++;
+		}
+
+		refresh_keys(tree, node, level == tree->height - 2);
+	}
+
+	/* The root itself was split, so the tree grows a level */
+	if(num_splits == tree->height) {
+#ifdef CSBPT_DEBUG
+		fprintf(stderr, "Growing tree to height %d\n", tree->height + 1);
+#endif
+		group = spare_groups[num_splits];
+		group[0] = *tree->root;
+		group[1] = sibling;
+		tree->root->num_keys = 2;
+		tree->root->keys = spare_keys[num_splits];
+		tree->root->children = group;
+		refresh_keys(tree, tree->root, tree->height == 1);
+		tree->height++;
+	}
+
+	return 0;
+}
+
+/*!
+ *  \brief State for merging a sorted batch into a tree
+ *
+ *  A batch is merged in two passes over the same recursion.  The first pass
+ *  only counts the groups, key arrays and scratch space the merge will need;
+ *  these are all allocated before the second pass modifies the tree, so that
+ *  a failed allocation leaves the tree unchanged.
+ */
+struct batch_merge {
+	unsigned char                *elems;                          /*!< Sorted measure/value pairs to merge            */
+	int                           dry_run;                        /*!< Whether this is the counting pass              */
+	size_t                        num_leaf_groups;                /*!< New leaf groups needed                         */
+	size_t                        num_node_groups;                /*!< New internal node groups needed                */
+	size_t                        num_keys;                       /*!< New key arrays needed                          */
+	size_t                        merge_size;                     /*!< Most elements merged into a single leaf group  */
+	size_t                        list_size[CSBPT_MAX_HEIGHT];    /*!< Most replacement nodes produced at each level  */
+	struct csbpt_internal_node   *lists[CSBPT_MAX_HEIGHT];        /*!< Replacement nodes at each level                */
+	unsigned char                *merge_buf;                      /*!< Space to merge a leaf group's elements         */
+	struct csbpt_leaf_group     **leaf_groups;                    /*!< Preallocated leaf groups                       */
+	struct csbpt_internal_node  **node_groups;                    /*!< Preallocated internal node groups              */
+	csbpt_key_t                 **keys;                           /*!< Preallocated key arrays                        */
+};
+
+/*!
+ *  Merges part of a sorted batch into a subtree.
+ *
+ *  The subtree's root is replaced by one or more nodes, written to \c out.
+ *  When the merged children of a node no longer fit in one node group, they
+ *  are spread evenly over as many groups as needed; every group keeps at
+ *  least \c min_children children.  Subtrees which receive nothing from the
+ *  batch are left alone.
+ *
+ *  \param  tree    Tree being merged into
+ *  \param  m       Merge state
+ *  \param  level   Level of \c node
+ *  \param  node    Root of the subtree
+ *  \param  first   Index of the first batch element for this subtree
+ *  \param  n       Number of batch elements for this subtree
+ *  \param  out     Destination for the replacement nodes; unused in a dry run
+ *
+ *  \return The number of replacement nodes
+ */
+static size_t merge_node(struct csbpt *tree, struct batch_merge *m, int level, struct csbpt_internal_node *node,
+                         size_t first, size_t n, struct csbpt_internal_node *out)
+{
+	size_t                       i, j, k;
+	size_t                       total;
+	size_t                       count;
+	size_t                       end;
+	size_t                       size;
+	struct csbpt_leaf_group     *leaf;
+	struct csbpt_leaf_group     *new_leaf;
+	struct csbpt_internal_node  *group;
+	struct csbpt_internal_node  *list;
+	unsigned char               *batch = m->elems + first * CSBPT_ELEM_SIZE;
+
+	if(n == 0) {
+		if(!m->dry_run) {
+			out[0] = *node;
+		}
+		return 1;
+	}
+
+	if(level == tree->height - 1) {
+		leaf = (struct csbpt_leaf_group *) node->children;
+		total = leaf->num_elems + n;
+		k = groups_needed(tree, total);
+
+		if(m->dry_run) {
+			m->num_leaf_groups += k - 1;
+			if(bottom_keys_needed(tree)) {
+				m->num_keys += k - 1;
+			}
+			if(total > m->merge_size) {
+				m->merge_size = total;
+			}
+			return k;
+		}
+
+		/* Existing values go first when measures are equal */
+		for(i = 0, j = 0; i + j < total; ) {
+			if(j == n || (i < leaf->num_elems && leaf_key(tree, leaf, i) <= elem_key(batch, j))) {
+				leaf_get_elems(tree, leaf, i, m->merge_buf + (i + j) * CSBPT_ELEM_SIZE, 1);
+				i++;
+			} else {
+				memcpy(m->merge_buf + (i + j) * CSBPT_ELEM_SIZE, batch + j * CSBPT_ELEM_SIZE, CSBPT_ELEM_SIZE);
+				j++;
+			}
+		}
+
+		for(i = 0, j = 0; i < k; i++) {
+			size = total / k + (i < total % k);
+
+			if(i == 0) {
+				out[i] = *node;
+			} else {
+				new_leaf = m->leaf_groups[--m->num_leaf_groups];
+				new_leaf->prev = leaf;
+				new_leaf->next = leaf->next;
+				if(leaf->next) {
+					leaf->next->prev = new_leaf;
+				}
+				leaf->next = new_leaf;
+				leaf = new_leaf;
+
+				out[i].children = leaf;
+				if(bottom_keys_needed(tree)) {
+					out[i].keys = m->keys[--m->num_keys];
+				}
+			}
+
+			leaf_put_elems(tree, leaf, 0, m->merge_buf + j * CSBPT_ELEM_SIZE, size);
+			leaf->num_elems = size;
+			compress_leaf(tree, leaf);
+			sync_bottom_keys(tree, &out[i]);
+			j += size;
+		}
+
+		return k;
+	}
+
+	/* Hand each child the part of the batch which sorts under it */
+	group = (struct csbpt_internal_node *) node->children;
+	list = m->lists[level + 1];
+	count = 0;
+	for(i = 0, j = 0; i < node->num_keys; i++) {
+		end = j;
+		if(i == node->num_keys - 1) {
+			end = n;
+		} else {
+			while(end < n && elem_key(batch, end) < node->keys[i]) {
+				end++;
+			}
+		}
+
+		count += merge_node(tree, m, level + 1, &group[i], first + j, end - j, m->dry_run ? NULL : list + count);
+		j = end;
+	}
+
+	k = groups_needed(tree, count);
+
+	if(m->dry_run) {
+		m->num_node_groups += k - 1;
+		m->num_keys += k - 1;
+		if(count > m->list_size[level + 1]) {
+			m->list_size[level + 1] = count;
+		}
+		return k;
+	}
+
+	for(i = 0, j = 0; i < k; i++) {
+		size = count / k + (i < count % k);
+
+		if(i == 0) {
+			out[i] = *node;
+		} else {
+			out[i].children = m->node_groups[--m->num_node_groups];
+			out[i].keys = m->keys[--m->num_keys];
+		}
+
+		memcpy(out[i].children, list + j, size * sizeof(struct csbpt_internal_node));
+		out[i].num_keys = size;
+		refresh_keys(tree, &out[i], level == tree->height - 2);
+		j += size;
+	}
+
+	return k;
+}
+
+/*!
+ *  Frees whatever was preallocated for a batch merge and not used
+ */
+static void release_batch_merge(struct csbpt *tree, struct batch_merge *m)
+{
+	size_t i;
+
+	for(i = 0; i < m->num_leaf_groups && m->leaf_groups; i++) {
+		free_leaf_node_group(tree, m->leaf_groups[i]);
+	}
+	for(i = 0; i < m->num_node_groups && m->node_groups; i++) {
+		free_internal_node_group(tree, m->node_groups[i]);
+	}
+	for(i = 0; i < m->num_keys && m->keys; i++) {
+		free_keys(tree, m->keys[i]);
+	}
+	for(i = 0; i < CSBPT_MAX_HEIGHT; i++) {
+		free(m->lists[i]);
+	}
+
+	free(m->leaf_groups);
+	free(m->node_groups);
+	free(m->keys);
+	free(m->merge_buf);
+	free(m->elems);
+}
+
+/*!
+ *  Merges a batch of values into a tree in a single left-to-right pass.
+ *
+ *  \param  tree   Tree to insert into
+ *  \param  elems  Measure/value pairs to insert, sorted by measure.  They
+ *                 are freed whether or not the insert succeeds.
+ *  \param  count  Number of pairs
+ *
+ *  \retval 0      The batch was inserted
+ *  \retval other  An error occurred; the tree is unchanged
+ */
+static int insert_batch(struct csbpt *tree, unsigned char *elems, size_t count)
+{
+	int                          i;
+	int                          height;
+	int                          failed = 0;
+	size_t                       j, k;
+	size_t                       num_roots;
+	size_t                       size;
+	struct csbpt_internal_node  *roots;
+	struct batch_merge           m;
+
+	memset(&m, 0, sizeof(m));
+
+	m.elems = elems;
+
+	/* Count what the merge needs, including any new levels above the root */
+	m.dry_run = 1;
+	num_roots = merge_node(tree, &m, 0, tree->root, 0, count, NULL);
+	m.list_size[0] = num_roots;
+
+	for(height = tree->height, k = num_roots; k > 1; height++) {
+		k = groups_needed(tree, k);
+		m.num_node_groups += k;
+		m.num_keys += k;
+	}
+
+	if(height > CSBPT_MAX_HEIGHT) {
+		free(m.elems);
+		errno = EOVERFLOW;
+		return 1;
+	}
+
+	m.merge_buf = malloc(m.merge_size * CSBPT_ELEM_SIZE);
+	m.leaf_groups = calloc(m.num_leaf_groups + 1, sizeof(struct csbpt_leaf_group *));
+	m.node_groups = calloc(m.num_node_groups + 1, sizeof(struct csbpt_internal_node *));
+	m.keys = calloc(m.num_keys + 1, sizeof(csbpt_key_t *));
+
+	if((m.merge_size > 0 && !m.merge_buf) || !m.leaf_groups || !m.node_groups || !m.keys) {
+		failed = 1;
+	}
+
+	for(i = 0; i < tree->height && !failed; i++) {
+		if(m.list_size[i] > 0) {
+			m.lists[i] = malloc(m.list_size[i] * sizeof(struct csbpt_internal_node));
+			failed = !m.lists[i];
+		}
+	}
+
+	for(j = 0; j < m.num_leaf_groups && !failed; j++) {
+		m.leaf_groups[j] = alloc_leaf_node_group(tree);
+		failed = !m.leaf_groups[j];
+	}
+	for(j = 0; j < m.num_node_groups && !failed; j++) {
+		m.node_groups[j] = alloc_internal_node_group(tree);
+		failed = !m.node_groups[j];
+	}
+	for(j = 0; j < m.num_keys && !failed; j++) {
+		m.keys[j] = alloc_keys(tree);
+		failed = !m.keys[j];
+	}
+
+	if(failed) {
+		release_batch_merge(tree, &m);
+		errno = ENOMEM;
+		return 1;
+	}
+
+	STATS_COUNT(tree, splits, m.num_leaf_groups + m.num_node_groups);
+
+	/* Do the merge for real */
+	m.dry_run = 0;
+	roots = m.lists[0];
+	num_roots = merge_node(tree, &m, 0, tree->root, 0, count, roots);
+
+	/* Stack new levels on top until there is a single root */
+	while(num_roots > 1) {
+#ifdef CSBPT_DEBUG
+		fprintf(stderr, "Growing tree to height %d\n", tree->height + 1);
+#endif
+		k = groups_needed(tree, num_roots);
+		for(i = 0, j = 0; i < k; i++) {
+			size = num_roots / k + (i < num_roots % k);
+			tree->root->children = m.node_groups[--m.num_node_groups];
+			tree->root->keys = m.keys[--m.num_keys];
+			tree->root->num_keys = size;
+			memcpy(tree->root->children, roots + j, size * sizeof(struct csbpt_internal_node));
+			refresh_keys(tree, tree->root, tree->height == 1);
+			roots[i] = *tree->root;
+			j += size;
+		}
+
+		num_roots = k;
+		tree->height++;
+	}
+
+	*tree->root = roots[0];
+
+	release_batch_merge(tree, &m);
+
+	return 0;
+}
+
+/*
+ *  Write-ahead log
+ *
+ *  With a log attached, every write to the tree appends a record of what it
+ *  did once it has succeeded: the measure and bytes of each value inserted
+ *  or removed, or the range of measures a delete without a predicate
+ *  cleared.  Records are only buffered by the writer.  They reach the disk
+ *  when csbpt_log_sync() is called, when the flusher thread wakes up, or when
+ *  the buffer fills, and each flush writes and syncs everything appended
+ *  before it at once, so however many writes went into the buffer they
+ *  share one fdatasync().
+ *
+ *  Records are numbered in the order they were appended, and a checkpoint
+ *  records how many it includes.  Recovery loads the checkpoint, then
+ *  replays the records after it up to the first one which is torn or fails
+ *  its checksum.
+ */
+
+/*!
+ *  Extends a CRC-32C checksum one byte at a time
+ */
+static uint32_t crc32c_scalar(uint32_t crc, const unsigned char *data, size_t size)
+{
+	int k;
+
+	crc = ~crc;
+	while(size--) {
+		crc ^= *data++;
+		for(k = 0; k < 8; k++) {
+			crc = (crc >> 1) ^ (0x82f63b78 & -(crc & 1));
+		}
+	}
+
+	return ~crc;
+}
+
+#ifdef CSBPT_X86_SIMD
+
+/*!
+ *  SSE4.2 version of crc32c_scalar(); takes 4 bytes at a time.
+ */
+__attribute__((target("sse4.2")))
+static uint32_t crc32c_sse42(uint32_t crc, const unsigned char *data, size_t size)
+{
+	uint32_t word;
+
+	crc = ~crc;
+	for(; size >= 4; size -= 4, data += 4) {
+		memcpy(&word, data, sizeof(word));
+		crc = _mm_crc32_u32(crc, word);
+	}
+	while(size--) {
+		crc = _mm_crc32_u8(crc, *data++);
+	}
+
+	return ~crc;
+}
+
+#endif /* CSBPT_X86_SIMD */
+
+/*!
+ *  Extends a CRC-32C (Castagnoli) checksum over a run of bytes
+ *
+ *  \param  crc   Checksum of the bytes before; 0 to start
+ *  \param  data  Bytes to add
+ *  \param  size  Number of bytes
+ *
+ *  \return The checksum
+ */
+static uint32_t crc32c(uint32_t crc, const void *data, size_t size)
+{
+#ifdef CSBPT_X86_SIMD
+	if(__builtin_cpu_supports("sse4.2")) {
+		return crc32c_sse42(crc, (const unsigned char *) data, size);
+	}
+#endif
+
+	return crc32c_scalar(crc, (const unsigned char *) data, size);
+}
+
+/*!
+ *  Writes the whole of a buffer to a descriptor
+ *
+ *  \retval 0      The bytes were written
+ *  \retval other  Writing failed, and \c errno is set
+ */
+static int write_fully(int fd, const unsigned char *data, size_t size)
+{
+	ssize_t n;
+
+	while(size > 0) {
+		n = write(fd, data, size);
+
+		if(n < 0 && errno == EINTR) {
+			continue;
+		}
+		if(n <= 0) {
+			if(n == 0) {
+				errno = EIO;
+			}
+			return 1;
+		}
+
+		data += n;
+		size -= n;
+	}
+
+	return 0;
+}
+
+/*!
+ *  Makes sure the records appended to a log up to some point are on disk,
+ *  joining a flush which is already under way, and leading the next one if
+ *  that was not enough.  Called with the log's lock held, which is dropped
+ *  while the records are written.
+ *
+ *  \param  log   Log to flush
+ *  \param  upto  Number of bytes appended which must be durable
+ *
+ *  \retval 0      The records are on disk
+ *  \retval other  A flush failed, and \c errno is set to what it failed with
+ */
+static int log_flush(struct csbpt_log *log, uint64_t upto)
+{
+	int             failed;
+	unsigned char  *data;
+	size_t          len;
+	size_t          size;
+	uint64_t        end;
+
+	while(log->durable < upto && !log->error) {
+		if(log->flushing) {
+			pthread_cond_wait(&log->flushed, &log->lock);
+			continue;
+		}
+
+		/* Take everything appended so far, and let the writer carry on
+		 * in the spare buffer */
+		data = log->buf;
+		len = log->len;
+		size = log->size;
+		end = log->appended;
+		log->buf = log->spare;
+		log->size = log->spare_size;
+		log->len = 0;
+		log->spare = data;
+		log->spare_size = size;
+		log->flushing = 1;
+
+		pthread_mutex_unlock(&log->lock);
+		failed = write_fully(log->fd, data, len) || fdatasync(log->fd);
+		pthread_mutex_lock(&log->lock);
+
+		if(failed) {
+			log->error = errno;
+		} else {
+			log->durable = end;
+		}
+		log->flushing = 0;
+		pthread_cond_broadcast(&log->flushed);
+	}
+
+	if(log->error) {
+		errno = log->error;
+		return 1;
+	}
+
+	return 0;
+}
+
+/*!
+ *  Body of the thread which flushes a log every \c sync_usec microseconds
+ */
+static void *log_flusher(void *arg)
+{
+	struct csbpt_log  *log = (struct csbpt_log *) arg;
+	struct timespec    until;
+
+	pthread_mutex_lock(&log->lock);
+
+	while(!log->closing) {
+		clock_gettime(CLOCK_REALTIME, &until);
+		until.tv_nsec += (long) (log->sync_usec % 1000000) * 1000;
+		until.tv_sec += log->sync_usec / 1000000 + until.tv_nsec / 1000000000;
+		until.tv_nsec %= 1000000000;
+
+		pthread_cond_timedwait(&log->wake, &log->lock, &until);
+
+		if(log->appended > log->durable) {
+			log_flush(log, log->appended);
+		}
+	}
+
+	pthread_mutex_unlock(&log->lock);
+
+	return NULL;
+}
+
+/*!
+ *  Returns how many log records a version being published includes.  A
+ *  write is logged just after its version is published, so the version
+ *  already counts the write's own record.
+ */
+static uint64_t published_log_sequence(struct csbpt *tree)
+{
+	return tree->log ? tree->log_sequence + 1 : tree->log_sequence;
+}
+
+/*!
+ *  Sets how many log records a tree includes, outside of a write.  Only
+ *  used while the tree is being recovered, when nothing can have pinned it.
+ */
+static void set_log_sequence(struct csbpt *tree, uint64_t sequence)
+{
+	tree->log_sequence = sequence;
+
+	if(tree->version) {
+		tree->version->log_sequence = sequence;
+	}
+}
+
+/*!
+ *  Appends a record of a write which has just succeeded to the tree's log.
+ *  A log which cannot take it remembers the error, which the next
+ *  csbpt_log_sync() reports; the write itself stands.
+ *
+ *  \param  tree   Tree which was written to
+ *  \param  op     What was done
+ *  \param  lo     Measure of the value, or first measure of the range
+ *  \param  hi     Last measure of the range; ignored for values
+ *  \param  value  The value inserted or removed; NULL for a range
+ */
+static void log_append(struct csbpt *tree, enum log_op op, csbpt_key_t lo, csbpt_key_t hi, void *value)
+{
+	struct csbpt_log          *log = tree->log;
+	struct csbpt_log_record    record;
+	size_t                     value_size = op == LOG_DELETE_RANGE ? 0 : log->value_size;
+	size_t                     size = sizeof(record) + value_size;
+	size_t                     grown;
+	unsigned char             *buf;
+
+	memset(&record, 0, sizeof(record));
+	record.op = op;
+	record.sequence = tree->log_sequence++;
+	record.lo = (csbpt_key_bits_t) lo;
+	record.hi = (csbpt_key_bits_t) hi;
+
+	pthread_mutex_lock(&log->lock);
+
+	if(log->len + size > log->size && !log->error) {
+		grown = log->size ? log->size : 4096;
+		while(grown < log->len + size) {
+			grown *= 2;
+		}
+
+		buf = realloc(log->buf, grown);
+		if(buf) {
+			log->buf = buf;
+			log->size = grown;
+		} else {
+			log->error = ENOMEM;
+		}
+	}
+
+	if(log->error) {
+		pthread_mutex_unlock(&log->lock);
+		return;
+	}
+
+	buf = log->buf + log->len;
+	memcpy(buf, &record, sizeof(record));
+	if(value && value_size) {
+		memcpy(buf + sizeof(record), value, value_size);
+	} else {
+		memset(buf + sizeof(record), 0, value_size);
+	}
+	record.checksum = crc32c(0, buf + sizeof(record.checksum), size - sizeof(record.checksum));
+	memcpy(buf, &record.checksum, sizeof(record.checksum));
+
+	log->len += size;
+	log->appended += size;
+
+	if(log->len >= CSBPT_LOG_BUFFER) {
+		log_flush(log, log->appended);
+	}
+
+	pthread_mutex_unlock(&log->lock);
+}
+
+/*!
+ *  Hands out memory for a copy of a recovered value, which lives as long as
+ *  the tree
+ *
+ *  \retval NULL   Allocation failed
+ *  \retval other  \c size bytes
+ */
+static void *own_value(struct csbpt *tree, size_t size)
+{
+	size_t                     aligned = (size + sizeof(void *) - 1) / sizeof(void *) * sizeof(void *);
+	size_t                     block_size;
+	struct csbpt_value_block  *block = tree->owned_values;
+
+	if(!block || block->size - block->used < aligned) {
+		block_size = aligned > CSBPT_VALUE_BLOCK ? aligned : CSBPT_VALUE_BLOCK;
+		block = malloc(sizeof(struct csbpt_value_block) + block_size);
+
+		if(!block) {
+			errno = ENOMEM;
+			return NULL;
+		}
+
+		block->next = tree->owned_values;
+		block->used = 0;
+		block->size = block_size;
+		tree->owned_values = block;
+	}
+
+	block->used += aligned;
+
+	return (unsigned char *) (block + 1) + block->used - aligned;
+}
+
+/*
+ *  Concurrent trees
+ *
+ *  A concurrent tree has a single writer and any number of lock-free readers.
+ *  The writer never modifies memory a reader can reach: an insert first
+ *  copies the root, every node group and key array along its path, and the
+ *  leaf group it lands in, then runs the ordinary insert on the copies.  The
+ *  new root is published, together with the tree's height and log sequence,
+ *  by a single atomic store of tree->version.  Readers load the version once
+ *  and see either the old tree or the new one, never a mix.
+ *
+ *  The only shared memory written in place is the links between leaf groups,
+ *  which are updated after publishing so that the neighbours of a copied
+ *  group point at the copy.
+ *
+ *  Whatever a write replaced is retired rather than freed.  Readers announce
+ *  the epoch they entered in their csbpt_reader record, and a retired block is
+ *  only returned to the arena once no reader is in an epoch at or before the
+ *  one it was retired in.
+ */
+
+/*!
+ *  Returns the root and height readers should use
+ *
+ *  \param  tree    Tree being read
+ *  \param  height  Set to the height of the tree
+ *
+ *  \return The root of the tree
+ */
+static struct csbpt_internal_node *read_root(struct csbpt *tree, int *height)
+{
+	struct csbpt_version *version;
+
+	if(!tree->concurrent) {
+		*height = tree->height;
+		return tree->root;
+	}
+
+	version = __atomic_load_n(&tree->version, __ATOMIC_ACQUIRE);
+	*height = version->height;
+
+	return &version->root;
+}
+
+/*!
+ *  Makes sure the retired list has room for more entries, so that retiring
+ *  cannot fail once a write has been published
+ *
+ *  \param  tree   Tree to prepare
+ *  \param  count  Number of entries needed
+ *
+ *  \retval 0      There is enough room
+ *  \retval other  Allocation failed
+ */
+static int reserve_retired(struct csbpt *tree, size_t count)
+{
+	size_t                 size;
+	struct csbpt_retired  *retired;
+
+	if(tree->num_retired + count <= tree->retired_size) {
+		return 0;
+	}
+
+	size = 2 * (tree->num_retired + count);
+	retired = realloc(tree->retired, size * sizeof(struct csbpt_retired));
+
+	if(!retired) {
+		errno = ENOMEM;
+		return 1;
+	}
+
+	tree->retired = retired;
+	tree->retired_size = size;
+
+	return 0;
+}
+
+/*!
+ *  Retires memory which has just been unlinked from the tree.  Room must
+ *  have been reserved with reserve_retired().
+ */
+static void retire(struct csbpt *tree, void *ptr, size_t size)
+{
+	tree->retired[tree->num_retired].ptr = ptr;
+	tree->retired[tree->num_retired].size = size;
+	tree->retired[tree->num_retired].epoch = tree->epoch;
+	tree->num_retired++;
+}
+
+/*!
+ *  Starts a new epoch, then frees whatever no reader can still be using
+ */
+static void reclaim(struct csbpt *tree)
+{
+	size_t                i, j;
+	unsigned long         oldest;
+	unsigned long         epoch;
+	struct csbpt_reader  *reader;
+
+	__atomic_store_n(&tree->epoch, tree->epoch + 1, __ATOMIC_SEQ_CST);
+
+	oldest = tree->epoch;
+	for(reader = __atomic_load_n(&tree->readers, __ATOMIC_ACQUIRE); reader; reader = reader->next) {
+		epoch = __atomic_load_n(&reader->epoch, __ATOMIC_SEQ_CST);
+
+		if(epoch && epoch < oldest) {
+			oldest = epoch;
+		}
+	}
+
+	for(i = 0, j = 0; i < tree->num_retired; i++) {
+		if(tree->retired[i].epoch < oldest) {
+			arena_free(&tree->arena, tree->retired[i].ptr, tree->retired[i].size);
+		} else {
+			tree->retired[j++] = tree->retired[i];
+		}
+	}
+
+	tree->num_retired = j;
+}
+
+/*!
+ *  Inserts a single value into a concurrent tree; see insert_value()
+ *
+ *  \param  tree   Tree to insert into
+ *  \param  key    Measure of the value
+ *  \param  value  Value to insert
+ *  \param  mode   Where to put the value
+ *
+ *  \retval 0      Insertion succeeded
+ *  \retval other  Insertion failed; the tree is unchanged
+ */
+static int cow_insert(struct csbpt *tree, csbpt_key_t key, void *value, enum insert_mode mode)
+{
+	int                          level;
+	int                          failed = 0;
+	size_t                       i;
+	size_t                       num_copies = 0;
+	void                        *copies[2 * CSBPT_MAX_HEIGHT + 1];
+	void                        *originals[2 * CSBPT_MAX_HEIGHT + 1];
+	size_t                       sizes[2 * CSBPT_MAX_HEIGHT + 1];
+	struct csbpt_version        *old_version = tree->version;
+	struct csbpt_version        *version;
+	struct csbpt_internal_node  *node;
+	struct csbpt_leaf_group     *leaf = NULL;
+	struct csbpt_leaf_group     *copy = NULL;
+	struct csbpt_leaf_group     *last;
+
+	if(reserve_retired(tree, 2 * tree->height + 2)) {
+		return 1;
+	}
+
+	version = arena_alloc(&tree->arena, sizeof(struct csbpt_version));
+
+	if(!version) {
+		return 1;
+	}
+
+	*version = *old_version;
+	tree->root = &version->root;
+
+	/* Copy the path the insert will take */
+	node = tree->root;
+	for(level = 0; level < tree->height; level++) {
+		if(node->keys && (level < tree->height - 1 || bottom_keys_needed(tree))) {
+			originals[num_copies] = node->keys;
+			sizes[num_copies] = tree->keys_size;
+			copies[num_copies] = alloc_keys(tree);
+
+			if(!copies[num_copies]) {
+				failed = 1;
+				break;
+			}
+
+			memcpy(copies[num_copies], node->keys, tree->keys_size);
+			node->keys = (csbpt_key_t *) copies[num_copies++];
+		}
+
+		originals[num_copies] = node->children;
+		if(level < tree->height - 1) {
+			sizes[num_copies] = tree->max_children * sizeof(struct csbpt_internal_node);
+			copies[num_copies] = alloc_internal_node_group(tree);
+		} else {
+			sizes[num_copies] = tree->leaf_group_size;
+			copies[num_copies] = alloc_leaf_node_group(tree);
+		}
+
+		if(!copies[num_copies]) {
+			failed = 1;
+			break;
+		}
+
+		memcpy(copies[num_copies], node->children, sizes[num_copies]);
+		node->children = copies[num_copies++];
+
+		if(level < tree->height - 1) {
+			node = &((struct csbpt_internal_node *) node->children)[insert_child(tree, node, key, mode)];
+		} else {
+			leaf = (struct csbpt_leaf_group *) originals[num_copies - 1];
+			copy = (struct csbpt_leaf_group *) node->children;
+			sync_bottom_keys(tree, node);
+		}
+	}
+
+	if(failed) {
+		errno = ENOMEM;
+	} else {
+		failed = insert_value(tree, key, value, mode);
+	}
+
+	if(failed) {
+		for(i = 0; i < num_copies; i++) {
+			arena_free(&tree->arena, copies[i], sizes[i]);
+		}
+		arena_free(&tree->arena, version, sizeof(struct csbpt_version));
+		tree->root = &old_version->root;
+		return 1;
+	}
+
+	version->height = tree->height;
+	version->log_sequence = published_log_sequence(tree);
+	__atomic_store_n(&tree->version, version, __ATOMIC_SEQ_CST);
+
+	/* Point the neighbours of the copied leaf group, and of any group split
+	 * off it, at the new groups */
+	if(copy->prev) {
+		publish_ptr((void **) &copy->prev->next, copy);
+	}
+	last = copy->next != leaf->next ? copy->next : copy;
+	if(last->next) {
+		publish_ptr((void **) &last->next->prev, last);
+	}
+
+	for(i = 0; i < num_copies; i++) {
+		retire(tree, originals[i], sizes[i]);
+	}
+	retire(tree, old_version, sizeof(struct csbpt_version));
+	reclaim(tree);
+
+	return 0;
+}
+
+/*!
+ *  Inserts a single value with a given measure, copying on write if the tree
+ *  is concurrent
+ */
+static int write_measured(struct csbpt *tree, csbpt_key_t key, void *value, enum insert_mode mode)
+{
+	static const enum log_op  ops[] = { LOG_INSERT, LOG_PUSH_LEFT, LOG_PUSH_RIGHT };
+	int                       ret;
+	uint64_t                  started = STATS_CLOCK();
+
+	if(tree->image || tree->origin) {
+		errno = EROFS;
+		return 1;
+	}
+
+	if(tree->concurrent) {
+		ret = cow_insert(tree, key, value, mode);
+	} else {
+		ret = insert_value(tree, key, value, mode);
+	}
+
+	if(!ret && tree->log) {
+		log_append(tree, ops[mode], key, key, value);
+	}
+
+	if(!ret) {
+		STATS_LOOKUPS(tree, 1, tree->height);
+		STATS_OP(tree, CSBPT_OP_INSERT, started, 1);
+	}
+
+	return ret;
+}
+
+/*!
+ *  Measures a value with the tree's measure function, and inserts it
+ */
+static int write_value(struct csbpt *tree, void *value, enum insert_mode mode)
+{
+	/* Loaded snapshots have no measure function either */
+	if(!tree->measure) {
+		errno = tree->image ? EROFS : EINVAL;
+		return 1;
+	}
+
+	return write_measured(tree, tree->measure(value), value, mode);
+}
+
+/*
+ *  Deletion
+ *
+ *  Deletes descend only into the children whose range of measures overlaps
+ *  the one being deleted.  A child lying wholly inside it, when no predicate
+ *  is given, is unlinked and freed without looking at its values.  On the way
+ *  back up, children left with fewer than min_children entries of their own
+ *  are merged with a neighbour if the two fit in one group, and otherwise
+ *  share the neighbour's entries evenly with it.  When the root is left with
+ *  a single child, the tree loses a level.
+ */
+
+/*!
+ *  \brief A delete in progress
+ */
+struct delete_op {
+	csbpt_key_t                  lo;            /*!< Smallest measure deleted                               */
+	csbpt_key_t                  hi;            /*!< Largest measure deleted                                */
+	csbpt_predicate_fn          *predicate;     /*!< Picks the values to delete; NULL deletes every one     */
+	void                        *user_data;     /*!< Passed to \c predicate                                 */
+	int                          cow;           /*!< Whether the tree is shared with readers                */
+	int                          log_values;    /*!< Whether each value deleted is logged on its own        */
+	size_t                       count;         /*!< Values deleted so far                                  */
+	unsigned char               *scratch;       /*!< Room for the entries of two groups                     */
+	struct csbpt_leaf_group     *spare_leaf;    /*!< Leaf group for a copy, or for an emptied tree's root   */
+	struct csbpt_internal_node  *spare_group;   /*!< Node group for a copy                                  */
+	csbpt_key_t                 *spare_keys;    /*!< Key array for either of the above                      */
+};
+
+/*!
+ *  Gives back memory which is no longer part of the tree.  In a concurrent
+ *  tree readers may still be using it, so it is retired instead.
+ */
+static void release_mem(struct csbpt *tree, struct delete_op *op, void *ptr, size_t size)
+{
+	if(!ptr) {
+		return;
+	}
+
+	if(op->cow) {
+		retire(tree, ptr, size);
+	} else {
+		arena_free(&tree->arena, ptr, size);
+	}
+}
+
+/*!
+ *  Gives back the key array and the children of a node which has been
+ *  removed from the tree
+ *
+ *  \param  tree   Tree being deleted from
+ *  \param  op     The delete
+ *  \param  level  Level of \c node
+ *  \param  node   The node
+ */
+static void release_node(struct csbpt *tree, struct delete_op *op, int level, struct csbpt_internal_node *node)
+{
+	if(level < tree->height - 1) {
+		release_mem(tree, op, node->children, tree->max_children * sizeof(struct csbpt_internal_node));
+		release_mem(tree, op, node->keys, tree->keys_size);
+		return;
+	}
+
+	release_mem(tree, op, node->children, tree->leaf_group_size);
+	if(bottom_keys_needed(tree)) {
+		release_mem(tree, op, node->keys, tree->keys_size);
+	}
+}
+
+/*!
+ *  Takes a leaf group out of the linked list
+ */
+static void unlink_leaf(struct csbpt_leaf_group *leaf)
+{
+	if(leaf->prev) {
+		leaf->prev->next = leaf->next;
+	}
+	if(leaf->next) {
+		leaf->next->prev = leaf->prev;
+	}
+}
+
+/*!
+ *  Removes a child from a node's group, keeping the others in order
+ */
+static void remove_child(struct csbpt_internal_node *node, int i)
+{
+	struct csbpt_internal_node *group = (struct csbpt_internal_node *) node->children;
+
+	memmove(&group[i], &group[i + 1], (node->num_keys - i - 1) * sizeof(struct csbpt_internal_node));
+	node->num_keys--;
+}
+
+/*!
+ *  Replaces the contents of a node with a run of entries
+ *
+ *  \param  tree     Tree being deleted from
+ *  \param  level    Level of \c node
+ *  \param  node     Node to fill
+ *  \param  entries  Measure/value pairs if \c node is directly above the
+ *                   leaves, otherwise child nodes
+ *  \param  n        Number of entries
+ */
+static void fill_node(struct csbpt *tree, int level, struct csbpt_internal_node *node, const unsigned char *entries, size_t n)
+{
+	struct csbpt_leaf_group *leaf;
+
+	if(level == tree->height - 1) {
+		leaf = (struct csbpt_leaf_group *) node->children;
+		leaf_put_elems(tree, leaf, 0, entries, n);
+		leaf->num_elems = n;
+		sync_bottom_keys(tree, node);
+		return;
+	}
+
+	memcpy(node->children, entries, n * sizeof(struct csbpt_internal_node));
+	node->num_keys = n;
+	refresh_keys(tree, node, level == tree->height - 2);
+}
+
+/*!
+ *  Replaces the key array and children of a node shared with readers by the
+ *  spare ones, ready to be refilled.  The links of a leaf group are kept.
+ */
+static void copy_to_spare(struct csbpt *tree, struct delete_op *op, int level, struct csbpt_internal_node *node)
+{
+	if(level == tree->height - 1) {
+		memcpy(op->spare_leaf, node->children, sizeof(struct csbpt_leaf_group));
+		release_node(tree, op, level, node);
+		node->children = op->spare_leaf;
+		op->spare_leaf = NULL;
+
+		if(bottom_keys_needed(tree)) {
+			node->keys = op->spare_keys;
+			op->spare_keys = NULL;
+		}
+		return;
+	}
+
+	release_node(tree, op, level, node);
+	node->children = op->spare_group;
+	node->keys = op->spare_keys;
+	op->spare_group = NULL;
+	op->spare_keys = NULL;
+}
+
+/*!
+ *  Evens out two adjacent children of a node, one of which has too few
+ *  entries.  If their entries fit in a single group they are merged, and the
+ *  node loses a child.
+ *
+ *  In a concurrent tree, \c keep is the only one of the two which is not
+ *  shared with readers; the other is copied before it is changed.
+ *
+ *  \param  tree   Tree being deleted from
+ *  \param  op     The delete
+ *  \param  level  Level of \c node
+ *  \param  node   Parent of the two children
+ *  \param  left   Index of the left child
+ *  \param  keep   Index of the child which survives a merge
+ *
+ *  \return Whether the children were merged
+ */
+static int rebalance_children(struct csbpt *tree, struct delete_op *op, int level, struct csbpt_internal_node *node,
+                              int left, int keep)
+{
+	int                          other = keep == left ? left + 1 : left;
+	int                          bottom = level + 1 == tree->height - 1;
+	size_t                       entry = bottom ? CSBPT_ELEM_SIZE : sizeof(struct csbpt_internal_node);
+	size_t                       na, nb, total, split;
+	struct csbpt_internal_node  *group = (struct csbpt_internal_node *) node->children;
+	struct csbpt_leaf_group     *kept;
+	struct csbpt_leaf_group     *gone;
+
+	na = group[left].num_keys;
+	nb = group[left + 1].num_keys;
+	total = na + nb;
+
+	/* Gather the entries of both children, in order */
+	if(bottom) {
+		leaf_get_elems(tree, (struct csbpt_leaf_group *) group[left].children, 0, op->scratch, na);
+		leaf_get_elems(tree, (struct csbpt_leaf_group *) group[left + 1].children, 0, op->scratch + na * entry, nb);
+	} else {
+		memcpy(op->scratch, group[left].children, na * entry);
+		memcpy(op->scratch + na * entry, group[left + 1].children, nb * entry);
+	}
+
+	if(total <= tree->max_children) {
+		fill_node(tree, level + 1, &group[keep], op->scratch, total);
+
+		/* The other child's leaf group leaves the list.  A concurrent
+		 * tree's neighbours are relinked once the delete is published. */
+		if(bottom) {
+			kept = (struct csbpt_leaf_group *) group[keep].children;
+			gone = (struct csbpt_leaf_group *) group[other].children;
+
+			if(other > keep) {
+				kept->next = gone->next;
+				if(gone->next && !op->cow) {
+					gone->next->prev = kept;
+				}
+			} else {
+				kept->prev = gone->prev;
+				if(gone->prev && !op->cow) {
+					gone->prev->next = kept;
+				}
+			}
+		}
+
+		release_node(tree, op, level + 1, &group[other]);
+		remove_child(node, other);
+		STATS_COUNT(tree, merges, 1);
+		return 1;
+	}
+
+	if(op->cow) {
+		copy_to_spare(tree, op, level + 1, &group[other]);
+	}
+
+	split = total - total / 2;
+	fill_node(tree, level + 1, &group[left], op->scratch, split);
+	fill_node(tree, level + 1, &group[left + 1], op->scratch + split * entry, total - split);
+
+	return 0;
+}
+
+/*!
+ *  Rebalances every child of a node which has too few entries.  Merging
+ *  two children can leave one of their own children next to others it can
+ *  now be rebalanced with, so merged children are fixed in turn.
+ *
+ *  \param  tree   Tree being deleted from; not a concurrent one
+ *  \param  op     The delete
+ *  \param  level  Level of \c node
+ *  \param  node   Node whose children are fixed
+ */
+static void fix_children(struct csbpt *tree, struct delete_op *op, int level, struct csbpt_internal_node *node)
+{
+	int                          i = 0;
+	int                          left;
+	int                          merged;
+	struct csbpt_internal_node  *group = (struct csbpt_internal_node *) node->children;
+
+	while(i < node->num_keys) {
+		if(group[i].num_keys >= tree->min_children || node->num_keys == 1) {
+			i++;
+			continue;
+		}
+
+		left = i + 1 < node->num_keys ? i : i - 1;
+		merged = rebalance_children(tree, op, level, node, left, left);
+
+		if(level + 1 < tree->height - 1) {
+			fix_children(tree, op, level + 1, &group[left]);
+			refresh_keys(tree, &group[left], level + 1 == tree->height - 2);
+
+			if(!merged) {
+				fix_children(tree, op, level + 1, &group[left + 1]);
+				refresh_keys(tree, &group[left + 1], level + 1 == tree->height - 2);
+			}
+		}
+
+		i = merged ? left : left + 1;
+	}
+}
+
+/*!
+ *  Unlinks and frees a whole subtree, counting its values
+ *
+ *  \param  tree   Tree being deleted from; not a concurrent one
+ *  \param  op     The delete
+ *  \param  level  Level of \c node
+ *  \param  node   Root of the subtree
+ */
+static void delete_subtree(struct csbpt *tree, struct delete_op *op, int level, struct csbpt_internal_node *node)
+{
+	int                          i;
+	struct csbpt_internal_node  *group = (struct csbpt_internal_node *) node->children;
+
+	if(level == tree->height - 1) {
+		op->count += node->num_keys;
+		unlink_leaf((struct csbpt_leaf_group *) node->children);
+	} else {
+		for(i = 0; i < node->num_keys; i++) {
+			delete_subtree(tree, op, level + 1, &group[i]);
+		}
+	}
+
+	release_node(tree, op, level, node);
+}
+
+/*!
+ *  Deletes the values of a leaf group which are picked by a delete
+ *
+ *  \param  tree   Tree being deleted from
+ *  \param  op     The delete
+ *  \param  node   Node above the leaf group
+ */
+static void delete_from_leaf(struct csbpt *tree, struct delete_op *op, struct csbpt_internal_node *node)
+{
+	csbpt_key_t               key;
+	size_t                    i, j;
+	unsigned char             elem[CSBPT_ELEM_SIZE];
+	struct csbpt_leaf_group  *leaf = (struct csbpt_leaf_group *) node->children;
+
+	for(i = 0, j = 0; i < leaf->num_elems; i++) {
+		key = leaf_key(tree, leaf, i);
+
+		if(key >= op->lo && key <= op->hi &&
+		   (!op->predicate || op->predicate(op->user_data, leaf_value(tree, leaf, i)))) {
+			if(op->log_values) {
+				log_append(tree, LOG_REMOVE, key, key, leaf_value(tree, leaf, i));
+			}
+			op->count++;
+			continue;
+		}
+
+		if(j != i) {
+			leaf_get_elems(tree, leaf, i, elem, 1);
+			leaf_put_elems(tree, leaf, j, elem, 1);
+		}
+		j++;
+	}
+
+	leaf->num_elems = j;
+	sync_bottom_keys(tree, node);
+}
+
+/*!
+ *  Deletes the values of a subtree which are picked by a delete, then
+ *  rebalances the node's children
+ *
+ *  \param  tree   Tree being deleted from; not a concurrent one
+ *  \param  op     The delete
+ *  \param  level  Level of \c node
+ *  \param  node   Root of the subtree
+ */
+static void delete_node(struct csbpt *tree, struct delete_op *op, int level, struct csbpt_internal_node *node)
+{
+	int                          i, j;
+	struct csbpt_internal_node  *group = (struct csbpt_internal_node *) node->children;
+
+	if(level == tree->height - 1) {
+		delete_from_leaf(tree, op, node);
+		return;
+	}
+
+	/* Child i holds measures from keys[i - 1] to keys[i] */
+	for(i = 0; i < node->num_keys; i++) {
+		if(node->keys[i] < op->lo) {
+			continue;
+		}
+		if(i > 0 && node->keys[i - 1] > op->hi) {
+			break;
+		}
+
+		if(!op->predicate && node->keys[i] <= op->hi && (i > 0 ? node->keys[i - 1] >= op->lo : op->lo == CSBPT_KEY_MIN)) {
+			delete_subtree(tree, op, level + 1, &group[i]);
+			group[i].children = NULL;
+		} else {
+			delete_node(tree, op, level + 1, &group[i]);
+		}
+	}
+
+	/* Drop the children which were emptied */
+	for(i = 0, j = 0; i < node->num_keys; i++) {
+		if(!group[i].children) {
+			continue;
+		}
+
+		if(group[i].num_keys == 0) {
+			if(level + 1 == tree->height - 1) {
+				unlink_leaf((struct csbpt_leaf_group *) group[i].children);
+			}
+			release_node(tree, op, level + 1, &group[i]);
+			continue;
+		}
+
+		group[j++] = group[i];
+	}
+	node->num_keys = j;
+
+	fix_children(tree, op, level, node);
+	refresh_keys(tree, node, level == tree->height - 2);
+}
+
+/*!
+ *  Removes levels from the top of the tree while the root has a single
+ *  child.  A root left with no children at all is given an empty leaf group,
+ *  taken from \c op->spare_leaf.
+ *
+ *  \param  tree   Tree being deleted from
+ *  \param  op     The delete
+ */
+static void shrink_root(struct csbpt *tree, struct delete_op *op)
+{
+	struct csbpt_internal_node  *root = tree->root;
+	struct csbpt_internal_node   child;
+
+	while(tree->height > 1 && root->num_keys <= 1) {
+		child = ((struct csbpt_internal_node *) root->children)[0];
+		release_mem(tree, op, root->keys, tree->keys_size);
+		release_mem(tree, op, root->children, tree->max_children * sizeof(struct csbpt_internal_node));
+
+		if(root->num_keys == 0) {
+#ifdef CSBPT_DEBUG
+			fprintf(stderr, "Tree emptied; shrinking to height 1\n");
+#endif
+			root->children = op->spare_leaf;
+			root->keys = bottom_keys_needed(tree) ? op->spare_keys : NULL;
+			op->spare_leaf = NULL;
+			if(bottom_keys_needed(tree)) {
+				op->spare_keys = NULL;
+			}
+			tree->height = 1;
+			sync_bottom_keys(tree, root);
+			return;
+		}
+
+#ifdef CSBPT_DEBUG
+		fprintf(stderr, "Shrinking tree to height %d\n", tree->height - 1);
+#endif
+		*root = child;
+		tree->height--;
+
+		if(tree->height > 1 && !op->cow) {
+			fix_children(tree, op, 0, root);
+			refresh_keys(tree, root, tree->height == 2);
+		}
+	}
+}
+
+/*!
+ *  Allocates the spare groups and key arrays a delete may need, so that it
+ *  cannot fail once the tree has been changed
+ *
+ *  \param  tree   Tree being deleted from
+ *  \param  op     The delete
+ *
+ *  \retval 0      Allocation succeeded
+ *  \retval other  Allocation failed; nothing is left allocated
+ */
+static int alloc_delete_spares(struct csbpt *tree, struct delete_op *op)
+{
+	op->spare_leaf = alloc_leaf_node_group(tree);
+	op->spare_keys = alloc_keys(tree);
+	op->spare_group = op->cow ? alloc_internal_node_group(tree) : NULL;
+
+	if(!op->spare_leaf || !op->spare_keys || (op->cow && !op->spare_group)) {
+		free_leaf_node_group(tree, op->spare_leaf);
+		free_keys(tree, op->spare_keys);
+		free_internal_node_group(tree, op->spare_group);
+		op->spare_leaf = NULL;
+		op->spare_keys = NULL;
+		op->spare_group = NULL;
+		errno = ENOMEM;
+		return 1;
+	}
+
+	return 0;
+}
+
+/*!
+ *  Frees whichever spares a delete did not use
+ */
+static void release_delete_spares(struct csbpt *tree, struct delete_op *op)
+{
+	free_leaf_node_group(tree, op->spare_leaf);
+	free_keys(tree, op->spare_keys);
+	free_internal_node_group(tree, op->spare_group);
+	op->spare_leaf = NULL;
+	op->spare_keys = NULL;
+	op->spare_group = NULL;
+}
+
+/*!
+ *  Deletes the values picked by a delete from a tree which is not
+ *  concurrent
+ *
+ *  \param  tree   Tree to delete from
+ *  \param  op     The delete
+ *
+ *  \retval 0      The values were deleted
+ *  \retval other  Allocation failed; the tree is unchanged
+ */
+static int delete_values(struct csbpt *tree, struct delete_op *op)
+{
+	if(tree->height > 1 && alloc_delete_spares(tree, op)) {
+		return 1;
+	}
+
+	delete_node(tree, op, 0, tree->root);
+	shrink_root(tree, op);
+	release_delete_spares(tree, op);
+
+	return 0;
+}
+
+/*!
+ *  Finds a value, and the path down to it
+ *
+ *  \param  tree     Tree to search
+ *  \param  measure  Measure of the value
+ *  \param  value    The value itself
+ *  \param  path     Set to the node at each level of the path
+ *  \param  idx      Set to the index of the child taken at each level
+ *  \param  pos      Set to the position of the value in its leaf group
+ *
+ *  \retval 0      The value was found
+ *  \retval other  It is not in the tree
+ */
+static int find_path(struct csbpt *tree, csbpt_key_t measure, void *value, struct csbpt_internal_node **path, int *idx, size_t *pos)
+{
+	int                          level;
+	struct csbpt_internal_node  *node = tree->root;
+	struct csbpt_leaf_group     *leaf;
+
+	for(level = 0; level < tree->height - 1; level++) {
+		path[level] = node;
+		idx[level] = search_keys(tree, node->keys, node->num_keys, measure);
+
+		if(idx[level] == node->num_keys) {
+			errno = ENOENT;
+			return 1;
+		}
+
+		node = &((struct csbpt_internal_node *) node->children)[idx[level]];
+	}
+	path[level] = node;
+	leaf = (struct csbpt_leaf_group *) node->children;
+	*pos = search_node(tree, node, 1, measure);
+
+	for(;;) {
+		/* Equal measures may carry on into the following leaf groups, so
+		 * step the path along to the next one */
+		while(*pos == leaf->num_elems) {
+			for(level = tree->height - 2; level >= 0 && idx[level] + 1 >= path[level]->num_keys; level--);
+
+			if(level < 0) {
+				errno = ENOENT;
+				return 1;
+			}
+
+			idx[level]++;
+			for(; level < tree->height - 1; level++) {
+				node = &((struct csbpt_internal_node *) path[level]->children)[idx[level]];
+				path[level + 1] = node;
+				if(level + 1 < tree->height - 1) {
+					idx[level + 1] = 0;
+				}
+			}
+
+			leaf = (struct csbpt_leaf_group *) node->children;
+			*pos = 0;
+		}
+
+		if(leaf_key(tree, leaf, *pos) != measure) {
+			errno = ENOENT;
+			return 1;
+		}
+
+		if(leaf_value(tree, leaf, *pos) == value) {
+			return 0;
+		}
+
+		(*pos)++;
+	}
+}
+
+/*!
+ *  Deletes a single value from a concurrent tree.
+ *
+ *  Like cow_insert(), this copies the path down to the value and changes
+ *  the copies.  Merging a child with a neighbour moves the neighbour's
+ *  entries into the copy, so the neighbour is only read; a neighbour which
+ *  shares its entries instead is copied first.  Everything the delete could
+ *  need is allocated before the tree is touched.
+ *
+ *  \param  tree     Tree to delete from
+ *  \param  op       The delete
+ *  \param  measure  Measure of the value
+ *  \param  value    The value itself
+ *
+ *  \retval 0      The value was deleted
+ *  \retval other  It was not found, or allocation failed; the tree is
+ *                 unchanged
+ */
+static int cow_delete(struct csbpt *tree, struct delete_op *op, csbpt_key_t measure, void *value)
+{
+	int                          level;
+	int                          c;
+	int                          left;
+	int                          failed = 0;
+	int                          idx[CSBPT_MAX_HEIGHT];
+	size_t                       i;
+	size_t                       pos;
+	size_t                       num_copies = 0;
+	void                        *copies[2 * CSBPT_MAX_HEIGHT + 1];
+	void                        *originals[2 * CSBPT_MAX_HEIGHT + 1];
+	size_t                       sizes[2 * CSBPT_MAX_HEIGHT + 1];
+	struct csbpt_version        *old_version = tree->version;
+	struct csbpt_version        *version;
+	struct csbpt_internal_node  *path[CSBPT_MAX_HEIGHT];
+	struct csbpt_internal_node  *node;
+	struct csbpt_internal_node  *group;
+	struct csbpt_leaf_group     *leaf;
+	struct csbpt_leaf_group     *first;
+	struct csbpt_leaf_group     *last;
+	struct csbpt_leaf_group     *before;
+	struct csbpt_leaf_group     *after;
+	unsigned char                elem[CSBPT_ELEM_SIZE];
+
+	if(find_path(tree, measure, value, path, idx, &pos)) {
+		return 1;
+	}
+
+	/* The path, the neighbours merged at each level, one copied neighbour,
+	 * the root groups removed as the tree shrinks, and the version */
+	if(reserve_retired(tree, 6 * tree->height + 3)) {
+		return 1;
+	}
+
+	version = arena_alloc(&tree->arena, sizeof(struct csbpt_version));
+
+	if(!version) {
+		errno = ENOMEM;
+		return 1;
+	}
+
+	if(alloc_delete_spares(tree, op)) {
+		arena_free(&tree->arena, version, sizeof(struct csbpt_version));
+		return 1;
+	}
+
+	*version = *old_version;
+	tree->root = &version->root;
+
+	/* Copy the path down to the value */
+	node = tree->root;
+	for(level = 0; level < tree->height; level++) {
+		path[level] = node;
+
+		if(node->keys && (level < tree->height - 1 || bottom_keys_needed(tree))) {
+			originals[num_copies] = node->keys;
+			sizes[num_copies] = tree->keys_size;
+			copies[num_copies] = alloc_keys(tree);
+
+			if(!copies[num_copies]) {
+				failed = 1;
+				break;
+			}
+
+			memcpy(copies[num_copies], node->keys, tree->keys_size);
+			node->keys = (csbpt_key_t *) copies[num_copies++];
+		}
+
+		originals[num_copies] = node->children;
+		if(level < tree->height - 1) {
+			sizes[num_copies] = tree->max_children * sizeof(struct csbpt_internal_node);
+			copies[num_copies] = alloc_internal_node_group(tree);
+		} else {
+			sizes[num_copies] = tree->leaf_group_size;
+			copies[num_copies] = alloc_leaf_node_group(tree);
+		}
+
+		if(!copies[num_copies]) {
+			failed = 1;
+			break;
+		}
+
+		memcpy(copies[num_copies], node->children, sizes[num_copies]);
+		node->children = copies[num_copies++];
+
+		if(level < tree->height - 1) {
+			node = &((struct csbpt_internal_node *) node->children)[idx[level]];
+		} else {
+			sync_bottom_keys(tree, node);
+		}
+	}
+
+	if(failed) {
+		for(i = 0; i < num_copies; i++) {
+			arena_free(&tree->arena, copies[i], sizes[i]);
+		}
+		release_delete_spares(tree, op);
+		arena_free(&tree->arena, version, sizeof(struct csbpt_version));
+		tree->root = &old_version->root;
+		errno = ENOMEM;
+		return 1;
+	}
+
+	/* Take the value out of the copied leaf group */
+	node = path[tree->height - 1];
+	leaf = (struct csbpt_leaf_group *) node->children;
+	for(i = pos; i + 1 < leaf->num_elems; i++) {
+		leaf_get_elems(tree, leaf, i + 1, elem, 1);
+		leaf_put_elems(tree, leaf, i, elem, 1);
+	}
+	leaf->num_elems--;
+	sync_bottom_keys(tree, node);
+	op->count++;
+
+	first = leaf;
+	last = leaf;
+	before = leaf->prev;
+	after = leaf->next;
+
+	/* Walk back up, rebalancing the children on the path which are left too
+	 * small.  first and last track the run of new leaf groups. */
+	for(level = tree->height - 2; level >= 0; level--) {
+		node = path[level];
+		group = (struct csbpt_internal_node *) node->children;
+		c = idx[level];
+
+		if(group[c].num_keys < tree->min_children && node->num_keys > 1) {
+			left = c + 1 < node->num_keys ? c : c - 1;
+
+			if(!rebalance_children(tree, op, level, node, left, c) && level == tree->height - 2) {
+				if(left < c) {
+					first = (struct csbpt_leaf_group *) group[left].children;
+					first->next = last;
+					last->prev = first;
+				} else {
+					last = (struct csbpt_leaf_group *) group[c + 1].children;
+					last->prev = first;
+					first->next = last;
+				}
+			}
+		} else if(group[c].num_keys == 0) {
+			/* An empty child with no siblings goes, leaving its parent
+			 * empty in turn */
+			if(level == tree->height - 2) {
+				first = NULL;
+				last = NULL;
+			}
+
+			release_node(tree, op, level + 1, &group[c]);
+			remove_child(node, c);
+		}
+
+		refresh_keys(tree, node, level == tree->height - 2);
+	}
+
+	shrink_root(tree, op);
+
+	version->height = tree->height;
+	version->log_sequence = published_log_sequence(tree);
+	__atomic_store_n(&tree->version, version, __ATOMIC_SEQ_CST);
+
+	/* Point the neighbours of the run of new leaf groups at it */
+	if(first) {
+		if(first->prev) {
+			publish_ptr((void **) &first->prev->next, first);
+		}
+		if(last->next) {
+			publish_ptr((void **) &last->next->prev, last);
+		}
+	} else {
+		if(before) {
+			publish_ptr((void **) &before->next, after);
+		}
+		if(after) {
+			publish_ptr((void **) &after->prev, before);
+		}
+	}
+
+	for(i = 0; i < num_copies; i++) {
+		retire(tree, originals[i], sizes[i]);
+	}
+	retire(tree, old_version, sizeof(struct csbpt_version));
+	release_delete_spares(tree, op);
+	reclaim(tree);
+
+	return 0;
+}
+
+/*!
+ *  Deletes the values picked by a delete from a concurrent tree, one at a
+ *  time.  A failure leaves the values before it deleted.
+ *
+ *  \param  tree   Tree to delete from
+ *  \param  op     The delete
+ *
+ *  \retval 0      The values were deleted
+ *  \retval other  An error occurred
+ */
+static int cow_delete_values(struct csbpt *tree, struct delete_op *op)
+{
+	int                   ret = 0;
+	csbpt_key_t           measure;
+	size_t                i;
+	size_t                num_targets = 0;
+	size_t                size = 0;
+	void                 *value;
+	unsigned char        *targets = NULL;
+	unsigned char        *grown;
+	struct csbpt_cursor   cursor;
+
+	/* Pick the values first, since each delete changes the tree */
+	if(!csbpt_cursor_seek(tree, &cursor, op->lo)) {
+		while(!csbpt_cursor_next(&cursor, &measure, &value) && measure <= op->hi) {
+			if(op->predicate && !op->predicate(op->user_data, value)) {
+				continue;
+			}
+
+			if(num_targets == size) {
+				size = size ? 2 * size : 64;
+				grown = realloc(targets, size * CSBPT_ELEM_SIZE);
+
+				if(!grown) {
+					free(targets);
+					errno = ENOMEM;
+					return 1;
+				}
+				targets = grown;
+			}
+
+			make_elem(targets + num_targets++ * CSBPT_ELEM_SIZE, measure, value);
+		}
+	}
+
+	for(i = 0; i < num_targets && !ret; i++) {
+		memcpy(&value, targets + i * CSBPT_ELEM_SIZE + sizeof(csbpt_key_t), sizeof(void *));
+		ret = cow_delete(tree, op, elem_key(targets, i), value);
+
+		if(!ret && op->log_values) {
+			log_append(tree, LOG_REMOVE, elem_key(targets, i), elem_key(targets, i), value);
+		}
+	}
+
+	free(targets);
+
+	return ret;
+}
+
+/*!
+ *  Deletes every value with a measure in a range which is picked by a
+ *  predicate; see csbpt_delete()
+ */
+static int delete_matching(struct csbpt *tree, csbpt_key_t lo, csbpt_key_t hi, void *user_data, csbpt_predicate_fn *predicate, size_t *count)
+{
+	int               ret;
+	size_t            entry = sizeof(struct csbpt_internal_node) > CSBPT_ELEM_SIZE ? sizeof(struct csbpt_internal_node) : CSBPT_ELEM_SIZE;
+	uint64_t          started = STATS_CLOCK();
+	struct delete_op  op;
+
+	if(count) {
+		*count = 0;
+	}
+
+	if(tree->image || tree->origin) {
+		errno = EROFS;
+		return 1;
+	}
+
+	if(lo > hi) {
+		return 0;
+	}
+
+	memset(&op, 0, sizeof(op));
+	op.lo = lo;
+	op.hi = hi;
+	op.predicate = predicate;
+	op.user_data = user_data;
+	op.cow = tree->concurrent;
+	op.scratch = malloc(2 * tree->max_children * entry);
+
+	/* A concurrent delete can fail part way, and a predicate can't be
+	 * replayed, so those log what they removed value by value; anything else
+	 * either clears the whole range or leaves the tree unchanged */
+	op.log_values = tree->log && (predicate || tree->concurrent);
+
+	if(!op.scratch) {
+		errno = ENOMEM;
+		return 1;
+	}
+
+	if(tree->concurrent) {
+		ret = cow_delete_values(tree, &op);
+	} else {
+		ret = delete_values(tree, &op);
+	}
+
+	free(op.scratch);
+
+	if(!ret && tree->log && !op.log_values) {
+		log_append(tree, LOG_DELETE_RANGE, lo, hi, NULL);
+	}
+
+	if(!ret) {
+		STATS_OP(tree, CSBPT_OP_DELETE, started, 1);
+	}
+
+	if(count) {
+		*count = op.count;
+	}
+
+	return ret;
+}
+
+/*!
+ *  Works out the sizes and offsets of a tree's node groups and key arrays
+ *
+ *  \param  tree         Tree being set up
+ *  \param  order        Order of the tree; values below 1 are raised to 1
+ *  \param  leaf_layout  How leaf groups are laid out
+ *  \param  summarized   Whether nodes cache counts and summaries
+ */
+static void init_layout(struct csbpt *tree, int order, enum csbpt_leaf_layout leaf_layout, int summarized)
+{
+	tree->leaf_layout = leaf_layout;
+	tree->min_children = order;
+	if(order <= 0) {
+		tree->min_children = 1;
+	}
+	tree->max_children = 2 * tree->min_children;
+
+	if(tree->leaf_layout == CSBPT_LEAF_SPLIT) {
+		tree->leaf_values = sizeof(struct csbpt_leaf_group) + tree->max_children * sizeof(csbpt_key_t);
+		tree->leaf_values = (tree->leaf_values + sizeof(void *) - 1) / sizeof(void *) * sizeof(void *);
+		tree->leaf_group_size = tree->leaf_values + tree->max_children * sizeof(void *);
+	} else {
+		tree->leaf_values = 0;
+		tree->leaf_group_size = sizeof(struct csbpt_leaf_group) + tree->max_children * CSBPT_ELEM_SIZE;
+	}
+
+	tree->keys_size = tree->max_children * sizeof(csbpt_key_t);
+	tree->summarized = summarized;
+	tree->counts_offset = 0;
+	tree->summaries_offset = 0;
+	if(tree->summarized) {
+		tree->counts_offset = (tree->keys_size + sizeof(long long) - 1) / sizeof(long long) * sizeof(long long);
+		tree->summaries_offset = tree->counts_offset + tree->max_children * sizeof(size_t);
+		tree->keys_size = tree->summaries_offset + tree->max_children * sizeof(long long);
+	}
+}
+
+/*!
+ *  Returns the cache line size of the machine: the larger of the L1 data and
+ *  L2 line sizes, so that a node filling whole lines of one fills whole
+ *  lines of the other.  Falls back to the line size flushed by CLFLUSH, then
+ *  to #CSBPT_DEFAULT_LINE_SIZE.
+ */
+static size_t cache_line_size(void)
+{
+	long          line = 0;
+	long          l2 = 0;
+#ifdef CSBPT_X86_SIMD
+	unsigned int  eax, ebx, ecx, edx;
+#endif
+
+#ifdef _SC_LEVEL1_DCACHE_LINESIZE
+	line = sysconf(_SC_LEVEL1_DCACHE_LINESIZE);
+#endif
+#ifdef _SC_LEVEL2_CACHE_LINESIZE
+	l2 = sysconf(_SC_LEVEL2_CACHE_LINESIZE);
+#endif
+	if(l2 > line) {
+		line = l2;
+	}
+
+#ifdef CSBPT_X86_SIMD
+	/* Reported in units of 8 bytes */
+	if(line <= 0 && __get_cpuid(1, &eax, &ebx, &ecx, &edx)) {
+		line = ((ebx >> 8) & 0xff) * 8;
+	}
+#endif
+
+	if(line < CSBPT_ARENA_ALIGN || line > CSBPT_DEFAULT_PAGE_SIZE || (line & (line - 1))) {
+		line = CSBPT_DEFAULT_LINE_SIZE;
+	}
+
+	return line;
+}
+
+/*!
+ *  Returns the page size of the machine, or #CSBPT_DEFAULT_PAGE_SIZE if it
+ *  doesn't report one
+ */
+static size_t page_size(void)
+{
+	long page = sysconf(_SC_PAGESIZE);
+
+	if(page <= 0) {
+		page = CSBPT_DEFAULT_PAGE_SIZE;
+	}
+
+	return page;
+}
+
+/*!
+ *  Sets up a tree's layout with an order picked from the machine's cache
+ *  line and page sizes; see #CSBPT_ORDER_AUTO.  Starting from keys filling
+ *  #CSBPT_AUTO_MAX_LINES lines, the order is lowered a line at a time until
+ *  a node group, a leaf group and a key array each fit in a page, all sizes
+ *  being rounded up to whole lines.  Keys filling a single line are kept
+ *  even if they don't fit.
+ *
+ *  \param  tree         Tree being set up
+ *  \param  leaf_layout  How leaf groups are laid out
+ *  \param  summarized   Whether nodes cache counts and summaries
+ *
+ *  \return The cache line size the order was picked for
+ */
+static size_t init_auto_layout(struct csbpt *tree, enum csbpt_leaf_layout leaf_layout, int summarized)
+{
+	int     lines;
+	size_t  line = cache_line_size();
+	size_t  page = page_size();
+	size_t  largest;
+
+	for(lines = CSBPT_AUTO_MAX_LINES; lines >= 1; lines--) {
+		init_layout(tree, lines * line / sizeof(csbpt_key_t) / 2, leaf_layout, summarized);
+
+		largest = tree->max_children * sizeof(struct csbpt_internal_node);
+		if(tree->leaf_group_size > largest) {
+			largest = tree->leaf_group_size;
+		}
+		if(tree->keys_size > largest) {
+			largest = tree->keys_size;
+		}
+
+		if((largest + line - 1) / line * line <= page) {
+			break;
+		}
+	}
+
+#ifdef CSBPT_DEBUG
+	fprintf(stderr, "Picked order %d for %d byte cache lines and %d byte pages\n",
+	        (int) tree->min_children, (int) line, (int) page);
+#endif
+
+	return line;
+}
+
+/*
+ *  Public functions
+ */
+
+/*!
+ *  Tuning parameters used when csbpt_create() is not given any
+ */
+static struct csbpt_tune default_tune = {
+	8,                         /* order; 16 int keys fill a 64 byte cache line */
+	0,                         /* initial_height */
+	CSBPT_SEARCH_AUTO,         /* search */
+	CSBPT_LEAF_INTERLEAVED,    /* leaf_layout */
+	NULL,                      /* allocator */
+	NULL,                      /* combinator */
+	0,                         /* concurrent */
+	0,                         /* threads */
+	0,                         /* huge_pages */
+	0,                         /* compress_keys */
+	0                          /* fill_factor */
+};
+
+struct csbpt *csbpt_create(struct csbpt_tune *tune,
+                           csbpt_measure_fn *measure,
+                           void *initial_values, size_t initial_value_count, size_t initial_value_elem_size)
+{
+	struct csbpt *tree = NULL;
+
+	if(!tune) {
+		tune = &default_tune;
+	}
+
+	/* Without a measure, values can only be inserted with their measures */
+	if(!measure && initial_value_count > 0) {
+		errno = EINVAL;
+		goto csbpt_create_error;
+	}
+
+	if(tune->fill_factor < 0 || tune->fill_factor > 100) {
+		errno = EINVAL;
+		goto csbpt_create_error;
+	}
+
+	tree = malloc(sizeof(struct csbpt));
+
+	if(!tree) {
+		goto csbpt_create_error;
+	}
+
+	arena_init(&tree->arena, tune->allocator);
+	tree->arena.huge_pages = tune->huge_pages;
+	tree->concurrent = tune->concurrent;
+	tree->compress_keys = tune->compress_keys && tune->leaf_layout == CSBPT_LEAF_SPLIT;
+	tree->threads = tune->threads;
+	if(tree->threads < 1) {
+		tree->threads = 1;
+	} else if(tree->threads > CSBPT_MAX_THREADS) {
+		tree->threads = CSBPT_MAX_THREADS;
+	}
+	tree->version = NULL;
+	tree->epoch = 1;
+	tree->readers = NULL;
+	tree->retired = NULL;
+	tree->num_retired = 0;
+	tree->retired_size = 0;
+
+	tree->image = NULL;
+	tree->image_size = 0;
+	tree->image_mapped = 0;
+	tree->origin = NULL;
+	tree->pin = NULL;
+	tree->num_pinned = 0;
+	tree->log = NULL;
+	tree->log_sequence = 0;
+	tree->owned_values = NULL;
+
+	tree->measure = measure;
+	tree->search = select_search(tune->search);
+	if(tune->combinator) {
+		tree->combinator = *tune->combinator;
+	}
+	if(tune->order == CSBPT_ORDER_AUTO) {
+		tree->arena.align = init_auto_layout(tree, tune->leaf_layout, tune->combinator != NULL);
+	} else {
+		init_layout(tree, tune->order, tune->leaf_layout, tune->combinator != NULL);
+	}
+
+#ifdef CSBPT_DEBUG
+	tree->bytes_used = 0;
+#endif
+#ifdef CSBPT_STATS
+	tree->stats_id = __atomic_add_fetch(&stats_ids, 1, __ATOMIC_RELAXED);
+	tree->thread_stats = NULL;
+#endif
+
+	/* Empty levels would break the minimum fan-out, so an empty tree starts
+	 * with a single leaf group and grows as values are inserted */
+	tree->height = 1;
+
+	if(initial_value_count > 0) {
+		if(bulk_load_tree(tree, initial_values, initial_value_count, initial_value_elem_size, tune->initial_height, tune->fill_factor)) {
+			goto csbpt_create_error;
+		}
+	} else {
+		tree->root = arena_alloc(&tree->arena, sizeof(struct csbpt_internal_node));
+
+		if(!tree->root) {
+			goto csbpt_create_error;
+		}
+
+#ifdef CSBPT_DEBUG
+		fprintf(stderr, "Creating tree of height %d, min children %d, and max children %d\n", tree->height, tree->min_children, tree->max_children);
+#endif
+
+		if(alloc_tree(tree, tree->root, tree->height - 1)) {
+			goto csbpt_create_error;
+		}
+	}
+
+	/* Readers of a concurrent tree find the root through its version */
+	if(tree->concurrent) {
+		tree->version = arena_alloc(&tree->arena, sizeof(struct csbpt_version));
+
+		if(!tree->version) {
+			goto csbpt_create_error;
+		}
+
+		tree->version->root = *tree->root;
+		tree->version->height = tree->height;
+		arena_free(&tree->arena, tree->root, sizeof(struct csbpt_internal_node));
+		tree->root = &tree->version->root;
+	}
+
+#ifdef CSBPT_DEBUG
+	fprintf(stderr, "Tree's memory footprint is %d bytes (not including data)\n", tree->bytes_used);
+#endif
+
+	goto csbpt_create_exit;
+
+csbpt_create_error:
+	if(tree) {
+		csbpt_release(tree);
+		tree = NULL;
+	}
+
+csbpt_create_exit:
+	return tree;
+}
+
+
+int csbpt_release(struct csbpt *tree)
+{
+	struct csbpt_reader       *reader;
+	struct csbpt_reader       *next;
+	struct csbpt_value_block  *block;
+#ifdef CSBPT_STATS
+	struct csbpt_thread_stats *counters;
+#endif
+
+#ifdef CSBPT_DEBUG
+	fprintf(stderr, "Destroying tree\n");
+#endif
+
+	/* A pinned version owns nothing but its pin; what it kept alive is
+	 * reclaimed by the next write to the tree it came from */
+	if(tree->origin) {
+		csbpt_reader_unregister(tree->pin);
+		__atomic_sub_fetch(&tree->origin->num_pinned, 1, __ATOMIC_RELEASE);
+		free(tree);
+		return 0;
+	}
+
+	if(__atomic_load_n(&tree->num_pinned, __ATOMIC_ACQUIRE) || tree->log) {
+		errno = EBUSY;
+		return 1;
+	}
+
+	for(reader = tree->readers; reader; reader = next) {
+		next = reader->next;
+		free(reader);
+	}
+	free(tree->retired);
+
+	while(tree->owned_values) {
+		block = tree->owned_values;
+		tree->owned_values = block->next;
+		free(block);
+	}
+
+#ifdef CSBPT_STATS
+	while(tree->thread_stats) {
+		counters = tree->thread_stats;
+		tree->thread_stats = counters->next;
+		free(counters);
+	}
+#endif
+
+	if(tree->image_mapped) {
+		munmap(tree->image, tree->image_size);
+	} else {
+		free(tree->image);
+	}
+
+	/* Every node, leaf and key array lives in the arena */
+	arena_release(&tree->arena);
+	free(tree);
+
+	return 0;
+}
+
+/*!
+ *  Adds the memory held below a node to a set of statistics
+ *
+ *  \param  tree   Tree being measured
+ *  \param  level  Level of \c node; the root is level 0
+ *  \param  node   Node whose children are measured
+ *  \param  stats  Statistics to add to
+ */
+static void memory_stats_node(struct csbpt *tree, int level, struct csbpt_internal_node *node,
+                              struct csbpt_memory_stats *stats)
+{
+	int                          i;
+	struct csbpt_internal_node  *group;
+	struct csbpt_level_stats    *below = &stats->levels[level + 1];
+
+	if(level == tree->height - 1) {
+		below->groups++;
+		below->entries += ((struct csbpt_leaf_group *) node->children)->num_elems;
+		below->bytes += tree->leaf_group_size;
+		return;
+	}
+
+	group = (struct csbpt_internal_node *) node->children;
+
+	below->groups++;
+	below->entries += node->num_keys;
+	below->bytes += tree->max_children * sizeof(struct csbpt_internal_node);
+
+	for(i = 0; i < node->num_keys; i++) {
+		if(group[i].keys && (level + 1 < tree->height - 1 || bottom_keys_needed(tree))) {
+			below->bytes += tree->keys_size;
+		}
+
+		memory_stats_node(tree, level + 1, &group[i], stats);
+	}
+}
+
+/*!
+ *  Returns how many bytes of an arena's slabs lie within a range of addresses
+ */
+static size_t slab_overlap(struct csbpt_arena *arena, uintptr_t start, uintptr_t end)
+{
+	size_t               ret = 0;
+	uintptr_t            lo, hi;
+	struct csbpt_slab   *slab;
+
+	for(slab = arena->slabs; slab; slab = slab->next) {
+		lo = (uintptr_t) slab > start ? (uintptr_t) slab : start;
+		hi = (uintptr_t) slab + slab->size < end ? (uintptr_t) slab + slab->size : end;
+		if(lo < hi && slab->source != CSBPT_SLAB_HUGETLB) {
+			ret += hi - lo;
+		}
+	}
+
+	return ret;
+}
+
+/*!
+ *  Works out how much of an arena the kernel backs with transparent huge
+ *  pages, from the \c AnonHugePages of each mapping in \c /proc/self/smaps
+ *  which holds slabs.  A mapping which also holds other memory has its huge
+ *  pages shared out in proportion.
+ *
+ *  \return The number of bytes, or 0 if \c /proc/self/smaps can't be read
+ */
+static size_t thp_bytes(struct csbpt_arena *arena)
+{
+	char                 line[256];
+	unsigned long        lo, hi;
+	unsigned long        start = 0;
+	unsigned long        end = 0;
+	unsigned long        kb;
+	size_t               overlap = 0;
+	size_t               ret = 0;
+	FILE                *smaps;
+
+	smaps = fopen("/proc/self/smaps", "r");
+
+	if(!smaps) {
+		return 0;
+	}
+
+	while(fgets(line, sizeof(line), smaps)) {
+		/* Field names such as AnonHugePages start with a hex digit, so
+		 * the range is only taken from lines which hold a whole one */
+		if(sscanf(line, "%lx-%lx ", &lo, &hi) == 2) {
+			start = lo;
+			end = hi;
+			overlap = slab_overlap(arena, start, end);
+		} else if(overlap > 0 && sscanf(line, "AnonHugePages: %lu kB", &kb) == 1) {
+			ret += (size_t) ((double) kb * 1024 * overlap / (end - start));
+		}
+	}
+
+	fclose(smaps);
+
+	return ret;
+}
+
+int csbpt_memory_stats(struct csbpt *tree, struct csbpt_memory_stats *stats)
+{
+	int                  i;
+	size_t               used = 0;
+	struct csbpt_slab   *slab;
+
+	if(tree->image || tree->origin) {
+		errno = ENOTSUP;
+		return 1;
+	}
+
+	if(tree->height + 1 > CSBPT_STATS_LEVELS) {
+		errno = EOVERFLOW;
+		return 1;
+	}
+
+	memset(stats, 0, sizeof(struct csbpt_memory_stats));
+	stats->levels_used = tree->height + 1;
+
+	stats->levels[0].entries = 1;
+	stats->levels[0].bytes = sizeof(struct csbpt_internal_node);
+	if(tree->root->keys && (tree->height > 1 || bottom_keys_needed(tree))) {
+		stats->levels[0].bytes += tree->keys_size;
+	}
+
+	memory_stats_node(tree, 0, tree->root, stats);
+
+	for(slab = tree->arena.slabs; slab; slab = slab->next) {
+		stats->slab_bytes += slab->size;
+		if(slab->source == CSBPT_SLAB_HUGETLB) {
+			stats->hugetlb_bytes += slab->size;
+		}
+	}
+	stats->thp_bytes = thp_bytes(&tree->arena);
+
+	for(i = 0; i < stats->levels_used; i++) {
+		used += stats->levels[i].bytes;
+	}
+	stats->unused_bytes = stats->slab_bytes - used;
+
+	return 0;
+}
+
+#ifdef CSBPT_STATS
+
+int csbpt_stats_get(struct csbpt *tree, struct csbpt_stats *stats)
+{
+	int                         op;
+	int                         i;
+	uint64_t                    max;
+	struct csbpt_thread_stats  *block;
+	struct csbpt_stats         *from;
+	struct csbpt_histogram     *histogram;
+
+	if(tree->origin) {
+		tree = tree->origin;
+	}
+
+	memset(stats, 0, sizeof(struct csbpt_stats));
+
+	for(block = __atomic_load_n(&tree->thread_stats, __ATOMIC_ACQUIRE); block; block = block->next) {
+		from = &block->stats;
+
+		for(op = 0; op < CSBPT_NUM_OPS; op++) {
+			stats->ops[op] += __atomic_load_n(&from->ops[op], __ATOMIC_RELAXED);
+
+			histogram = &stats->latency[op];
+			histogram->count += __atomic_load_n(&from->latency[op].count, __ATOMIC_RELAXED);
+			histogram->total_ns += __atomic_load_n(&from->latency[op].total_ns, __ATOMIC_RELAXED);
+			max = __atomic_load_n(&from->latency[op].max_ns, __ATOMIC_RELAXED);
+			if(max > histogram->max_ns) {
+				histogram->max_ns = max;
+			}
+			for(i = 0; i < CSBPT_HISTOGRAM_BUCKETS; i++) {
+				histogram->buckets[i] += __atomic_load_n(&from->latency[op].buckets[i], __ATOMIC_RELAXED);
+			}
+		}
+
+		stats->lookups += __atomic_load_n(&from->lookups, __ATOMIC_RELAXED);
+		stats->nodes_visited += __atomic_load_n(&from->nodes_visited, __ATOMIC_RELAXED);
+		stats->values_scanned += __atomic_load_n(&from->values_scanned, __ATOMIC_RELAXED);
+		stats->splits += __atomic_load_n(&from->splits, __ATOMIC_RELAXED);
+		stats->merges += __atomic_load_n(&from->merges, __ATOMIC_RELAXED);
+	}
+
+	return 0;
+}
+
+#endif /* CSBPT_STATS */
+
+struct csbpt_reader *csbpt_reader_register(struct csbpt *tree)
+{
+	int                   in_use;
+	struct csbpt_reader  *reader;
+
+	/* Take over a record a departed reader left behind, if there is one */
+	for(reader = __atomic_load_n(&tree->readers, __ATOMIC_ACQUIRE); reader; reader = reader->next) {
+		in_use = 0;
+		if(__atomic_compare_exchange_n(&reader->in_use, &in_use, 1, 0, __ATOMIC_ACQ_REL, __ATOMIC_RELAXED)) {
+			return reader;
+		}
+	}
+
+	if(posix_memalign((void **) &reader, sizeof(struct csbpt_reader), sizeof(struct csbpt_reader))) {
+		errno = ENOMEM;
+		return NULL;
+	}
+
+	memset(reader, 0, sizeof(struct csbpt_reader));
+	reader->in_use = 1;
+	reader->tree = tree;
+	reader->next = __atomic_load_n(&tree->readers, __ATOMIC_RELAXED);
+
+	while(!__atomic_compare_exchange_n(&tree->readers, &reader->next, reader, 1, __ATOMIC_RELEASE, __ATOMIC_RELAXED));
+
+	return reader;
+}
+
+int csbpt_reader_unregister(struct csbpt_reader *reader)
+{
+	__atomic_store_n(&reader->epoch, 0, __ATOMIC_RELEASE);
+	__atomic_store_n(&reader->in_use, 0, __ATOMIC_RELEASE);
+
+	return 0;
+}
+
+void csbpt_read_begin(struct csbpt_reader *reader)
+{
+	__atomic_store_n(&reader->epoch, __atomic_load_n(&reader->tree->epoch, __ATOMIC_SEQ_CST), __ATOMIC_SEQ_CST);
+}
+
+void csbpt_read_end(struct csbpt_reader *reader)
+{
+	__atomic_store_n(&reader->epoch, 0, __ATOMIC_RELEASE);
+}
+
+struct csbpt *csbpt_snapshot(struct csbpt *tree)
+{
+	struct csbpt          *pinned;
+	struct csbpt_reader   *pin;
+	struct csbpt_version  *version;
+
+	if(!tree->concurrent) {
+		errno = EINVAL;
+		return NULL;
+	}
+
+	pinned = calloc(1, sizeof(struct csbpt));
+	pin = pinned ? csbpt_reader_register(tree) : NULL;
+
+	if(!pin) {
+		free(pinned);
+		errno = ENOMEM;
+		return NULL;
+	}
+
+	/* Entering the current epoch before loading the version keeps everything
+	 * reachable from it out of reclaim() until the pin is dropped, exactly
+	 * as for a reader which never calls csbpt_read_end() */
+	csbpt_read_begin(pin);
+	version = __atomic_load_n(&tree->version, __ATOMIC_ACQUIRE);
+
+	/* Only what the writer never changes is read from the tree itself;
+	 * everything else comes from the version or stays zero */
+	pinned->min_children = tree->min_children;
+	pinned->max_children = tree->max_children;
+	pinned->measure = tree->measure;
+	pinned->search = tree->search;
+	pinned->leaf_layout = tree->leaf_layout;
+	pinned->leaf_group_size = tree->leaf_group_size;
+	pinned->leaf_values = tree->leaf_values;
+	pinned->keys_size = tree->keys_size;
+	pinned->summarized = tree->summarized;
+	pinned->counts_offset = tree->counts_offset;
+	pinned->summaries_offset = tree->summaries_offset;
+	pinned->combinator = tree->combinator;
+	pinned->threads = tree->threads;
+	pinned->compress_keys = tree->compress_keys;
+	pinned->root = &version->root;
+	pinned->height = version->height;
+	pinned->log_sequence = version->log_sequence;
+	pinned->origin = tree;
+	pinned->pin = pin;
+
+	__atomic_add_fetch(&tree->num_pinned, 1, __ATOMIC_RELEASE);
+
+	return pinned;
+}
+
+int csbpt_insert(struct csbpt *tree, void *value)
+{
+	return write_value(tree, value, INSERT_SORTED);
+}
+
+int csbpt_push_left(struct csbpt *tree, void *value)
+{
+	return write_value(tree, value, INSERT_LEFT);
+}
+
+int csbpt_push_right(struct csbpt *tree, void *value)
+{
+	return write_value(tree, value, INSERT_RIGHT);
+}
+
+int csbpt_insert_measured(struct csbpt *tree, csbpt_key_t measure, void *value)
+{
+	return write_measured(tree, measure, value, INSERT_SORTED);
+}
+
+int csbpt_insert_batch(struct csbpt *tree, void *values, size_t count, size_t elem_size)
+{
+	size_t          i;
+	unsigned char  *elems;
+	unsigned char  *value;
+	csbpt_key_t     measure;
+	uint64_t        started = STATS_CLOCK();
+
+	if(tree->image || tree->origin) {
+		errno = EROFS;
+		return 1;
+	}
+
+	if(!tree->measure) {
+		errno = EINVAL;
+		return 1;
+	}
+
+	if(count == 0) {
+		return 0;
+	}
+
+	/* Readers of a concurrent tree may be anywhere in it, so each value gets
+	 * its own copy-on-write insert */
+	if(tree->concurrent) {
+		for(i = 0; i < count; i++) {
+			value = ((unsigned char *) values) + i * elem_size;
+			if(write_measured(tree, tree->measure(value), value, INSERT_SORTED)) {
+				return 1;
+			}
+		}
+
+		return 0;
+	}
+
+	elems = measure_values(tree, values, count, elem_size);
+
+	if(!elems || insert_batch(tree, elems, count)) {
+		return 1;
+	}
+
+	STATS_OP(tree, CSBPT_OP_INSERT, started, count);
+
+	/* The batch keeps values with equal measures in order, as inserting
+	 * them one at a time does on replay */
+	for(i = 0; tree->log && i < count; i++) {
+		value = ((unsigned char *) values) + i * elem_size;
+		measure = tree->measure(value);
+		log_append(tree, LOG_INSERT, measure, measure, value);
+	}
+
+	return 0;
+}
+
+int csbpt_insert_pairs(struct csbpt *tree, const csbpt_key_t *measures, void *const *values, size_t count)
+{
+	size_t          i;
+	unsigned char  *elems;
+	uint64_t        started = STATS_CLOCK();
+
+	if(tree->image || tree->origin) {
+		errno = EROFS;
+		return 1;
+	}
+
+	if(count == 0) {
+		return 0;
+	}
+
+	if(tree->concurrent) {
+		for(i = 0; i < count; i++) {
+			if(write_measured(tree, measures[i], values[i], INSERT_SORTED)) {
+				return 1;
+			}
+		}
+
+		return 0;
+	}
+
+	elems = pair_values(tree, measures, values, count);
+
+	if(!elems || insert_batch(tree, elems, count)) {
+		return 1;
+	}
+
+	STATS_OP(tree, CSBPT_OP_INSERT, started, count);
+
+	for(i = 0; tree->log && i < count; i++) {
+		log_append(tree, LOG_INSERT, measures[i], measures[i], values[i]);
+	}
+
+	return 0;
+}
+
+int csbpt_delete(struct csbpt *tree, csbpt_key_t measure, void *user_data, csbpt_predicate_fn *predicate, size_t *count)
+{
+	return delete_matching(tree, measure, measure, user_data, predicate, count);
+}
+
+int csbpt_delete_pred(struct csbpt *tree, void *user_data, csbpt_predicate_fn *predicate, size_t *count)
+{
+	return delete_matching(tree, CSBPT_KEY_MIN, CSBPT_KEY_MAX, user_data, predicate, count);
+}
+
+int csbpt_delete_range(struct csbpt *tree, csbpt_key_t lo, csbpt_key_t hi, size_t *count)
+{
+	return delete_matching(tree, lo, hi, NULL, NULL, count);
+}
+
+int csbpt_find_value(struct csbpt *tree, csbpt_key_t measure, void *user_data, csbpt_action_fn *action)
+{
+	int                          i;
+	int                          height;
+	int                          found = 0;
+	int                          visited;
+	size_t                       j = 0;
+	uint64_t                     started = STATS_CLOCK();
+	struct csbpt_internal_node  *node = read_root(tree, &height);
+	struct csbpt_leaf_group     *leaf;
+
+	for(i = 0; i < height; i++) {
+		j = search_node(tree, node, i == height - 1, measure);
+
+		if(j == node->num_keys) {
+			visited = i + 1;
+			goto csbpt_find_value_exit;
+		}
+
+		if(i < height - 1) {
+			node = &((struct csbpt_internal_node *) node_children(tree, node))[j];
+		}
+	}
+
+	/* Equal measures may carry on into the following leaf groups */
+	visited = height - 1;
+	for(leaf = (struct csbpt_leaf_group *) node_children(tree, node); leaf; leaf = leaf_next(tree, leaf), j = 0) {
+		visited++;
+
+		for(; j < leaf->num_elems; j++) {
+			if(leaf_key(tree, leaf, j) != measure) {
+				goto csbpt_find_value_exit;
+			}
+
+			found++;
+			if(action && action(user_data, leaf_value(tree, leaf, j))) {
+				goto csbpt_find_value_exit;
+			}
+		}
+	}
+
+csbpt_find_value_exit:
+	STATS_LOOKUPS(tree, 1, visited);
+	STATS_OP(tree, CSBPT_OP_FIND, started, 1);
+
+	return found;
+}
+
+/*!
+ *  Starts loading every cache line of a range of memory
+ *
+ *  \param  addr   Start of the range
+ *  \param  size   Size of the range in bytes
+ */
+static void prefetch_range(const void *addr, size_t size)
+{
+#ifdef __GNUC__
+	uintptr_t line;
+
+	for(line = (uintptr_t) addr & ~(uintptr_t) 63; line < (uintptr_t) addr + size; line += 64) {
+		__builtin_prefetch((const void *) line, 0, 3);
+	}
+#endif
+}
+
+/*!
+ *  Starts loading a leaf group into the cache
+ *
+ *  \param  tree   Tree the group belongs to
+ *  \param  group  Group to load; may be NULL
+ */
+static void prefetch_leaf_group(struct csbpt *tree, struct csbpt_leaf_group *group)
+{
+	if(group) {
+		prefetch_range(group, tree->leaf_group_size);
+	}
+}
+
+/*!
+ *  Starts loading an element of a leaf group into the cache
+ */
+static void prefetch_leaf_elem(struct csbpt *tree, struct csbpt_leaf_group *group, size_t i)
+{
+	if(tree->leaf_layout == CSBPT_LEAF_SPLIT) {
+		prefetch_range(&leaf_keys(group)[i], sizeof(csbpt_key_t));
+		prefetch_range(&leaf_values(tree, group)[i], sizeof(void *));
+	} else {
+		prefetch_range(leaf_elem(group, i), CSBPT_ELEM_SIZE);
+	}
+}
+
+/*!
+ *  Looks up a handful of measures together; see csbpt_find_batch()
+ *
+ *  Each level is taken in two passes over the lookups.  The first starts
+ *  loading the key array of every lookup's node, and the second searches
+ *  them and starts loading the child each lookup descends to.  By the time a
+ *  lookup's memory is touched, the loads for all the others have been
+ *  issued, so their cache misses overlap instead of following one another.
+ *
+ *  \param  tree      Tree to search
+ *  \param  root      Root node, as returned by read_root()
+ *  \param  height    Height of the tree
+ *  \param  measures  Measures to look up
+ *  \param  count     Number of measures; at most CSBPT_FIND_BATCH
+ *  \param  values    Set to the first value with each measure, or NULL
+ *
+ *  \return The number of measures found
+ */
+static size_t find_lockstep(struct csbpt *tree, struct csbpt_internal_node *root, int height,
+                            const csbpt_key_t *measures, size_t count, void **values)
+{
+	int                          level;
+	size_t                       b;
+	size_t                       j;
+	size_t                       found = 0;
+	size_t                       index[CSBPT_FIND_BATCH];
+	struct csbpt_internal_node  *nodes[CSBPT_FIND_BATCH];
+	struct csbpt_leaf_group     *leaves[CSBPT_FIND_BATCH];
+
+	for(b = 0; b < count; b++) {
+		nodes[b] = root;
+	}
+
+	for(level = 0; level < height; level++) {
+		for(b = 0; b < count; b++) {
+			if(nodes[b]) {
+				prefetch_range(node_keys(tree, nodes[b]), nodes[b]->num_keys * sizeof(csbpt_key_t));
+				if(level == height - 1 && tree->compress_keys) {
+					prefetch_range(node_children(tree, nodes[b]), sizeof(struct csbpt_leaf_group));
+				}
+			}
+		}
+
+		for(b = 0; b < count; b++) {
+			if(!nodes[b]) {
+				continue;
+			}
+
+			j = search_node(tree, nodes[b], level == height - 1, measures[b]);
+
+			/* Larger than every measure in the tree */
+			if(j == nodes[b]->num_keys) {
+				nodes[b] = NULL;
+			} else if(level < height - 1) {
+				nodes[b] = &((struct csbpt_internal_node *) node_children(tree, nodes[b]))[j];
+				prefetch_range(nodes[b], sizeof(struct csbpt_internal_node));
+			} else {
+				leaves[b] = (struct csbpt_leaf_group *) node_children(tree, nodes[b]);
+				index[b] = j;
+				prefetch_leaf_elem(tree, leaves[b], j);
+			}
+		}
+	}
+
+	/* The search stops at the first measure at least as large, so the
+	 * element found is the first with the measure, if there is one */
+	for(b = 0; b < count; b++) {
+		values[b] = NULL;
+
+		if(nodes[b] && leaf_key(tree, leaves[b], index[b]) == measures[b]) {
+			values[b] = leaf_value(tree, leaves[b], index[b]);
+			found++;
+		}
+	}
+
+	return found;
+}
+
+size_t csbpt_find_batch(struct csbpt *tree, const csbpt_key_t *measures, size_t count, void **values)
+{
+	int                          height;
+	size_t                       i;
+	size_t                       found = 0;
+	uint64_t                     started = STATS_CLOCK();
+	struct csbpt_internal_node  *root = read_root(tree, &height);
+
+	for(i = 0; i < count; i += CSBPT_FIND_BATCH) {
+		found += find_lockstep(tree, root, height, measures + i,
+		                       count - i < CSBPT_FIND_BATCH ? count - i : CSBPT_FIND_BATCH, values + i);
+	}
+
+	STATS_LOOKUPS(tree, count, (uint64_t) count * height);
+	STATS_OP(tree, CSBPT_OP_FIND, started, count);
+
+	return found;
+}
+
+/*!
+ *  Walks a tree in order of measure, passing the values a predicate picks
+ *  to an action
+ *
+ *  \param  tree       Tree to walk
+ *  \param  user_data  Passed through to \c predicate and \c action
+ *  \param  predicate  Returns non-zero for each value to pass on
+ *  \param  action     Function to call for each value picked; may be NULL
+ *  \param  first      Non-zero to stop at the first value picked
+ *
+ *  \return The number of values picked
+ */
+static int find_matching(struct csbpt *tree, void *user_data, csbpt_predicate_fn *predicate, csbpt_action_fn *action, int first)
+{
+	int                  found = 0;
+	size_t               scanned = 0;
+	void                *value;
+	uint64_t             started = STATS_CLOCK();
+	struct csbpt_cursor  cursor;
+
+	/* The predicate can't be searched for, so every value is visited */
+	csbpt_cursor_seek(tree, &cursor, CSBPT_KEY_MIN);
+
+	while(!csbpt_cursor_next(&cursor, NULL, &value)) {
+		scanned++;
+		if(!predicate(user_data, value)) {
+			continue;
+		}
+
+		found++;
+		if((action && action(user_data, value)) || first) {
+			break;
+		}
+	}
+
+	STATS_COUNT(tree, values_scanned, scanned);
+	STATS_OP(tree, CSBPT_OP_SCAN, started, 1);
+
+	return found;
+}
+
+int csbpt_find_first_pred(struct csbpt *tree, void *user_data, csbpt_predicate_fn *predicate, csbpt_action_fn *action)
+{
+	return find_matching(tree, user_data, predicate, action, 1);
+}
+
+int csbpt_find_all_pred(struct csbpt *tree, void *user_data, csbpt_predicate_fn *predicate, csbpt_action_fn *action)
+{
+	return find_matching(tree, user_data, predicate, action, 0);
+}
+
+int csbpt_iterate(struct csbpt *tree, void *user_data, csbpt_action_fn *action)
+{
+	int                  found = 0;
+	void                *value;
+	uint64_t             started = STATS_CLOCK();
+	struct csbpt_cursor  cursor;
+
+	csbpt_cursor_seek(tree, &cursor, CSBPT_KEY_MIN);
+
+	while(!csbpt_cursor_next(&cursor, NULL, &value)) {
+		found++;
+		if(action(user_data, value)) {
+			break;
+		}
+	}
+
+	STATS_COUNT(tree, values_scanned, found);
+	STATS_OP(tree, CSBPT_OP_SCAN, started, 1);
+
+	return found;
+}
+
+int csbpt_cursor_seek(struct csbpt *tree, struct csbpt_cursor *cursor, csbpt_key_t measure)
+{
+	int                          i;
+	int                          height;
+	size_t                       j = 0;
+	struct csbpt_internal_node  *node = read_root(tree, &height);
+	struct csbpt_leaf_group     *leaf;
+
+	/* Past the last key, follow the rightmost path to the end of the tree */
+	for(i = 0; i < height - 1; i++) {
+		j = search_keys(tree, node_keys(tree, node), node->num_keys, measure);
+
+		if(j == node->num_keys && j > 0) {
+			j--;
+		}
+
+		node = &((struct csbpt_internal_node *) node_children(tree, node))[j];
+	}
+
+	leaf = (struct csbpt_leaf_group *) node_children(tree, node);
+	prefetch_leaf_group(tree, leaf_next(tree, leaf));
+	STATS_LOOKUPS(tree, 1, height);
+
+	cursor->tree = tree;
+	cursor->group = leaf;
+	cursor->index = search_node(tree, node, 1, measure);
+
+	/* Steps over the end of the group, and any empty groups after it */
+	if(csbpt_cursor_next(cursor, NULL, NULL)) {
+		return 1;
+	}
+	return csbpt_cursor_prev(cursor, NULL, NULL);
+}
+
+int csbpt_cursor_next(struct csbpt_cursor *cursor, csbpt_key_t *measure, void **value)
+{
+	struct csbpt_leaf_group *group = (struct csbpt_leaf_group *) cursor->group;
+
+	while(cursor->index >= group->num_elems) {
+		if(!leaf_next(cursor->tree, group)) {
+			errno = ENOENT;
+			return 1;
+		}
+
+		group = leaf_next(cursor->tree, group);
+		cursor->group = group;
+		cursor->index = 0;
+		prefetch_leaf_group(cursor->tree, leaf_next(cursor->tree, group));
+	}
+
+	if(measure) {
+		*measure = leaf_key(cursor->tree, group, cursor->index);
+	}
+	if(value) {
+		*value = leaf_value(cursor->tree, group, cursor->index);
+	}
+	cursor->index++;
+
+	return 0;
+}
+
+int csbpt_cursor_prev(struct csbpt_cursor *cursor, csbpt_key_t *measure, void **value)
+{
+	struct csbpt_leaf_group *group = (struct csbpt_leaf_group *) cursor->group;
+
+	while(cursor->index == 0) {
+		if(!leaf_prev(cursor->tree, group)) {
+			errno = ENOENT;
+			return 1;
+		}
+
+		group = leaf_prev(cursor->tree, group);
+		cursor->group = group;
+		cursor->index = group->num_elems;
+		prefetch_leaf_group(cursor->tree, leaf_prev(cursor->tree, group));
+	}
+
+	cursor->index--;
+	if(measure) {
+		*measure = leaf_key(cursor->tree, group, cursor->index);
+	}
+	if(value) {
+		*value = leaf_value(cursor->tree, group, cursor->index);
+	}
+
+	return 0;
+}
+
+size_t csbpt_cursor_read(struct csbpt_cursor *cursor, csbpt_key_t *measures, void **values, size_t max)
+{
+	size_t                   i;
+	size_t                   read = 0;
+	uint64_t                 started = STATS_CLOCK();
+	struct csbpt_leaf_group *group = (struct csbpt_leaf_group *) cursor->group;
+
+	while(read < max) {
+		if(cursor->index >= group->num_elems) {
+			if(!leaf_next(cursor->tree, group)) {
+				break;
+			}
+
+			group = leaf_next(cursor->tree, group);
+			cursor->group = group;
+			cursor->index = 0;
+			prefetch_leaf_group(cursor->tree, leaf_next(cursor->tree, group));
+			continue;
+		}
+
+		/* Copy the rest of the group, or as much of it as fits */
+		for(i = cursor->index; i < group->num_elems && read < max; i++, read++) {
+			if(measures) {
+				measures[read] = leaf_key(cursor->tree, group, i);
+			}
+			if(values) {
+				values[read] = leaf_value(cursor->tree, group, i);
+			}
+		}
+		cursor->index = i;
+	}
+
+	STATS_COUNT(cursor->tree, values_scanned, read);
+	STATS_OP(cursor->tree, CSBPT_OP_SCAN, started, 1);
+
+	return read;
+}
+
+int csbpt_find_kth(struct csbpt *tree, size_t k, csbpt_key_t *measure, void **value)
+{
+	int                          level;
+	int                          i;
+	int                          height;
+	struct csbpt_internal_node  *node = read_root(tree, &height);
+	struct csbpt_leaf_group     *leaf;
+
+	if(!tree->summarized) {
+		errno = ENOTSUP;
+		return 1;
+	}
+
+	for(level = 0; level < height - 1; level++) {
+		for(i = 0; i < node->num_keys && k >= node_counts(tree, node)[i]; i++) {
+			k -= node_counts(tree, node)[i];
+		}
+
+		if(i == node->num_keys) {
+			errno = ERANGE;
+			return 1;
+		}
+
+		node = &((struct csbpt_internal_node *) node_children(tree, node))[i];
+	}
+
+	leaf = (struct csbpt_leaf_group *) node_children(tree, node);
+
+	if(k >= leaf->num_elems) {
+		errno = ERANGE;
+		return 1;
+	}
+
+	if(measure) {
+		*measure = leaf_key(tree, leaf, k);
+	}
+	if(value) {
+		*value = leaf_value(tree, leaf, k);
+	}
+
+	return 0;
+}
+
+int csbpt_summarize_prefix(struct csbpt *tree, csbpt_key_t measure, size_t *count, long long *summary)
+{
+	int                          level;
+	int                          i, j;
+	int                          height;
+	size_t                       total = 0;
+	long long                    acc;
+	struct csbpt_internal_node  *node = read_root(tree, &height);
+
+	if(!tree->summarized) {
+		errno = ENOTSUP;
+		return 1;
+	}
+
+	acc = tree->combinator.identity;
+
+	/* Children before the first one with a larger key are included whole */
+	for(level = 0; level < height; level++) {
+		j = search_node_after(tree, node, level == height - 1, measure);
+
+		if(level == height - 1) {
+			total += j;
+			acc = combine(tree, acc, summarize_leaf(tree, (struct csbpt_leaf_group *) node_children(tree, node), j));
+			break;
+		}
+
+		for(i = 0; i < j; i++) {
+			total += node_counts(tree, node)[i];
+			acc = combine(tree, acc, node_summaries(tree, node)[i]);
+		}
+
+		if(j == node->num_keys) {
+			break;
+		}
+
+		node = &((struct csbpt_internal_node *) node_children(tree, node))[j];
+	}
+
+	if(count) {
+		*count = total;
+	}
+	if(summary) {
+		*summary = acc;
+	}
+
+	return 0;
+}
+
+/*
+ *  Snapshots
+ *
+ *  A snapshot is an image of a tree in which every pointer has been replaced
+ *  by its offset from the start of the file.  Searches turn offsets back into
+ *  pointers as they follow them (see resolve()), so a snapshot can be read
+ *  straight out of a mapping of the file.  Opening one takes the same time
+ *  however large the tree is, and each page is only read from disk when a
+ *  search first touches it.  Offset 0 holds the header, so it doubles as
+ *  NULL.
+ *
+ *  After the header come the root node, then, for each level from the root
+ *  down, the key arrays of the level's nodes followed by the node groups
+ *  below them (leaf groups, below the last level), and finally the values.
+ *  Each region starts on a #CSBPT_SNAPSHOT_ALIGN boundary.  Only what can be
+ *  reached from the root is written, and the leaf groups are relinked in
+ *  order, so padding left by a bulk load is dropped.
+ *
+ *  Structures are written as they are laid out in memory, so a snapshot can
+ *  only be read where pointers are the same size and bytes are in the same
+ *  order as where it was written.
+ */
+
+/*!
+ *  \brief Where everything in a snapshot goes
+ */
+struct snapshot_layout {
+	int                           height;                          /*!< Height of the tree                          */
+	int                           keyed[CSBPT_MAX_HEIGHT];         /*!< Whether each level has key arrays of its own */
+	size_t                        num_nodes[CSBPT_MAX_HEIGHT];     /*!< Nodes on each level                         */
+	struct csbpt_internal_node  **nodes[CSBPT_MAX_HEIGHT];         /*!< Nodes on each level, in order               */
+	uint64_t                      keys_at[CSBPT_MAX_HEIGHT];       /*!< Offset of each level's key arrays           */
+	uint64_t                      groups_at[CSBPT_MAX_HEIGHT];     /*!< Offset of the groups below each level       */
+	uint64_t                      root_at;                         /*!< Offset of the root node                     */
+	uint64_t                      values_at;                       /*!< Offset of the values                        */
+	uint64_t                      num_values;                      /*!< Number of values                            */
+	uint64_t                      file_size;                       /*!< Size of the snapshot                        */
+};
+
+/*!
+ *  Rounds a snapshot offset up to the start of the next region
+ */
+static uint64_t snapshot_align(uint64_t offset)
+{
+	return (offset + CSBPT_SNAPSHOT_ALIGN - 1) / CSBPT_SNAPSHOT_ALIGN * CSBPT_SNAPSHOT_ALIGN;
+}
+
+/*!
+ *  Returns the size of the groups below a level of a snapshot
+ */
+static size_t snapshot_group_size(struct csbpt *tree, struct snapshot_layout *layout, int level)
+{
+	if(level == layout->height - 1) {
+		return tree->leaf_group_size;
+	}
+
+	return tree->max_children * sizeof(struct csbpt_internal_node);
+}
+
+/*!
+ *  Lists the nodes on each level of a tree, and works out where they will be
+ *  written
+ *
+ *  \param  tree        Tree to be saved
+ *  \param  value_size  Bytes stored for each value
+ *  \param  layout      Filled in; free with release_snapshot_layout()
+ *
+ *  \retval 0      The layout was worked out
+ *  \retval other  Allocation failed
+ */
+static int plan_snapshot(struct csbpt *tree, size_t value_size, struct snapshot_layout *layout)
+{
+	int                          level;
+	int                          i;
+	size_t                       j;
+	size_t                       n;
+	uint64_t                     offset;
+	struct csbpt_internal_node  *node;
+	struct csbpt_internal_node  *group;
+
+	memset(layout, 0, sizeof(struct snapshot_layout));
+	node = read_root(tree, &layout->height);
+
+	layout->num_nodes[0] = 1;
+	layout->nodes[0] = malloc(sizeof(struct csbpt_internal_node *));
+	if(!layout->nodes[0]) {
+		errno = ENOMEM;
+		return 1;
+	}
+	layout->nodes[0][0] = node;
+
+	for(level = 0; level < layout->height - 1; level++) {
+		n = 0;
+		for(j = 0; j < layout->num_nodes[level]; j++) {
+			n += layout->nodes[level][j]->num_keys;
+		}
+
+		layout->num_nodes[level + 1] = n;
+		layout->nodes[level + 1] = malloc((n ? n : 1) * sizeof(struct csbpt_internal_node *));
+		if(!layout->nodes[level + 1]) {
+			errno = ENOMEM;
+			return 1;
+		}
+
+		n = 0;
+		for(j = 0; j < layout->num_nodes[level]; j++) {
+			node = layout->nodes[level][j];
+			group = (struct csbpt_internal_node *) node_children(tree, node);
+
+			for(i = 0; i < node->num_keys; i++) {
+				layout->nodes[level + 1][n++] = &group[i];
+			}
+		}
+	}
+
+	for(j = 0; j < layout->num_nodes[layout->height - 1]; j++) {
+		layout->num_values += ((struct csbpt_leaf_group *) node_children(tree, layout->nodes[layout->height - 1][j]))->num_elems;
+	}
+
+	offset = snapshot_align(sizeof(struct csbpt_snapshot_header));
+	layout->root_at = offset;
+	offset += sizeof(struct csbpt_internal_node);
+
+	for(level = 0; level < layout->height; level++) {
+		layout->keyed[level] = level < layout->height - 1 || bottom_keys_needed(tree);
+
+		offset = snapshot_align(offset);
+		layout->keys_at[level] = offset;
+		if(layout->keyed[level]) {
+			offset += layout->num_nodes[level] * tree->keys_size;
+		}
+
+		offset = snapshot_align(offset);
+		layout->groups_at[level] = offset;
+		offset += layout->num_nodes[level] * snapshot_group_size(tree, layout, level);
+	}
+
+	layout->values_at = snapshot_align(offset);
+	layout->file_size = layout->values_at + layout->num_values * value_size;
+
+	return 0;
+}
+
+/*!
+ *  Frees the node lists of a snapshot layout
+ */
+static void release_snapshot_layout(struct snapshot_layout *layout)
+{
+	int level;
+
+	for(level = 0; level < layout->height; level++) {
+		free(layout->nodes[level]);
+	}
+}
+
+/*!
+ *  Writes bytes to a snapshot, padding with zeros up to an offset first
+ *
+ *  \param  file    Snapshot being written
+ *  \param  pos     In/out: offset \c file is at
+ *  \param  offset  Where the bytes belong
+ *  \param  data    Bytes to write; NULL writes zeros
+ *  \param  size    Number of bytes
+ *
+ *  \retval 0      The bytes were written
+ *  \retval other  Writing failed
+ */
+static int snapshot_write(FILE *file, uint64_t *pos, uint64_t offset, const void *data, size_t size)
+{
+	static const unsigned char   zeros[CSBPT_SNAPSHOT_ALIGN];
+	uint64_t                     end = data ? offset : offset + size;
+	size_t                       n;
+
+	while(*pos < end) {
+		n = end - *pos < sizeof(zeros) ? end - *pos : sizeof(zeros);
+
+		if(fwrite(zeros, 1, n, file) != n) {
+			errno = EIO;
+			return 1;
+		}
+		*pos += n;
+	}
+
+	if(data && size) {
+		if(fwrite(data, 1, size, file) != size) {
+			errno = EIO;
+			return 1;
+		}
+		*pos += size;
+	}
+
+	return 0;
+}
+
+/*!
+ *  Converts a snapshot offset to the pointer stored in its place
+ */
+static void *snapshot_ptr(uint64_t offset)
+{
+	return (void *) (uintptr_t) offset;
+}
+
+/*!
+ *  Builds the copy of a node written to a snapshot
+ *
+ *  \param  tree    Tree being saved
+ *  \param  layout  Layout of the snapshot
+ *  \param  level   Level of the node
+ *  \param  index   Position of the node within its level
+ *  \param  out     Set to the copy
+ */
+static void snapshot_node(struct csbpt *tree, struct snapshot_layout *layout, int level, size_t index,
+                          struct csbpt_internal_node *out)
+{
+	size_t group_size = snapshot_group_size(tree, layout, level);
+
+	memset(out, 0, sizeof(struct csbpt_internal_node));
+	out->num_keys = layout->nodes[level][index]->num_keys;
+	out->children = snapshot_ptr(layout->groups_at[level] + index * group_size);
+
+	/* Without key arrays of their own, nodes above split leaf groups use
+	 * the group's keys */
+	if(layout->keyed[level]) {
+		out->keys = snapshot_ptr(layout->keys_at[level] + index * tree->keys_size);
+	} else {
+		out->keys = snapshot_ptr(layout->groups_at[level] + index * group_size + sizeof(struct csbpt_leaf_group));
+	}
+}
+
+int csbpt_save(struct csbpt *tree, FILE *file, size_t value_size)
+{
+	int                            ret = 1;
+	int                            level;
+	int                            i;
+	size_t                         j, k;
+	size_t                         child;
+	uint64_t                       pos = 0;
+	uint64_t                       value_index = 0;
+	void                          *value;
+	unsigned char                 *buf = NULL;
+	unsigned char                  elem[CSBPT_ELEM_SIZE];
+	struct csbpt_snapshot_header   header;
+	struct csbpt_internal_node     node;
+	struct csbpt_internal_node    *src;
+	struct csbpt_leaf_group       *leaf;
+	struct csbpt_leaf_group       *out;
+	struct snapshot_layout         layout;
+
+	if(plan_snapshot(tree, value_size, &layout)) {
+		goto csbpt_save_exit;
+	}
+
+	buf = malloc(tree->keys_size > tree->leaf_group_size ? tree->keys_size : tree->leaf_group_size);
+	if(!buf) {
+		errno = ENOMEM;
+		goto csbpt_save_exit;
+	}
+
+	memset(&header, 0, sizeof(header));
+	memcpy(header.magic, CSBPT_SNAPSHOT_MAGIC, sizeof(header.magic));
+	header.version = CSBPT_SNAPSHOT_VERSION;
+	header.byte_order = CSBPT_SNAPSHOT_BYTE_ORDER;
+	header.word_size = sizeof(void *);
+	header.height = layout.height;
+	header.leaf_layout = tree->leaf_layout;
+	header.summarized = tree->summarized;
+	header.key_bits = CSBPT_KEY_BITS;
+	header.key_signed = CSBPT_KEY_SIGNED;
+	header.compress_keys = tree->compress_keys;
+	header.min_children = tree->min_children;
+	header.max_children = tree->max_children;
+	header.leaf_group_size = tree->leaf_group_size;
+	header.leaf_values = tree->leaf_values;
+	header.keys_size = tree->keys_size;
+	header.counts_offset = tree->counts_offset;
+	header.summaries_offset = tree->summaries_offset;
+	header.identity = tree->summarized ? tree->combinator.identity : 0;
+	header.value_size = value_size;
+	header.num_values = layout.num_values;
+	header.root = layout.root_at;
+	header.file_size = layout.file_size;
+	header.log_sequence = tree->log_sequence;
+
+	if(snapshot_write(file, &pos, 0, &header, sizeof(header))) {
+		goto csbpt_save_exit;
+	}
+
+	snapshot_node(tree, &layout, 0, 0, &node);
+	if(snapshot_write(file, &pos, layout.root_at, &node, sizeof(node))) {
+		goto csbpt_save_exit;
+	}
+
+	for(level = 0; level < layout.height; level++) {
+		/* Key arrays, with the unused entries zeroed */
+		for(j = 0; layout.keyed[level] && j < layout.num_nodes[level]; j++) {
+			src = layout.nodes[level][j];
+
+			memset(buf, 0, tree->keys_size);
+			memcpy(buf, node_keys(tree, src), src->num_keys * sizeof(csbpt_key_t));
+			if(tree->summarized && level < layout.height - 1) {
+				memcpy(buf + tree->counts_offset, node_counts(tree, src), src->num_keys * sizeof(size_t));
+				memcpy(buf + tree->summaries_offset, node_summaries(tree, src), src->num_keys * sizeof(long long));
+			}
+
+			if(snapshot_write(file, &pos, layout.keys_at[level] + j * tree->keys_size, buf, tree->keys_size)) {
+				goto csbpt_save_exit;
+			}
+		}
+
+		/* Node groups, whose children are numbered in order across the
+		 * whole of the next level */
+		if(level < layout.height - 1) {
+			child = 0;
+
+			for(j = 0; j < layout.num_nodes[level]; j++) {
+				src = layout.nodes[level][j];
+
+				for(i = 0; i < tree->max_children; i++) {
+					if(i < src->num_keys) {
+						snapshot_node(tree, &layout, level + 1, child++, &node);
+					} else {
+						memset(&node, 0, sizeof(node));
+					}
+
+					if(snapshot_write(file, &pos, layout.groups_at[level] + (j * tree->max_children + i) * sizeof(node), &node, sizeof(node))) {
+						goto csbpt_save_exit;
+					}
+				}
+			}
+
+			continue;
+		}
+
+		/* Leaf groups, relinked in order, with values replaced by their
+		 * offsets */
+		for(j = 0; j < layout.num_nodes[level]; j++) {
+			leaf = (struct csbpt_leaf_group *) node_children(tree, layout.nodes[level][j]);
+			out = (struct csbpt_leaf_group *) buf;
+
+			memset(buf, 0, tree->leaf_group_size);
+			out->num_elems = leaf->num_elems;
+			if(j > 0) {
+				out->prev = snapshot_ptr(layout.groups_at[level] + (j - 1) * tree->leaf_group_size);
+			}
+			if(j + 1 < layout.num_nodes[level]) {
+				out->next = snapshot_ptr(layout.groups_at[level] + (j + 1) * tree->leaf_group_size);
+			}
+
+			for(k = 0; k < leaf->num_elems; k++) {
+				make_elem(elem, leaf_key(tree, leaf, k), value_size ? snapshot_ptr(layout.values_at + value_index * value_size) : NULL);
+				leaf_put_elems(tree, out, k, elem, 1);
+				value_index++;
+			}
+			compress_leaf(tree, out);
+
+			if(snapshot_write(file, &pos, layout.groups_at[level] + j * tree->leaf_group_size, buf, tree->leaf_group_size)) {
+				goto csbpt_save_exit;
+			}
+		}
+	}
+
+	value_index = 0;
+	for(j = 0; value_size && j < layout.num_nodes[layout.height - 1]; j++) {
+		leaf = (struct csbpt_leaf_group *) node_children(tree, layout.nodes[layout.height - 1][j]);
+
+		for(k = 0; k < leaf->num_elems; k++) {
+			value = leaf_value(tree, leaf, k);
+
+			if(snapshot_write(file, &pos, layout.values_at + value_index * value_size, value, value_size)) {
+				goto csbpt_save_exit;
+			}
+			value_index++;
+		}
+	}
+
+	if(snapshot_write(file, &pos, layout.file_size, NULL, 0) || fflush(file)) {
+		errno = EIO;
+		goto csbpt_save_exit;
+	}
+
+	ret = 0;
+
+csbpt_save_exit:
+	release_snapshot_layout(&layout);
+	free(buf);
+
+	return ret;
+}
+
+/*!
+ *  Checks that an image holds a snapshot this build can read, and wraps it
+ *  in a tree.  The tree takes ownership of the image.
+ *
+ *  \param  image   The snapshot
+ *  \param  size    Size of \c image
+ *  \param  mapped  Whether \c image is a mapping, rather than allocated
+ *  \param  tune    Search kernel and combinator to use; may be NULL
+ *
+ *  \retval NULL   The image is not a usable snapshot; it is left alone
+ *  \retval other  The tree
+ */
+static struct csbpt *open_snapshot(unsigned char *image, size_t size, int mapped, struct csbpt_tune *tune)
+{
+	struct csbpt                  *tree;
+	struct csbpt_snapshot_header  *header = (struct csbpt_snapshot_header *) image;
+
+	if(size < sizeof(struct csbpt_snapshot_header) || memcmp(header->magic, CSBPT_SNAPSHOT_MAGIC, sizeof(header->magic))) {
+		errno = EINVAL;
+		return NULL;
+	}
+
+	if(header->version != CSBPT_SNAPSHOT_VERSION || header->byte_order != CSBPT_SNAPSHOT_BYTE_ORDER ||
+	   header->word_size != sizeof(void *)) {
+		errno = ENOTSUP;
+		return NULL;
+	}
+
+	/* The measures must be read by the instance of the tree they were
+	 * written by */
+	if(header->key_bits != CSBPT_KEY_BITS || header->key_signed != CSBPT_KEY_SIGNED) {
+		errno = EINVAL;
+		return NULL;
+	}
+
+	if(header->file_size != size || header->root + sizeof(struct csbpt_internal_node) > size ||
+	   header->height < 1 || header->height > CSBPT_MAX_HEIGHT ||
+	   header->leaf_layout < CSBPT_LEAF_INTERLEAVED || header->leaf_layout > CSBPT_LEAF_SPLIT ||
+	   header->min_children < 1 || header->min_children > INT_MAX / 2) {
+		errno = EINVAL;
+		return NULL;
+	}
+
+	tree = malloc(sizeof(struct csbpt));
+	if(!tree) {
+		errno = ENOMEM;
+		return NULL;
+	}
+
+	memset(tree, 0, sizeof(struct csbpt));
+	init_layout(tree, header->min_children, header->leaf_layout, header->summarized != 0);
+
+	if(tree->max_children != header->max_children || tree->leaf_group_size != header->leaf_group_size ||
+	   tree->leaf_values != header->leaf_values || tree->keys_size != header->keys_size ||
+	   tree->counts_offset != header->counts_offset || tree->summaries_offset != header->summaries_offset) {
+		free(tree);
+		errno = EINVAL;
+		return NULL;
+	}
+
+	if(tune && tune->combinator) {
+		tree->combinator = *tune->combinator;
+	}
+	tree->combinator.identity = header->identity;
+
+	arena_init(&tree->arena, NULL);
+	tree->search = select_search(tune ? tune->search : CSBPT_SEARCH_AUTO);
+	tree->threads = 1;
+	tree->epoch = 1;
+	tree->compress_keys = header->compress_keys != 0;
+	tree->height = header->height;
+	tree->image = image;
+	tree->image_size = size;
+	tree->image_mapped = mapped;
+	tree->origin = NULL;
+	tree->pin = NULL;
+	tree->num_pinned = 0;
+	tree->log_sequence = header->log_sequence;
+	tree->root = (struct csbpt_internal_node *) (image + header->root);
+#ifdef CSBPT_STATS
+	tree->stats_id = __atomic_add_fetch(&stats_ids, 1, __ATOMIC_RELAXED);
+#endif
+
+	return tree;
+}
+
+struct csbpt *csbpt_load(FILE *file, struct csbpt_tune *tune)
+{
+	unsigned char                 *image;
+	struct csbpt                  *tree;
+	struct csbpt_snapshot_header   header;
+
+	if(fread(&header, 1, sizeof(header), file) != sizeof(header)) {
+		errno = EINVAL;
+		return NULL;
+	}
+
+	if(memcmp(header.magic, CSBPT_SNAPSHOT_MAGIC, sizeof(header.magic)) || header.file_size < sizeof(header) ||
+	   header.file_size > SIZE_MAX) {
+		errno = EINVAL;
+		return NULL;
+	}
+
+	if(posix_memalign((void **) &image, CSBPT_SNAPSHOT_ALIGN, header.file_size)) {
+		errno = ENOMEM;
+		return NULL;
+	}
+
+	memcpy(image, &header, sizeof(header));
+	if(fread(image + sizeof(header), 1, header.file_size - sizeof(header), file) != header.file_size - sizeof(header)) {
+		free(image);
+		errno = EINVAL;
+		return NULL;
+	}
+
+	tree = open_snapshot(image, header.file_size, 0, tune);
+	if(!tree) {
+		free(image);
+	}
+
+	return tree;
+}
+
+struct csbpt *csbpt_load_mmap(const char *path, struct csbpt_tune *tune)
+{
+	int            fd;
+	int            err;
+	void          *image;
+	struct stat    st;
+	struct csbpt  *tree;
+
+	fd = open(path, O_RDONLY);
+	if(fd < 0) {
+		return NULL;
+	}
+
+	if(fstat(fd, &st)) {
+		err = errno;
+		close(fd);
+		errno = err;
+		return NULL;
+	}
+
+	if(st.st_size < (off_t) sizeof(struct csbpt_snapshot_header)) {
+		close(fd);
+		errno = EINVAL;
+		return NULL;
+	}
+
+	/* The mapping outlives the descriptor */
+	image = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+	err = errno;
+	close(fd);
+
+	if(image == MAP_FAILED) {
+		errno = err;
+		return NULL;
+	}
+
+	tree = open_snapshot(image, st.st_size, 1, tune);
+	if(!tree) {
+		err = errno;
+		munmap(image, st.st_size);
+		errno = err;
+	}
+
+	return tree;
+}
+
+/*!
+ *  Makes the creation, renaming or removal of a file durable by syncing the
+ *  directory it is in
+ *
+ *  \retval 0      The directory was synced
+ *  \retval other  An error occurred, and \c errno is set
+ */
+static int sync_parent(const char *path)
+{
+	int    fd;
+	int    err;
+	char  *dir = strdup(path);
+	char  *slash;
+
+	if(!dir) {
+		errno = ENOMEM;
+		return 1;
+	}
+
+	slash = strrchr(dir, '/');
+	if(slash == dir) {
+		slash[1] = '\0';
+	} else if(slash) {
+		*slash = '\0';
+	}
+
+	fd = open(slash ? dir : ".", O_RDONLY | O_DIRECTORY);
+	err = errno;
+	free(dir);
+
+	if(fd < 0) {
+		errno = err;
+		return 1;
+	}
+
+	if(fsync(fd)) {
+		err = errno;
+		close(fd);
+		errno = err;
+		return 1;
+	}
+
+	close(fd);
+
+	return 0;
+}
+
+/*!
+ *  Checks that a log was written by a tree like this one
+ *
+ *  \param  image       Start of the log
+ *  \param  size        Size of the log
+ *  \param  value_size  Bytes the caller expects each value to have
+ *
+ *  \retval 0      The header is usable
+ *  \retval other  It is not, and \c errno is set to \c EINVAL or \c ENOTSUP
+ *                 as for snapshots
+ */
+static int check_log_header(const unsigned char *image, size_t size, size_t value_size)
+{
+	struct csbpt_log_header header;
+
+	if(size < sizeof(header)) {
+		errno = EINVAL;
+		return 1;
+	}
+
+	memcpy(&header, image, sizeof(header));
+
+	if(memcmp(header.magic, CSBPT_LOG_MAGIC, sizeof(header.magic)) ||
+	   header.checksum != crc32c(0, &header, offsetof(struct csbpt_log_header, checksum))) {
+		errno = EINVAL;
+		return 1;
+	}
+
+	if(header.version != CSBPT_LOG_VERSION || header.byte_order != CSBPT_SNAPSHOT_BYTE_ORDER) {
+		errno = ENOTSUP;
+		return 1;
+	}
+
+	if(header.key_bits != CSBPT_KEY_BITS || header.key_signed != CSBPT_KEY_SIGNED || header.value_size != value_size) {
+		errno = EINVAL;
+		return 1;
+	}
+
+	return 0;
+}
+
+/*!
+ *  Reads a record from a log, if it was written in full
+ *
+ *  \param  image       Start of the log
+ *  \param  size        Size of the log
+ *  \param  offset      Where the record starts
+ *  \param  value_size  Bytes stored for each value
+ *  \param  sequence    Sequence number the record must have
+ *  \param  record      Set to the record's header
+ *
+ *  \return The size of the record and its value, or 0 if the log ends
+ *          before it, or it is torn, or it is not the record expected
+ */
+static size_t read_log_record(const unsigned char *image, size_t size, size_t offset, size_t value_size,
+                              uint64_t sequence, struct csbpt_log_record *record)
+{
+	size_t record_size;
+
+	if(size - offset < sizeof(struct csbpt_log_record)) {
+		return 0;
+	}
+
+	memcpy(record, image + offset, sizeof(struct csbpt_log_record));
+
+	if(record->op < LOG_INSERT || record->op > LOG_DELETE_RANGE || record->sequence != sequence) {
+		return 0;
+	}
+
+	record_size = sizeof(struct csbpt_log_record) + (record->op == LOG_DELETE_RANGE ? 0 : value_size);
+
+	if(size - offset < record_size ||
+	   record->checksum != crc32c(0, image + offset + sizeof(record->checksum), record_size - sizeof(record->checksum))) {
+		return 0;
+	}
+
+	return record_size;
+}
+
+/*!
+ *  Starts a log afresh, with no records, by writing a new one next to it
+ *  and renaming it over the top.  The log's lock must be held, and no flush
+ *  under way, unless nothing else can see the log yet.
+ *
+ *  \param  log    Log to restart
+ *  \param  start  Sequence number of its first record
+ *
+ *  \retval 0      The log was restarted
+ *  \retval other  An error occurred, and \c errno is set; the old log is
+ *                 left as it was
+ */
+static int restart_log(struct csbpt_log *log, uint64_t start)
+{
+	int                       fd;
+	int                       err;
+	size_t                    len = strlen(log->path);
+	char                     *tmp = malloc(len + 5);
+	struct csbpt_log_header   header;
+
+	if(!tmp) {
+		errno = ENOMEM;
+		return 1;
+	}
+	memcpy(tmp, log->path, len);
+	memcpy(tmp + len, ".tmp", 5);
+
+	memset(&header, 0, sizeof(header));
+	memcpy(header.magic, CSBPT_LOG_MAGIC, sizeof(header.magic));
+	header.version = CSBPT_LOG_VERSION;
+	header.byte_order = CSBPT_SNAPSHOT_BYTE_ORDER;
+	header.key_bits = CSBPT_KEY_BITS;
+	header.key_signed = CSBPT_KEY_SIGNED;
+	header.value_size = log->value_size;
+	header.start = start;
+	header.checksum = crc32c(0, &header, offsetof(struct csbpt_log_header, checksum));
+
+	fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+	if(fd < 0 || write_fully(fd, (const unsigned char *) &header, sizeof(header)) || fdatasync(fd) ||
+	   rename(tmp, log->path) || sync_parent(log->path)) {
+		err = errno;
+		if(fd >= 0) {
+			close(fd);
+			unlink(tmp);
+		}
+		free(tmp);
+		errno = err;
+		return 1;
+	}
+
+	free(tmp);
+
+	if(log->fd >= 0) {
+		close(log->fd);
+	}
+	log->fd = fd;
+
+	return 0;
+}
+
+struct csbpt_log *csbpt_log_open(struct csbpt *tree, const char *path, size_t value_size, unsigned long sync_usec)
+{
+	int                       err;
+	size_t                    offset;
+	size_t                    record_size;
+	uint64_t                  sequence;
+	unsigned char            *image = MAP_FAILED;
+	struct stat               st;
+	struct csbpt_log         *log;
+	struct csbpt_log_header   header;
+	struct csbpt_log_record   record;
+
+	if(tree->image || tree->origin) {
+		errno = EROFS;
+		return NULL;
+	}
+
+	if(tree->log) {
+		errno = EINVAL;
+		return NULL;
+	}
+
+	log = calloc(1, sizeof(struct csbpt_log));
+	if(!log || !(log->path = strdup(path))) {
+		free(log);
+		errno = ENOMEM;
+		return NULL;
+	}
+
+	log->tree = tree;
+	log->value_size = value_size;
+	log->sync_usec = sync_usec;
+	log->fd = open(path, O_RDWR | O_CREAT, 0644);
+
+	if(log->fd < 0 || fstat(log->fd, &st)) {
+		goto csbpt_log_open_error;
+	}
+
+	/* A log too short to have a header was never started, or was torn
+	 * while it was */
+	if(st.st_size < (off_t) sizeof(header)) {
+		if(restart_log(log, tree->log_sequence)) {
+			goto csbpt_log_open_error;
+		}
+		goto csbpt_log_open_ready;
+	}
+
+	image = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, log->fd, 0);
+	if(image == MAP_FAILED || check_log_header(image, st.st_size, value_size)) {
+		goto csbpt_log_open_error;
+	}
+
+	memcpy(&header, image, sizeof(header));
+	sequence = header.start;
+	offset = sizeof(header);
+	while((record_size = read_log_record(image, st.st_size, offset, value_size, sequence, &record))) {
+		offset += record_size;
+		sequence++;
+	}
+	munmap(image, st.st_size);
+	image = MAP_FAILED;
+
+	/* Records the tree does not include would be lost between the ones
+	 * before and after them; recover the tree from the log first */
+	if(header.start > tree->log_sequence || sequence > tree->log_sequence) {
+		errno = EINVAL;
+		goto csbpt_log_open_error;
+	}
+
+	/* The tree may also include records the log has lost, so the log can
+	 * only go on from where the tree is */
+	if(sequence < tree->log_sequence) {
+		if(restart_log(log, tree->log_sequence)) {
+			goto csbpt_log_open_error;
+		}
+		goto csbpt_log_open_ready;
+	}
+
+	/* Anything after the last whole record was torn by a crash */
+	if(offset < (size_t) st.st_size && (ftruncate(log->fd, offset) || fdatasync(log->fd))) {
+		goto csbpt_log_open_error;
+	}
+
+csbpt_log_open_ready:
+	if(lseek(log->fd, 0, SEEK_END) < 0) {
+		goto csbpt_log_open_error;
+	}
+
+	pthread_mutex_init(&log->lock, NULL);
+	pthread_cond_init(&log->flushed, NULL);
+	pthread_cond_init(&log->wake, NULL);
+
+	if(sync_usec && pthread_create(&log->flusher, NULL, log_flusher, log)) {
+		pthread_mutex_destroy(&log->lock);
+		pthread_cond_destroy(&log->flushed);
+		pthread_cond_destroy(&log->wake);
+		errno = EAGAIN;
+		goto csbpt_log_open_error;
+	}
+
+	tree->log = log;
+
+	return log;
+
+csbpt_log_open_error:
+	err = errno;
+	if(image != MAP_FAILED) {
+		munmap(image, st.st_size);
+	}
+	if(log->fd >= 0) {
+		close(log->fd);
+	}
+	free(log->path);
+	free(log);
+	errno = err;
+
+	return NULL;
+}
+
+int csbpt_log_sync(struct csbpt_log *log)
+{
+	int ret;
+
+	pthread_mutex_lock(&log->lock);
+	ret = log_flush(log, log->appended);
+	pthread_mutex_unlock(&log->lock);
+
+	return ret;
+}
+
+int csbpt_log_close(struct csbpt_log *log)
+{
+	int ret;
+	int err;
+
+	ret = csbpt_log_sync(log);
+	err = errno;
+
+	if(log->sync_usec) {
+		pthread_mutex_lock(&log->lock);
+		log->closing = 1;
+		pthread_cond_signal(&log->wake);
+		pthread_mutex_unlock(&log->lock);
+		pthread_join(log->flusher, NULL);
+	}
 
-	ret = calloc(1, sizeof(struct csbpt_leaf_group) + tree->max_children * CSBPT_ELEM_SIZE);
+	pthread_mutex_destroy(&log->lock);
+	pthread_cond_destroy(&log->flushed);
+	pthread_cond_destroy(&log->wake);
 
-#ifdef CSBPT_DEBUG
-	fprintf(stderr, "Allocating a leaf node group of size %d to hold %d leaves at address %x\n",
-			sizeof(struct csbpt_leaf_group) + tree->max_children * CSBPT_ELEM_SIZE, tree->max_children, ret);
-	tree->bytes_used += sizeof(struct csbpt_leaf_group) + tree->max_children * CSBPT_ELEM_SIZE;
-#endif
+	if(close(log->fd) && !ret) {
+		ret = 1;
+		err = errno;
+	}
+
+	log->tree->log = NULL;
+	free(log->buf);
+	free(log->spare);
+	free(log->path);
+	free(log);
+
+	errno = err;
 
 	return ret;
 }
 
-/*!
- *  Calculates the height required for a tree to hold the given number of elements
- *
- *  \param  max_children  Maximum number of children per node
- *  \param  num_elems     Required capacity
- *
- *  \return Height required to hold the given capacity
- */
-static int calc_required_height(int max_children, int num_elems)
+int csbpt_checkpoint(struct csbpt *tree, const char *path)
 {
-	int  hyp_cur_height = 0;
-	int  hyp_num_elems  = 1;
+	int                ret = 1;
+	int                err;
+	size_t             len = strlen(path);
+	char              *tmp;
+	FILE              *file;
+	struct csbpt_log  *log = tree->log;
 
-	while(hyp_num_elems < num_elems) {
-		hyp_cur_height++;
-		hyp_num_elems *= max_children;
+	if(!log) {
+		errno = EINVAL;
+		return 1;
 	}
 
-	return hyp_cur_height;
-}
+	/* The log must hold everything up to the checkpoint until the
+	 * checkpoint is in place */
+	if(csbpt_log_sync(log)) {
+		return 1;
+	}
 
-/*!
- *  Allocates memory for the given tree.  Calls itself recursively to allocate
- *  lower levels.
- *
- *  \param  tree   Tree to allocate memory for
- *  \param  root   Root of the current subtree being allocated
- *  \param  height Height of the current subtree being allocated
- *
- *  \retval 0      Allocation succeeded
- *  \retval other  Allocation failed
- */
-static int alloc_tree(struct csbpt *tree, struct csbpt_internal_node *root, int height)
-{
-	int i;
+	tmp = malloc(len + 5);
+	if(!tmp) {
+		errno = ENOMEM;
+		return 1;
+	}
+	memcpy(tmp, path, len);
+	memcpy(tmp + len, ".tmp", 5);
 
-	if(height > 0) {
-		root->children = alloc_internal_node_group(tree);
+	file = fopen(tmp, "wb");
+	if(!file) {
+		goto csbpt_checkpoint_exit;
+	}
 
-		if(!root->children) {
-			return 0;
-		}
+	if(csbpt_save(tree, file, log->value_size) || fsync(fileno(file))) {
+		err = errno;
+		fclose(file);
+		unlink(tmp);
+		errno = err;
+		goto csbpt_checkpoint_exit;
+	}
 
-		for(i = 0; i < tree->max_children; i++) {
-			if(alloc_tree(tree, &((struct csbpt_internal_node *) root->children)[i], height - 1)) {
-				return 1;
-			}
-		}
+	if(fclose(file) || rename(tmp, path) || sync_parent(path)) {
+		err = errno;
+		unlink(tmp);
+		errno = err;
+		goto csbpt_checkpoint_exit;
+	}
 
-		return 0;
-	} else if(height == 0) {
-		root->children = alloc_leaf_node_group(tree);
+	/* The records up to here are in the checkpoint, so the log can start
+	 * again.  If this fails, the old log is still consistent with it. */
+	pthread_mutex_lock(&log->lock);
+	while(log->flushing) {
+		pthread_cond_wait(&log->flushed, &log->lock);
+	}
+	ret = restart_log(log, tree->log_sequence);
+	pthread_mutex_unlock(&log->lock);
 
-		if(!root->children) {
-			return 1;
-		}
+csbpt_checkpoint_exit:
+	free(tmp);
 
-		return 0;
-	} else {
-		return 0;
-	}
+	return ret;
 }
 
 /*!
- *  Comparison function for sorting int values
- *
- *  \param  pv1  First value; pointer to an int
- *  \param  pv2  Second value; pointer to an int
- *
- *  \retval -1  v1 < v2
- *  \retval  0  v1 == v2
- *  \retval  1  v1 > v2
+ *  Picks the first value whose bytes match those in a log record
  */
-static int int_cmp(const void *pv1, const void *pv2)
-{
-	int *v1 = (int *) pv1;
-	int *v2 = (int *) pv2;
-
-	return (*v1 > *v2) - (*v1 < *v2);
-}
+struct log_match {
+	const unsigned char  *bytes;    /*!< Bytes of the value removed           */
+	size_t                size;     /*!< Number of bytes; 0 matches any value */
+	int                   found;    /*!< Whether a value was picked           */
+};
 
-static struct csbpt_internal_node *alloc_tree_bottom_up(struct csbpt *tree, struct csbpt_internal_node *lower_row, int num_lower_elems)
+static int match_logged_value(void *user_data, void *value)
 {
-	int i, j;
-	int num_elems = num_lower_elems / tree->max_children;
-	int num_groups = num_elems / tree->max_children;
-
-	struct csbpt_internal_node  *row;
-	struct csbpt_internal_node  *ret;
-
-	if(num_elems > 1) {
-#ifdef CSBPT_DEBUG
-		fprintf(stderr, "Creating row of %d elements in %d groups with first child at %x\n", num_elems, num_groups, lower_row);
-#endif
-
-		row = alloc_internal_row(tree, num_elems);
-		for(i = 0; i < num_elems; i++) {
-#ifdef CSBPT_DEBUG
-			fprintf(stderr, "row[%d] = %x\n", i, &row[i]);
-#endif
-			row[i].children = &lower_row[i * tree->max_children];
-		}
+	struct log_match *match = (struct log_match *) user_data;
 
-		ret = alloc_tree_bottom_up(tree, row, num_elems);
-	} else {
-		ret = malloc(sizeof(struct csbpt_internal_node));
-#ifdef CSBPT_DEBUG
-		fprintf(stderr, "Creating a root node of %d elements at %x with first child at %x\n", num_elems, ret, lower_row);
-#endif
-		ret->children = lower_row;
+	if(match->found || (match->size && memcmp(value, match->bytes, match->size))) {
+		return 0;
 	}
 
-	return ret;
+	match->found = 1;
+
+	return 1;
 }
 
 /*!
- *  Bulk loads the provided data into a tree
+ *  Copies the values of a checkpoint into a tree
  *
- *  \param  tree   Tree to load
- *  \param  values Values to load into the tree
- *  \param  count  Number of values to load
- *
- *  \retval 0      Loading succeeded
- *  \retval other  Loading failed
+ *  \retval 0      The values were copied, or there is no checkpoint
+ *  \retval other  An error occurred, and \c errno is set
  */
-static int bulk_load_tree(struct csbpt *tree, void *values, size_t count, size_t elem_size)
+static int recover_checkpoint(struct csbpt *tree, const char *path, size_t value_size)
 {
-	int                          i, j;
-	int                          num_leaves;
-	int                          num_leaf_groups;
-	void                        *tmp_addr;
-	struct csbpt_leaf_group    **leaves;
-	unsigned char               *elems;
-	unsigned char               *a_values = (unsigned char *) values;
-	struct csbpt_internal_node  *parents;
-	struct csbpt_internal_node  *cur_parent_group;
-
-	num_leaves = (int) pow((double) tree->max_children, (double) tree->height);
-	num_leaf_groups = num_leaves / tree->max_children;
+	int                            ret = 1;
+	size_t                         i;
+	size_t                         count;
+	FILE                          *file;
+	unsigned char                 *copies = NULL;
+	csbpt_key_t                   *measures = NULL;
+	void                         **values = NULL;
+	struct csbpt                  *saved;
+	struct csbpt_cursor            cursor;
+	struct csbpt_snapshot_header  *header;
 
-#ifdef CSBPT_DEBUG
-	fprintf(stderr, "Bulk loading %d values into %d leaf nodes into a tree of height %d and order %d\n", count, num_leaves, tree->height, tree->max_children);
-#endif
-
-	/* Create list of measure-elem pairs */
-	elems = calloc(count, CSBPT_ELEM_SIZE);
-	for(i = 0; i < count; i++) {
-		*(elems + i * CSBPT_ELEM_SIZE) = tree->measure(a_values + i * elem_size);
-		*((void **) (elems + i * CSBPT_ELEM_SIZE + sizeof(int))) = a_values + i * elem_size;
+	file = fopen(path, "rb");
+	if(!file) {
+		return errno != ENOENT;
 	}
 
-	qsort(elems, count, CSBPT_ELEM_SIZE, &int_cmp);
+	saved = csbpt_load(file, NULL);
+	fclose(file);
 
-#ifdef CSBPT_DEBUG
-	fprintf(stderr, "Sorted measurements: [");
-	for(i = 0; i < count; i++) {
-		fprintf(stderr, "%d:%x%s", *((int *)(elems + i * CSBPT_ELEM_SIZE)), *((void **)(elems + i * CSBPT_ELEM_SIZE + sizeof(int))), i == count - 1 ? "]\n" : ", ");
+	if(!saved) {
+		return 1;
 	}
-#endif
 
-	/* Allocate leaf nodes and copy values */
-	leaves = calloc(num_leaf_groups, sizeof(struct csbpt_leaf_group *));
-	parents = alloc_internal_row(tree, num_leaf_groups);
-	for(i = 0; i < num_leaf_groups; i++) {
-		leaves[i] = alloc_leaf_node_group(tree);
-
-		if(!leaves[i]) {
-			return 1;
-		}
+	header = (struct csbpt_snapshot_header *) saved->image;
+	count = header->num_values;
 
-		parents[i].children = leaves[i];
+	if(header->value_size != value_size) {
+		errno = EINVAL;
+		goto recover_checkpoint_exit;
+	}
 
-		if(i > 0) {
-			leaves[i]->prev = leaves[i - 1];
-			leaves[i - 1]->next = leaves[i];
-		}
+	measures = malloc(count * sizeof(csbpt_key_t) + 1);
+	values = malloc(count * sizeof(void *) + 1);
+	copies = count && value_size ? own_value(tree, count * value_size) : NULL;
 
-		if(i < count / tree->max_children) {
-			leaves[i]->num_elems = tree->max_children;
-		} else if(i == count / tree->max_children) {
-			leaves[i]->num_elems = count % tree->max_children;
-		} else {
-			leaves[i]->num_elems = 0;
-		}
+	if(!measures || !values || (count && value_size && !copies)) {
+		errno = ENOMEM;
+		goto recover_checkpoint_exit;
+	}
 
-#ifdef CSBPT_DEBUG
-		fprintf(stderr, "Copying over %d data elements at offset %d to addr %x[%x]\n", leaves[i]->num_elems, i * tree->max_children * CSBPT_ELEM_SIZE, ((unsigned char *) leaves[i]) + sizeof(struct csbpt_leaf_group), leaves[i]);
-#endif
-		memcpy(((unsigned char *) leaves[i]) + sizeof(struct csbpt_leaf_group), elems + i * tree->max_children * CSBPT_ELEM_SIZE, leaves[i]->num_elems * CSBPT_ELEM_SIZE);
+	csbpt_cursor_seek(saved, &cursor, CSBPT_KEY_MIN);
+	if(csbpt_cursor_read(&cursor, measures, values, count) != count) {
+		errno = EINVAL;
+		goto recover_checkpoint_exit;
+	}
 
-		parents[i].num_keys = leaves[i]->num_elems;
-		parents[i].keys = malloc(sizeof(int));
-		for(j = 0; j < leaves[i]->num_elems; j++) {
-			parents[i].keys[j] = *((int *) (((unsigned char *) leaves[i]) + sizeof(struct csbpt_leaf_group) + j * CSBPT_ELEM_SIZE));
-		}
+	/* The loaded values point into the snapshot, which goes with it */
+	for(i = 0; value_size && i < count; i++) {
+		memcpy(copies + i * value_size, values[i], value_size);
+		values[i] = copies + i * value_size;
 	}
 
-	if(tree->height == 1) {
-		tree->root = parents;
-	} else {
-		tree->root = alloc_tree_bottom_up(tree, parents, num_leaf_groups);
+	if(count && csbpt_insert_pairs(tree, measures, values, count)) {
+		goto recover_checkpoint_exit;
 	}
 
-	return 0;
+	set_log_sequence(tree, header->log_sequence);
+	ret = 0;
+
+recover_checkpoint_exit:
+	free(measures);
+	free(values);
+	csbpt_release(saved);
+
+	return ret;
 }
 
-/*
- *  Public functions
+/*!
+ *  Replays the records of a log which a tree does not include yet
+ *
+ *  \retval 0      The records were replayed, up to the first torn one, or
+ *                 there is no log
+ *  \retval other  An error occurred, and \c errno is set
  */
-
-struct csbpt *csbpt_create(struct csbpt_tune *tune,
-                           csbpt_measure_fn *measure,
-                           void *initial_values, size_t initial_value_count, size_t initial_value_elem_size)
+static int recover_log(struct csbpt *tree, const char *path, size_t value_size)
 {
-	struct csbpt *tree = NULL;
+	static const enum insert_mode   modes[] = { INSERT_SORTED, INSERT_SORTED, INSERT_LEFT, INSERT_RIGHT };
+	int                             fd;
+	int                             ret = 1;
+	int                             err;
+	size_t                          offset;
+	size_t                          record_size;
+	uint64_t                        sequence;
+	csbpt_key_t                     lo;
+	csbpt_key_t                     hi;
+	unsigned char                  *image;
+	void                           *value;
+	struct stat                     st;
+	struct log_match                match;
+	struct csbpt_log_header         header;
+	struct csbpt_log_record         record;
 
-	tree = malloc(sizeof(struct csbpt));
-
-	if(!tree) {
-		goto csbpt_create_error;
+	fd = open(path, O_RDONLY);
+	if(fd < 0) {
+		return errno != ENOENT;
 	}
 
-	tree->measure = measure;
-	tree->min_children = tune->order;
-	if(tree->min_children <= 0) {
-		tree->min_children = 1;
+	if(fstat(fd, &st)) {
+		err = errno;
+		close(fd);
+		errno = err;
+		return 1;
 	}
-	tree->max_children = 2 * tree->min_children;
 
-#ifdef CSBPT_DEBUG
-	tree->bytes_used = 0;
-#endif
+	/* Torn while it was being started, so it has no records */
+	if(st.st_size < (off_t) sizeof(header)) {
+		close(fd);
+		return 0;
+	}
 
-	if(initial_value_count > 0) {
-		tree->height = calc_required_height(tree->max_children, initial_value_count);
+	image = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+	err = errno;
+	close(fd);
 
-		if(tune->initial_height > tree->height) {
-			tree->height = tune->initial_height;
-		}
-	} else {
-		tree->height = tune->initial_height;
+	if(image == MAP_FAILED) {
+		errno = err;
+		return 1;
 	}
 
-	if(tree->height == 0){
-		tree->height = 1;
+	if(check_log_header(image, st.st_size, value_size)) {
+		goto recover_log_exit;
 	}
 
-	tree->root = calloc(1, sizeof(struct csbpt_internal_node));
+	memcpy(&header, image, sizeof(header));
+	if(header.start > tree->log_sequence) {
+		errno = EINVAL;
+		goto recover_log_exit;
+	}
 
-	if(initial_value_count > 0) {
-		bulk_load_tree(tree, initial_values, initial_value_count, initial_value_elem_size);
-	} else {
+	sequence = header.start;
+	offset = sizeof(header);
+	while((record_size = read_log_record(image, st.st_size, offset, value_size, sequence, &record))) {
+		value = image + offset + sizeof(record);
+		offset += record_size;
 
-		if(!tree->root) {
-			goto csbpt_create_error;
+		/* Already in the checkpoint */
+		if(sequence++ < tree->log_sequence) {
+			continue;
 		}
 
-#ifdef CSBPT_DEBUG
-		fprintf(stderr, "Creating tree of height %d, min children %d, and max children %d\n", tree->height, tree->min_children, tree->max_children);
-#endif
+		lo = (csbpt_key_t) (csbpt_key_bits_t) record.lo;
+		hi = (csbpt_key_t) (csbpt_key_bits_t) record.hi;
 
-		if(alloc_tree(tree, tree->root, tree->height - 1)) {
-			goto csbpt_create_error;
-		}
-	}
+		switch(record.op) {
+		case LOG_REMOVE:
+			match.bytes = (const unsigned char *) value;
+			match.size = value_size;
+			match.found = 0;
+			if(delete_matching(tree, lo, lo, &match, match_logged_value, NULL)) {
+				goto recover_log_exit;
+			}
+			break;
 
-#ifdef CSBPT_DEBUG
-	fprintf(stderr, "Tree's memory footprint is %d bytes (not including data)\n", tree->bytes_used);
-#endif
+		case LOG_DELETE_RANGE:
+			if(delete_matching(tree, lo, hi, NULL, NULL, NULL)) {
+				goto recover_log_exit;
+			}
+			break;
 
-	goto csbpt_create_exit;
+		default:
+			if(value_size) {
+				if(!(value = own_value(tree, value_size))) {
+					goto recover_log_exit;
+				}
+				memcpy(value, image + offset - value_size, value_size);
+			} else {
+				value = NULL;
+			}
 
-csbpt_create_error:
-	if(tree) {
-		csbpt_release(tree);
-		tree = NULL;
+			if(write_measured(tree, lo, value, modes[record.op])) {
+				goto recover_log_exit;
+			}
+			break;
+		}
+
+		set_log_sequence(tree, sequence);
 	}
 
-csbpt_create_exit:
-	return tree;
-}
+	ret = 0;
 
+recover_log_exit:
+	err = errno;
+	munmap(image, st.st_size);
+	errno = err;
 
-int csbpt_release(struct csbpt *tree)
+	return ret;
+}
+
+struct csbpt *csbpt_recover(const char *checkpoint, const char *log_path, struct csbpt_tune *tune,
+                            csbpt_measure_fn *measure, size_t value_size)
 {
-#ifdef CSBPT_DEBUG
-	fprintf(stderr, "Destroying tree\n");
-#endif
+	int            err;
+	struct csbpt  *tree;
 
-	free(tree);
+	tree = csbpt_create(tune, measure, NULL, 0, 0);
+	if(!tree) {
+		return NULL;
+	}
 
-	return 0;
+	if(recover_checkpoint(tree, checkpoint, value_size) || recover_log(tree, log_path, value_size)) {
+		err = errno;
+		csbpt_release(tree);
+		errno = err;
+		return NULL;
+	}
+
+	return tree;
 }
 
 #ifdef CSBPT_DEBUG
@@ -441,7 +7455,7 @@ static int csbpt_dump_dot_node(struct csbpt *tree, int level, void *node, FILE *
 		internal_node = (struct csbpt_internal_node *) node;
 		fprintf(file, "\t\"%x\" [label=\"", node);
 		for(i = 0; i < internal_node->num_keys; i++) {
-			fprintf(file, "%d", internal_node->keys[i]);
+			fprintf(file, "%" CSBPT_KEY_FORMAT, level + 1 == tree->height ? leaf_key(tree, internal_node->children, i) : internal_node->keys[i]);
 			if(i != internal_node->num_keys - 1) {
 				fprintf(file, ",");
 			}
@@ -455,7 +7469,7 @@ static int csbpt_dump_dot_node(struct csbpt *tree, int level, void *node, FILE *
 				return 1;
 			}
 		} else {
-			for(i = 0; i < tree->max_children; i++) {
+			for(i = 0; i < internal_node->num_keys; i++) {
 				child = ((struct csbpt_internal_node *) internal_node->children) + i;
 				fprintf(file, "\t\"%x\" -> \"%x\";\n", node, child);
 				if(csbpt_dump_dot_node(tree, level + 1, child, file)) {
@@ -471,7 +7485,7 @@ static int csbpt_dump_dot_node(struct csbpt *tree, int level, void *node, FILE *
 		if(leaf_node->num_elems > 0) {
 			fprintf(file, "\t\"%x\" [label=\"{", node);
 			for(i = 0; i < leaf_node->num_elems; i++) {
-				fprintf(file, "%d", *((int *) (((unsigned char *) node) + sizeof(struct csbpt_leaf_group) + i * CSBPT_ELEM_SIZE)));
+				fprintf(file, "%" CSBPT_KEY_FORMAT, leaf_key(tree, leaf_node, i));
 				if(i != leaf_node->num_elems - 1) {
 					fprintf(file, "|");
 				}
@@ -500,4 +7514,155 @@ int csbpt_dump_dot(struct csbpt *tree, FILE *file)
 
 	return 0;
 }
+
+/*!
+ *  Checks the invariants of a subtree.
+ *
+ *  \param  tree       Tree being checked
+ *  \param  level      Level of \c node; the root is level 0
+ *  \param  node       Root of the subtree
+ *  \param  leaf       In/out: the next leaf group expected in the linked list
+ *  \param  last_key   In/out: the last key seen, in order
+ *  \param  have_key   In/out: whether \c last_key has been set
+ *
+ *  \retval 0      The subtree is valid
+ *  \retval other  An invariant was broken
+ */
+static int csbpt_check_node(struct csbpt *tree, int level, struct csbpt_internal_node *node,
+                            struct csbpt_leaf_group **leaf, csbpt_key_t *last_key, int *have_key)
+{
+	int                          i;
+	size_t                       count;
+	long long                    summary;
+	csbpt_key_t                  key;
+	struct csbpt_internal_node  *group;
+	struct csbpt_leaf_group     *children;
+
+	if(node->num_keys > tree->max_children) {
+		fprintf(stderr, "Node %p at level %d has %d keys; the maximum is %d\n", (void *) node, level, node->num_keys, (int) tree->max_children);
+		return 1;
+	}
+
+	if(level > 0 && node->num_keys < tree->min_children) {
+		fprintf(stderr, "Node %p at level %d has %d keys; the minimum is %d\n", (void *) node, level, node->num_keys, (int) tree->min_children);
+		return 1;
+	}
+
+	if(level < tree->height - 1) {
+		group = (struct csbpt_internal_node *) node->children;
+
+		if(node->num_keys == 0) {
+			fprintf(stderr, "Internal node %p at level %d is empty\n", (void *) node, level);
+			return 1;
+		}
+
+		for(i = 0; i < node->num_keys; i++) {
+			if(csbpt_check_node(tree, level + 1, &group[i], leaf, last_key, have_key)) {
+				return 1;
+			}
+
+			if(tree->summarized) {
+				node_summary(tree, &group[i], level + 1 == tree->height - 1, &count, &summary);
+
+				if(count != node_counts(tree, node)[i] || summary != node_summaries(tree, node)[i]) {
+					fprintf(stderr, "Summary %d of node %p is out of date\n", i, (void *) node);
+					return 1;
+				}
+			}
+
+			if(node->keys[i] != node_max(tree, &group[i], level + 1 == tree->height - 1)) {
+				fprintf(stderr, "Key %d of node %p is %" CSBPT_KEY_FORMAT ", but its child's largest key is %" CSBPT_KEY_FORMAT "\n",
+				        i, (void *) node, node->keys[i], node_max(tree, &group[i], level + 1 == tree->height - 1));
+				return 1;
+			}
+		}
+
+		return 0;
+	}
+
+	children = (struct csbpt_leaf_group *) node->children;
+
+	while(*leaf && *leaf != children && (*leaf)->num_elems == 0) {
+		*leaf = leaf_next(tree, *leaf);
+	}
+
+	if(*leaf != children) {
+		fprintf(stderr, "Leaf group %p is out of place in the linked list\n", (void *) children);
+		return 1;
+	}
+	*leaf = leaf_next(tree, children);
+
+	if(children->num_elems != node->num_keys) {
+		fprintf(stderr, "Leaf group %p has %d elements, but its node has %d keys\n", (void *) children, (int) children->num_elems, node->num_keys);
+		return 1;
+	}
+
+	if(children->delta_bits && (!tree->compress_keys || (children->delta_bits != 8 && children->delta_bits != 16))) {
+		fprintf(stderr, "Leaf group %p has %u bit deltas\n", (void *) children, children->delta_bits);
+		return 1;
+	}
+
+	if(!bottom_keys_needed(tree) && node->keys != leaf_keys(children)) {
+		fprintf(stderr, "Node %p doesn't share its leaf group's keys\n", (void *) node);
+		return 1;
+	}
+
+	for(i = 0; i < node->num_keys; i++) {
+		key = leaf_key(tree, children, i);
+
+		if(bottom_keys_needed(tree) && node->keys[i] != key) {
+			fprintf(stderr, "Key %d of node %p doesn't match its leaf group\n", i, (void *) node);
+			return 1;
+		}
+
+		if(*have_key && key < *last_key) {
+			fprintf(stderr, "Key %d of node %p is out of order\n", i, (void *) node);
+			return 1;
+		}
+
+		*last_key = key;
+		*have_key = 1;
+	}
+
+	return 0;
+}
+
+int csbpt_check(struct csbpt *tree)
+{
+	int                          i;
+	csbpt_key_t                  last_key = 0;
+	int                          have_key = 0;
+	struct csbpt_leaf_group     *leaf;
+	struct csbpt_internal_node  *node = tree->root;
+
+	if(tree->image) {
+		fprintf(stderr, "Trees read from snapshots cannot be checked\n");
+		errno = ENOTSUP;
+		return 1;
+	}
+
+	/* The leftmost leaf group heads the linked list */
+	for(i = 0; i < tree->height - 1; i++) {
+		node = (struct csbpt_internal_node *) node->children;
+	}
+	leaf = (struct csbpt_leaf_group *) node->children;
+
+	if(leaf_prev(tree, leaf)) {
+		fprintf(stderr, "Leftmost leaf group %p has a predecessor\n", (void *) leaf);
+		return 1;
+	}
+
+	if(csbpt_check_node(tree, 0, tree->root, &leaf, &last_key, &have_key)) {
+		return 1;
+	}
+
+	for(; leaf; leaf = leaf_next(tree, leaf)) {
+		if(leaf->num_elems > 0) {
+			fprintf(stderr, "Leaf group %p is linked but not in the tree\n", (void *) leaf);
+			return 1;
+		}
+	}
+
+	return 0;
+}
 #endif
@@ -10,7 +10,7 @@
 /*!
  *  \mainpage CSB+ Tree Implementation in C
  *
- *  - API Reference: csbpt.h
+ *  - API Reference: csbpt.h, csbpt_api.h, and csbpt.hpp for C++
  *  - Developer Documentation: csbpt.c
  *
  *  \section Overview
@@ -26,11 +26,20 @@
  *
  *  The generality comes from a design inspired by the Haskell's finger trees:
  *  keys are computed from values using a user-provided measure function, and
- *  combined using a combinator function.
+ *  combined using a combinator function.  A tree given a #csbpt_combinator
+ *  caches, in each internal node, the number of values under each child and
+ *  the combination of their summaries, which answers order-statistic and
+ *  prefix queries such as csbpt_find_kth() and csbpt_summarize_prefix() in
+ *  logarithmic time.
  *
- *  One limitation is that, for performance, measurements are always ints, and
- *  are always compared using C's built-in comparison operators, rather than
- *  a user-provided comparator.
+ *  One limitation is that, for performance, measurements are always integers,
+ *  and are always compared using C's built-in comparison operators, rather
+ *  than a user-provided comparator.  The type of the measures is fixed when
+ *  the library is compiled: csbpt.h declares trees of int measures, while
+ *  csbpt_i64.h and csbpt_u64.h declare separate trees of 64-bit measures,
+ *  such as timestamps, or pairs of 32-bit fields packed by csbpt_u64_pair().
+ *  Each type has its own copy of the code and its own search kernels.  See
+ *  csbpt_api.h.
  *
  *  \section Error-Handling
  *
@@ -70,7 +79,8 @@
  *  The height of the tree is automatically increased as necessary to maintain
  *  these invariants.
  *
- *  The order of the tree is controllable through a #csbpt_tune setting.
+ *  The order of the tree is controllable through a #csbpt_tune setting, or
+ *  can be derived from the cache line size of the machine.
  *
  *  \section References
  *
@@ -83,111 +93,408 @@
 #ifndef CSBPT_H_
 #define CSBPT_H_
 
+#include <stdint.h>
 #include <stdio.h>
 
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/*!
+ *  \brief Key search implementations
+ *
+ *  Searches within a node can use the CPU's vector instructions to compare
+ *  several keys at once.  By default the widest instruction set the CPU
+ *  supports is used.  The widths below are for 32-bit measures; registers
+ *  hold half as many 64-bit ones, and comparing those needs SSE4.2 rather
+ *  than SSE2.
+ */
+enum csbpt_search {
+	CSBPT_SEARCH_AUTO = 0,    /*!< Pick the fastest one the CPU supports    */
+	CSBPT_SEARCH_SCALAR,      /*!< One key at a time                        */
+	CSBPT_SEARCH_SSE2,        /*!< 4 keys at a time                         */
+	CSBPT_SEARCH_AVX2,        /*!< 8 keys at a time                         */
+	CSBPT_SEARCH_AVX512       /*!< 16 keys at a time                        */
+};
+
+/*!
+ *  \brief Leaf group layouts
+ */
+enum csbpt_leaf_layout {
+	/*!
+	 *  Each key is stored next to its value.  Reading a value found by a
+	 *  search touches the same cache line as its key.
+	 */
+	CSBPT_LEAF_INTERLEAVED = 0,
+
+	/*!
+	 *  The keys of a leaf group are stored together, followed by the values.
+	 *  Searching a group only reads cache lines holding keys, and the nodes
+	 *  directly above the leaves share the group's keys instead of keeping a
+	 *  copy of them.
+	 */
+	CSBPT_LEAF_SPLIT
+};
+
+/*!
+ *  Order which lets csbpt_create() pick one to suit the CPU's caches; see
+ *  csbpt_tune.order
+ */
+#define CSBPT_ORDER_AUTO (-1)
+
 /*!
- *  \brief Opaque handle to a tree
+ *  \brief Source of the memory a tree is built from
+ *
+ *  A tree carves its nodes from large slabs obtained through this interface,
+ *  and only gives them back when it is released.
  */
-struct csbpt;
+struct csbpt_allocator {
+	/*!
+	 *  Allocates a slab.
+	 *
+	 *  \param  user_data  The allocator's \c user_data
+	 *  \param  size       Size of the slab; a multiple of \c alignment
+	 *  \param  alignment  Required alignment of the slab, currently 2 MB
+	 *
+	 *  \retval NULL       If the slab could not be allocated
+	 *  \retval other      The slab
+	 */
+	void *(*alloc)(void *user_data, size_t size, size_t alignment);
+
+	/*!
+	 *  Frees a slab returned by \c alloc.
+	 *
+	 *  \param  user_data  The allocator's \c user_data
+	 *  \param  ptr        The slab
+	 *  \param  size       Size the slab was allocated with
+	 */
+	void (*free)(void *user_data, void *ptr, size_t size);
+
+	/*!
+	 *  Passed to \c alloc and \c free.
+	 */
+	void *user_data;
+};
+
+/*!
+ *  \brief Monoid used to summarize the values of a tree
+ *
+ *  Summaries are 64-bit integers, which covers counts, sums, minimums and
+ *  maximums.  \c combine must be associative, with \c identity as its
+ *  identity element, since values are combined in whatever grouping the
+ *  tree's shape dictates.
+ */
+struct csbpt_combinator {
+	/*!
+	 *  Summarizes a single value.  If NULL, every summary is \c identity, and
+	 *  only counts are kept.
+	 */
+	long long (*summarize)(void *user_data, void *val);
+
+	/*!
+	 *  Combines the summaries of two adjacent runs of values, \c left
+	 *  coming first.
+	 */
+	long long (*combine)(void *user_data, long long left, long long right);
+
+	/*!
+	 *  Summary of no values.
+	 */
+	long long identity;
+
+	/*!
+	 *  Passed to \c summarize and \c combine.
+	 */
+	void *user_data;
+};
 
 /*!
  *  \brief Parameters to tune a tree
  *
  *  These parameters provide detailed control over a tree's setting.  See the
- *  main documentation for more details on their meaning.
+ *  main documentation for more details on their meaning.  A zero value for
+ *  any field other than \c order selects its default behaviour, so the
+ *  structure can be zeroed before setting the fields of interest.
  */
 struct csbpt_tune {
 	/*!
-	 *  The order of the tree.
+	 *  The order of the tree.  #CSBPT_ORDER_AUTO reads the cache line and
+	 *  page sizes of the machine, and picks the largest order whose node
+	 *  keys fill at most 4 cache lines and whose node groups and leaf
+	 *  groups each fit in a page.  Node groups, leaf groups and key arrays
+	 *  are then aligned to cache lines.
 	 */
 	int order;
 
 	/*!
-	 *  The initial height of the tree.  The tree will have an initial capacity
-	 *  of \f$2d^h\f$ entries.  If the tree is created with a set of initial
-	 *  values greater than this, its initial height will be increased beyond
-	 *  this value.
+	 *  The smallest initial height of a tree created with initial values.
+	 *  The values are spread over more, emptier leaf groups to reach it, as
+	 *  far as they go while every group stays at least half full.  Trees
+	 *  with more initial values than this height holds are built taller.
+	 *  Trees created without initial values always start with a height of 1,
+	 *  and grow as values are inserted.
 	 */
 	int initial_height;
+
+	/*!
+	 *  How keys are searched within a node.  If the CPU does not support the
+	 *  requested instruction set, the fastest one it does support is used.
+	 *  A zero value picks automatically.
+	 */
+	enum csbpt_search search;
+
+	/*!
+	 *  How keys and values are arranged within a leaf group.
+	 */
+	enum csbpt_leaf_layout leaf_layout;
+
+	/*!
+	 *  Where the tree gets its memory from.  The structure is copied when
+	 *  the tree is created.  NULL uses posix_memalign() and free().
+	 */
+	struct csbpt_allocator *allocator;
+
+	/*!
+	 *  How to summarize values.  The structure is copied when the tree is
+	 *  created.  NULL disables summaries, which saves their space in every
+	 *  internal node.
+	 */
+	struct csbpt_combinator *combinator;
+
+	/*!
+	 *  Non-zero to allow one writer and any number of readers to use the
+	 *  tree at the same time.  Readers never block and are never blocked;
+	 *  see csbpt_read_begin().  Writes copy the path they modify, so they
+	 *  are slower than in an ordinary tree, but versions of the tree can be
+	 *  pinned with csbpt_snapshot().
+	 */
+	int concurrent;
+
+	/*!
+	 *  Number of threads used to measure, sort and build the tree when bulk
+	 *  loading, in csbpt_create() and csbpt_insert_batch().  Zero or one
+	 *  loads on the calling thread.  The result is the same for any number
+	 *  of threads; with more than one, the measure function and combinator
+	 *  must be safe to call from several threads at once.
+	 */
+	int threads;
+
+	/*!
+	 *  Non-zero to back the slabs the tree is carved from with 2 MB huge
+	 *  pages, which saves TLB misses once a tree outgrows the caches.  Slabs
+	 *  are mapped from the system's reserved huge pages (\c MAP_HUGETLB)
+	 *  while it has some free, and are otherwise advised to be backed by
+	 *  transparent huge pages (\c MADV_HUGEPAGE).  Slabs from a custom
+	 *  \c allocator are only advised.  csbpt_memory_stats() reports how
+	 *  much of the tree ended up on huge pages.
+	 */
+	int huge_pages;
+
+	/*!
+	 *  Non-zero to store the keys of a leaf group as 8 or 16 bit deltas from
+	 *  its smallest key whenever they span less than 256 or 65536, which
+	 *  fits four or eight times as many keys in each cache line for dense
+	 *  measures such as sequential ids.  Groups are compressed when they are
+	 *  built by csbpt_create() or csbpt_insert_batch() or written to a
+	 *  snapshot, and are expanded again the first time a single insert or
+	 *  removal changes them.  Searches compare the deltas directly, with
+	 *  SSE2 where available.  Only used with #CSBPT_LEAF_SPLIT.
+	 */
+	int compress_keys;
+
+	/*!
+	 *  Percentage of each group that csbpt_create() fills when it bulk
+	 *  loads initial values.  Lower fill factors, such as 70, leave room in
+	 *  every group for values inserted later before it has to split, at the
+	 *  cost of more groups.  Groups are never filled below min_children, so
+	 *  fill factors under 50 act as 50.  Zero fills groups completely.
+	 */
+	int fill_factor;
 };
 
 /*!
- *  \brief Function to measure a value
- *
- *  The measure function is used to compute an integer key from a given value.
- *  This is referred to as a measure, rather than a key, to emphasise that it
- *  is used in comparison operations, rather than opaquely.  Values are always
- *  passed by pointer.
- *
- *  \param  val  Value to measure
- *
- *  \return Integer measure of the value
+ *  Number of levels csbpt_memory_stats() can report on
  */
-typedef int (csbpt_measure_fn)(void *val);
+#define CSBPT_STATS_LEVELS 65
 
-typedef int (csbpt_predicate_fn)(void *user_data, void *val);
+/*!
+ *  \brief Memory held by one level of a tree
+ */
+struct csbpt_level_stats {
+	size_t groups;     /*!< Node groups; leaf groups on the bottom level       */
+	size_t entries;    /*!< Nodes in use; values on the bottom level           */
+	size_t bytes;      /*!< Bytes held by the groups and their nodes' keys     */
+};
 
-typedef int (csbpt_action_fn)(void *user_data, void *val);
+/*!
+ *  \brief Memory held by a tree
+ */
+struct csbpt_memory_stats {
+	/*!
+	 *  Number of levels in \c levels.  Level 0 holds the root node, and the
+	 *  last level holds the leaf groups.
+	 */
+	int levels_used;
+
+	/*!
+	 *  Memory held by each level.
+	 */
+	struct csbpt_level_stats levels[CSBPT_STATS_LEVELS];
+
+	/*!
+	 *  Total size of the slabs obtained from the tree's allocator.
+	 */
+	size_t slab_bytes;
+
+	/*!
+	 *  Bytes of \c slab_bytes not held by any level: slab headers, freed
+	 *  groups awaiting reuse, and space not handed out yet.
+	 */
+	size_t unused_bytes;
+
+	/*!
+	 *  Bytes of \c slab_bytes mapped from reserved huge pages; see
+	 *  csbpt_tune.huge_pages.
+	 */
+	size_t hugetlb_bytes;
+
+	/*!
+	 *  Bytes of \c slab_bytes the kernel currently backs with transparent
+	 *  huge pages, as read from \c /proc/self/smaps.  Mappings shared with
+	 *  memory outside the tree are counted in proportion to the part of
+	 *  them the tree holds.  Zero where \c /proc is not available.
+	 */
+	size_t thp_bytes;
+};
 
 /*!
- *  \brief Generates a new tree
- *
- *  Generates a new tree with the given tuning parameters and measure function.
- *
- *  \param  tune                 Tuning parameters to control how the tree
- *                                 behaves.  If 0, the default parameters are
- *                                 used.
- *  \param  measure              Function used to measure
- *  \param  combinator           Function used to combine values
- *  \param  initial_values       Values to bulk load into the tree on creation.
- *                                 Bulk loading values on creation is
- *                                 significantly faster than adding them
- *                                 individually later.
- *  \param  initial_value_count  Number of values pointed at by initial_values.
- *
- *  \retval NULL     An error occurred.
- *  \retval other    The function completed successfully
+ *  \brief Operations csbpt_stats_get() reports on
  */
-struct csbpt *csbpt_create(struct csbpt_tune *tune,
-                           csbpt_measure_fn *measure,
-                           void *initial_values, size_t initial_value_count, size_t initial_value_elem_size);
+enum csbpt_op {
+	CSBPT_OP_FIND,      /*!< csbpt_find_value(), and csbpt_find_batch() per measure    */
+	CSBPT_OP_INSERT,    /*!< Inserts and pushes, per value                             */
+	CSBPT_OP_DELETE,    /*!< csbpt_delete() and the other deletes, per call            */
+	CSBPT_OP_SCAN,      /*!< csbpt_iterate() and csbpt_cursor_read(), per call         */
+	CSBPT_NUM_OPS       /*!< Number of operations                                      */
+};
 
+/*!
+ *  Number of buckets in a #csbpt_histogram
+ */
+#define CSBPT_HISTOGRAM_BUCKETS 976
 
 /*!
- *  \brief Releases a tree
- *
- *  Releases a tree and all the resources associated with it.  This should be
- *  called when you are through using a tree for performance purposes.
+ *  \brief Latencies of an operation, in nanoseconds
  *
- *  \param  tree   Tree to release
- *
- *  \retval     0  Resources were released successfully
- *  \retval other  An error occurred while freeing resources
+ *  Buckets 0 to 15 each count a single latency.  Above that, each power of
+ *  two is divided into 16 buckets, so a latency is known to within 1/16th:
+ *  bucket \c i for \c i of 16 or more counts latencies from
+ *  \f$(16 + i \bmod 16) \cdot 2^{\lfloor i / 16 \rfloor - 1}\f$ up to the
+ *  start of the next bucket.  A call handling several values, such as
+ *  csbpt_find_batch(), counts each of them at the average latency.
  */
-int csbpt_release(struct csbpt *tree);
+struct csbpt_histogram {
+	uint64_t count;                               /*!< Latencies counted                 */
+	uint64_t total_ns;                            /*!< Sum of the latencies              */
+	uint64_t max_ns;                              /*!< Largest latency                   */
+	uint64_t buckets[CSBPT_HISTOGRAM_BUCKETS];    /*!< Latencies counted in each bucket  */
+};
 
-int csbpt_insert(struct csbpt *tree, void *value);
+/*!
+ *  \brief Counters kept by a tree built with \c CSBPT_STATS; see
+ *  csbpt_stats_get()
+ */
+struct csbpt_stats {
+	/*!
+	 *  Number of each #csbpt_op.
+	 */
+	uint64_t ops[CSBPT_NUM_OPS];
 
-int csbpt_push_left(struct csbpt *tree, void *value);
+	/*!
+	 *  Descents from the root, by finds, inserts and csbpt_cursor_seek().
+	 */
+	uint64_t lookups;
 
-int csbpt_push_right(struct csbpt *tree, void *value);
+	/*!
+	 *  Nodes and leaf groups read by those descents, including the leaf
+	 *  groups csbpt_find_value() walks along for equal measures.
+	 */
+	uint64_t nodes_visited;
 
-int csbpt_delete(csbpt_predicate_fn *predicate);
+	/*!
+	 *  Values returned by scans.
+	 */
+	uint64_t values_scanned;
 
-int csbpt_find_value(struct csbpt *csbpt, void *user_data, csbpt_predicate_fn *predicate, csbpt_action_fn *action);
+	/*!
+	 *  Node groups and leaf groups split by inserts, or added by batch
+	 *  inserts.
+	 */
+	uint64_t splits;
 
-int csbpt_find_first_pred(struct csbpt *csbpt, void *user_data, csbpt_predicate_fn *predicate, csbpt_action_fn *action);
+	/*!
+	 *  Node groups and leaf groups merged away by deletes.
+	 */
+	uint64_t merges;
 
-int csbpt_find_all_pred(struct csbpt *csbpt, void *user_data, csbpt_predicate_fn *predicate, csbpt_action_fn *action);
+	/*!
+	 *  Latency of each #csbpt_op.
+	 */
+	struct csbpt_histogram latency[CSBPT_NUM_OPS];
+};
 
-int csbpt_iterate(struct csbpt *csbpt, void *user_data, csbpt_action_fn *action);
+/*!
+ *  \brief Estimates a percentile of the latencies in a histogram
+ *
+ *  \param  histogram  Histogram to read
+ *  \param  fraction   Fraction of the latencies which are no larger than the
+ *                     estimate, such as 0.99
+ *
+ *  \return The upper end of the bucket holding the percentile, in
+ *          nanoseconds, or 0 if the histogram is empty
+ */
+static inline uint64_t csbpt_histogram_percentile(const struct csbpt_histogram *histogram, double fraction)
+{
+	int       i;
+	uint64_t  seen = 0;
+	uint64_t  rank = (uint64_t) (fraction * histogram->count);
+	uint64_t  upper;
 
-int csbpt_save(struct csbpt *csbpt, FILE *file);
+	for(i = 0; i < CSBPT_HISTOGRAM_BUCKETS && histogram->count; i++) {
+		seen += histogram->buckets[i];
+		if(seen > rank || seen == histogram->count) {
+			upper = i < 16 ? (uint64_t) i : ((uint64_t) (17 + i % 16) << (i / 16 - 1)) - 1;
+			return upper < histogram->max_ns ? upper : histogram->max_ns;
+		}
+	}
 
-#ifdef CSBPT_DEBUG
-int csbpt_dump_dot(struct csbpt *tree, FILE *file);
+	return 0;
+}
+
+/*!
+ *  \brief Function to pick values
+ *
+ *  \param  user_data  Passed through by the caller
+ *  \param  val        Value to test
+ *
+ *  \return Non-zero if the value is picked
+ */
+typedef int (csbpt_predicate_fn)(void *user_data, void *val);
+
+typedef int (csbpt_action_fn)(void *user_data, void *val);
+
+/*
+ *  The tree of int measures.  csbpt.c defines CSBPT_KEY_TYPE itself when
+ *  compiled for another type.
+ */
+#ifndef CSBPT_KEY_TYPE
+#define CSBPT_KEY_TYPE int
 #endif
 
-struct csbt *csbpt_load(FILE *file);
+#include "csbpt_api.h"
+
+#ifdef __cplusplus
+}
+#endif
 
 #endif /* CSBPT_H_ */
@@ -0,0 +1,531 @@
+/*!
+ *  \file     csbpt.hpp
+ *  \brief    C++ wrapper of the CSB+ tree
+ *
+ *  <a href="index.html">Main documentation</a>
+ *
+ *  csbpt::tree holds values of any type under measures of a type the library
+ *  was built for: int, int64_t or uint64_t.  Values which fit in a pointer,
+ *  can be copied with memcpy() and can be default constructed are stored in
+ *  the leaf groups themselves, in place of the pointer a C tree keeps, so a
+ *  lookup does not follow a pointer to reach them.  Callbacks are passed
+ *  copies of them.  Other values are copied to the heap, and the tree owns
+ *  the copies.
+ *
+ *  Callbacks are taken as template parameters, so the compiler can inline
+ *  them.  Scans read the leaf groups a batch at a time through
+ *  csbpt_cursor_read(), so a scan makes one call into the library per batch
+ *  rather than one indirect call per value.
+ *
+ *  Errors are reported by throwing \c std::system_error holding the \c errno
+ *  of the failed call.  Callbacks must not throw: those passed to erase_if()
+ *  are called from within the library.
+ *
+ *  The C struct csbpt is named \c csbpt_tree in C++, since \c csbpt names
+ *  this namespace.
+ */
+
+#ifndef CSBPT_HPP_
+#define CSBPT_HPP_
+
+#include <cerrno>
+#include <cstddef>
+#include <cstring>
+#include <limits>
+#include <new>
+#include <system_error>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+#include "csbpt.h"
+#include "csbpt_i64.h"
+#include "csbpt_u64.h"
+
+namespace csbpt {
+
+namespace detail {
+
+/*!
+ *  \brief The C functions of the tree with measures of type \c Key
+ */
+template<typename Key>
+struct api;
+
+#define CSBPT_HPP_API(KEY, TREE, NAME)                                                                  \
+	template<>                                                                                          \
+	struct api<KEY> {                                                                                   \
+		typedef struct TREE          tree_type;                                                         \
+		typedef struct NAME##_cursor cursor_type;                                                       \
+                                                                                                        \
+		static tree_type *create(struct csbpt_tune *tune)                                               \
+		{ return NAME##_create(tune, NULL, NULL, 0, 0); }                                               \
+		static int release(tree_type *tree)                                                             \
+		{ return NAME##_release(tree); }                                                                \
+		static int insert(tree_type *tree, KEY measure, void *value)                                    \
+		{ return NAME##_insert_measured(tree, measure, value); }                                        \
+		static int insert_pairs(tree_type *tree, const KEY *measures, void *const *values, size_t count) \
+		{ return NAME##_insert_pairs(tree, measures, values, count); }                                  \
+		static int erase(tree_type *tree, KEY measure, void *user_data, csbpt_predicate_fn *predicate, size_t *count) \
+		{ return NAME##_delete(tree, measure, user_data, predicate, count); }                           \
+		static int erase_range(tree_type *tree, KEY lo, KEY hi, size_t *count)                          \
+		{ return NAME##_delete_range(tree, lo, hi, count); }                                            \
+		static int count(tree_type *tree, KEY measure)                                                  \
+		{ return NAME##_find_value(tree, measure, NULL, NULL); }                                        \
+		static int seek(tree_type *tree, cursor_type *cursor, KEY measure)                              \
+		{ return NAME##_cursor_seek(tree, cursor, measure); }                                           \
+		static size_t read(cursor_type *cursor, KEY *measures, void **values, size_t max)               \
+		{ return NAME##_cursor_read(cursor, measures, values, max); }                                   \
+	}
+
+CSBPT_HPP_API(int, csbpt_tree, csbpt);
+CSBPT_HPP_API(int64_t, csbpt_i64, csbpt_i64);
+CSBPT_HPP_API(uint64_t, csbpt_u64, csbpt_u64);
+
+#undef CSBPT_HPP_API
+
+/*!
+ *  \brief How values are kept in the pointer slot of a leaf group
+ *
+ *  Small plain values are stored in the slot itself.
+ */
+template<typename Value,
+         bool Inline = sizeof(Value) <= sizeof(void *) && alignof(Value) <= alignof(void *) &&
+                       std::is_trivially_copyable<Value>::value && std::is_default_constructible<Value>::value>
+struct value_store {
+	static const bool is_inline = true;
+
+	static void *wrap(const Value &value)
+	{
+		void *slot = NULL;
+
+		std::memcpy(&slot, &value, sizeof(Value));
+		return slot;
+	}
+
+	/*!
+	 *  Returns a copy of the value held by a slot.  The slot's bytes are
+	 *  copied out rather than read through a Value pointer, which would
+	 *  break strict aliasing.
+	 */
+	static Value unwrap(void *slot)
+	{
+		Value value;
+
+		std::memcpy(&value, &slot, sizeof(Value));
+		return value;
+	}
+
+	static void free(void *)
+	{
+	}
+};
+
+/*!
+ *  Other values are copied to the heap, and the slot points at the copy.
+ */
+template<typename Value>
+struct value_store<Value, false> {
+	static const bool is_inline = false;
+
+	static void *wrap(const Value &value)
+	{
+		return new Value(value);
+	}
+
+	static const Value &unwrap(void *slot)
+	{
+		return *static_cast<const Value *>(slot);
+	}
+
+	static void free(void *slot)
+	{
+		delete static_cast<Value *>(slot);
+	}
+};
+
+/*!
+ *  Throws the error of a failed call
+ */
+inline void fail(const char *what)
+{
+	throw std::system_error(errno, std::generic_category(), what);
+}
+
+} /* namespace detail */
+
+/*!
+ *  \brief Ordered multimap from measures to values
+ *
+ *  \tparam  Key    Type of the measures: int, int64_t or uint64_t
+ *  \tparam  Value  Type of the values
+ *  \tparam  Order  Order of the tree, or #CSBPT_ORDER_AUTO to fit it to the
+ *                 machine's cache lines
+ *
+ *  As in a C tree, values with equal measures are kept in insertion order.
+ *  Trees can be moved but not copied.
+ */
+template<typename Key, typename Value, int Order = 8>
+class tree {
+	typedef detail::api<Key>           api;
+	typedef detail::value_store<Value> store;
+	typedef typename api::tree_type    tree_type;
+	typedef typename api::cursor_type  cursor_type;
+
+public:
+	typedef Key   key_type;
+	typedef Value value_type;
+
+	/*!
+	 *  Values are read this many at a time by scans
+	 */
+	static const size_t batch_size = 64;
+
+	/*!
+	 *  \brief Creates an empty tree
+	 *
+	 *  \param  tune  Tuning parameters; may be NULL.  \c order is replaced by
+	 *                \c Order.  Trees of the wrapper keep no summaries and
+	 *                are not concurrent, so \c combinator and \c concurrent
+	 *                are ignored.
+	 */
+	explicit tree(const struct csbpt_tune *tune = NULL)
+		: tree_(NULL), size_(0)
+	{
+		struct csbpt_tune t;
+
+		if(tune) {
+			t = *tune;
+		} else {
+			std::memset(&t, 0, sizeof(t));
+		}
+		t.order = Order;
+		t.combinator = NULL;
+		t.concurrent = 0;
+
+		tree_ = api::create(&t);
+
+		if(!tree_) {
+			detail::fail("csbpt_create");
+		}
+	}
+
+	tree(tree &&other) noexcept
+		: tree_(other.tree_), size_(other.size_)
+	{
+		other.tree_ = NULL;
+		other.size_ = 0;
+	}
+
+	tree &operator=(tree &&other) noexcept
+	{
+		std::swap(tree_, other.tree_);
+		std::swap(size_, other.size_);
+		return *this;
+	}
+
+	tree(const tree &) = delete;
+	tree &operator=(const tree &) = delete;
+
+	~tree()
+	{
+		if(!tree_) {
+			return;
+		}
+
+		if(!store::is_inline) {
+			for_each_slot([](const Key &, void *slot) { store::free(slot); });
+		}
+		api::release(tree_);
+	}
+
+	/*!
+	 *  \brief Number of values in the tree
+	 */
+	size_t size() const
+	{
+		return size_;
+	}
+
+	bool empty() const
+	{
+		return size_ == 0;
+	}
+
+	/*!
+	 *  \brief The C tree, for functions the wrapper does not cover
+	 *
+	 *  Values read from it are in the form described in value_store.
+	 */
+	tree_type *native_handle()
+	{
+		return tree_;
+	}
+
+	/*!
+	 *  \brief Inserts a value after any values with the same measure
+	 */
+	void insert(const Key &key, const Value &value)
+	{
+		void *slot = store::wrap(value);
+
+		if(api::insert(tree_, key, slot)) {
+			int error = errno;
+
+			store::free(slot);
+			errno = error;
+			detail::fail("csbpt_insert_measured");
+		}
+		size_++;
+	}
+
+	/*!
+	 *  \brief Inserts a range of measure/value pairs as one batch
+	 *
+	 *  \param  first  Start of the range; each element has members \c first
+	 *                 and \c second, like \c std::pair<Key, Value>
+	 *  \param  last   End of the range
+	 *
+	 *  If an exception is thrown, the tree is unchanged.
+	 */
+	template<typename Iterator>
+	void insert(Iterator first, Iterator last)
+	{
+		std::vector<Key>    keys;
+		std::vector<void *> slots;
+		int                 error;
+
+		try {
+			for(; first != last; ++first) {
+				keys.push_back(first->first);
+				slots.push_back(NULL);
+				slots.back() = store::wrap(first->second);
+			}
+		} catch(...) {
+			free_slots(slots);
+			throw;
+		}
+
+		if(api::insert_pairs(tree_, keys.data(), slots.data(), keys.size())) {
+			error = errno;
+			free_slots(slots);
+			errno = error;
+			detail::fail("csbpt_insert_pairs");
+		}
+		size_ += keys.size();
+	}
+
+	/*!
+	 *  \brief Erases every value with a given measure
+	 *
+	 *  \return The number of values erased
+	 */
+	size_t erase(const Key &key)
+	{
+		if(store::is_inline) {
+			return erase_slots(key, NULL, NULL);
+		}
+
+		return erase_if(key, [](const Value &) { return true; });
+	}
+
+	/*!
+	 *  \brief Erases the values with a given measure picked by a predicate
+	 *
+	 *  \param  key   Measure of the values
+	 *  \param  pred  Called as \c pred(value) on each value with the measure;
+	 *                returns true to erase it
+	 *
+	 *  \return The number of values erased
+	 */
+	template<typename Predicate>
+	size_t erase_if(const Key &key, Predicate pred)
+	{
+		std::vector<void *>         picked;
+		erase_context<Predicate>    ctx = { &pred, &picked };
+		size_t                      count;
+
+		/* The predicate cannot throw from within the library */
+		if(!store::is_inline) {
+			picked.reserve(this->count(key));
+		}
+
+		count = erase_slots(key, &ctx, &erase_context<Predicate>::pick);
+		free_slots(picked);
+
+		return count;
+	}
+
+	/*!
+	 *  \brief Erases every value with a measure from \c lo to \c hi
+	 *
+	 *  \return The number of values erased
+	 */
+	size_t erase_range(const Key &lo, const Key &hi)
+	{
+		std::vector<void *> slots;
+		size_t              count = 0;
+
+		if(lo > hi) {
+			return 0;
+		}
+
+		/* Plain values need no visit, so whole subtrees can be unlinked */
+		if(!store::is_inline) {
+			scan_slots(lo, hi, [&slots](const Key &, void *slot) { slots.push_back(slot); });
+		}
+
+		if(api::erase_range(tree_, lo, hi, &count)) {
+			detail::fail("csbpt_delete_range");
+		}
+		free_slots(slots);
+		size_ -= count;
+
+		return count;
+	}
+
+	/*!
+	 *  \brief Number of values with a given measure
+	 */
+	size_t count(const Key &key) const
+	{
+		return api::count(tree_, key);
+	}
+
+	/*!
+	 *  \brief Calls a function on each value with a given measure
+	 *
+	 *  \param  key  Measure to look for
+	 *  \param  f    Called as \c f(value), in insertion order
+	 *
+	 *  \return The number of values found
+	 */
+	template<typename Function>
+	size_t find(const Key &key, Function f) const
+	{
+		return scan_slots(key, key, [&f](const Key &, void *slot) { f(store::unwrap(slot)); });
+	}
+
+	/*!
+	 *  \brief Calls a function on each value with a measure from \c lo to
+	 *  \c hi
+	 *
+	 *  \param  lo  Smallest measure to visit
+	 *  \param  hi  Largest measure to visit
+	 *  \param  f   Called as \c f(key, value), in order of measure
+	 *
+	 *  \return The number of values visited
+	 */
+	template<typename Function>
+	size_t scan(const Key &lo, const Key &hi, Function f) const
+	{
+		return scan_slots(lo, hi, [&f](const Key &key, void *slot) { f(key, store::unwrap(slot)); });
+	}
+
+	/*!
+	 *  \brief Calls a function on every value, in order of measure
+	 *
+	 *  \param  f   Called as \c f(key, value)
+	 *
+	 *  \return The number of values visited
+	 */
+	template<typename Function>
+	size_t for_each(Function f) const
+	{
+		return for_each_slot([&f](const Key &key, void *slot) { f(key, store::unwrap(slot)); });
+	}
+
+private:
+	/*!
+	 *  Predicate passed through the C interface by erase_if()
+	 */
+	template<typename Predicate>
+	struct erase_context {
+		Predicate            *pred;      /*!< Predicate picking the values  */
+		std::vector<void *>  *picked;    /*!< Slots of the values picked    */
+
+		static int pick(void *user_data, void *val) noexcept
+		{
+			erase_context *ctx = static_cast<erase_context *>(user_data);
+
+			if(!(*ctx->pred)(store::unwrap(val))) {
+				return 0;
+			}
+			if(!store::is_inline) {
+				ctx->picked->push_back(val);
+			}
+			return 1;
+		}
+	};
+
+	size_t erase_slots(const Key &key, void *user_data, csbpt_predicate_fn *predicate)
+	{
+		size_t count = 0;
+
+		if(api::erase(tree_, key, user_data, predicate, &count)) {
+			detail::fail("csbpt_delete");
+		}
+		size_ -= count;
+
+		return count;
+	}
+
+	/*!
+	 *  Calls \c f(key, slot) on the slots with measures from \c lo to \c hi,
+	 *  reading them a batch at a time.  Batches start small and double, so a
+	 *  lookup of a single measure does not copy a whole batch.
+	 */
+	template<typename Function>
+	size_t scan_slots(const Key &lo, const Key &hi, Function f) const
+	{
+		cursor_type  cursor;
+		Key          keys[batch_size];
+		void        *slots[batch_size];
+		size_t       found = 0;
+		size_t       want = 4;
+		size_t       read;
+		size_t       i;
+
+		if(api::seek(tree_, &cursor, lo)) {
+			return 0;
+		}
+
+		for(;; want = want < batch_size / 2 ? 2 * want : batch_size) {
+			read = api::read(&cursor, keys, slots, want);
+
+			for(i = 0; i < read; i++) {
+				if(keys[i] > hi) {
+					return found;
+				}
+				f(keys[i], slots[i]);
+				found++;
+			}
+
+			if(read < want) {
+				break;
+			}
+		}
+
+		return found;
+	}
+
+	template<typename Function>
+	size_t for_each_slot(Function f) const
+	{
+		return scan_slots(std::numeric_limits<Key>::min(), std::numeric_limits<Key>::max(), f);
+	}
+
+	static void free_slots(const std::vector<void *> &slots)
+	{
+		for(size_t i = 0; i < slots.size(); i++) {
+			store::free(slots[i]);
+		}
+	}
+
+	tree_type  *tree_;    /*!< The C tree                  */
+	size_t      size_;    /*!< Number of values it holds   */
+};
+
+} /* namespace csbpt */
+
+#endif /* CSBPT_HPP_ */
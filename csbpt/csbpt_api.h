@@ -0,0 +1,849 @@
+/*!
+ *  \file     csbpt_api.h
+ *  \brief    Functions of a tree with one type of measure
+ *
+ *  <a href="index.html">Main documentation</a>
+ *
+ *  This header has no include guard: it is included once for each type of
+ *  measure, with \c CSBPT_KEY_TYPE naming the type.  csbpt.h includes it for
+ *  int measures, under the names documented here.  csbpt_i64.h and
+ *  csbpt_u64.h include it for \c int64_t and \c uint64_t measures, with
+ *  \c CSBPT_PREFIX set, so that \c struct \c csbpt becomes \c struct
+ *  \c csbpt_i64, csbpt_insert() becomes \c csbpt_i64_insert(), and so on.
+ *  Each type is a separate build of csbpt.c; see csbpt_i64.c.
+ */
+
+#ifndef CSBPT_KEY_TYPE
+#error "CSBPT_KEY_TYPE must be defined before including csbpt_api.h"
+#endif
+
+#ifdef CSBPT_PREFIX
+
+#ifndef CSBPT_PASTE
+#define CSBPT_PASTE_(prefix, name)  csbpt_##prefix##name
+#define CSBPT_PASTE(prefix, name)   CSBPT_PASTE_(prefix, name)
+#endif
+
+/* Functions are renamed by function-like macros, so that struct
+ * csbpt_memory_stats keeps its name while csbpt_memory_stats() changes */
+#define csbpt                          CSBPT_PASTE(CSBPT_PREFIX, )
+#define csbpt_reader                   CSBPT_PASTE(CSBPT_PREFIX, _reader)
+#define csbpt_cursor                   CSBPT_PASTE(CSBPT_PREFIX, _cursor)
+#define csbpt_log                      CSBPT_PASTE(CSBPT_PREFIX, _log)
+#define csbpt_key_t                    CSBPT_PASTE(CSBPT_PREFIX, _key_t)
+#define csbpt_measure_fn               CSBPT_PASTE(CSBPT_PREFIX, _measure_fn)
+#define csbpt_create(...)              CSBPT_PASTE(CSBPT_PREFIX, _create)(__VA_ARGS__)
+#define csbpt_release(...)             CSBPT_PASTE(CSBPT_PREFIX, _release)(__VA_ARGS__)
+#define csbpt_memory_stats(...)        CSBPT_PASTE(CSBPT_PREFIX, _memory_stats)(__VA_ARGS__)
+#define csbpt_stats_get(...)           CSBPT_PASTE(CSBPT_PREFIX, _stats_get)(__VA_ARGS__)
+#define csbpt_reader_register(...)     CSBPT_PASTE(CSBPT_PREFIX, _reader_register)(__VA_ARGS__)
+#define csbpt_reader_unregister(...)   CSBPT_PASTE(CSBPT_PREFIX, _reader_unregister)(__VA_ARGS__)
+#define csbpt_read_begin(...)          CSBPT_PASTE(CSBPT_PREFIX, _read_begin)(__VA_ARGS__)
+#define csbpt_read_end(...)            CSBPT_PASTE(CSBPT_PREFIX, _read_end)(__VA_ARGS__)
+#define csbpt_snapshot(...)            CSBPT_PASTE(CSBPT_PREFIX, _snapshot)(__VA_ARGS__)
+#define csbpt_insert(...)              CSBPT_PASTE(CSBPT_PREFIX, _insert)(__VA_ARGS__)
+#define csbpt_insert_measured(...)     CSBPT_PASTE(CSBPT_PREFIX, _insert_measured)(__VA_ARGS__)
+#define csbpt_push_left(...)           CSBPT_PASTE(CSBPT_PREFIX, _push_left)(__VA_ARGS__)
+#define csbpt_push_right(...)          CSBPT_PASTE(CSBPT_PREFIX, _push_right)(__VA_ARGS__)
+#define csbpt_insert_batch(...)        CSBPT_PASTE(CSBPT_PREFIX, _insert_batch)(__VA_ARGS__)
+#define csbpt_insert_pairs(...)        CSBPT_PASTE(CSBPT_PREFIX, _insert_pairs)(__VA_ARGS__)
+#define csbpt_delete(...)              CSBPT_PASTE(CSBPT_PREFIX, _delete)(__VA_ARGS__)
+#define csbpt_delete_pred(...)         CSBPT_PASTE(CSBPT_PREFIX, _delete_pred)(__VA_ARGS__)
+#define csbpt_delete_range(...)        CSBPT_PASTE(CSBPT_PREFIX, _delete_range)(__VA_ARGS__)
+#define csbpt_find_value(...)          CSBPT_PASTE(CSBPT_PREFIX, _find_value)(__VA_ARGS__)
+#define csbpt_find_batch(...)          CSBPT_PASTE(CSBPT_PREFIX, _find_batch)(__VA_ARGS__)
+#define csbpt_find_kth(...)            CSBPT_PASTE(CSBPT_PREFIX, _find_kth)(__VA_ARGS__)
+#define csbpt_summarize_prefix(...)    CSBPT_PASTE(CSBPT_PREFIX, _summarize_prefix)(__VA_ARGS__)
+#define csbpt_find_first_pred(...)     CSBPT_PASTE(CSBPT_PREFIX, _find_first_pred)(__VA_ARGS__)
+#define csbpt_find_all_pred(...)       CSBPT_PASTE(CSBPT_PREFIX, _find_all_pred)(__VA_ARGS__)
+#define csbpt_iterate(...)             CSBPT_PASTE(CSBPT_PREFIX, _iterate)(__VA_ARGS__)
+#define csbpt_cursor_seek(...)         CSBPT_PASTE(CSBPT_PREFIX, _cursor_seek)(__VA_ARGS__)
+#define csbpt_cursor_next(...)         CSBPT_PASTE(CSBPT_PREFIX, _cursor_next)(__VA_ARGS__)
+#define csbpt_cursor_prev(...)         CSBPT_PASTE(CSBPT_PREFIX, _cursor_prev)(__VA_ARGS__)
+#define csbpt_cursor_read(...)         CSBPT_PASTE(CSBPT_PREFIX, _cursor_read)(__VA_ARGS__)
+#define csbpt_save(...)                CSBPT_PASTE(CSBPT_PREFIX, _save)(__VA_ARGS__)
+#define csbpt_load(...)                CSBPT_PASTE(CSBPT_PREFIX, _load)(__VA_ARGS__)
+#define csbpt_load_mmap(...)           CSBPT_PASTE(CSBPT_PREFIX, _load_mmap)(__VA_ARGS__)
+#define csbpt_log_open(...)            CSBPT_PASTE(CSBPT_PREFIX, _log_open)(__VA_ARGS__)
+#define csbpt_log_sync(...)            CSBPT_PASTE(CSBPT_PREFIX, _log_sync)(__VA_ARGS__)
+#define csbpt_log_close(...)           CSBPT_PASTE(CSBPT_PREFIX, _log_close)(__VA_ARGS__)
+#define csbpt_checkpoint(...)          CSBPT_PASTE(CSBPT_PREFIX, _checkpoint)(__VA_ARGS__)
+#define csbpt_recover(...)             CSBPT_PASTE(CSBPT_PREFIX, _recover)(__VA_ARGS__)
+#define csbpt_dump_dot(...)            CSBPT_PASTE(CSBPT_PREFIX, _dump_dot)(__VA_ARGS__)
+#define csbpt_check(...)               CSBPT_PASTE(CSBPT_PREFIX, _check)(__VA_ARGS__)
+
+#elif defined(__cplusplus)
+
+/* C++ keeps the name csbpt for the namespace of csbpt.hpp */
+#define csbpt                          csbpt_tree
+
+#endif /* CSBPT_PREFIX */
+
+/*!
+ *  \brief Type of a measure
+ */
+typedef CSBPT_KEY_TYPE csbpt_key_t;
+
+/*!
+ *  \brief Opaque handle to a tree
+ */
+struct csbpt;
+
+/*!
+ *  \brief Opaque handle to a reader thread of a concurrent tree
+ */
+struct csbpt_reader;
+
+/*!
+ *  \brief Opaque handle to a write-ahead log attached to a tree
+ */
+struct csbpt_log;
+
+/*!
+ *  \brief Position within a tree, between two values
+ *
+ *  Cursors walk the leaf groups in order, without descending the tree again.
+ *  A cursor is invalidated by any change to its tree.  Its fields are
+ *  private.
+ */
+struct csbpt_cursor {
+	struct csbpt  *tree;     /*!< Tree being walked                   */
+	void          *group;    /*!< Leaf group holding the next value   */
+	size_t         index;    /*!< Index of the next value in \c group */
+};
+
+/*!
+ *  \brief Function to measure a value
+ *
+ *  The measure function is used to compute an integer key from a given value.
+ *  This is referred to as a measure, rather than a key, to emphasise that it
+ *  is used in comparison operations, rather than opaquely.  Values are always
+ *  passed by pointer.
+ *
+ *  \param  val  Value to measure
+ *
+ *  \return Integer measure of the value
+ */
+typedef csbpt_key_t (csbpt_measure_fn)(void *val);
+
+/*!
+ *  \brief Generates a new tree
+ *
+ *  Generates a new tree with the given tuning parameters and measure function.
+ *
+ *  \param  tune                 Tuning parameters to control how the tree
+ *                                 behaves.  If 0, the default parameters are
+ *                                 used.
+ *  \param  measure              Function used to measure.  May be NULL if
+ *                                 there are no initial values, in which case
+ *                                 values can only be inserted with
+ *                                 csbpt_insert_measured() and
+ *                                 csbpt_insert_pairs().
+ *  \param  initial_values       Values to bulk load into the tree on creation.
+ *                                 Bulk loading values on creation is
+ *                                 significantly faster than adding them
+ *                                 individually later.
+ *  \param  initial_value_count  Number of values pointed at by initial_values.
+ *
+ *  \retval NULL     An error occurred.
+ *  \retval other    The function completed successfully
+ */
+struct csbpt *csbpt_create(struct csbpt_tune *tune,
+                           csbpt_measure_fn *measure,
+                           void *initial_values, size_t initial_value_count, size_t initial_value_elem_size);
+
+
+/*!
+ *  \brief Releases a tree
+ *
+ *  Releases a tree and all the resources associated with it.  This should be
+ *  called when you are through using a tree for performance purposes.
+ *  The tree's memory is returned a slab at a time, so this takes time in
+ *  proportion to the number of slabs rather than the number of nodes.
+ *
+ *  \param  tree   Tree to release
+ *
+ *  \retval     0  Resources were released successfully
+ *  \retval other  An error occurred while freeing resources; \c errno is
+ *                 \c EBUSY if versions pinned by csbpt_snapshot() have not
+ *                 been released, or a log is still attached
+ */
+int csbpt_release(struct csbpt *tree);
+
+/*!
+ *  \brief Reports the memory held by a tree
+ *
+ *  Walks the whole tree, so this takes time in proportion to its size, and
+ *  reads \c /proc/self/smaps to find out how much of it is on transparent
+ *  huge pages.
+ *
+ *  \param  tree   Tree to report on
+ *  \param  stats  Filled in with the tree's memory use
+ *
+ *  \retval     0  The statistics were gathered
+ *  \retval other  An error occurred
+ */
+int csbpt_memory_stats(struct csbpt *tree, struct csbpt_memory_stats *stats);
+
+#ifdef CSBPT_STATS
+/*!
+ *  \brief Reports what a tree has done
+ *
+ *  Only available when the library and its callers are built with
+ *  \c CSBPT_STATS defined.  Each thread counts the operations it runs into
+ *  counters of its own, which this adds up, so it can be called from any
+ *  thread while others use the tree.  Counters of a thread which is in the
+ *  middle of an operation may be a little behind.  Operations on versions
+ *  pinned by csbpt_snapshot() count towards the tree they came from.
+ *
+ *  \param  tree   Tree to report on
+ *  \param  stats  Filled in with the totals since the tree was created or
+ *                 loaded
+ *
+ *  \retval     0  The statistics were gathered
+ *  \retval other  An error occurred
+ */
+int csbpt_stats_get(struct csbpt *tree, struct csbpt_stats *stats);
+#endif
+
+/*!
+ *  \brief Registers a reader thread with a tree
+ *
+ *  Each thread reading a concurrent tree while it is being written needs its
+ *  own reader.  Records of unregistered readers are reused.
+ *
+ *  \param  tree   Tree to be read
+ *
+ *  \retval NULL   An error occurred
+ *  \retval other  The reader
+ */
+struct csbpt_reader *csbpt_reader_register(struct csbpt *tree);
+
+/*!
+ *  \brief Unregisters a reader thread
+ *
+ *  \param  reader  Reader to unregister; it must not be between
+ *                  csbpt_read_begin() and csbpt_read_end()
+ *
+ *  \retval     0  The reader was unregistered
+ *  \retval other  An error occurred
+ */
+int csbpt_reader_unregister(struct csbpt_reader *reader);
+
+/*!
+ *  \brief Starts a run of reads of a concurrent tree
+ *
+ *  Between csbpt_read_begin() and csbpt_read_end(), the reader's thread may
+ *  call csbpt_find_value(), csbpt_find_batch(), csbpt_find_kth(),
+ *  csbpt_summarize_prefix(), csbpt_iterate() and the cursor functions while
+ *  another thread writes to the tree.  Each search, or batch of searches,
+ *  sees the tree as it was before or after any given write.  Cursors walk
+ *  the current leaf groups, so they may see values inserted after they
+ *  were placed; csbpt_snapshot() gives reads which all see the same
+ *  version.
+ *
+ *  Memory a writer replaces is not reclaimed until every reader which might
+ *  be using it has called csbpt_read_end(), so runs of reads should be kept
+ *  short.
+ *
+ *  \param  reader  Reader of the calling thread
+ */
+void csbpt_read_begin(struct csbpt_reader *reader);
+
+/*!
+ *  \brief Ends a run of reads of a concurrent tree
+ *
+ *  \param  reader  Reader of the calling thread
+ */
+void csbpt_read_end(struct csbpt_reader *reader);
+
+/*!
+ *  \brief Pins the current version of a concurrent tree
+ *
+ *  The version is returned as a read-only tree which shares every node and
+ *  leaf group with the live one, so taking it costs the same whatever the
+ *  tree's size.  Writes to the live tree carry on copying the groups on
+ *  their path, and the groups they replace are kept for as long as the
+ *  version is, which costs memory in proportion to the height of the tree
+ *  for each write made meanwhile.
+ *
+ *  Any thread may search the version, walk it with cursors or save it with
+ *  csbpt_save(), without registering as a reader; every read sees the tree
+ *  as it was when the version was taken.  Cursors step from one leaf group
+ *  to the next by descending the version, as the links between the groups
+ *  belong to the live tree.  Writes to the version fail with \c EROFS.
+ *
+ *  Release the version with csbpt_release() to let the memory it holds be
+ *  reclaimed.  Every version must be released before the tree itself.
+ *
+ *  \param  tree  Tree created with csbpt_tune.concurrent set
+ *
+ *  \retval NULL   An error occurred, and \c errno is set to \c EINVAL if
+ *                 the tree is not concurrent, or \c ENOMEM
+ *  \retval other  The version
+ */
+struct csbpt *csbpt_snapshot(struct csbpt *tree);
+
+/*!
+ *  \brief Inserts a value into a tree
+ *
+ *  The value is placed after any values with the same measure.  Full node
+ *  groups along the way are split, and the tree grows in height as needed.
+ *  The value itself is not copied; the tree keeps a pointer to it.
+ *
+ *  \param  tree   Tree to insert into
+ *  \param  value  Value to insert
+ *
+ *  \retval     0  The value was inserted
+ *  \retval other  An error occurred; the tree is unchanged
+ */
+int csbpt_insert(struct csbpt *tree, void *value);
+
+/*!
+ *  \brief Inserts a value with a measure given by the caller
+ *
+ *  Like csbpt_insert(), but the tree's measure function is not called, so
+ *  the value need not point at anything; it can be any bits which fit in a
+ *  pointer.  A tree may mix values inserted both ways, as long as the
+ *  measures given here are the ones the measure function would return.
+ *
+ *  \param  tree     Tree to insert into
+ *  \param  measure  Measure of the value
+ *  \param  value    Value to insert
+ *
+ *  \retval     0  The value was inserted
+ *  \retval other  An error occurred; the tree is unchanged
+ */
+int csbpt_insert_measured(struct csbpt *tree, csbpt_key_t measure, void *value);
+
+/*!
+ *  \brief Inserts a value at the start of a tree
+ *
+ *  This is faster than csbpt_insert(), since no search is needed, but the
+ *  value's measure must not be greater than that of any value in the tree.
+ *
+ *  \param  tree   Tree to insert into
+ *  \param  value  Value to insert
+ *
+ *  \retval     0  The value was inserted
+ *  \retval other  An error occurred; the tree is unchanged.  \c errno is set
+ *                 to \c EINVAL if the value would be out of order.
+ */
+int csbpt_push_left(struct csbpt *tree, void *value);
+
+/*!
+ *  \brief Inserts a value at the end of a tree
+ *
+ *  This is faster than csbpt_insert(), since no search is needed, but the
+ *  value's measure must not be less than that of any value in the tree.  It
+ *  is the natural way to add monotonically increasing values.
+ *
+ *  \param  tree   Tree to insert into
+ *  \param  value  Value to insert
+ *
+ *  \retval     0  The value was inserted
+ *  \retval other  An error occurred; the tree is unchanged.  \c errno is set
+ *                 to \c EINVAL if the value would be out of order.
+ */
+int csbpt_push_right(struct csbpt *tree, void *value);
+
+/*!
+ *  \brief Inserts a batch of values into a tree
+ *
+ *  The values are measured and sorted in the same way as the initial values
+ *  given to csbpt_create(), then merged into the existing leaf groups in a
+ *  single pass from left to right.  Only the parts of the tree which receive
+ *  new values are rebuilt.  For large batches this is much faster than
+ *  calling csbpt_insert() for each value.
+ *
+ *  Values with the same measure as a value already in the tree are placed
+ *  after it.
+ *
+ *  \param  tree       Tree to insert into
+ *  \param  values     Values to insert
+ *  \param  count      Number of values pointed at by \c values
+ *  \param  elem_size  Size of each value
+ *
+ *  In a concurrent tree, the values are inserted one at a time, and a
+ *  failure leaves the values before it in the tree.
+ *
+ *  \retval     0  The values were inserted
+ *  \retval other  An error occurred; the tree is unchanged
+ */
+int csbpt_insert_batch(struct csbpt *tree, void *values, size_t count, size_t elem_size);
+
+/*!
+ *  \brief Inserts a batch of values with measures given by the caller
+ *
+ *  Like csbpt_insert_batch(), with the measures taken from \c measures
+ *  rather than from the tree's measure function, as in
+ *  csbpt_insert_measured().  Values with the same measure keep their order
+ *  in \c values.
+ *
+ *  \param  tree      Tree to insert into
+ *  \param  measures  Measure of each value
+ *  \param  values    Values to insert
+ *  \param  count     Number of entries in \c measures and \c values
+ *
+ *  \retval     0  The values were inserted
+ *  \retval other  An error occurred; the tree is unchanged
+ */
+int csbpt_insert_pairs(struct csbpt *tree, const csbpt_key_t *measures, void *const *values, size_t count);
+
+/*!
+ *  \brief Deletes the values with a given measure
+ *
+ *  Node groups left with fewer than \c order entries are merged with a
+ *  neighbour, or share the neighbour's entries, so the tree stays as compact
+ *  as if the remaining values had been inserted.  The tree loses levels as
+ *  it shrinks.
+ *
+ *  In a concurrent tree, the values are deleted one at a time, each copying
+ *  the path to it, and a failure leaves the values before it deleted.
+ *
+ *  \param  tree       Tree to delete from
+ *  \param  measure    Measure of the values to delete
+ *  \param  user_data  Passed through to \c predicate
+ *  \param  predicate  Returns non-zero for each value to delete; NULL
+ *                     deletes every value with the measure.  It must not
+ *                     change the tree.
+ *  \param  count      Set to the number of values deleted; may be NULL
+ *
+ *  \retval     0  The values were deleted
+ *  \retval other  An error occurred.  Unless the tree is concurrent, it is
+ *                 unchanged.
+ */
+int csbpt_delete(struct csbpt *tree, csbpt_key_t measure, void *user_data, csbpt_predicate_fn *predicate, size_t *count);
+
+/*!
+ *  \brief Deletes every value picked by a predicate
+ *
+ *  Like csbpt_delete(), but \c predicate is called on every value in the
+ *  tree.
+ *
+ *  \param  tree       Tree to delete from
+ *  \param  user_data  Passed through to \c predicate
+ *  \param  predicate  Returns non-zero for each value to delete
+ *  \param  count      Set to the number of values deleted; may be NULL
+ *
+ *  \retval     0  The values were deleted
+ *  \retval other  An error occurred
+ */
+int csbpt_delete_pred(struct csbpt *tree, void *user_data, csbpt_predicate_fn *predicate, size_t *count);
+
+/*!
+ *  \brief Deletes every value with a measure in a range
+ *
+ *  Subtrees lying wholly inside the range are unlinked and freed a node
+ *  group at a time, without visiting their values, so expiring a large
+ *  range costs little more than rebalancing its two edges.  This does not
+ *  apply to a concurrent tree, where values are deleted one at a time as in
+ *  csbpt_delete().
+ *
+ *  \param  tree   Tree to delete from
+ *  \param  lo     Smallest measure to delete
+ *  \param  hi     Largest measure to delete
+ *  \param  count  Set to the number of values deleted; may be NULL
+ *
+ *  \retval     0  The values were deleted
+ *  \retval other  An error occurred
+ */
+int csbpt_delete_range(struct csbpt *tree, csbpt_key_t lo, csbpt_key_t hi, size_t *count);
+
+/*!
+ *  \brief Finds the values with a given measure
+ *
+ *  Calls \c action on every value whose measure is \c measure, in insertion
+ *  order.  If \c action returns non-zero, the search stops.
+ *
+ *  \param  tree       Tree to search
+ *  \param  measure    Measure to look for
+ *  \param  user_data  Passed through to \c action
+ *  \param  action     Function to call for each value found; may be NULL
+ *
+ *  \return The number of values passed to \c action
+ */
+int csbpt_find_value(struct csbpt *tree, csbpt_key_t measure, void *user_data, csbpt_action_fn *action);
+
+/*!
+ *  \brief Finds the first value with each of many measures
+ *
+ *  A lookup waits on a cache miss at nearly every level of a large tree.
+ *  This walks groups of lookups down the tree together, a level at a time,
+ *  prefetching the nodes each one needs next before searching any of them,
+ *  so that the misses of a group overlap.  For many independent lookups,
+ *  such as the probes of a join, it is much faster than calling
+ *  csbpt_find_value() for each.  The measures need not be sorted.
+ *
+ *  \param  tree      Tree to search
+ *  \param  measures  Measures to look for
+ *  \param  count     Number of entries in \c measures and \c values
+ *  \param  values    Set to the first value with each measure, in insertion
+ *                    order, or to NULL if there is none
+ *
+ *  \return The number of measures found
+ */
+size_t csbpt_find_batch(struct csbpt *tree, const csbpt_key_t *measures, size_t count, void **values);
+
+/*!
+ *  \brief Finds the value at a given position
+ *
+ *  The tree must have been created with a #csbpt_combinator.
+ *
+ *  \param  tree     Tree to search
+ *  \param  k        Position of the value, counting from 0, in order of
+ *                   measure
+ *  \param  measure  Set to the value's measure; may be NULL
+ *  \param  value    Set to the value; may be NULL
+ *
+ *  \retval     0  The value was found
+ *  \retval other  An error occurred.  \c errno is set to \c ERANGE if the tree
+ *                 has no more than \c k values, or \c ENOTSUP if it keeps no
+ *                 summaries.
+ */
+int csbpt_find_kth(struct csbpt *tree, size_t k, csbpt_key_t *measure, void **value);
+
+/*!
+ *  \brief Summarizes every value with a measure of at most a given one
+ *
+ *  The tree must have been created with a #csbpt_combinator.  Pass the
+ *  largest measure, such as INT_MAX, to summarize the whole tree.
+ *
+ *  \param  tree     Tree to search
+ *  \param  measure  Largest measure to include
+ *  \param  count    Set to the number of values included; may be NULL
+ *  \param  summary  Set to the combined summary of those values; may be NULL
+ *
+ *  \retval     0  The values were summarized
+ *  \retval other  An error occurred.  \c errno is set to \c ENOTSUP if the
+ *                 tree keeps no summaries.
+ */
+int csbpt_summarize_prefix(struct csbpt *tree, csbpt_key_t measure, size_t *count, long long *summary);
+
+/*!
+ *  \brief Finds the first value a predicate picks
+ *
+ *  Values are tried in order of measure, starting from the leftmost leaf
+ *  group, until \c predicate returns non-zero for one; \c action is then
+ *  called on it.
+ *
+ *  \param  tree       Tree to search
+ *  \param  user_data  Passed through to \c predicate and \c action
+ *  \param  predicate  Returns non-zero for the value to find
+ *  \param  action     Function to call on the value found; may be NULL
+ *
+ *  \return 1 if a value was found, or 0 if none was
+ */
+int csbpt_find_first_pred(struct csbpt *tree, void *user_data, csbpt_predicate_fn *predicate, csbpt_action_fn *action);
+
+/*!
+ *  \brief Finds every value a predicate picks
+ *
+ *  Values are tried in order of measure, and \c action is called on each
+ *  one \c predicate returns non-zero for.  If \c action returns non-zero,
+ *  the search stops.
+ *
+ *  \param  tree       Tree to search
+ *  \param  user_data  Passed through to \c predicate and \c action
+ *  \param  predicate  Returns non-zero for each value to find
+ *  \param  action     Function to call for each value found; may be NULL
+ *
+ *  \return The number of values passed to \c action
+ */
+int csbpt_find_all_pred(struct csbpt *tree, void *user_data, csbpt_predicate_fn *predicate, csbpt_action_fn *action);
+
+/*!
+ *  \brief Calls a function on every value in a tree
+ *
+ *  Values are visited in order of measure.  If \c action returns non-zero,
+ *  the walk stops.
+ *
+ *  \param  tree       Tree to walk
+ *  \param  user_data  Passed through to \c action
+ *  \param  action     Function to call for each value
+ *
+ *  \return The number of values passed to \c action
+ */
+int csbpt_iterate(struct csbpt *tree, void *user_data, csbpt_action_fn *action);
+
+/*!
+ *  \brief Places a cursor before the first value with a measure of at least
+ *  \c measure
+ *
+ *  This descends the tree once.  Later calls to csbpt_cursor_next() and
+ *  csbpt_cursor_prev() follow the links between leaf groups, prefetching
+ *  the next group as they go.
+ *
+ *  \param  tree     Tree to walk
+ *  \param  cursor   Cursor to position
+ *  \param  measure  Measure to seek to; use the smallest measure, such as
+ *                   INT_MIN, for the start of the tree
+ *
+ *  \retval     0  The cursor was placed before such a value
+ *  \retval other  No value has a large enough measure.  The cursor is placed
+ *                 at the end of the tree, and \c errno is set to \c ENOENT.
+ */
+int csbpt_cursor_seek(struct csbpt *tree, struct csbpt_cursor *cursor, csbpt_key_t measure);
+
+/*!
+ *  \brief Returns the value after a cursor, and moves the cursor past it
+ *
+ *  \param  cursor   Cursor to move
+ *  \param  measure  Set to the value's measure; may be NULL
+ *  \param  value    Set to the value; may be NULL
+ *
+ *  \retval     0  A value was returned
+ *  \retval other  The cursor is at the end of the tree, and \c errno is set
+ *                 to \c ENOENT
+ */
+int csbpt_cursor_next(struct csbpt_cursor *cursor, csbpt_key_t *measure, void **value);
+
+/*!
+ *  \brief Returns the value before a cursor, and moves the cursor before it
+ *
+ *  \param  cursor   Cursor to move
+ *  \param  measure  Set to the value's measure; may be NULL
+ *  \param  value    Set to the value; may be NULL
+ *
+ *  \retval     0  A value was returned
+ *  \retval other  The cursor is at the start of the tree, and \c errno is
+ *                 set to \c ENOENT
+ */
+int csbpt_cursor_prev(struct csbpt_cursor *cursor, csbpt_key_t *measure, void **value);
+
+/*!
+ *  \brief Returns the values after a cursor, and moves the cursor past them
+ *
+ *  Copies a leaf group at a time, so walking a range this way costs one
+ *  call per batch rather than one per value.
+ *
+ *  \param  cursor    Cursor to move
+ *  \param  measures  Filled in with the values' measures; may be NULL
+ *  \param  values    Filled in with the values; may be NULL
+ *  \param  max       Room in \c measures and \c values
+ *
+ *  \return The number of values returned; less than \c max only at the end
+ *          of the tree
+ */
+size_t csbpt_cursor_read(struct csbpt_cursor *cursor, csbpt_key_t *measures, void **values, size_t max);
+
+/*!
+ *  \brief Writes a snapshot of a tree to a file
+ *
+ *  The snapshot is an image of the tree's nodes in which pointers are
+ *  replaced by offsets, so csbpt_load_mmap() can search it without rebuilding
+ *  anything.  Each value is stored as the \c value_size bytes it points at,
+ *  so values must be plain data, not holding pointers of their own.
+ *
+ *  Snapshots can only be read on machines with the same word size and byte
+ *  order.  In a concurrent tree, this must be called from the writing thread.
+ *
+ *  \param  tree        Tree to save
+ *  \param  file        File to write to, from its current position
+ *  \param  value_size  Bytes to store for each value; 0 stores only the
+ *                      measures, and values read back are NULL
+ *
+ *  \retval     0  The snapshot was written
+ *  \retval other  An error occurred
+ */
+int csbpt_save(struct csbpt *tree, FILE *file, size_t value_size);
+
+/*!
+ *  \brief Reads a snapshot into memory
+ *
+ *  The snapshot is read in a single pass, and searched in place.  The tree is
+ *  read-only: inserts fail with \c errno set to \c EROFS.
+ *
+ *  \param  file  File to read from, from its current position
+ *  \param  tune  Only \c search and \c combinator are used.  Summaries are
+ *                read from the snapshot, but the \c summarize and \c combine
+ *                functions it was saved with are needed to summarize part of
+ *                a leaf group in csbpt_summarize_prefix().  May be NULL.
+ *
+ *  \retval NULL   An error occurred.  \c errno is set to \c EINVAL if the
+ *                 file is not a snapshot of a tree with this type of measure,
+ *                 or \c ENOTSUP if it was written by an incompatible version
+ *                 or machine.
+ *  \retval other  The tree
+ */
+struct csbpt *csbpt_load(FILE *file, struct csbpt_tune *tune);
+
+/*!
+ *  \brief Searches a snapshot straight out of the file
+ *
+ *  Like csbpt_load(), but the file is mapped into memory instead of read,
+ *  so opening it takes the same time however large it is, and pages are only
+ *  read when a search touches them.  Values point into the mapping, and stay
+ *  valid until the tree is released.  The file must not change while it is
+ *  mapped.
+ *
+ *  \param  path  Path of the snapshot
+ *  \param  tune  As for csbpt_load(); may be NULL
+ *
+ *  \retval NULL   An error occurred
+ *  \retval other  The tree
+ */
+struct csbpt *csbpt_load_mmap(const char *path, struct csbpt_tune *tune);
+
+/*!
+ *  \brief Attaches a write-ahead log to a tree
+ *
+ *  From then on, each insert and delete which succeeds appends a record of
+ *  what it did to the log, with the \c value_size bytes of any value it
+ *  inserted or removed.  Records are buffered, and written and synced to disk
+ *  in groups: by csbpt_log_sync(), by a background thread every
+ *  \c sync_usec microseconds, or when the buffer grows past a megabyte.
+ *  However many writes a group holds, it costs one \c fdatasync().
+ *
+ *  The log must not hold records the tree does not include, and the tree
+ *  must hold nothing the log and the last checkpoint lack.  Open the log on
+ *  a tree returned by csbpt_recover(), or on an empty tree with no log yet,
+ *  and call csbpt_checkpoint() right after opening it if the tree already
+ *  holds values.
+ *
+ *  \param  tree        Tree to log the writes of
+ *  \param  path        Path of the log; created if it does not exist, and
+ *                      any torn record at its end is cut off
+ *  \param  value_size  Bytes to log for each value; 0 logs only measures
+ *  \param  sync_usec   How often the background thread syncs the log; 0
+ *                      starts no thread, so records only reach the disk
+ *                      when csbpt_log_sync() is called or the buffer fills
+ *
+ *  \retval NULL   An error occurred.  \c errno is set to \c EROFS for a
+ *                 loaded or pinned tree, or \c EINVAL if the tree already
+ *                 has a log, or the log does not match the tree.
+ *  \retval other  The log
+ */
+struct csbpt_log *csbpt_log_open(struct csbpt *tree, const char *path, size_t value_size, unsigned long sync_usec);
+
+/*!
+ *  \brief Waits until every record appended to a log is on disk
+ *
+ *  Joins a flush which is already under way if that covers the records.
+ *  Safe to call from any thread.
+ *
+ *  \param  log  Log to sync
+ *
+ *  \retval     0  The records are durable
+ *  \retval other  Writing the log failed, now or earlier, and \c errno is
+ *                 set to the error.  The tree's writes since the last
+ *                 successful sync may be lost in a crash.
+ */
+int csbpt_log_sync(struct csbpt_log *log);
+
+/*!
+ *  \brief Syncs a log and detaches it from its tree
+ *
+ *  \param  log  Log to close
+ *
+ *  \retval     0  The log was synced and closed
+ *  \retval other  Syncing failed; the log is closed all the same
+ */
+int csbpt_log_close(struct csbpt_log *log);
+
+/*!
+ *  \brief Saves a checkpoint of a logged tree, and starts its log afresh
+ *
+ *  The tree is saved with csbpt_save() to a file next to \c path, synced,
+ *  and renamed over it, so a crash leaves either the old checkpoint or the
+ *  new one.  In a concurrent tree, this must be called from the writing
+ *  thread.
+ *
+ *  \param  tree  Tree with a log attached
+ *  \param  path  Path of the checkpoint
+ *
+ *  \retval     0  The checkpoint was saved
+ *  \retval other  An error occurred; \c errno is \c EINVAL if the tree has
+ *                 no log
+ */
+int csbpt_checkpoint(struct csbpt *tree, const char *path);
+
+/*!
+ *  \brief Rebuilds a tree from its last checkpoint and log
+ *
+ *  Loads the checkpoint, if there is one, then replays the records in the
+ *  log after it, up to the first one which was torn by a crash.  The values
+ *  are copied into memory the tree owns, which lasts until it is released.
+ *  Attach the log to the tree again with csbpt_log_open() to carry on.
+ *
+ *  \param  checkpoint  Path of the checkpoint; it need not exist
+ *  \param  log_path    Path of the log; it need not exist
+ *  \param  tune        Tuning parameters of the new tree; may be NULL
+ *  \param  measure     Measure function of the new tree; may be NULL
+ *  \param  value_size  Bytes logged for each value
+ *
+ *  \retval NULL   An error occurred.  \c errno is set to \c EINVAL if the
+ *                 files do not belong together or to a tree like this one.
+ *  \retval other  The tree
+ */
+struct csbpt *csbpt_recover(const char *checkpoint, const char *log_path, struct csbpt_tune *tune,
+                            csbpt_measure_fn *measure, size_t value_size);
+
+#ifdef CSBPT_DEBUG
+int csbpt_dump_dot(struct csbpt *tree, FILE *file);
+
+/*!
+ *  \brief Checks the structure of a tree
+ *
+ *  Verifies that keys are in order and match the leaf groups, that every node
+ *  respects the tree's order, and that the leaf groups are linked correctly.
+ *  A description of the first problem found is written to \c stderr.
+ *
+ *  \param  tree   Tree to check
+ *
+ *  \retval     0  The tree is valid
+ *  \retval other  The tree is corrupt
+ */
+int csbpt_check(struct csbpt *tree);
+#endif
+
+/* Only csbpt.c keeps using the names of the type it is compiled for */
+#ifndef CSBPT_KEEP_NAMES
+#undef csbpt
+#undef csbpt_reader
+#undef csbpt_cursor
+#undef csbpt_log
+#undef csbpt_key_t
+#undef csbpt_measure_fn
+#undef csbpt_create
+#undef csbpt_release
+#undef csbpt_memory_stats
+#undef csbpt_stats_get
+#undef csbpt_reader_register
+#undef csbpt_reader_unregister
+#undef csbpt_read_begin
+#undef csbpt_read_end
+#undef csbpt_snapshot
+#undef csbpt_insert
+#undef csbpt_insert_measured
+#undef csbpt_push_left
+#undef csbpt_push_right
+#undef csbpt_insert_batch
+#undef csbpt_insert_pairs
+#undef csbpt_delete
+#undef csbpt_delete_pred
+#undef csbpt_delete_range
+#undef csbpt_find_value
+#undef csbpt_find_batch
+#undef csbpt_find_kth
+#undef csbpt_summarize_prefix
+#undef csbpt_find_first_pred
+#undef csbpt_find_all_pred
+#undef csbpt_iterate
+#undef csbpt_cursor_seek
+#undef csbpt_cursor_next
+#undef csbpt_cursor_prev
+#undef csbpt_cursor_read
+#undef csbpt_save
+#undef csbpt_load
+#undef csbpt_load_mmap
+#undef csbpt_log_open
+#undef csbpt_log_sync
+#undef csbpt_log_close
+#undef csbpt_checkpoint
+#undef csbpt_recover
+#undef csbpt_dump_dot
+#undef csbpt_check
+#undef CSBPT_KEY_TYPE
+#undef CSBPT_PREFIX
+#endif
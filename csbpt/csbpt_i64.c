@@ -0,0 +1,19 @@
+/*!
+ *  \file     csbpt_i64.c
+ *  \brief    CSB+ tree of int64_t measures
+ *
+ *  Compiles csbpt.c into the functions declared in csbpt_i64.h.
+ */
+
+#include <inttypes.h>
+#include <stdint.h>
+
+#define CSBPT_KEY_TYPE    int64_t
+#define CSBPT_KEY_MIN     INT64_MIN
+#define CSBPT_KEY_MAX     INT64_MAX
+#define CSBPT_KEY_BITS    64
+#define CSBPT_KEY_SIGNED  1
+#define CSBPT_KEY_FORMAT  PRId64
+#define CSBPT_PREFIX      i64
+
+#include "csbpt.c"
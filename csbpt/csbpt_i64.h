@@ -0,0 +1,28 @@
+/*!
+ *  \file     csbpt_i64.h
+ *  \brief    CSB+ tree of int64_t measures
+ *
+ *  Declares \c struct \c csbpt_i64 and the \c csbpt_i64_ functions, which
+ *  behave like their counterparts in csbpt_api.h, with \c int64_t measures.
+ *  The smallest and largest measures are \c INT64_MIN and \c INT64_MAX.
+ */
+
+#ifndef CSBPT_I64_H_
+#define CSBPT_I64_H_
+
+#include "csbpt.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define CSBPT_KEY_TYPE int64_t
+#define CSBPT_PREFIX   i64
+
+#include "csbpt_api.h"
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* CSBPT_I64_H_ */
@@ -0,0 +1,19 @@
+/*!
+ *  \file     csbpt_u64.c
+ *  \brief    CSB+ tree of uint64_t measures
+ *
+ *  Compiles csbpt.c into the functions declared in csbpt_u64.h.
+ */
+
+#include <inttypes.h>
+#include <stdint.h>
+
+#define CSBPT_KEY_TYPE    uint64_t
+#define CSBPT_KEY_MIN     0
+#define CSBPT_KEY_MAX     UINT64_MAX
+#define CSBPT_KEY_BITS    64
+#define CSBPT_KEY_SIGNED  0
+#define CSBPT_KEY_FORMAT  PRIu64
+#define CSBPT_PREFIX      u64
+
+#include "csbpt.c"
@@ -0,0 +1,63 @@
+/*!
+ *  \file     csbpt_u64.h
+ *  \brief    CSB+ tree of uint64_t measures
+ *
+ *  Declares \c struct \c csbpt_u64 and the \c csbpt_u64_ functions, which
+ *  behave like their counterparts in csbpt_api.h, with \c uint64_t measures.
+ *  The smallest and largest measures are 0 and \c UINT64_MAX.
+ *
+ *  Composite keys of two 32-bit fields, such as a tenant and an id, are
+ *  packed into a single measure by csbpt_u64_pair(), so they are still
+ *  compared with one instruction.
+ */
+
+#ifndef CSBPT_U64_H_
+#define CSBPT_U64_H_
+
+#include "csbpt.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define CSBPT_KEY_TYPE uint64_t
+#define CSBPT_PREFIX   u64
+
+#include "csbpt_api.h"
+
+#ifdef __cplusplus
+}
+#endif
+
+/*!
+ *  \brief Packs two fields into a measure
+ *
+ *  Measures made this way order by \c major, then by \c minor.
+ *
+ *  \param  major  Field compared first
+ *  \param  minor  Field compared when the \c major fields are equal
+ *
+ *  \return The measure
+ */
+static inline uint64_t csbpt_u64_pair(uint32_t major, uint32_t minor)
+{
+	return ((uint64_t) major << 32) | minor;
+}
+
+/*!
+ *  \brief Returns the \c major field of a measure made by csbpt_u64_pair()
+ */
+static inline uint32_t csbpt_u64_pair_major(uint64_t measure)
+{
+	return (uint32_t) (measure >> 32);
+}
+
+/*!
+ *  \brief Returns the \c minor field of a measure made by csbpt_u64_pair()
+ */
+static inline uint32_t csbpt_u64_pair_minor(uint64_t measure)
+{
+	return (uint32_t) measure;
+}
+
+#endif /* CSBPT_U64_H_ */
@@ -1,6 +1,12 @@
+#include <errno.h>
+#include <limits.h>
+#include <pthread.h>
 #include <stdlib.h>
+#include <string.h>
 
 #include "csbpt.h"
+#include "csbpt_i64.h"
+#include "csbpt_u64.h"
 
 static int ordered_ints_measure(void *val)
 {
@@ -11,18 +17,2328 @@ static int ordered_ints_measure(void *val)
 static int ordered_ints_action_fn(void *user_data, void *val)
 {
 	printf("Action called with value %d\n", *((int *) val));
+
+	return 0;
+}
+
+static int count_action_fn(void *user_data, void *val)
+{
+	(*((int *) user_data))++;
+
+	return 0;
+}
+
+/*
+ *  Counts how often each value occurs in data, then checks the tree agrees.
+ */
+static int check_counts(struct csbpt *tree, int *data, int size, int range)
+{
+	int i;
+	int found;
+	int *expected = calloc(range, sizeof(int));
+
+	for(i = 0; i < size; i++) {
+		expected[data[i]]++;
+	}
+
+	for(i = 0; i < range; i++) {
+		found = 0;
+		if(csbpt_find_value(tree, i, &found, count_action_fn) != expected[i] || found != expected[i]) {
+			fprintf(stderr, "Expected %d copies of %d, found %d\n", expected[i], i, found);
+			free(expected);
+			return 1;
+		}
+	}
+
+	free(expected);
+
+	return 0;
+}
+
+/*
+ *  Values found by a predicate search, and whether they came in order.
+ */
+struct pred_search {
+	int divisor;
+	int stop_after;
+	int found;
+	int last;
+	int out_of_order;
+};
+
+static int divisible_predicate(void *user_data, void *val)
+{
+	return *((int *) val) % ((struct pred_search *) user_data)->divisor == 0;
+}
+
+static int pred_search_action(void *user_data, void *val)
+{
+	struct pred_search *search = (struct pred_search *) user_data;
+
+	if(*((int *) val) < search->last) {
+		search->out_of_order = 1;
+	}
+	search->last = *((int *) val);
+	search->found++;
+
+	return search->found == search->stop_after;
+}
+
+static int test_find_pred(int order, enum csbpt_leaf_layout layout)
+{
+	int i;
+	int failed = 0;
+	int expected = 0;
+	int smallest;
+	struct pred_search search;
+	struct csbpt_tune tune;
+	struct csbpt *tree;
+	const int size = 3000;
+	const int range = 1000;
+	int *data;
+
+	memset(&tune, 0, sizeof(tune));
+	tune.order = order;
+	tune.leaf_layout = layout;
+
+	data = calloc(size, sizeof(int));
+	smallest = range + 1;
+	for(i = 0; i < size; i++) {
+		data[i] = 1 + rand() % range;
+		if(data[i] % 7 == 0) {
+			expected++;
+			smallest = data[i] < smallest ? data[i] : smallest;
+		}
+	}
+
+	tree = csbpt_create(&tune, ordered_ints_measure, data, size / 2, sizeof(int));
+	for(i = size / 2; i < size && !failed; i++) {
+		failed = csbpt_insert(tree, &data[i]);
+	}
+
+	memset(&search, 0, sizeof(search));
+	search.divisor = 7;
+	if(!failed && (csbpt_find_all_pred(tree, &search, divisible_predicate, pred_search_action) != expected ||
+	               search.found != expected || search.out_of_order)) {
+		fprintf(stderr, "Found %d multiples of 7, expected %d\n", search.found, expected);
+		failed = 1;
+	}
+
+	memset(&search, 0, sizeof(search));
+	search.divisor = 7;
+	if(!failed && (csbpt_find_first_pred(tree, &search, divisible_predicate, pred_search_action) != 1 ||
+	               search.found != 1 || search.last != smallest)) {
+		fprintf(stderr, "Found %d first, expected %d\n", search.last, smallest);
+		failed = 1;
+	}
+
+	/* The action can stop the search early */
+	memset(&search, 0, sizeof(search));
+	search.divisor = 7;
+	search.stop_after = 5;
+	if(!failed && expected >= 5 && csbpt_find_all_pred(tree, &search, divisible_predicate, pred_search_action) != 5) {
+		fprintf(stderr, "Search went on after the action stopped it\n");
+		failed = 1;
+	}
+
+	memset(&search, 0, sizeof(search));
+	search.divisor = range + 1;
+	if(!failed && (csbpt_find_first_pred(tree, &search, divisible_predicate, pred_search_action) != 0 ||
+	               csbpt_find_all_pred(tree, &search, divisible_predicate, NULL) != 0 || search.found != 0)) {
+		fprintf(stderr, "Found a value no predicate picks\n");
+		failed = 1;
+	}
+
+	csbpt_release(tree);
+	free(data);
+
+	return failed;
+}
+
+static int test_insert(int order, enum csbpt_search search, enum csbpt_leaf_layout layout)
+{
+	int i;
+	int failed = 0;
+	struct csbpt_tune tune;
+	struct csbpt *tree;
+	const int size = 3000;
+	int *data;
+
+	memset(&tune, 0, sizeof(tune));
+	tune.order = order;
+	tune.search = search;
+	tune.leaf_layout = layout;
+
+	tree = csbpt_create(&tune, ordered_ints_measure, NULL, 0, sizeof(int));
+	data = calloc(size, sizeof(int));
+
+	for(i = 0; i < size && !failed; i++) {
+		data[i] = rand() % (size / 2);
+		if(csbpt_insert(tree, &data[i]) || csbpt_check(tree)) {
+			fprintf(stderr, "Insert %d (%d) failed at order %d\n", i, data[i], order);
+			failed = 1;
+		}
+	}
+
+	if(!failed && check_counts(tree, data, size, size / 2)) {
+		failed = 1;
+	}
+
+	csbpt_release(tree);
+	free(data);
+
+	return failed;
+}
+
+static int test_push(int order, enum csbpt_leaf_layout layout)
+{
+	int i;
+	int failed = 0;
+	struct csbpt_tune tune;
+	struct csbpt *tree;
+	const int size = 2000;
+	int *data;
+	int bad = -1;
+
+	memset(&tune, 0, sizeof(tune));
+	tune.order = order;
+	tune.leaf_layout = layout;
+
+	tree = csbpt_create(&tune, ordered_ints_measure, NULL, 0, sizeof(int));
+	data = calloc(size, sizeof(int));
+
+	for(i = 0; i < size && !failed; i++) {
+		data[i] = i;
+		if(i % 2 == 0) {
+			data[i] = size + i;
+			failed = csbpt_push_right(tree, &data[i]);
+		} else {
+			data[i] = size - i;
+			failed = csbpt_push_left(tree, &data[i]);
+		}
+	}
+
+	if(!failed && (csbpt_push_right(tree, &bad) == 0 || errno != EINVAL)) {
+		fprintf(stderr, "Out of order push was accepted\n");
+		failed = 1;
+	}
+
+	if(!failed && csbpt_check(tree)) {
+		failed = 1;
+	}
+
+	for(i = 0; i < size && !failed; i++) {
+		if(csbpt_find_value(tree, data[i], NULL, NULL) != 1) {
+			fprintf(stderr, "Pushed value %d not found\n", data[i]);
+			failed = 1;
+		}
+	}
+
+	csbpt_release(tree);
+	free(data);
+
+	return failed;
+}
+
+static int test_insert_after_load(enum csbpt_leaf_layout layout)
+{
+	int i;
+	int failed = 0;
+	struct csbpt_tune tune;
+	struct csbpt *tree;
+	const int size = 1000;
+	int *data;
+
+	memset(&tune, 0, sizeof(tune));
+	tune.order = 3;
+	tune.leaf_layout = layout;
+
+	data = calloc(2 * size, sizeof(int));
+	for(i = 0; i < 2 * size; i++) {
+		data[i] = rand() % size;
+	}
+
+	tree = csbpt_create(&tune, ordered_ints_measure, data, size, sizeof(int));
+
+	for(i = size; i < 2 * size && !failed; i++) {
+		failed = csbpt_insert(tree, &data[i]);
+	}
+
+	if(!failed) {
+		failed = check_counts(tree, data, 2 * size, size);
+	}
+
+	csbpt_release(tree);
+	free(data);
+
+	return failed;
+}
+
+static int test_insert_batch(int order, enum csbpt_leaf_layout layout)
+{
+	int i;
+	int failed = 0;
+	struct csbpt_tune tune;
+	struct csbpt *tree;
+	const int batch_size = 1500;
+	const int num_batches = 4;
+	int *data;
+
+	memset(&tune, 0, sizeof(tune));
+	tune.order = order;
+	tune.leaf_layout = layout;
+
+	data = calloc(batch_size * num_batches, sizeof(int));
+	for(i = 0; i < batch_size * num_batches; i++) {
+		data[i] = rand() % batch_size;
+	}
+
+	tree = csbpt_create(&tune, ordered_ints_measure, NULL, 0, sizeof(int));
+
+	for(i = 0; i < num_batches && !failed; i++) {
+		/* Batches of every size, down to a single value */
+		if(csbpt_insert_batch(tree, data + i * batch_size, batch_size >> (2 * i), sizeof(int)) || csbpt_check(tree)) {
+			fprintf(stderr, "Batch %d failed at order %d\n", i, order);
+			failed = 1;
+		}
+		if(i > 0 && csbpt_insert_batch(tree, data + i * batch_size + (batch_size >> (2 * i)),
+		                               batch_size - (batch_size >> (2 * i)), sizeof(int))) {
+			failed = 1;
+		}
+	}
+
+	if(!failed && csbpt_check(tree)) {
+		failed = 1;
+	}
+
+	if(!failed) {
+		failed = check_counts(tree, data, batch_size * num_batches, batch_size);
+	}
+
+	csbpt_release(tree);
+	free(data);
+
+	return failed;
+}
+
+static int first_value_action(void *user_data, void *val)
+{
+	*((void **) user_data) = val;
+
+	return 1;
+}
+
+static int test_find_batch(int order, enum csbpt_leaf_layout layout)
+{
+	int i;
+	int length;
+	int failed = 0;
+	size_t found = 0;
+	void *expected;
+	struct csbpt_tune tune;
+	struct csbpt *tree;
+	const int size = 5000;
+	int *data;
+	int *probes;
+	void **values;
+
+	memset(&tune, 0, sizeof(tune));
+	tune.order = order;
+	tune.leaf_layout = layout;
+
+	data = calloc(size, sizeof(int));
+	probes = calloc(size, sizeof(int));
+	values = calloc(size, sizeof(void *));
+	for(i = 0; i < size; i++) {
+		data[i] = 2 * (rand() % (size / 4));
+		probes[i] = rand() % (size / 2 + 10) - 5;
+	}
+
+	/* Duplicates spread across leaf groups, and probes missing on both
+	 * sides of the tree and between its measures */
+	tree = csbpt_create(&tune, ordered_ints_measure, NULL, 0, sizeof(int));
+	if(csbpt_find_batch(tree, probes, size, values) != 0 || values[0]) {
+		fprintf(stderr, "Batch lookup found values in an empty tree\n");
+		failed = 1;
+	}
+	if(!failed && csbpt_insert_batch(tree, data, size, sizeof(int))) {
+		failed = 1;
+	}
+
+	/* Batches of every length up to a few times CSBPT_FIND_BATCH */
+	for(i = 0, length = 1; i < size && !failed; i += length, length = length % 50 + 1) {
+		found += csbpt_find_batch(tree, probes + i, length < size - i ? length : size - i, values + i);
+	}
+
+	for(i = 0; i < size && !failed; i++) {
+		expected = NULL;
+		if(csbpt_find_value(tree, probes[i], &expected, first_value_action)) {
+			found--;
+		}
+		if(values[i] != expected) {
+			fprintf(stderr, "Batch lookup of %d found %p, expected %p\n", probes[i], values[i], expected);
+			failed = 1;
+		}
+	}
+
+	if(!failed && found != 0) {
+		fprintf(stderr, "Batch lookup miscounted by %d\n", (int) found);
+		failed = 1;
+	}
+
+	csbpt_release(tree);
+	free(data);
+	free(probes);
+	free(values);
+
+	return failed;
+}
+
+static int int_compare(const void *a, const void *b)
+{
+	return (*((int *) a) > *((int *) b)) - (*((int *) a) < *((int *) b));
+}
+
+/*
+ *  Values are plain ids held in the value pointers, so the tree has no
+ *  measure function.
+ */
+static int test_insert_pairs(int order, enum csbpt_leaf_layout layout)
+{
+	int i;
+	int failed = 0;
+	size_t j, read;
+	intptr_t previous = -1;
+	struct csbpt_cursor cursor;
+	struct csbpt_tune tune;
+	struct csbpt *tree;
+	const int size = 3000;
+	int *measures;
+	void **values;
+	int batch_measures[7];
+	void *batch_values[7];
+
+	memset(&tune, 0, sizeof(tune));
+	tune.order = order;
+	tune.leaf_layout = layout;
+
+	measures = calloc(size, sizeof(int));
+	values = calloc(size, sizeof(void *));
+	for(i = 0; i < size; i++) {
+		measures[i] = rand() % 100;
+		values[i] = (void *) (intptr_t) (measures[i] * size + i);
+	}
+
+	tree = csbpt_create(&tune, NULL, NULL, 0, 0);
+
+	if(!tree || csbpt_insert(tree, &i) == 0 || errno != EINVAL) {
+		fprintf(stderr, "Insert without a measure function succeeded\n");
+		failed = 1;
+	}
+
+	/* A third one at a time, the rest as a batch */
+	for(i = 0; i < size / 3 && !failed; i++) {
+		failed = csbpt_insert_measured(tree, measures[i], values[i]);
+	}
+	if(!failed && (csbpt_insert_pairs(tree, measures + size / 3, values + size / 3, size - size / 3) || csbpt_check(tree))) {
+		fprintf(stderr, "Inserting pairs failed at order %d\n", order);
+		failed = 1;
+	}
+
+	/* Equal measures keep the order they were inserted in, which is the
+	 * order of the ids */
+	csbpt_cursor_seek(tree, &cursor, INT_MIN);
+	for(i = 0; !failed && (read = csbpt_cursor_read(&cursor, batch_measures, batch_values, 7)) > 0; ) {
+		for(j = 0; j < read; j++, i++) {
+			if((intptr_t) batch_values[j] / size != batch_measures[j] ||
+			   (intptr_t) batch_values[j] <= previous) {
+				fprintf(stderr, "Read %d:%d out of order\n", batch_measures[j], (int) (intptr_t) batch_values[j]);
+				failed = 1;
+			}
+			previous = (intptr_t) batch_values[j];
+		}
+	}
+
+	if(!failed && i != size) {
+		fprintf(stderr, "Read %d pairs, expected %d\n", i, size);
+		failed = 1;
+	}
+
+	if(tree) {
+		csbpt_release(tree);
+	}
+	free(measures);
+	free(values);
+
+	return failed;
+}
+
+static int test_cursor(int order, enum csbpt_leaf_layout layout)
+{
+	int i, j;
+	int failed = 0;
+	int measure;
+	void *value;
+	struct csbpt_cursor cursor;
+	struct csbpt_tune tune;
+	struct csbpt *tree;
+	const int size = 2000;
+	int *data;
+	int *sorted;
+
+	memset(&tune, 0, sizeof(tune));
+	tune.order = order;
+	tune.leaf_layout = layout;
+
+	data = calloc(size, sizeof(int));
+	sorted = calloc(size, sizeof(int));
+	for(i = 0; i < size; i++) {
+		data[i] = 2 * (rand() % size);
+	}
+	memcpy(sorted, data, size * sizeof(int));
+	qsort(sorted, size, sizeof(int), int_compare);
+
+	/* Half bulk loaded, half inserted, so that some leaf groups are partly full */
+	tree = csbpt_create(&tune, ordered_ints_measure, data, size / 2, sizeof(int));
+	for(i = size / 2; i < size && !failed; i++) {
+		failed = csbpt_insert(tree, &data[i]);
+	}
+
+	/* Seek to every position, then walk a little way in both directions */
+	for(i = 0; i < size && !failed; i += 7) {
+		for(j = i; j > 0 && sorted[j - 1] == sorted[i]; j--);
+
+		if(csbpt_cursor_seek(tree, &cursor, sorted[i] - (i % 2))) {
+			fprintf(stderr, "Seek to %d failed\n", sorted[i]);
+			failed = 1;
+			break;
+		}
+
+		for(; j < size && j < i + 3 * order && !failed; j++) {
+			if(csbpt_cursor_next(&cursor, &measure, &value) || measure != sorted[j] || *((int *) value) != measure) {
+				fprintf(stderr, "Cursor moving forward from %d found the wrong value\n", sorted[i]);
+				failed = 1;
+			}
+		}
+
+		for(; j > 0 && j > i - 3 * order && !failed; j--) {
+			if(csbpt_cursor_prev(&cursor, &measure, NULL) || measure != sorted[j - 1]) {
+				fprintf(stderr, "Cursor moving back from %d found the wrong value\n", sorted[i]);
+				failed = 1;
+			}
+		}
+	}
+
+	if(!failed && (csbpt_cursor_seek(tree, &cursor, sorted[size - 1] + 1) == 0 || errno != ENOENT)) {
+		fprintf(stderr, "Seek past the end succeeded\n");
+		failed = 1;
+	}
+
+	for(j = size; j > 0 && !failed; j--) {
+		if(csbpt_cursor_prev(&cursor, &measure, NULL) || measure != sorted[j - 1]) {
+			fprintf(stderr, "Cursor moving back from the end found the wrong value\n");
+			failed = 1;
+		}
+	}
+
+	if(!failed && csbpt_cursor_prev(&cursor, NULL, NULL) == 0) {
+		fprintf(stderr, "Cursor moved before the start\n");
+		failed = 1;
+	}
+
+	i = 0;
+	if(!failed && (csbpt_iterate(tree, &i, count_action_fn) != size || i != size)) {
+		fprintf(stderr, "Iterating visited %d values, expected %d\n", i, size);
+		failed = 1;
+	}
+
+	csbpt_release(tree);
+	free(data);
+	free(sorted);
+
+	return failed;
+}
+
+static long long int_summarize(void *user_data, void *val)
+{
+	return *((int *) val);
+}
+
+static long long sum_combine(void *user_data, long long left, long long right)
+{
+	return left + right;
+}
+
+static int test_summaries(int order, enum csbpt_leaf_layout layout)
+{
+	int i;
+	int failed = 0;
+	int measure;
+	size_t count;
+	long long sum;
+	long long expected;
+	struct csbpt_combinator combinator = { int_summarize, sum_combine, 0, NULL };
+	struct csbpt_tune tune;
+	struct csbpt *tree;
+	const int size = 3000;
+	int *data;
+	int *sorted;
+
+	memset(&tune, 0, sizeof(tune));
+	tune.order = order;
+	tune.leaf_layout = layout;
+	tune.combinator = &combinator;
+
+	data = calloc(size, sizeof(int));
+	sorted = calloc(size, sizeof(int));
+	for(i = 0; i < size; i++) {
+		data[i] = rand() % size;
+	}
+	memcpy(sorted, data, size * sizeof(int));
+	qsort(sorted, size, sizeof(int), int_compare);
+
+	/* Built by every path: bulk load, single inserts and a batch */
+	tree = csbpt_create(&tune, ordered_ints_measure, data, size / 3, sizeof(int));
+	for(i = size / 3; i < 2 * size / 3 && !failed; i++) {
+		failed = csbpt_insert(tree, &data[i]) || csbpt_check(tree);
+	}
+	if(!failed) {
+		failed = csbpt_insert_batch(tree, data + 2 * size / 3, size - 2 * size / 3, sizeof(int)) || csbpt_check(tree);
+	}
+
+	for(i = 0; i < size && !failed; i++) {
+		if(csbpt_find_kth(tree, i, &measure, NULL) || measure != sorted[i]) {
+			fprintf(stderr, "Value %d should be %d\n", i, sorted[i]);
+			failed = 1;
+		}
+	}
+
+	if(!failed && (csbpt_find_kth(tree, size, NULL, NULL) == 0 || errno != ERANGE)) {
+		fprintf(stderr, "Found a value past the end\n");
+		failed = 1;
+	}
+
+	expected = 0;
+	for(i = 0; i < size && !failed; i++) {
+		expected += sorted[i];
+		if(i < size - 1 && sorted[i + 1] == sorted[i]) {
+			continue;
+		}
+
+		if(csbpt_summarize_prefix(tree, sorted[i], &count, &sum) || count != i + 1 || sum != expected) {
+			fprintf(stderr, "Prefix up to %d has %d values summing to %lld, expected %d and %lld\n",
+			        sorted[i], (int) count, sum, i + 1, expected);
+			failed = 1;
+		}
+	}
+
+	csbpt_release(tree);
+	free(data);
+	free(sorted);
+
+	return failed;
+}
+
+static int even_index_predicate(void *user_data, void *val)
+{
+	return (((int *) val) - ((int *) user_data)) % 2 == 0;
+}
+
+static int multiple_of_3_predicate(void *user_data, void *val)
+{
+	return *((int *) val) % 3 == 0;
+}
+
+/*
+ *  Checks a tree against the values of data which are still alive, in both
+ *  directions.
+ */
+static int check_alive(struct csbpt *tree, int *data, char *alive, int size, int range)
+{
+	int i;
+	int n = 0;
+	int failed;
+	int *values = calloc(size, sizeof(int));
+	struct csbpt_cursor cursor;
+
+	for(i = 0; i < size; i++) {
+		if(alive[i]) {
+			values[n++] = data[i];
+		}
+	}
+
+	failed = csbpt_check(tree) || check_counts(tree, values, n, range);
+
+	/* Walk back from the end, to check the links between leaf groups */
+	csbpt_cursor_seek(tree, &cursor, INT_MAX);
+	for(i = 0; !csbpt_cursor_prev(&cursor, NULL, NULL); i++);
+	if(!failed && i != n) {
+		fprintf(stderr, "Walked back over %d values, expected %d\n", i, n);
+		failed = 1;
+	}
+
+	free(values);
+
+	return failed;
+}
+
+static int test_delete(int order, enum csbpt_leaf_layout layout, int concurrent)
+{
+	int i;
+	int failed = 0;
+	size_t count;
+	size_t expected;
+	struct csbpt_combinator combinator = { int_summarize, sum_combine, 0, NULL };
+	struct csbpt_tune tune;
+	struct csbpt *tree;
+	const int size = 4000;
+	const int range = 1000;
+	int *data;
+	char *alive;
+
+	memset(&tune, 0, sizeof(tune));
+	tune.order = order;
+	tune.leaf_layout = layout;
+	tune.combinator = &combinator;
+	tune.concurrent = concurrent;
+
+	data = calloc(size, sizeof(int));
+	alive = calloc(size, 1);
+	for(i = 0; i < size; i++) {
+		data[i] = rand() % range;
+		alive[i] = 1;
+	}
+
+	tree = csbpt_create(&tune, ordered_ints_measure, data, size / 2, sizeof(int));
+	for(i = size / 2; i < size && !failed; i++) {
+		failed = csbpt_insert(tree, &data[i]);
+	}
+
+	/* Single measures, picking half of their values */
+	for(i = 0; i < 100 && !failed; i++) {
+		failed = csbpt_delete(tree, i, data, even_index_predicate, NULL);
+	}
+	for(i = 0; i < size; i += 2) {
+		if(data[i] < 100) {
+			alive[i] = 0;
+		}
+	}
+	failed = failed || check_alive(tree, data, alive, size, range);
+
+	/* A range, which frees whole subtrees */
+	expected = 0;
+	for(i = 0; i < size; i++) {
+		if(alive[i] && data[i] >= 200 && data[i] <= 599) {
+			alive[i] = 0;
+			expected++;
+		}
+	}
+	if(!failed && (csbpt_delete_range(tree, 200, 599, &count) || count != expected)) {
+		fprintf(stderr, "Deleted %d values from a range, expected %d\n", (int) count, (int) expected);
+		failed = 1;
+	}
+	failed = failed || check_alive(tree, data, alive, size, range);
+
+	for(i = 0; i < size; i++) {
+		if(data[i] % 3 == 0) {
+			alive[i] = 0;
+		}
+	}
+	failed = failed || csbpt_delete_pred(tree, NULL, multiple_of_3_predicate, NULL) || check_alive(tree, data, alive, size, range);
+
+	/* Emptying the tree takes it back to a single leaf group */
+	memset(alive, 0, size);
+	failed = failed || csbpt_delete_range(tree, INT_MIN, INT_MAX, NULL) || check_alive(tree, data, alive, size, range);
+
+	alive[0] = 1;
+	failed = failed || csbpt_insert(tree, &data[0]) || check_alive(tree, data, alive, size, range);
+
+	csbpt_release(tree);
+	free(data);
+	free(alive);
+
+	return failed;
+}
+
+static int same_value_predicate(void *user_data, void *val)
+{
+	return val == user_data;
+}
+
+/*
+ *  Bulk loads a tree at the automatic order, whose wide groups are the
+ *  hardest to keep at least min_children full, and checks it stays valid as
+ *  values are deleted.
+ */
+static int test_auto_order(int size, enum csbpt_leaf_layout layout)
+{
+	int i;
+	int failed = 0;
+	struct csbpt_combinator combinator = { int_summarize, sum_combine, 0, NULL };
+	struct csbpt_tune tune;
+	struct csbpt *tree;
+	const int range = 20000;
+	int *data;
+	char *alive;
+
+	memset(&tune, 0, sizeof(tune));
+	tune.order = CSBPT_ORDER_AUTO;
+	tune.leaf_layout = layout;
+	tune.combinator = &combinator;
+
+	data = calloc(size, sizeof(int));
+	alive = calloc(size, 1);
+	for(i = 0; i < size; i++) {
+		data[i] = rand() % range;
+		alive[i] = 1;
+	}
+
+	tree = csbpt_create(&tune, ordered_ints_measure, data, size, sizeof(int));
+	if(!tree) {
+		fprintf(stderr, "Bulk load at the automatic order failed\n");
+		failed = 1;
+	}
+
+	failed = failed || check_alive(tree, data, alive, size, range);
+
+	for(i = 0; i < size; i++) {
+		if(data[i] >= 1000 && data[i] <= 8999) {
+			alive[i] = 0;
+		}
+	}
+	failed = failed || csbpt_delete_range(tree, 1000, 8999, NULL) || check_alive(tree, data, alive, size, range);
+
+	for(i = 0; i < size; i++) {
+		if(data[i] % 3 == 0) {
+			alive[i] = 0;
+		}
+	}
+	failed = failed || csbpt_delete_pred(tree, NULL, multiple_of_3_predicate, NULL) || check_alive(tree, data, alive, size, range);
+
+	for(i = 0; i < 500 && !failed; i++) {
+		failed = csbpt_delete(tree, i, data, even_index_predicate, NULL);
+	}
+	for(i = 0; i < size; i += 2) {
+		if(data[i] < 500) {
+			alive[i] = 0;
+		}
+	}
+	failed = failed || check_alive(tree, data, alive, size, range);
+
+	csbpt_release(tree);
+	free(data);
+	free(alive);
+
+	return failed;
+}
+
+/*
+ *  Bulk loads trees of many sizes and shapes, checks that each one is as
+ *  small as its values allow, and that it stays valid as it is changed.
+ */
+static int test_bulk_load(int order, enum csbpt_leaf_layout layout, int summarized)
+{
+	int i;
+	int j;
+	int round;
+	int failed = 0;
+	int height;
+	size_t used;
+	size_t expected;
+	size_t tall;
+	struct csbpt_combinator combinator = { int_summarize, sum_combine, 0, NULL };
+	struct csbpt_memory_stats stats;
+	struct csbpt_tune tune;
+	struct csbpt *tree;
+	const int max = 2 * order;
+	const int range = 1000;
+	const int sizes[] = { 1, order - 1, order, 2 * order, 2 * order + 1, 4 * order * order + 1, 0, 0, 0 };
+	const int rounds = sizeof(sizes) / sizeof(sizes[0]);
+	int size;
+	int *data;
+	char *alive;
+
+	for(round = 0; round < rounds && !failed; round++) {
+		size = sizes[round] ? sizes[round] : 1 + rand() % (round == rounds - 1 ? 1000 * order : 5000);
+		if(size < 1) {
+			continue;
+		}
+
+		memset(&tune, 0, sizeof(tune));
+		tune.order = order;
+		tune.leaf_layout = layout;
+		tune.combinator = summarized ? &combinator : NULL;
+		tune.initial_height = round % 4;
+
+		data = calloc(2 * size, sizeof(int));
+		alive = calloc(2 * size, 1);
+		for(i = 0; i < 2 * size; i++) {
+			data[i] = rand() % range;
+			alive[i] = i < size;
+		}
+
+		tree = csbpt_create(&tune, ordered_ints_measure, data, size, sizeof(int));
+		if(!tree) {
+			fprintf(stderr, "Bulk load of %d values failed\n", size);
+			failed = 1;
+		}
+
+		failed = failed || check_alive(tree, data, alive, 2 * size, range) || csbpt_memory_stats(tree, &stats);
+
+		/* As few leaf groups as hold the values, unless more are needed to
+		 * reach the requested height */
+		expected = (size + max - 1) / max;
+		for(height = 2, tall = 1; height < tune.initial_height && tall <= (size_t) size; height++) {
+			tall *= max;
+		}
+		tall = tune.initial_height > 1 ? tall + 1 : 1;
+		if(tall > (size_t) size / order) {
+			tall = size / order;
+		}
+		expected = expected > tall ? expected : tall;
+
+		if(!failed && stats.levels[stats.levels_used - 1].groups != expected) {
+			fprintf(stderr, "Bulk load of %d values made %d leaf groups, expected %d\n",
+			        size, (int) stats.levels[stats.levels_used - 1].groups, (int) expected);
+			failed = 1;
+		}
+
+		for(i = 0, used = 0; i < stats.levels_used && !failed; i++) {
+			used += stats.levels[i].bytes;
+		}
+		if(!failed && used + stats.unused_bytes != stats.slab_bytes) {
+			fprintf(stderr, "Memory stats of a bulk loaded tree don't add up\n");
+			failed = 1;
+		}
+
+		/* Grow and shrink it at random */
+		for(i = size; i < 2 * size && !failed; i++) {
+			j = rand() % (i + 1);
+			if(rand() % 3 == 0 && alive[j]) {
+				failed = csbpt_delete(tree, data[j], &data[j], same_value_predicate, NULL);
+				alive[j] = 0;
+			}
+			failed = failed || csbpt_insert(tree, &data[i]);
+			alive[i] = 1;
+		}
+
+		failed = failed || check_alive(tree, data, alive, 2 * size, range);
+
+		csbpt_release(tree);
+		free(data);
+		free(alive);
+	}
+
+	return failed;
+}
+
+/*
+ *  Bulk loads at several fill factors, and checks that each leaves the
+ *  expected room in its leaf groups.
+ */
+static int test_fill_factor(int order, enum csbpt_leaf_layout layout)
+{
+	int i;
+	int fill;
+	int failed = 0;
+	size_t per_group;
+	size_t expected;
+	size_t last_groups = 0;
+	struct csbpt_memory_stats stats;
+	struct csbpt_tune tune;
+	struct csbpt *tree;
+	const int max = 2 * order;
+	const int size = 20000;
+	const int range = 1000;
+	int *data;
+	char *alive;
+
+	memset(&tune, 0, sizeof(tune));
+	tune.order = order;
+	tune.leaf_layout = layout;
+
+	data = calloc(2 * size, sizeof(int));
+	alive = calloc(2 * size, 1);
+	for(i = 0; i < 2 * size; i++) {
+		data[i] = rand() % range;
+	}
+
+	/* Out of range fill factors are refused */
+	tune.fill_factor = 101;
+	tree = csbpt_create(&tune, ordered_ints_measure, data, size, sizeof(int));
+	if(tree || errno != EINVAL) {
+		fprintf(stderr, "Created a tree with a fill factor of 101\n");
+		csbpt_release(tree);
+		failed = 1;
+	}
+
+	for(fill = 100; fill >= 30 && !failed; fill -= 10) {
+		tune.fill_factor = fill;
+		for(i = 0; i < 2 * size; i++) {
+			alive[i] = i < size;
+		}
+
+		tree = csbpt_create(&tune, ordered_ints_measure, data, size, sizeof(int));
+		if(!tree) {
+			fprintf(stderr, "Bulk load at a fill factor of %d failed\n", fill);
+			failed = 1;
+			break;
+		}
+
+		failed = check_alive(tree, data, alive, 2 * size, range) || csbpt_memory_stats(tree, &stats);
+
+		per_group = (max * fill + 50) / 100;
+		per_group = per_group < (size_t) order ? order : per_group;
+		per_group = per_group < 2 ? 2 : per_group;
+		expected = (size + per_group - 1) / per_group;
+		expected = expected < (size_t) (size / order) ? expected : size / order;
+
+		if(!failed && (stats.levels[stats.levels_used - 1].groups != expected || stats.levels[stats.levels_used - 1].groups < last_groups)) {
+			fprintf(stderr, "Bulk load at a fill factor of %d made %d leaf groups, expected %d\n",
+			        fill, (int) stats.levels[stats.levels_used - 1].groups, (int) expected);
+			failed = 1;
+		}
+		last_groups = stats.levels[stats.levels_used - 1].groups;
+
+		for(i = size; i < 2 * size && !failed; i++) {
+			failed = csbpt_insert(tree, &data[i]);
+			alive[i] = 1;
+		}
+
+		failed = failed || check_alive(tree, data, alive, 2 * size, range);
+
+		csbpt_release(tree);
+	}
+
+	free(data);
+	free(alive);
+
+	return failed;
+}
+
+/*
+ *  Checks that a tree read back from a snapshot holds the given sorted values.
+ */
+static int check_snapshot(struct csbpt *loaded, int *sorted, int size)
+{
+	int i;
+	int measure;
+	void *value;
+	size_t count;
+	long long sum;
+	long long expected = 0;
+	struct csbpt_cursor cursor;
+
+	if(check_counts(loaded, sorted, size, size)) {
+		return 1;
+	}
+
+	csbpt_cursor_seek(loaded, &cursor, INT_MIN);
+	for(i = 0; i < size; i++) {
+		if(csbpt_cursor_next(&cursor, &measure, &value) || measure != sorted[i] || *((int *) value) != sorted[i]) {
+			fprintf(stderr, "Snapshot value %d should be %d\n", i, sorted[i]);
+			return 1;
+		}
+	}
+
+	for(i = 0; i < size; i++) {
+		expected += sorted[i];
+		if(i < size - 1 && sorted[i + 1] == sorted[i]) {
+			continue;
+		}
+
+		if(csbpt_find_kth(loaded, i, &measure, NULL) || measure != sorted[i] ||
+		   csbpt_summarize_prefix(loaded, sorted[i], &count, &sum) || count != i + 1 || sum != expected) {
+			fprintf(stderr, "Snapshot summaries are wrong at %d\n", i);
+			return 1;
+		}
+	}
+
+	if(csbpt_insert(loaded, &sorted[0]) == 0 || errno != EROFS) {
+		fprintf(stderr, "Inserted into a snapshot\n");
+		return 1;
+	}
+
+	return 0;
+}
+
+static int test_snapshot(int order, enum csbpt_leaf_layout layout)
+{
+	int i;
+	int failed = 0;
+	struct csbpt_combinator combinator = { int_summarize, sum_combine, 0, NULL };
+	struct csbpt_tune tune;
+	struct csbpt *tree;
+	struct csbpt *loaded;
+	const int size = 5000;
+	int *data;
+	int *sorted;
+	FILE *file;
+
+	memset(&tune, 0, sizeof(tune));
+	tune.order = order;
+	tune.leaf_layout = layout;
+	tune.combinator = &combinator;
+
+	data = calloc(size, sizeof(int));
+	sorted = calloc(size, sizeof(int));
+	for(i = 0; i < size; i++) {
+		data[i] = rand() % size;
+	}
+	memcpy(sorted, data, size * sizeof(int));
+	qsort(sorted, size, sizeof(int), int_compare);
+
+	tree = csbpt_create(&tune, ordered_ints_measure, data, size / 2, sizeof(int));
+	for(i = size / 2; i < size && !failed; i++) {
+		failed = csbpt_insert(tree, &data[i]);
+	}
+
+	file = fopen("snapshot.csbpt", "wb");
+	if(!failed && (!file || csbpt_save(tree, file, sizeof(int)))) {
+		fprintf(stderr, "Error saving snapshot\n");
+		failed = 1;
+	}
+	if(file) {
+		fclose(file);
+	}
+
+	/* The data is gone by the time the snapshot is read */
+	if(!failed) {
+		file = fopen("snapshot.csbpt", "rb");
+		loaded = file ? csbpt_load(file, &tune) : NULL;
+		if(file) {
+			fclose(file);
+		}
+
+		memset(data, 0, size * sizeof(int));
+		failed = !loaded || check_snapshot(loaded, sorted, size);
+		if(loaded) {
+			csbpt_release(loaded);
+		}
+	}
+
+	if(!failed) {
+		loaded = csbpt_load_mmap("snapshot.csbpt", &tune);
+		failed = !loaded || check_snapshot(loaded, sorted, size);
+		if(loaded) {
+			csbpt_release(loaded);
+		}
+	}
+
+	file = fopen("snapshot.csbpt", "wb");
+	if(file) {
+		fputs("not a snapshot", file);
+		fclose(file);
+	}
+	if(!failed && (csbpt_load_mmap("snapshot.csbpt", NULL) || errno != EINVAL)) {
+		fprintf(stderr, "Loaded something which is not a snapshot\n");
+		failed = 1;
+	}
+
+	remove("snapshot.csbpt");
+	csbpt_release(tree);
+	free(data);
+	free(sorted);
+
+	return failed;
+}
+
+/*
+ *  Values with an id, so a log can tell apart values with the same measure
+ */
+struct logged_value {
+	int measure;
+	int id;
+};
+
+static int odd_id_predicate(void *user_data, void *val)
+{
+	return ((struct logged_value *) val)->id % 2;
+}
+
+/*
+ *  Checks that two trees hold the same values, byte for byte, in the same
+ *  order.
+ */
+static int check_same_values(struct csbpt *tree, struct csbpt *recovered)
+{
+	int i;
+	int measure;
+	int other;
+	void *value;
+	void *copy;
+	struct csbpt_cursor cursor;
+	struct csbpt_cursor copy_cursor;
+
+	if(csbpt_check(recovered)) {
+		return 1;
+	}
+
+	csbpt_cursor_seek(tree, &cursor, INT_MIN);
+	csbpt_cursor_seek(recovered, &copy_cursor, INT_MIN);
+	for(i = 0; !csbpt_cursor_next(&cursor, &measure, &value); i++) {
+		if(csbpt_cursor_next(&copy_cursor, &other, &copy) || other != measure ||
+		   memcmp(value, copy, sizeof(struct logged_value))) {
+			fprintf(stderr, "Recovered value %d is wrong\n", i);
+			return 1;
+		}
+	}
+
+	if(!csbpt_cursor_next(&copy_cursor, NULL, NULL)) {
+		fprintf(stderr, "Recovered more than %d values\n", i);
+		return 1;
+	}
+
+	return 0;
+}
+
+static int test_log(int order, enum csbpt_leaf_layout layout, int concurrent)
+{
+	int i;
+	int failed = 0;
+	struct csbpt_tune tune;
+	struct csbpt *tree;
+	struct csbpt *recovered = NULL;
+	struct csbpt *empty;
+	struct csbpt *pinned;
+	struct csbpt_log *log;
+	struct logged_value *data;
+	struct logged_value extra = { 42, -1 };
+	const int size = 4000;
+	const int range = 1000;
+	FILE *file;
+
+	memset(&tune, 0, sizeof(tune));
+	tune.order = order;
+	tune.leaf_layout = layout;
+	tune.concurrent = concurrent;
+
+	remove("test.log");
+	remove("test.checkpoint");
+
+	data = calloc(size, sizeof(struct logged_value));
+	for(i = 0; i < size; i++) {
+		data[i].measure = rand() % range;
+		data[i].id = i;
+	}
+
+	/* A concurrent tree's log is synced in the background */
+	tree = csbpt_create(&tune, ordered_ints_measure, NULL, 0, 0);
+	log = csbpt_log_open(tree, "test.log", sizeof(struct logged_value), concurrent ? 500 : 0);
+	if(!log) {
+		fprintf(stderr, "Error opening a log\n");
+		csbpt_release(tree);
+		free(data);
+		return 1;
+	}
+
+	for(i = 0; i < size / 4 && !failed; i++) {
+		failed = csbpt_insert(tree, &data[i]);
+	}
+	failed = failed || csbpt_insert_batch(tree, &data[size / 4], size / 4, sizeof(struct logged_value));
+
+	/* Records before the checkpoint are skipped on recovery */
+	failed = failed || csbpt_checkpoint(tree, "test.checkpoint");
+
+	data[size / 2].measure = -1;
+	data[size / 2 + 1].measure = range;
+	failed = failed || csbpt_push_left(tree, &data[size / 2]) || csbpt_push_right(tree, &data[size / 2 + 1]);
+
+	/* A pinned version saves the log position it was published with, so
+	 * recovering from it replays just the writes after it */
+	if(!failed && concurrent) {
+		pinned = csbpt_snapshot(tree);
+		file = fopen("test.pinned", "wb");
+		failed = !pinned || !file || csbpt_save(pinned, file, sizeof(struct logged_value));
+		if(file) {
+			fclose(file);
+		}
+		if(pinned) {
+			csbpt_release(pinned);
+		}
+	}
+
+	for(i = 0; i < 100 && !failed; i++) {
+		failed = csbpt_delete(tree, i, NULL, odd_id_predicate, NULL);
+	}
+	failed = failed || csbpt_delete_range(tree, 200, 399, NULL);
+	for(i = size / 2 + 2; i < size && !failed; i++) {
+		failed = csbpt_insert(tree, &data[i]);
+	}
+	failed = failed || csbpt_insert(tree, &extra);
+
+	if(failed || csbpt_log_sync(log)) {
+		fprintf(stderr, "Error writing to a logged tree\n");
+		failed = 1;
+	}
+
+	/* The values must come from the files, not the data */
+	if(!failed) {
+		recovered = csbpt_recover("test.checkpoint", "test.log", &tune, ordered_ints_measure, sizeof(struct logged_value));
+		failed = !recovered || check_same_values(tree, recovered);
+	}
+	if(recovered) {
+		csbpt_release(recovered);
+		recovered = NULL;
+	}
+
+	if(!failed && concurrent) {
+		recovered = csbpt_recover("test.pinned", "test.log", &tune, ordered_ints_measure, sizeof(struct logged_value));
+		failed = !recovered || check_same_values(tree, recovered);
+	}
+	if(recovered) {
+		csbpt_release(recovered);
+		recovered = NULL;
+	}
+
+	/* A log with records must not be attached to a tree without them */
+	empty = csbpt_create(&tune, ordered_ints_measure, NULL, 0, 0);
+	if(!failed && (csbpt_log_open(empty, "test.log", sizeof(struct logged_value), 0) || errno != EINVAL)) {
+		fprintf(stderr, "Attached a log to a tree it does not match\n");
+		failed = 1;
+	}
+	csbpt_release(empty);
+
+	failed = csbpt_log_close(log) || failed;
+
+	/* A torn last record is dropped, and the log carries on from there */
+	file = fopen("test.log", "r+b");
+	if(file) {
+		fseek(file, -3, SEEK_END);
+		fputs("torn", file);
+		fclose(file);
+	}
+
+	if(!failed) {
+		recovered = csbpt_recover("test.checkpoint", "test.log", &tune, ordered_ints_measure, sizeof(struct logged_value));
+		failed = !recovered || csbpt_find_value(recovered, extra.measure, NULL, NULL) !=
+		                       csbpt_find_value(tree, extra.measure, NULL, NULL) - 1;
+	}
+
+	if(!failed) {
+		log = csbpt_log_open(recovered, "test.log", sizeof(struct logged_value), 0);
+		failed = !log || csbpt_insert(recovered, &extra) || csbpt_log_close(log);
+	}
+	if(recovered) {
+		csbpt_release(recovered);
+		recovered = NULL;
+	}
+
+	if(!failed) {
+		recovered = csbpt_recover("test.checkpoint", "test.log", &tune, ordered_ints_measure, sizeof(struct logged_value));
+		failed = !recovered || check_same_values(tree, recovered);
+	}
+
+	/* So does a version pinned from a tree straight after its recovery */
+	if(!failed && concurrent) {
+		pinned = csbpt_snapshot(recovered);
+		file = fopen("test.pinned", "wb");
+		failed = !pinned || !file || csbpt_save(pinned, file, sizeof(struct logged_value));
+		if(file) {
+			fclose(file);
+		}
+		if(pinned) {
+			csbpt_release(pinned);
+		}
+	}
+	if(recovered) {
+		csbpt_release(recovered);
+		recovered = NULL;
+	}
+
+	if(!failed && concurrent) {
+		recovered = csbpt_recover("test.pinned", "test.log", &tune, ordered_ints_measure, sizeof(struct logged_value));
+		failed = !recovered || check_same_values(tree, recovered);
+	}
+	if(recovered) {
+		csbpt_release(recovered);
+	}
+
+	remove("test.log");
+	remove("test.checkpoint");
+	remove("test.pinned");
+	csbpt_release(tree);
+	free(data);
+
+	return failed;
+}
+
+struct concurrent_test {
+	struct csbpt *tree;
+	int *data;
+	int num_loaded;
+	int done;
+	int failed;
+};
+
+static void *concurrent_reader(void *arg)
+{
+	int i;
+	int found;
+	struct concurrent_test *test = (struct concurrent_test *) arg;
+	struct csbpt_reader *reader = csbpt_reader_register(test->tree);
+
+	while(!__atomic_load_n(&test->done, __ATOMIC_ACQUIRE)) {
+		csbpt_read_begin(reader);
+		for(i = 0; i < test->num_loaded; i++) {
+			found = 0;
+			csbpt_find_value(test->tree, test->data[i], &found, count_action_fn);
+			if(found == 0) {
+				fprintf(stderr, "Reader lost value %d\n", test->data[i]);
+				test->failed = 1;
+			}
+		}
+		csbpt_read_end(reader);
+	}
+
+	csbpt_reader_unregister(reader);
+
+	return NULL;
+}
+
+static int test_concurrent(int order, enum csbpt_leaf_layout layout)
+{
+	int i;
+	int failed = 0;
+	struct csbpt_combinator combinator = { int_summarize, sum_combine, 0, NULL };
+	struct concurrent_test test;
+	struct csbpt_tune tune;
+	pthread_t readers[4];
+	const int size = 4000;
+
+	memset(&tune, 0, sizeof(tune));
+	tune.order = order;
+	tune.leaf_layout = layout;
+	tune.combinator = &combinator;
+	tune.concurrent = 1;
+
+	test.data = calloc(size, sizeof(int));
+	for(i = 0; i < size; i++) {
+		test.data[i] = rand() % size;
+	}
+	test.num_loaded = size / 4;
+	test.done = 0;
+	test.failed = 0;
+	test.tree = csbpt_create(&tune, ordered_ints_measure, test.data, test.num_loaded, sizeof(int));
+
+	for(i = 0; i < 4; i++) {
+		pthread_create(&readers[i], NULL, concurrent_reader, &test);
+	}
+
+	for(i = test.num_loaded; i < size && !failed; i++) {
+		if(i % 3 == 0) {
+			failed = csbpt_insert_batch(test.tree, &test.data[i], 1, sizeof(int));
+		} else {
+			failed = csbpt_insert(test.tree, &test.data[i]);
+		}
+
+		if(!failed && i % 64 == 0) {
+			failed = csbpt_check(test.tree);
+		}
+	}
+
+	__atomic_store_n(&test.done, 1, __ATOMIC_RELEASE);
+	for(i = 0; i < 4; i++) {
+		pthread_join(readers[i], NULL);
+	}
+
+	if(!failed && (test.failed || csbpt_check(test.tree) || check_counts(test.tree, test.data, size, size))) {
+		failed = 1;
+	}
+
+	csbpt_release(test.tree);
+	free(test.data);
+
+	return failed;
+}
+
+/*
+ *  Walks a pinned version over and over, which must not see any of the
+ *  writes made since it was taken
+ */
+static void *version_reader(void *arg)
+{
+	int i;
+	int measure;
+	int last;
+	struct concurrent_test *test = (struct concurrent_test *) arg;
+	struct csbpt_cursor cursor;
+
+	while(!__atomic_load_n(&test->done, __ATOMIC_ACQUIRE)) {
+		csbpt_cursor_seek(test->tree, &cursor, INT_MIN);
+		for(i = 0, last = INT_MIN; !csbpt_cursor_next(&cursor, &measure, NULL); i++) {
+			if(measure < last) {
+				fprintf(stderr, "Version walked back from %d to %d\n", last, measure);
+				test->failed = 1;
+			}
+			last = measure;
+		}
+
+		if(i != test->num_loaded) {
+			fprintf(stderr, "Version holds %d values, expected %d\n", i, test->num_loaded);
+			test->failed = 1;
+		}
+	}
+
+	return NULL;
+}
+
+static int test_versions(int order, enum csbpt_leaf_layout layout)
+{
+	int i;
+	int failed = 0;
+	size_t count;
+	struct csbpt_combinator combinator = { int_summarize, sum_combine, 0, NULL };
+	struct concurrent_test test;
+	struct csbpt_tune tune;
+	struct csbpt *tree;
+	struct csbpt *first;
+	struct csbpt *second;
+	struct csbpt *loaded;
+	pthread_t reader;
+	const int size = 4000;
+	int *data;
+	char *alive;
+	FILE *file;
+
+	memset(&tune, 0, sizeof(tune));
+	tune.order = order;
+	tune.leaf_layout = layout;
+	tune.combinator = &combinator;
+	tune.concurrent = 1;
+
+	data = calloc(size, sizeof(int));
+	alive = calloc(size, 1);
+	for(i = 0; i < size; i++) {
+		data[i] = rand() % size;
+		alive[i] = i < size / 2;
+	}
+
+	tree = csbpt_create(&tune, ordered_ints_measure, NULL, 0, sizeof(int));
+	failed = csbpt_insert_batch(tree, data, size / 2, sizeof(int));
+
+	first = failed ? NULL : csbpt_snapshot(tree);
+	if(!first) {
+		fprintf(stderr, "Could not pin a version\n");
+		failed = 1;
+		goto test_versions_exit;
+	}
+
+	/* The live tree takes the rest of the values, and loses a range, while
+	 * another thread walks the first version */
+	test.tree = first;
+	test.num_loaded = size / 2;
+	test.done = 0;
+	test.failed = 0;
+	pthread_create(&reader, NULL, version_reader, &test);
+
+	for(i = size / 2; i < size && !failed; i++) {
+		failed = csbpt_insert(tree, &data[i]);
+	}
+
+	second = failed ? NULL : csbpt_snapshot(tree);
+	failed = failed || !second || csbpt_delete_range(tree, size / 4, size / 2, &count);
+
+	__atomic_store_n(&test.done, 1, __ATOMIC_RELEASE);
+	pthread_join(reader, NULL);
+	failed = failed || test.failed;
+
+	/* Each version still holds what the tree held when it was pinned */
+	failed = failed || check_alive(first, data, alive, size, size);
+	for(i = size / 2; i < size; i++) {
+		alive[i] = 1;
+	}
+	failed = failed || check_alive(second, data, alive, size, size);
+	for(i = 0; i < size; i++) {
+		alive[i] = data[i] < size / 4 || data[i] > size / 2;
+	}
+	failed = failed || check_alive(tree, data, alive, size, size);
+
+	if(!failed && (csbpt_insert(first, &data[0]) != 1 || errno != EROFS ||
+	               csbpt_delete_range(second, 0, size, NULL) != 1 || errno != EROFS)) {
+		fprintf(stderr, "Wrote to a pinned version\n");
+		failed = 1;
+	}
+
+	if(!failed && (csbpt_release(tree) != 1 || errno != EBUSY)) {
+		fprintf(stderr, "Released a tree with pinned versions\n");
+		failed = 1;
+	}
+
+	/* A version can be saved while the tree moves on */
+	file = fopen("snapshot.csbpt", "wb");
+	if(!failed && (!file || csbpt_save(first, file, 0))) {
+		fprintf(stderr, "Error saving a pinned version\n");
+		failed = 1;
+	}
+	if(file) {
+		fclose(file);
+	}
+	if(!failed) {
+		loaded = csbpt_load_mmap("snapshot.csbpt", NULL);
+		failed = !loaded || check_counts(loaded, data, size / 2, size);
+		if(loaded) {
+			csbpt_release(loaded);
+		}
+	}
+	remove("snapshot.csbpt");
+
+	if(second) {
+		csbpt_release(second);
+	}
+	csbpt_release(first);
+
+	/* The next write reclaims what the versions held */
+	failed = failed || csbpt_insert(tree, &data[0]);
+
+test_versions_exit:
+	if(csbpt_release(tree)) {
+		failed = 1;
+	}
+	free(data);
+	free(alive);
+
+	return failed;
+}
+
+#ifdef CSBPT_STATS
+
+struct stats_test {
+	struct csbpt *tree;
+	int *data;
+	int size;
+};
+
+static void *stats_reader(void *arg)
+{
+	int i;
+	struct stats_test *test = (struct stats_test *) arg;
+	struct csbpt_reader *reader = csbpt_reader_register(test->tree);
+
+	csbpt_read_begin(reader);
+	for(i = 0; i < test->size; i++) {
+		csbpt_find_value(test->tree, test->data[i], NULL, NULL);
+	}
+	csbpt_read_end(reader);
+	csbpt_reader_unregister(reader);
+
+	return NULL;
+}
+
+static int test_stats(int order, enum csbpt_leaf_layout layout)
+{
+	int i;
+	int op;
+	int failed = 0;
+	int scanned = 0;
+	uint64_t total;
+	struct csbpt_tune tune;
+	struct csbpt_stats stats;
+	struct stats_test test;
+	pthread_t readers[4];
+	void **found;
+	const int size = 3000;
+
+	memset(&tune, 0, sizeof(tune));
+	tune.order = order;
+	tune.leaf_layout = layout;
+	tune.concurrent = 1;
+
+	test.size = size;
+	test.data = calloc(size, sizeof(int));
+	found = calloc(size, sizeof(void *));
+	for(i = 0; i < size; i++) {
+		test.data[i] = rand() % size;
+	}
+
+	test.tree = csbpt_create(&tune, ordered_ints_measure, NULL, 0, 0);
+	for(i = 0; i < size && !failed; i++) {
+		failed = csbpt_insert(test.tree, &test.data[i]);
+	}
+
+	/* Each reader counts into counters of its own */
+	for(i = 0; i < 4; i++) {
+		pthread_create(&readers[i], NULL, stats_reader, &test);
+	}
+	for(i = 0; i < 4; i++) {
+		pthread_join(readers[i], NULL);
+	}
+
+	csbpt_find_batch(test.tree, test.data, size, found);
+	csbpt_iterate(test.tree, &scanned, count_action_fn);
+	failed = failed || csbpt_delete_range(test.tree, 0, size / 2, NULL) || csbpt_stats_get(test.tree, &stats);
+
+	if(!failed && (stats.ops[CSBPT_OP_INSERT] != size || stats.ops[CSBPT_OP_FIND] != 5 * size ||
+	               stats.ops[CSBPT_OP_DELETE] != 1 || stats.ops[CSBPT_OP_SCAN] != 1 || stats.values_scanned != scanned)) {
+		fprintf(stderr, "Counted %d inserts, %d finds, %d deletes, %d scans of %d values\n",
+		        (int) stats.ops[CSBPT_OP_INSERT], (int) stats.ops[CSBPT_OP_FIND], (int) stats.ops[CSBPT_OP_DELETE],
+		        (int) stats.ops[CSBPT_OP_SCAN], (int) stats.values_scanned);
+		failed = 1;
+	}
+
+	if(!failed && (stats.lookups < 6 * size || stats.nodes_visited < 2 * stats.lookups || stats.splits == 0 || stats.merges == 0)) {
+		fprintf(stderr, "Counted %d lookups visiting %d nodes, %d splits and %d merges\n",
+		        (int) stats.lookups, (int) stats.nodes_visited, (int) stats.splits, (int) stats.merges);
+		failed = 1;
+	}
+
+	for(op = 0; op < CSBPT_NUM_OPS && !failed; op++) {
+		total = 0;
+		for(i = 0; i < CSBPT_HISTOGRAM_BUCKETS; i++) {
+			total += stats.latency[op].buckets[i];
+		}
+
+		if(total != stats.ops[op] || stats.latency[op].count != total ||
+		   csbpt_histogram_percentile(&stats.latency[op], 0.5) > csbpt_histogram_percentile(&stats.latency[op], 0.99) ||
+		   csbpt_histogram_percentile(&stats.latency[op], 1.0) != stats.latency[op].max_ns) {
+			fprintf(stderr, "Latency histogram of operation %d is inconsistent\n", op);
+			failed = 1;
+		}
+	}
+
+	csbpt_release(test.tree);
+	free(test.data);
+	free(found);
+
+	return failed;
+}
+
+#endif /* CSBPT_STATS */
+
+static int test_parallel_load(int threads, enum csbpt_leaf_layout layout)
+{
+	int i;
+	int failed = 0;
+	int serial_measure, parallel_measure, last_measure = 0;
+	void *serial_value, *parallel_value;
+	int *last_value = NULL;
+	struct csbpt_combinator combinator = { int_summarize, sum_combine, 0, NULL };
+	struct csbpt_cursor serial_cursor, parallel_cursor;
+	struct csbpt_tune tune;
+	struct csbpt *serial, *parallel;
+	const int size = 300000;
+	int *data;
+
+	memset(&tune, 0, sizeof(tune));
+	tune.order = 4;
+	tune.leaf_layout = layout;
+	tune.combinator = &combinator;
+
+	/* Plenty of equal measures, whose order must not depend on the threads,
+	 * and negative ones, which the radix sort has to put first */
+	data = calloc(size, sizeof(int));
+	for(i = 0; i < size; i++) {
+		data[i] = rand() % (size / 10) - size / 20;
+	}
+
+	serial = csbpt_create(&tune, ordered_ints_measure, data, size, sizeof(int));
+	tune.threads = threads;
+	parallel = csbpt_create(&tune, ordered_ints_measure, data, size, sizeof(int));
+
+	if(!serial || !parallel) {
+		failed = 1;
+	}
+
+	if(!failed) {
+		csbpt_cursor_seek(serial, &serial_cursor, INT_MIN);
+		csbpt_cursor_seek(parallel, &parallel_cursor, INT_MIN);
+	}
+
+	for(i = 0; i < size && !failed; i++) {
+		if(csbpt_cursor_next(&serial_cursor, &serial_measure, &serial_value) ||
+		   csbpt_cursor_next(&parallel_cursor, &parallel_measure, &parallel_value) ||
+		   serial_measure != parallel_measure || serial_value != parallel_value) {
+			fprintf(stderr, "Loading with %d threads differs at value %d\n", threads, i);
+			failed = 1;
+		} else if(i > 0 && serial_measure < last_measure) {
+			fprintf(stderr, "Value %d is out of order\n", i);
+			failed = 1;
+		} else if(i > 0 && serial_measure == last_measure && (int *) serial_value < last_value) {
+			fprintf(stderr, "Equal measures were not kept in their original order\n");
+			failed = 1;
+		}
+
+		last_measure = serial_measure;
+		last_value = (int *) serial_value;
+	}
+
+	if(!failed && (csbpt_cursor_next(&parallel_cursor, NULL, NULL) == 0 || csbpt_find_kth(parallel, size - 1, NULL, NULL))) {
+		fprintf(stderr, "Loading with %d threads has the wrong number of values\n", threads);
+		failed = 1;
+	}
+
+	if(serial) {
+		csbpt_release(serial);
+	}
+	if(parallel) {
+		csbpt_release(parallel);
+	}
+	free(data);
+
+	return failed;
+}
+
+struct slab_counts {
+	int allocated;
+	int freed;
+};
+
+static void *counting_alloc(void *user_data, size_t size, size_t alignment)
+{
+	void *ret;
+
+	if(posix_memalign(&ret, alignment, size)) {
+		return NULL;
+	}
+	((struct slab_counts *) user_data)->allocated++;
+
+	return ret;
+}
+
+static void counting_free(void *user_data, void *ptr, size_t size)
+{
+	((struct slab_counts *) user_data)->freed++;
+	free(ptr);
+}
+
+static int test_allocator(enum csbpt_leaf_layout layout)
+{
+	int i;
+	int failed = 0;
+	struct slab_counts counts = { 0, 0 };
+	struct csbpt_allocator allocator = { counting_alloc, counting_free, &counts };
+	struct csbpt_tune tune;
+	struct csbpt *tree;
+	const int size = 20000;
+	int *data;
+
+	memset(&tune, 0, sizeof(tune));
+	tune.order = 2;
+	tune.leaf_layout = layout;
+	tune.allocator = &allocator;
+
+	data = calloc(2 * size, sizeof(int));
+	for(i = 0; i < 2 * size; i++) {
+		data[i] = rand() % size;
+	}
+
+	tree = csbpt_create(&tune, ordered_ints_measure, data, size, sizeof(int));
+
+	for(i = size; i < 2 * size && !failed; i++) {
+		failed = csbpt_insert(tree, &data[i]);
+	}
+
+	if(!failed) {
+		failed = check_counts(tree, data, 2 * size, size);
+	}
+
+	csbpt_release(tree);
+	free(data);
+
+	if(counts.allocated == 0 || counts.allocated != counts.freed) {
+		fprintf(stderr, "%d slabs allocated, %d freed\n", counts.allocated, counts.freed);
+		failed = 1;
+	}
+
+	return failed;
+}
+
+/*
+ *  Whether the system has huge pages to give is out of the test's hands, so
+ *  only the accounting is checked.
+ */
+static int test_huge_pages(enum csbpt_leaf_layout layout)
+{
+	int i;
+	int failed = 0;
+	struct slab_counts counts = { 0, 0 };
+	struct csbpt_allocator allocator = { counting_alloc, counting_free, &counts };
+	struct csbpt_memory_stats stats;
+	struct csbpt_tune tune;
+	struct csbpt *tree;
+	const int size = 100000;
+	int *data;
+
+	memset(&tune, 0, sizeof(tune));
+	tune.order = 8;
+	tune.leaf_layout = layout;
+	tune.huge_pages = 1;
+
+	data = calloc(2 * size, sizeof(int));
+	for(i = 0; i < 2 * size; i++) {
+		data[i] = rand() % size;
+	}
+
+	tree = csbpt_create(&tune, ordered_ints_measure, NULL, 0, sizeof(int));
+	failed = csbpt_insert_batch(tree, data, size, sizeof(int));
+	for(i = size; i < 2 * size && !failed; i++) {
+		failed = csbpt_insert(tree, &data[i]);
+	}
+
+	failed = failed || check_counts(tree, data, 2 * size, size) || csbpt_memory_stats(tree, &stats);
+
+	if(!failed && (stats.slab_bytes == 0 || stats.hugetlb_bytes + stats.thp_bytes > stats.slab_bytes)) {
+		fprintf(stderr, "%d bytes on huge pages out of %d\n", (int) (stats.hugetlb_bytes + stats.thp_bytes), (int) stats.slab_bytes);
+		failed = 1;
+	}
+
+	csbpt_release(tree);
+
+	/* A custom allocator's slabs are only advised, and go back to it */
+	tune.allocator = &allocator;
+	tree = csbpt_create(&tune, ordered_ints_measure, NULL, 0, sizeof(int));
+	failed = failed || csbpt_insert_batch(tree, data, size, sizeof(int)) || check_counts(tree, data, size, size) ||
+	         csbpt_memory_stats(tree, &stats);
+
+	if(!failed && stats.hugetlb_bytes != 0) {
+		fprintf(stderr, "Slabs from a custom allocator counted as reserved huge pages\n");
+		failed = 1;
+	}
+
+	csbpt_release(tree);
+	free(data);
+
+	if(counts.allocated == 0 || counts.allocated != counts.freed) {
+		fprintf(stderr, "%d slabs allocated, %d freed\n", counts.allocated, counts.freed);
+		failed = 1;
+	}
+
+	return failed;
+}
+
+static int test_compressed(int order, enum csbpt_search search, int scale)
+{
+	int i;
+	int n;
+	int failed = 0;
+	size_t count;
+	size_t expected = 0;
+	void *value;
+	struct csbpt_combinator combinator = { int_summarize, sum_combine, 0, NULL };
+	struct csbpt_tune tune;
+	struct csbpt *tree;
+	struct csbpt *loaded;
+	const int size = 4000;
+	const int range = size * scale;
+	int *data;
+	int *deleted;
+	char *alive;
+	void **values;
+	FILE *file;
+
+	memset(&tune, 0, sizeof(tune));
+	tune.order = order;
+	tune.search = search;
+	tune.leaf_layout = CSBPT_LEAF_SPLIT;
+	tune.combinator = &combinator;
+	tune.compress_keys = 1;
+
+	/* Dense measures, whose groups span less than 256 (or 65536 when
+	 * scaled up) and so get compressed by the batches */
+	data = calloc(size, sizeof(int));
+	deleted = calloc(size, sizeof(int));
+	alive = calloc(size, 1);
+	values = calloc(size, sizeof(void *));
+	for(i = 0; i < size; i++) {
+		data[i] = rand() % size * scale;
+		alive[i] = i < size / 2;
+	}
+
+	tree = csbpt_create(&tune, ordered_ints_measure, NULL, 0, sizeof(int));
+	failed = csbpt_insert_batch(tree, data, size / 4, sizeof(int)) ||
+	         csbpt_insert_batch(tree, data + size / 4, size / 4, sizeof(int)) ||
+	         check_alive(tree, data, alive, size, range);
+
+	/* Half the probes were never inserted, though some match anyway */
+	count = failed ? 0 : csbpt_find_batch(tree, data + size / 4, size / 2, values);
+	for(i = 0; i < size / 2 && !failed; i++) {
+		value = NULL;
+		if(csbpt_find_value(tree, data[size / 4 + i], &value, first_value_action)) {
+			count--;
+		}
+		if(values[i] != value) {
+			fprintf(stderr, "Batch lookup of compressed %d found %p, expected %p\n", data[size / 4 + i], values[i], value);
+			failed = 1;
+		}
+	}
+	if(!failed && count != 0) {
+		fprintf(stderr, "Batch lookup over compressed groups miscounted by %d\n", (int) count);
+		failed = 1;
+	}
+
+	/* Snapshots keep the groups compressed */
+	file = fopen("snapshot.csbpt", "wb");
+	if(!failed && (!file || csbpt_save(tree, file, sizeof(int)))) {
+		fprintf(stderr, "Error saving compressed snapshot\n");
+		failed = 1;
+	}
+	if(file) {
+		fclose(file);
+	}
+	if(!failed) {
+		loaded = csbpt_load_mmap("snapshot.csbpt", &tune);
+		failed = !loaded || check_counts(loaded, data, size / 2, range);
+		if(loaded) {
+			csbpt_release(loaded);
+		}
+	}
+	remove("snapshot.csbpt");
+
+	/* Single inserts and deletes expand the groups they change */
+	for(i = size / 2; i < size && !failed; i++) {
+		failed = csbpt_insert(tree, &data[i]);
+		alive[i] = 1;
+	}
+	for(i = 0; i < size; i++) {
+		if(alive[i] && data[i] >= range / 4 && data[i] <= range / 2) {
+			alive[i] = 0;
+			expected++;
+		}
+	}
+	if(!failed && (csbpt_delete_range(tree, range / 4, range / 2, &count) || count != expected)) {
+		fprintf(stderr, "Deleted %d compressed values, expected %d\n", (int) count, (int) expected);
+		failed = 1;
+	}
+	failed = failed || check_alive(tree, data, alive, size, range);
+
+	/* Putting the deleted values back in a batch compresses their groups
+	 * again */
+	for(i = 0, n = 0; i < size; i++) {
+		if(!alive[i]) {
+			deleted[n++] = data[i];
+			alive[i] = 1;
+		}
+	}
+	failed = failed || csbpt_insert_batch(tree, deleted, n, sizeof(int)) || check_alive(tree, data, alive, size, range);
+
+	csbpt_release(tree);
+	free(data);
+	free(deleted);
+	free(alive);
+	free(values);
+
+	return failed;
+}
+
+static int test_memory_stats(enum csbpt_leaf_layout layout)
+{
+	int i;
+	int failed = 0;
+	size_t used = 0;
+	struct csbpt_memory_stats stats;
+	struct csbpt_tune tune;
+	struct csbpt *tree;
+	const int size = 5000;
+	int *data;
+
+	memset(&tune, 0, sizeof(tune));
+	tune.order = 4;
+	tune.leaf_layout = layout;
+
+	data = calloc(2 * size, sizeof(int));
+	for(i = 0; i < 2 * size; i++) {
+		data[i] = rand() % size;
+	}
+
+	tree = csbpt_create(&tune, ordered_ints_measure, data, size, sizeof(int));
+
+	for(i = size; i < 2 * size && !failed; i++) {
+		failed = csbpt_insert(tree, &data[i]);
+	}
+
+	if(!failed) {
+		failed = csbpt_memory_stats(tree, &stats);
+	}
+
+	if(!failed && stats.levels[stats.levels_used - 1].entries != 2 * size) {
+		fprintf(stderr, "Memory stats count %d values, expected %d\n", (int) stats.levels[stats.levels_used - 1].entries, 2 * size);
+		failed = 1;
+	}
+
+	for(i = 0; i < stats.levels_used && !failed; i++) {
+		used += stats.levels[i].bytes;
+		if(i > 0 && stats.levels[i].groups > stats.levels[i - 1].entries) {
+			fprintf(stderr, "Level %d has more groups than the level above has nodes\n", i);
+			failed = 1;
+		}
+	}
+
+	if(!failed && used + stats.unused_bytes != stats.slab_bytes) {
+		fprintf(stderr, "Memory stats don't add up to the slabs held\n");
+		failed = 1;
+	}
+
+	csbpt_release(tree);
+	free(data);
+
+	return failed;
+}
+
+static int64_t ordered_i64_measure(void *val)
+{
+	return *((int64_t *) val);
+}
+
+static int i64_compare(const void *a, const void *b)
+{
+	int64_t x = *((const int64_t *) a);
+	int64_t y = *((const int64_t *) b);
+
+	return (x > y) - (x < y);
+}
+
+/*
+ *  Measures which only differ above their low 32 bits, and both extremes,
+ *  are sorted, searched and deleted correctly.  Snapshots can only be read
+ *  back by the same type of tree.
+ */
+static int test_i64(int order, enum csbpt_search search, enum csbpt_leaf_layout layout)
+{
+	int                       i;
+	int                       failed = 0;
+	int                       expected;
+	int                       found = 0;
+	int64_t                   measure;
+	void                     *value;
+	size_t                    count;
+	FILE                     *file;
+	struct csbpt_tune         tune;
+	struct csbpt_i64         *tree;
+	struct csbpt_i64         *loaded;
+	struct csbpt             *wrong;
+	struct csbpt_i64_cursor   cursor;
+	const int                 size = 5000;
+	const int64_t             step = (int64_t) 1 << 40;
+	int64_t                  *data = calloc(size, sizeof(int64_t));
+	int64_t                  *sorted = calloc(size, sizeof(int64_t));
+
+	for(i = 0; i < size; i++) {
+		data[i] = ((int64_t) (rand() % 64) - 32) * step + rand() % 100;
+	}
+	data[0] = INT64_MIN;
+	data[1] = INT64_MAX;
+	memcpy(sorted, data, size * sizeof(int64_t));
+	qsort(sorted, size, sizeof(int64_t), i64_compare);
+
+	memset(&tune, 0, sizeof(tune));
+	tune.order = order;
+	tune.search = search;
+	tune.leaf_layout = layout;
+	tune.compress_keys = 1;
+
+	/* Add a batch large enough to be radix sorted, then insert the rest */
+	tree = csbpt_i64_create(&tune, ordered_i64_measure, NULL, 0, sizeof(int64_t));
+	failed = !tree || csbpt_i64_insert_batch(tree, data, size / 2, sizeof(int64_t));
+	for(i = size / 2; i < size && !failed; i++) {
+		failed = csbpt_i64_insert(tree, &data[i]);
+	}
+
+	if(!tree || failed || csbpt_i64_check(tree)) {
+		fprintf(stderr, "Building an int64_t tree failed at order %d\n", order);
+		failed = 1;
+		goto test_i64_exit;
+	}
+
+	csbpt_i64_cursor_seek(tree, &cursor, INT64_MIN);
+	for(i = 0; i < size && !csbpt_i64_cursor_next(&cursor, &measure, &value); i++) {
+		if(measure != sorted[i] || *((int64_t *) value) != measure) {
+			fprintf(stderr, "Value %d of the int64_t tree is %lld, expected %lld\n", i, (long long) measure, (long long) sorted[i]);
+			failed = 1;
+			goto test_i64_exit;
+		}
+	}
+
+	if(i != size || !csbpt_i64_cursor_next(&cursor, NULL, NULL)) {
+		fprintf(stderr, "The int64_t tree has the wrong number of values\n");
+		failed = 1;
+		goto test_i64_exit;
+	}
+
+	for(i = 0; i < 100; i++) {
+		measure = sorted[rand() % size];
+		for(expected = 0, count = 0; count < size; count++) {
+			expected += sorted[count] == measure;
+		}
+
+		/* Flipping bit 50 gives a measure far outside the data */
+		if(csbpt_i64_find_value(tree, measure, NULL, NULL) != expected ||
+		   csbpt_i64_find_value(tree, measure ^ ((int64_t) 1 << 50), NULL, NULL) != 0) {
+			fprintf(stderr, "Found the wrong number of values measuring %lld\n", (long long) measure);
+			failed = 1;
+			goto test_i64_exit;
+		}
+	}
+
+	/* Snapshots record the type of their measures */
+	file = fopen("snapshot_i64.csbpt", "w+");
+	if(!file || csbpt_i64_save(tree, file, sizeof(int64_t))) {
+		fprintf(stderr, "Saving an int64_t tree failed\n");
+		failed = 1;
+	} else {
+		rewind(file);
+		wrong = csbpt_load(file, NULL);
+		if(wrong || errno != EINVAL) {
+			fprintf(stderr, "An int64_t snapshot was loaded into the wrong type of tree\n");
+			failed = 1;
+		}
+
+		rewind(file);
+		loaded = csbpt_i64_load(file, NULL);
+		if(!loaded || csbpt_i64_find_value(loaded, INT64_MAX, NULL, NULL) != csbpt_i64_find_value(tree, INT64_MAX, NULL, NULL) ||
+		          csbpt_i64_find_value(loaded, INT64_MIN, NULL, NULL) != csbpt_i64_find_value(tree, INT64_MIN, NULL, NULL)) {
+			fprintf(stderr, "Loading an int64_t snapshot failed\n");
+			failed = 1;
+		}
+
+		if(wrong) {
+			csbpt_release(wrong);
+		}
+		if(loaded) {
+			csbpt_i64_release(loaded);
+		}
+	}
+	if(file) {
+		fclose(file);
+		remove("snapshot_i64.csbpt");
+	}
+
+	/* Everything in [-4 * step, 4 * step) goes */
+	for(expected = 0, i = 0; i < size; i++) {
+		expected += sorted[i] < -4 * step || sorted[i] >= 4 * step;
+	}
+
+	if(failed || csbpt_i64_delete_range(tree, -4 * step, 4 * step - 1, &count) || csbpt_i64_check(tree) ||
+	   csbpt_i64_iterate(tree, &found, count_action_fn) != expected || found != expected || count != size - expected) {
+		fprintf(stderr, "Deleting a range of an int64_t tree failed\n");
+		failed = 1;
+	}
+
+test_i64_exit:
+	if(tree) {
+		csbpt_i64_release(tree);
+	}
+	free(data);
+	free(sorted);
+
+	return failed;
+}
+
+static uint64_t ordered_u64_measure(void *val)
+{
+	return *((uint64_t *) val);
+}
+
+static int u64_compare(const void *a, const void *b)
+{
+	uint64_t x = *((const uint64_t *) a);
+	uint64_t y = *((const uint64_t *) b);
+
+	return (x > y) - (x < y);
+}
+
+/*
+ *  Composite (tenant, id) measures, with tenants on both sides of the top
+ *  bit, sort as unsigned integers, and a seek to a tenant's first possible
+ *  id finds all of its values.
+ */
+static int test_u64(int order, enum csbpt_search search, enum csbpt_leaf_layout layout)
+{
+	int                       i;
+	int                       failed = 0;
+	uint32_t                  tenant;
+	size_t                    count;
+	size_t                    expected;
+	uint64_t                  measure;
+	void                     *value;
+	struct csbpt_tune         tune;
+	struct csbpt_u64         *tree;
+	struct csbpt_u64_cursor   cursor;
+	const int                 size = 5000;
+	uint64_t                 *data = calloc(size, sizeof(uint64_t));
+	uint64_t                 *sorted = calloc(size, sizeof(uint64_t));
+
+	for(i = 0; i < size; i++) {
+		tenant = rand() % 8;
+		data[i] = csbpt_u64_pair(tenant % 2 ? tenant : 0x80000000u | tenant, rand() % 1000);
+	}
+	data[0] = 0;
+	data[1] = UINT64_MAX;
+	memcpy(sorted, data, size * sizeof(uint64_t));
+	qsort(sorted, size, sizeof(uint64_t), u64_compare);
+
+	memset(&tune, 0, sizeof(tune));
+	tune.order = order;
+	tune.search = search;
+	tune.leaf_layout = layout;
+	tune.compress_keys = 1;
+
+	tree = csbpt_u64_create(&tune, ordered_u64_measure, NULL, 0, sizeof(uint64_t));
+	if(!tree || csbpt_u64_insert_batch(tree, data, size / 2, sizeof(uint64_t)) ||
+	   csbpt_u64_insert_batch(tree, data + size / 2, size - size / 2, sizeof(uint64_t)) || csbpt_u64_check(tree)) {
+		fprintf(stderr, "Building a uint64_t tree failed at order %d\n", order);
+		failed = 1;
+		goto test_u64_exit;
+	}
+
+	csbpt_u64_cursor_seek(tree, &cursor, 0);
+	for(i = 0; i < size && !csbpt_u64_cursor_next(&cursor, &measure, &value); i++) {
+		if(measure != sorted[i] || *((uint64_t *) value) != measure) {
+			fprintf(stderr, "Value %d of the uint64_t tree is %llx, expected %llx\n", i,
+			        (unsigned long long) measure, (unsigned long long) sorted[i]);
+			failed = 1;
+			goto test_u64_exit;
+		}
+	}
+
+	if(i != size) {
+		fprintf(stderr, "The uint64_t tree has the wrong number of values\n");
+		failed = 1;
+		goto test_u64_exit;
+	}
+
+	for(tenant = 0; tenant < 8 && !failed; tenant++) {
+		measure = csbpt_u64_pair(tenant % 2 ? tenant : 0x80000000u | tenant, 0);
+
+		for(expected = 0, i = 0; i < size; i++) {
+			expected += csbpt_u64_pair_major(sorted[i]) == csbpt_u64_pair_major(measure);
+		}
+
+		count = 0;
+		if(!csbpt_u64_cursor_seek(tree, &cursor, measure)) {
+			while(!csbpt_u64_cursor_next(&cursor, &measure, NULL) &&
+			      csbpt_u64_pair_major(measure) == (tenant % 2 ? tenant : 0x80000000u | tenant)) {
+				count++;
+			}
+		}
+
+		if(count != expected) {
+			fprintf(stderr, "Tenant %u has %zu values, expected %zu\n", tenant, count, expected);
+			failed = 1;
+		}
+	}
+
+test_u64_exit:
+	if(tree) {
+		csbpt_u64_release(tree);
+	}
+	free(data);
+	free(sorted);
+
+	return failed;
 }
 
 int main(int argc, char **argv) {
 	int i;
+	int layout;
+	int failed = 0;
 	struct csbpt_tune tune;
 	struct csbpt *tree;
 	FILE *dot_file;
 	int *initial_data;
 	const int initial_data_size = 25;
 
+	memset(&tune, 0, sizeof(tune));
 	tune.order = 2;
-	tune.initial_height = 0;
 
 	initial_data = calloc(initial_data_size, sizeof(int));
 	fprintf(stderr, "Initial values: [");
@@ -52,4 +2368,164 @@ int main(int argc, char **argv) {
 	}
 
 	fclose(dot_file);
+
+	csbpt_find_value(tree, initial_data[0], NULL, ordered_ints_action_fn);
+	csbpt_release(tree);
+	free(initial_data);
+
+	for(i = CSBPT_SEARCH_AUTO; i <= CSBPT_SEARCH_AVX512; i++) {
+		if(test_insert(3, i, CSBPT_LEAF_INTERLEAVED) || test_insert(8, i, CSBPT_LEAF_INTERLEAVED) ||
+		   test_insert(13, i, CSBPT_LEAF_SPLIT) || test_insert(32, i, CSBPT_LEAF_SPLIT)) {
+			fprintf(stderr, "Insert test failed with search kernel %d\n", i);
+			failed = 1;
+		}
+	}
+
+	for(i = CSBPT_SEARCH_AUTO; i <= CSBPT_SEARCH_AVX512; i++) {
+		if(test_i64(3, i, CSBPT_LEAF_INTERLEAVED) || test_i64(4, i, CSBPT_LEAF_SPLIT) ||
+		   test_u64(3, i, CSBPT_LEAF_SPLIT) || test_u64(4, i, CSBPT_LEAF_INTERLEAVED)) {
+			fprintf(stderr, "64-bit measure test failed with search kernel %d\n", i);
+			failed = 1;
+		}
+	}
+
+	for(layout = CSBPT_LEAF_INTERLEAVED; layout <= CSBPT_LEAF_SPLIT; layout++) {
+		for(i = 1; i <= 4; i++) {
+			if(test_insert(i, CSBPT_SEARCH_AUTO, layout)) {
+				fprintf(stderr, "Insert test failed at order %d, layout %d\n", i, layout);
+				failed = 1;
+			}
+
+			if(test_insert_batch(i, layout)) {
+				fprintf(stderr, "Batch insert test failed at order %d, layout %d\n", i, layout);
+				failed = 1;
+			}
+
+			if(test_find_batch(i, layout)) {
+				fprintf(stderr, "Batch lookup test failed at order %d, layout %d\n", i, layout);
+				failed = 1;
+			}
+
+			if(test_insert_pairs(i, layout)) {
+				fprintf(stderr, "Pair insert test failed at order %d, layout %d\n", i, layout);
+				failed = 1;
+			}
+
+			if(test_cursor(i, layout)) {
+				fprintf(stderr, "Cursor test failed at order %d, layout %d\n", i, layout);
+				failed = 1;
+			}
+
+			if(test_summaries(i, layout)) {
+				fprintf(stderr, "Summary test failed at order %d, layout %d\n", i, layout);
+				failed = 1;
+			}
+
+			if(test_find_pred(i, layout)) {
+				fprintf(stderr, "Predicate search test failed at order %d, layout %d\n", i, layout);
+				failed = 1;
+			}
+
+			if(test_push(i, layout)) {
+				fprintf(stderr, "Push test failed at order %d, layout %d\n", i, layout);
+				failed = 1;
+			}
+
+			if(test_delete(i, layout, 0) || test_delete(i, layout, 1)) {
+				fprintf(stderr, "Delete test failed at order %d, layout %d\n", i, layout);
+				failed = 1;
+			}
+
+			if(test_bulk_load(i, layout, i % 2)) {
+				fprintf(stderr, "Bulk load test failed at order %d, layout %d\n", i, layout);
+				failed = 1;
+			}
+
+			if(test_snapshot(i, layout)) {
+				fprintf(stderr, "Snapshot test failed at order %d, layout %d\n", i, layout);
+				failed = 1;
+			}
+
+			if(test_log(i, layout, 0) || test_log(i, layout, 1)) {
+				fprintf(stderr, "Log test failed at order %d, layout %d\n", i, layout);
+				failed = 1;
+			}
+		}
+
+		if(test_insert(CSBPT_ORDER_AUTO, CSBPT_SEARCH_AUTO, layout) || test_insert_batch(CSBPT_ORDER_AUTO, layout) ||
+		   test_find_batch(CSBPT_ORDER_AUTO, layout) || test_summaries(CSBPT_ORDER_AUTO, layout) ||
+		   test_delete(CSBPT_ORDER_AUTO, layout, 0) || test_snapshot(CSBPT_ORDER_AUTO, layout)) {
+			fprintf(stderr, "Automatic order test failed with layout %d\n", layout);
+			failed = 1;
+		}
+
+		if(test_auto_order(2000, layout) || test_auto_order(70000, layout) || test_auto_order(300000, layout)) {
+			fprintf(stderr, "Automatic order delete test failed with layout %d\n", layout);
+			failed = 1;
+		}
+
+		if(test_bulk_load(13, layout, 0) || test_bulk_load(64, layout, 1)) {
+			fprintf(stderr, "Bulk load test failed with layout %d\n", layout);
+			failed = 1;
+		}
+
+		if(test_fill_factor(1, layout) || test_fill_factor(4, layout) || test_fill_factor(32, layout)) {
+			fprintf(stderr, "Fill factor test failed with layout %d\n", layout);
+			failed = 1;
+		}
+
+		if(test_insert_after_load(layout)) {
+			fprintf(stderr, "Insert after bulk load failed with layout %d\n", layout);
+			failed = 1;
+		}
+
+		if(test_concurrent(2, layout) || test_concurrent(8, layout)) {
+			fprintf(stderr, "Concurrent test failed with layout %d\n", layout);
+			failed = 1;
+		}
+
+		if(test_versions(2, layout) || test_versions(16, layout)) {
+			fprintf(stderr, "Pinned version test failed with layout %d\n", layout);
+			failed = 1;
+		}
+
+#ifdef CSBPT_STATS
+		if(test_stats(2, layout) || test_stats(8, layout)) {
+			fprintf(stderr, "Statistics test failed with layout %d\n", layout);
+			failed = 1;
+		}
+#endif
+
+		if(test_parallel_load(4, layout) || test_parallel_load(7, layout)) {
+			fprintf(stderr, "Parallel load test failed with layout %d\n", layout);
+			failed = 1;
+		}
+
+		if(test_memory_stats(layout)) {
+			fprintf(stderr, "Memory stats test failed with layout %d\n", layout);
+			failed = 1;
+		}
+
+		if(test_allocator(layout)) {
+			fprintf(stderr, "Allocator test failed with layout %d\n", layout);
+			failed = 1;
+		}
+
+		if(test_huge_pages(layout)) {
+			fprintf(stderr, "Huge page test failed with layout %d\n", layout);
+			failed = 1;
+		}
+	}
+
+	for(i = CSBPT_SEARCH_AUTO; i <= CSBPT_SEARCH_SCALAR; i++) {
+		if(test_compressed(2, i, 1) || test_compressed(13, i, 1) || test_compressed(64, i, 1) ||
+		   test_compressed(3, i, 100) || test_compressed(64, i, 100)) {
+			fprintf(stderr, "Compressed key test failed with search kernel %d\n", i);
+			failed = 1;
+		}
+	}
+
+	printf("%s\n", failed ? "FAILED" : "PASSED");
+
+	return failed;
 }
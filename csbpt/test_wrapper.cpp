@@ -0,0 +1,211 @@
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include "csbpt.hpp"
+
+/*
+ *  Values too large to be stored inline, which count their live copies so
+ *  leaks and double frees show up.
+ */
+struct record {
+	static int live;
+
+	std::string  name;
+	long long    payload[2];
+
+	record(const std::string &n, long long p) : name(n)
+	{
+		payload[0] = p;
+		payload[1] = -p;
+		live++;
+	}
+
+	record(const record &other) : name(other.name)
+	{
+		payload[0] = other.payload[0];
+		payload[1] = other.payload[1];
+		live++;
+	}
+
+	~record()
+	{
+		live--;
+	}
+};
+
+int record::live = 0;
+
+/*
+ *  Small values, stored in the leaf groups
+ */
+struct point {
+	short x;
+	short y;
+	int   id;
+};
+
+template<typename Key, int Order>
+static int test_inline(enum csbpt_leaf_layout layout, Key base)
+{
+	int                            i;
+	const int                      size = 3000;
+	size_t                         found;
+	Key                            last;
+	struct csbpt_tune              tune;
+	std::vector<std::pair<Key, point> > batch;
+
+	std::memset(&tune, 0, sizeof(tune));
+	tune.leaf_layout = layout;
+
+	csbpt::tree<Key, point, Order> tree(&tune);
+
+	/* Odd ids one at a time, even ids as a batch */
+	for(i = 0; i < size; i++) {
+		point p = { (short) i, (short) -i, i };
+
+		if(i % 2) {
+			tree.insert(base + (Key) (i % 500), p);
+		} else {
+			batch.push_back(std::make_pair(base + (Key) (i % 500), p));
+		}
+	}
+	tree.insert(batch.begin(), batch.end());
+
+	if(tree.size() != (size_t) size || tree.count(base + 7) != (size_t) size / 500) {
+		fprintf(stderr, "Expected %d values, found %d, and %d of %d\n",
+		        size, (int) tree.size(), size / 500, (int) tree.count(base + 7));
+		return 1;
+	}
+
+	last = base;
+	found = tree.for_each([&](const Key &key, const point &p) {
+		if(key < last || key != base + (Key) (p.id % 500) || p.x != (short) p.id || p.y != (short) -p.id) {
+			fprintf(stderr, "Value %d out of order or corrupt\n", p.id);
+			std::exit(1);
+		}
+		last = key;
+	});
+
+	if(found != (size_t) size) {
+		fprintf(stderr, "Walked %d values of %d\n", (int) found, size);
+		return 1;
+	}
+
+	/* Values with equal measures keep their insertion order within each
+	 * batch; odd ids went in first */
+	int previous = -1;
+	found = tree.find(base + 3, [&](const point &p) {
+		if(p.id % 500 != 3 || (p.id % 2 == previous % 2 && p.id < previous)) {
+			fprintf(stderr, "Value %d found after %d\n", p.id, previous);
+			std::exit(1);
+		}
+		previous = p.id;
+	});
+
+	if(found != (size_t) size / 500) {
+		fprintf(stderr, "Found %d values of measure 3\n", (int) found);
+		return 1;
+	}
+
+	if(tree.erase_if(base + 10, [](const point &p) { return p.id % 1000 == 10; }) != (size_t) size / 1000 ||
+	   tree.erase(base + 11) != (size_t) size / 500 ||
+	   tree.erase_range(base + 100, base + 199) != (size_t) size / 5) {
+		fprintf(stderr, "Erased the wrong number of values\n");
+		return 1;
+	}
+
+	found = tree.scan(base + 90, base + 210, [&](const Key &key, const point &) {
+		if(key >= base + 100 && key <= base + 199) {
+			fprintf(stderr, "Found an erased measure\n");
+			std::exit(1);
+		}
+	});
+
+	if(found != (size_t) size / 500 * 21 || tree.size() != (size_t) (size - size / 1000 - size / 500 - size / 5)) {
+		fprintf(stderr, "Scanned %d values after erasing\n", (int) found);
+		return 1;
+	}
+
+	return 0;
+}
+
+static int test_boxed(enum csbpt_leaf_layout layout)
+{
+	int                                          i;
+	const int                                    size = 2000;
+	std::vector<std::pair<int64_t, record> >     batch;
+	struct csbpt_tune                            tune;
+
+	std::memset(&tune, 0, sizeof(tune));
+	tune.leaf_layout = layout;
+
+	{
+		csbpt::tree<int64_t, record, 4> tree(&tune);
+
+		for(i = 0; i < size; i++) {
+			batch.push_back(std::make_pair((int64_t) (i % 100) << 40, record("r" + std::to_string(i), i)));
+		}
+		tree.insert(batch.begin(), batch.end());
+		batch.clear();
+
+		tree.insert((int64_t) 5 << 40, record("extra", -1));
+
+		size_t sum = 0;
+		tree.find((int64_t) 5 << 40, [&](const record &r) { sum += r.name.size(); });
+		if(tree.count((int64_t) 5 << 40) != (size_t) size / 100 + 1 || sum == 0) {
+			fprintf(stderr, "Boxed values not found\n");
+			return 1;
+		}
+
+		tree.erase_if((int64_t) 5 << 40, [](const record &r) { return r.payload[0] < 0; });
+		tree.erase((int64_t) 6 << 40);
+		tree.erase_range((int64_t) 50 << 40, (int64_t) 59 << 40);
+
+		if(record::live != (int) tree.size() || tree.size() != (size_t) (size - size / 100 * 11)) {
+			fprintf(stderr, "%d records live for %d values\n", record::live, (int) tree.size());
+			return 1;
+		}
+
+		csbpt::tree<int64_t, record, 4> moved(std::move(tree));
+
+		if(moved.size() != (size_t) record::live || tree.size() != 0) {
+			fprintf(stderr, "Move lost values\n");
+			return 1;
+		}
+	}
+
+	if(record::live != 0) {
+		fprintf(stderr, "%d records leaked\n", record::live);
+		return 1;
+	}
+
+	return 0;
+}
+
+int main(int argc, char **argv)
+{
+	int layout;
+	int failed = 0;
+
+	for(layout = CSBPT_LEAF_INTERLEAVED; layout <= CSBPT_LEAF_SPLIT; layout++) {
+		if(test_inline<int, 3>((enum csbpt_leaf_layout) layout, -250) ||
+		   test_inline<int64_t, 8>((enum csbpt_leaf_layout) layout, -((int64_t) 1 << 40)) ||
+		   test_inline<uint64_t, 4>((enum csbpt_leaf_layout) layout, (uint64_t) 1 << 63)) {
+			fprintf(stderr, "Inline value test failed with layout %d\n", layout);
+			failed = 1;
+		}
+
+		if(test_boxed((enum csbpt_leaf_layout) layout)) {
+			fprintf(stderr, "Boxed value test failed with layout %d\n", layout);
+			failed = 1;
+		}
+	}
+
+	printf("%s\n", failed ? "FAILED" : "PASSED");
+
+	return failed;
+}